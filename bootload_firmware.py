@@ -116,14 +116,133 @@ def send_bytes(data):
     return b"".join(cmd)
 
 
-def block_reader(fobj, blocksize=1275):
-    "generates blocks of data of size blocksize reading from fobj"
-    while True:
-        data = fobj.read(blocksize)
-        if data:
-            yield data
-        else:
-            break
+def crc32_mpeg2(data, crc=0xFFFFFFFF):
+    "CRC-32/MPEG-2 as computed by the device, see crc32.hpp"
+    for b in data:
+        crc ^= b << 24
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x04C11DB7) if crc & 0x80000000 else (crc << 1)
+            crc &= 0xFFFFFFFF
+    return crc
+
+
+def lz4_length(n):
+    "returns the extension bytes of an lz4 length field holding n"
+    out = bytearray()
+    if n >= 15:
+        n -= 15
+        while n >= 255:
+            out.append(255)
+            n -= 255
+        out.append(n)
+    return out
+
+
+def lz4_compress(data):
+    "returns data compressed as a single lz4 block (greedy, no dictionary)"
+    MINMATCH = 4
+    # the format requires the last 5 bytes to be literals, and the last
+    # match to start at least 12 bytes before the end
+    match_limit = len(data) - 12
+    end_limit = len(data) - 5
+    table = {}
+    out = bytearray()
+    anchor = 0
+    i = 0
+    while i < match_limit:
+        key = data[i:i + MINMATCH]
+        ref = table.get(key)
+        table[key] = i
+        if ref is None or i - ref > 0xFFFF:
+            i += 1
+            continue
+        length = MINMATCH
+        while i + length < end_limit and data[ref + length] == data[i + length]:
+            length += 1
+        literals = i - anchor
+        ml = length - MINMATCH
+        out.append((min(literals, 15) << 4) | min(ml, 15))
+        out += lz4_length(literals)
+        out += data[anchor:i]
+        out += (i - ref).to_bytes(2, "little")
+        out += lz4_length(ml)
+        i += length
+        anchor = i
+    literals = len(data) - anchor
+    out.append(min(literals, 15) << 4)
+    out += lz4_length(literals)
+    out += data[anchor:]
+    return bytes(out)
+
+
+USER_CODE_FLASH = 0x08004000
+FLASH_PAGESIZE = 2048
+
+
+def read_bootloader_version(ser):
+    "returns the bootloader version (register 0xf4)"
+    ser.write(b"\x10\xf4")
+    resp = ser.read(1)
+    return resp[0] if resp else 0
+
+
+def read_page_hashes(ser, addr, pages):
+    "returns the crc32 of each flash page starting at addr"
+    # write the page hash address, then read the page hash FIFO
+    ser.write(b"\x22\xc8" + addr.to_bytes(4, "little"))
+    hashes = []
+    while len(hashes) < pages:
+        n = min(pages - len(hashes), 255)
+        ser.write(b"\x18\xe6" + bytes([n]))
+        resp = ser.read(4 * n)
+        if len(resp) != 4 * n:
+            return None
+        hashes += unpack_from(f"<{n}I", resp)
+    return hashes
+
+
+def send_page(addr, page, packed=False):
+    """returns the cmd to write one page frame. if packed, the page is sent
+    compressed unless that would not make it smaller."""
+    header = pack("<II", addr, crc32_mpeg2(page))
+    fifo = b"\xe5"
+    if packed:
+        data = lz4_compress(page)
+        if len(data) < len(page):
+            fifo = b"\xe7"
+            page = data
+    frame = header + page
+    return b"\x29" + fifo + len(frame).to_bytes(2, "little") + frame
+
+
+def upload_pages(ser, image, pbar, packed, retries=3):
+    """writes image in page frames, skipping pages the device already holds.
+    returns True once all page hashes match."""
+    image += b"\xff" * (-len(image) % FLASH_PAGESIZE)
+    pages = [image[i:i + FLASH_PAGESIZE] for i in range(0, len(image), FLASH_PAGESIZE)]
+    hashes = [crc32_mpeg2(page) for page in pages]
+    for attempt in range(retries):
+        device_hashes = read_page_hashes(ser, USER_CODE_FLASH, len(pages))
+        if device_hashes is None:
+            print("Read timeout")
+            continue
+        todo = [i for i in range(len(pages)) if device_hashes[i] != hashes[i]]
+        if not todo:
+            return True
+        if attempt > 0:
+            print(f"Retrying {len(todo)} pages")
+        # reset the page transfer state
+        ser.write(b"\x22\xc0" + bytes(4))
+        for i in todo:
+            ser.write(send_page(USER_CODE_FLASH + i * FLASH_PAGESIZE, pages[i], packed))
+            pbar.next(FLASH_PAGESIZE)
+        # wait for the last page to be written, allowing for the page erases
+        timeout = ser.timeout
+        ser.timeout = max(timeout, 0.1 * len(todo))
+        ser.write(b"\x0d")
+        ser.read(1)
+        ser.timeout = timeout
+    return False
 
 
 def main():
@@ -195,19 +314,48 @@ def main():
 
     if args.file is not None:
         print(f"Uploading firmware file {args.file.name}")
-        # set the flash address where the firmware is to be written
-        ser.write(send_write_addr(0x08004000))
-        size = os.stat(args.file.name).st_size
-        pbar = Bar(message=os.path.basename(args.file.name), max=size)
+        # flash is written in words, pad the image to a multiple of 4 bytes
+        image = args.file.read()
+        image += b"\xff" * (-len(image) % 4)
+        pbar = Bar(message=os.path.basename(args.file.name), max=len(image))
         pbar.start()
-        # write the firmware
-        for data in block_reader(args.file, blocksize=1200):
-            if data:
+        version = read_bootloader_version(ser)
+        if version >= 1 and not args.dummy:
+            # page transfer, only pages that differ are sent.
+            # bootloader version 2 and later take compressed pages.
+            if not upload_pages(ser, image, pbar, packed=version >= 2):
+                pbar.finish()
+                print("Upload failed, device not reset, please retry")
+                exit(1)
+        else:
+            # set the flash address where the firmware is to be written
+            ser.write(send_write_addr(USER_CODE_FLASH))
+            # write the firmware
+            for i in range(0, len(image), 1200):
+                data = image[i:i + 1200]
                 ser.write(send_bytes(data))
                 pbar.next(len(data))
                 ser.read(1)  # wait for block write to complete
         pbar.finish()
 
+        # verify: write the image length to register 0xf8, read back the crc at 0xfc.
+        # bootloader version 3 and later; older ones do not have these registers
+        if version >= 3 and not args.dummy:
+            print("Verifying")
+            ser.write(b"\x22\xf8" + len(image).to_bytes(4, "little"))
+            ser.write(b"\x12\xfc")
+            resp = ser.read(4)
+            if len(resp) != 4:
+                print("Read timeout")
+                exit(1)
+            crc = unpack_from("<I", resp)[0]
+            if crc != crc32_mpeg2(image):
+                print(f"Verify failed: device crc {crc:08x}, image crc {crc32_mpeg2(image):08x}")
+                print("Device not reset, please retry")
+                exit(1)
+        elif not args.dummy:
+            print(f"Bootloader version {version} can not verify the image, skipping verify")
+
     # set user argument
     if args.argument >= 0:
         print("Sending user argument")
@@ -25,8 +25,11 @@
 #include <libopencm3/stm32/flash.h>
 #include <libopencm3/stm32/rcc.h>
 #include <libopencm3/stm32/rtc.h>
+#include <string.h>
 #include "../stream_fifo.hpp"
 #include "../command_parser.hpp"
+#include "../crc32.hpp"
+#include "lz4.hpp"
 
 using namespace mculib;
 using namespace std;
@@ -58,6 +61,11 @@ uint8_t cmdInputBuffer[16384];
 uint8_t registers[256];
 uint32_t& reg_flashWriteStart = *(uint32_t*) &registers[0xe0];
 uint32_t& reg_userArgument = *(uint32_t*) &registers[0xe8];
+uint32_t& reg_pagesWritten = *(uint32_t*) &registers[0xc0];
+uint32_t& reg_pagesRejected = *(uint32_t*) &registers[0xc4];
+uint32_t& reg_pageHashAddress = *(uint32_t*) &registers[0xc8];
+uint32_t& reg_verifyLength = *(uint32_t*) &registers[0xf8];
+uint32_t& reg_verifyCRC = *(uint32_t*) &registers[0xfc];
 
 
 // hardware specific functions
@@ -282,11 +290,18 @@ void bootloadHWInit() {
 
 /*
 registers map:
+-- c0..c3: pages written by page transfer; write to reset the page transfer
+-- c4..c7: page frames rejected because of a bad address, crc or readback
+-- c8..cb: page hash address, advanced by reading the page hash FIFO
 -- e0: flashWriteStart[7..0]
 -- e1: flashWriteStart[15..8]
 -- e2: flashWriteStart[23..16]
 -- e3: flashWriteStart[31..24]
 -- e4: flash FIFO
+-- e5: page frame FIFO, see handlePageFrame()
+-- e6: page hash FIFO; each value is the crc32() of the flash page at the
+--     page hash address (4 bytes)
+-- e7: packed page frame FIFO, one 29 command per frame, see handlePackedFrame()
 -- e8..eb: user argument (written to memory end - 4 bytes)
 -- ef: write 0x5e to reboot device
 -- f0: device variant
@@ -294,6 +309,10 @@ registers map:
 -- f2: hardware revision (always 0 in bootload mode)
 -- f3: firmware major version (ff => bootload mode)
 -- f4: firmware minor version (bootloader version)
+-- f8..fb: verify length; writing it sets the verify crc to the crc32()
+--         of that many bytes of flash starting at the user code
+--         (bootloader version 3 and later)
+-- fc..ff: verify crc
 */
 
 void setMspAndJump(uint32_t usrAddr) {
@@ -384,15 +403,139 @@ void handleFlashWrite(const uint8_t* data, int bytes) {
 	}
 }
 
+// page transfer: the host sends frames of a page address, the crc32() of
+// the page data and the page data. A frame is staged in RAM and only
+// programmed once its crc matches, so a broken transfer never leaves a
+// partly written page behind, and pages that already hold the data are
+// not erased again. Together with the page hashes this lets the host skip
+// unchanged pages and resume an interrupted update.
+struct pageFrameHeader {
+	uint32_t address;
+	uint32_t crc;
+};
+uint8_t pageFrame[sizeof(pageFrameHeader) + FLASH_PAGESIZE] __attribute__((aligned(4)));
+uint32_t pageFrameBytes = 0;
+
+bool programPage(uint32_t address, const uint8_t* data) {
+	if(memcmp((const void*) address, data, FLASH_PAGESIZE) == 0)
+		return true;
+	flash_erase_page(address);
+	while ((FLASH_SR & FLASH_SR_BSY) == FLASH_SR_BSY);
+	FLASH_CR |= FLASH_CR_PG;
+	for(uint32_t i = 0; i < FLASH_PAGESIZE; i += 2) {
+		MMIO16(address + i) = *(const uint16_t*)(data + i);
+		while ((FLASH_SR & FLASH_SR_BSY) == FLASH_SR_BSY);
+	}
+	FLASH_CR &= ~FLASH_CR_PG;
+	return memcmp((const void*) address, data, FLASH_PAGESIZE) == 0;
+}
+
+void handlePageFrame() {
+	pageFrameHeader hdr;
+	memcpy(&hdr, pageFrame, sizeof(hdr));
+	const uint8_t* data = pageFrame + sizeof(hdr);
+	bool valid = (hdr.address & FLASH_PAGESIZE_MASK) == 0
+		&& hdr.address >= USER_CODE_FLASH && hdr.address < USER_CODE_FLASH_END
+		&& crc32(data, FLASH_PAGESIZE) == hdr.crc;
+	if(valid && programPage(hdr.address, data))
+		reg_pagesWritten++;
+	else
+		reg_pagesRejected++;
+}
+
+void handlePageFrameData(const uint8_t* data, int bytes) {
+	while(bytes > 0) {
+		int n = sizeof(pageFrame) - pageFrameBytes;
+		if(n > bytes)
+			n = bytes;
+		memcpy(pageFrame + pageFrameBytes, data, n);
+		pageFrameBytes += n;
+		data += n;
+		bytes -= n;
+		if(pageFrameBytes == sizeof(pageFrame)) {
+			handlePageFrame();
+			pageFrameBytes = 0;
+		}
+	}
+}
+
+// packed page transfer: a frame is the page frame header followed by the
+// page data compressed as an lz4 block. It is decompressed into the page
+// frame buffer, so the only extra RAM is the compressed frame itself.
+// Frames that do not compress are sent as plain page frames instead.
+uint8_t packedFrame[sizeof(pageFrameHeader) + FLASH_PAGESIZE];
+uint32_t packedFrameBytes = 0;
+uint32_t packedFrameLength = 0;
+
+void handlePackedFrame() {
+	uint8_t* data = pageFrame + sizeof(pageFrameHeader);
+	if(packedFrameLength < sizeof(pageFrameHeader) || packedFrameLength > sizeof(packedFrame)
+		|| lz4Decompress(packedFrame + sizeof(pageFrameHeader), packedFrameLength - sizeof(pageFrameHeader),
+					data, FLASH_PAGESIZE) != int(FLASH_PAGESIZE)) {
+		reg_pagesRejected++;
+		return;
+	}
+	memcpy(pageFrame, packedFrame, sizeof(pageFrameHeader));
+	handlePageFrame();
+}
+
+// totalBytes is the frame length at the start of a frame and 0 for the rest of it
+void handlePackedFrameData(int totalBytes, const uint8_t* data, int bytes) {
+	if(totalBytes != 0) {
+		packedFrameLength = totalBytes;
+		packedFrameBytes = 0;
+	}
+	for(int i = 0; i < bytes; i++, packedFrameBytes++) {
+		if(packedFrameBytes < sizeof(packedFrame))
+			packedFrame[packedFrameBytes] = data[i];
+	}
+	if(packedFrameBytes == packedFrameLength)
+		handlePackedFrame();
+}
+
+void sendPageHashes(int nValues) {
+	uint32_t hashes[16];
+	while(nValues > 0) {
+		int n = nValues < 16 ? nValues : 16;
+		for(int i = 0; i < n; i++) {
+			uint32_t address = reg_pageHashAddress;
+			if(address >= USER_CODE_FLASH && address < USER_CODE_FLASH_END)
+				hashes[i] = crc32((const void*) address, FLASH_PAGESIZE);
+			else
+				hashes[i] = 0;
+			reg_pageHashAddress = address + FLASH_PAGESIZE;
+		}
+		serial.print((char*) hashes, n * sizeof(uint32_t));
+		nValues -= n;
+	}
+}
+
 void cmdInit() {
 	cmdParser.handleReadFIFO = [](int address, int nValues) {
-		
+		if(address == 0xe6)
+			sendPageHashes(nValues);
 	};
 	cmdParser.handleWriteFIFO = [](int address, int totalBytes, int nBytes, const uint8_t* data) {
 		if(address == 0xe4)
 			handleFlashWrite(data, nBytes);
+		if(address == 0xe5)
+			handlePageFrameData(data, nBytes);
+		if(address == 0xe7)
+			handlePackedFrameData(totalBytes, data, nBytes);
 	};
 	cmdParser.handleWrite = [](int address) {
+		if(address == 0xc0) {
+			pageFrameBytes = 0;
+			packedFrameBytes = packedFrameLength = 0;
+			reg_pagesWritten = 0;
+			reg_pagesRejected = 0;
+		}
+		if(address == 0xf8) {
+			uint32_t len = reg_verifyLength;
+			if(len > USER_CODE_FLASH_END - USER_CODE_FLASH)
+				len = USER_CODE_FLASH_END - USER_CODE_FLASH;
+			reg_verifyCRC = crc32((const void*) USER_CODE_FLASH, len);
+		}
 		if(address == 0xef && registers[address] == 0x5e) {
 			// clear enter bootload indicator
 			bootloaderBootloadIndicator = reg_userArgument;
@@ -431,7 +574,7 @@ void bootloadMain() {
 	registers[0xf1] = 1;	// protocol version
 	registers[0xf2] = 0;	// board revision (always 0 in bootload mode)
 	registers[0xf3] = 0xff;	// firmware major version (0xff in bootload mode)
-	registers[0xf4] = 0;	// firmware minor version
+	registers[0xf4] = 3;	// firmware minor version
 
 	// set up command interface
 	cmdInit();
@@ -481,6 +624,14 @@ extern "C" void *memset(void *s, int c, size_t n) {
 		((char*)s)[i] = c;
 	return s;
 }
+extern "C" int memcmp(const void *s1, const void *s2, size_t n) {
+	for(size_t i=0;i<n;i++) {
+		int d = ((const uint8_t*)s1)[i] - ((const uint8_t*)s2)[i];
+		if(d != 0)
+			return d;
+	}
+	return 0;
+}
 extern "C" int atoi(const char* s) {
 	// TODO: implement
 	return 0;
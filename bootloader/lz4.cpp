@@ -0,0 +1,53 @@
+#include "lz4.hpp"
+#include <string.h>
+
+int lz4Decompress(const uint8_t* src, int srcLen, uint8_t* dst, int dstLen) {
+	const uint8_t* end = src + srcLen;
+	int o = 0;
+	while(src < end) {
+		int token = *src++;
+
+		// literals
+		int len = token >> 4;
+		if(len == 15) {
+			int b;
+			do {
+				if(src >= end) return -1;
+				b = *src++;
+				len += b;
+			} while(b == 255);
+		}
+		if(len > end - src || len > dstLen - o)
+			return -1;
+		memcpy(dst + o, src, len);
+		o += len;
+		src += len;
+		// the last sequence has no match
+		if(src == end)
+			break;
+
+		// match
+		if(end - src < 2)
+			return -1;
+		int offset = src[0] | (src[1] << 8);
+		src += 2;
+		if(offset == 0 || offset > o)
+			return -1;
+		len = token & 15;
+		if(len == 15) {
+			int b;
+			do {
+				if(src >= end) return -1;
+				b = *src++;
+				len += b;
+			} while(b == 255);
+		}
+		len += 4;
+		if(len > dstLen - o)
+			return -1;
+		// byte by byte; the match may overlap the bytes it produces
+		for(int i = 0; i < len; i++, o++)
+			dst[o] = dst[o - offset];
+	}
+	return o;
+}
@@ -0,0 +1,7 @@
+#pragma once
+#include <stdint.h>
+
+// decompress an lz4 block (the block format, without a frame header) into
+// dst. returns the decompressed size, or -1 if the block is malformed or
+// does not fit into dstLen bytes; nothing outside of src and dst is accessed.
+int lz4Decompress(const uint8_t* src, int srcLen, uint8_t* dst, int dstLen);
@@ -0,0 +1,138 @@
+#include "cal_codec.hpp"
+#include <string.h>
+#include <math.h>
+
+struct cal_segment_header {
+	float first[2];
+	int8_t exponent[2];
+	uint8_t order[2];
+};
+static_assert(sizeof(cal_segment_header) == 12, "segment header must be 12 bytes");
+
+static inline float cal_predict(uint8_t order, int k, float prev, float prev2) {
+	if(order && k >= 2)
+		return 2*prev - prev2;
+	return prev;
+}
+
+static inline float part(complexf v, int c) {
+	return c ? v.imag() : v.real();
+}
+
+// largest residual of predicting the original values
+static float max_residual(const complexf* values, int n, int c, uint8_t order) {
+	float m = 0;
+	for(int k = 1; k < n; k++) {
+		float pred = cal_predict(order, k, part(values[k-1], c), k >= 2 ? part(values[k-2], c) : 0);
+		float r = fabsf(part(values[k], c) - pred);
+		if(!(r <= m)) m = r;
+	}
+	return m;
+}
+
+// quantize one component with the given scale, predicting from decoded
+// values. returns false if a residual does not fit into an int16.
+static bool encode_component(const complexf* values, int n, int c, uint8_t order, int exponent,
+		int16_t* residual, float* decoded) {
+	float scale = ldexpf(1.f, exponent);
+	float invScale = ldexpf(1.f, -exponent);
+	float prev = part(values[0], c), prev2 = prev;
+	decoded[0] = prev;
+	for(int k = 1; k < n; k++) {
+		float pred = cal_predict(order, k, prev, prev2);
+		float q = roundf((part(values[k], c) - pred) * invScale);
+		if(!(fabsf(q) <= 32767.f))
+			return false;
+		residual[(k-1)*2] = (int16_t) q;
+		float v = pred + residual[(k-1)*2] * scale;
+		decoded[k] = v;
+		prev2 = prev;
+		prev = v;
+	}
+	return true;
+}
+
+uint32_t cal_encode_segment(complexf* values, int n, uint8_t* out, float& maxError) {
+	cal_segment_header hdr;
+	int16_t* residual = (int16_t*)(out + sizeof(hdr));
+	float decoded[2][CAL_BLOCK_POINTS];
+
+	for(int c = 0; c < 2; c++) {
+		float r0 = max_residual(values, n, c, 0);
+		float r1 = max_residual(values, n, c, 1);
+		uint8_t order = (r1 < r0) ? 1 : 0;
+		float r = order ? r1 : r0;
+
+		// smallest scale that would hold the open loop residuals; closed
+		// loop residuals can be slightly larger, so retry with a larger scale
+		int exponent = -126;
+		if(r > 0) {
+			frexpf(r / 32767.f, &exponent);
+			if(exponent < -126) exponent = -126;
+		}
+		while(!encode_component(values, n, c, order, exponent, residual + c, decoded[c])
+				&& exponent < 127)
+			exponent++;
+
+		hdr.first[c] = part(values[0], c);
+		hdr.exponent[c] = (int8_t) exponent;
+		hdr.order[c] = order;
+	}
+	memcpy(out, &hdr, sizeof(hdr));
+
+	for(int k = 0; k < n; k++) {
+		complexf v(decoded[0][k], decoded[1][k]);
+		float e = fmaxf(fabsf(v.real() - values[k].real()), fabsf(v.imag() - values[k].imag()));
+		if(e > maxError) maxError = e;
+		values[k] = v;
+	}
+	return sizeof(hdr) + 4*(n - 1);
+}
+
+void cal_decoder::begin(const void* data, int points) {
+	block = (const uint8_t*) data;
+	pointsLeft = points;
+	beginBlock();
+}
+
+void cal_decoder::beginBlock() {
+	int n = pointsLeft < CAL_BLOCK_POINTS ? pointsLeft : CAL_BLOCK_POINTS;
+	const uint8_t* p = block;
+	for(int eterm = 0; eterm < CAL_ENTRIES; eterm++) {
+		cal_segment_header hdr;
+		memcpy(&hdr, p, sizeof(hdr));
+		for(int c = 0; c < 2; c++) {
+			component& cc = comp[eterm][c];
+			cc.residual = (const int16_t*)(p + sizeof(hdr)) + c;
+			cc.scale = ldexpf(1.f, hdr.exponent[c]);
+			cc.prev = cc.prev2 = hdr.first[c];
+			cc.order = hdr.order[c];
+		}
+		p += sizeof(hdr) + 4*(n - 1);
+	}
+	block = p;
+	index = 0;
+}
+
+void cal_decoder::next(complexf out[CAL_ENTRIES]) {
+	if(index == CAL_BLOCK_POINTS) {
+		pointsLeft -= CAL_BLOCK_POINTS;
+		beginBlock();
+	}
+	int k = index++;
+	for(int eterm = 0; eterm < CAL_ENTRIES; eterm++) {
+		float v[2];
+		for(int c = 0; c < 2; c++) {
+			component& cc = comp[eterm][c];
+			if(k == 0) {
+				v[c] = cc.prev;
+				continue;
+			}
+			float pred = cal_predict(cc.order, k, cc.prev, cc.prev2);
+			v[c] = pred + cc.residual[(k-1)*2] * cc.scale;
+			cc.prev2 = cc.prev;
+			cc.prev = v[c];
+		}
+		out[eterm] = complexf(v[0], v[1]);
+	}
+}
@@ -0,0 +1,52 @@
+#pragma once
+#include "common.hpp"
+
+/*
+ * Compressed storage of the calibration arrays.
+ *
+ * Points are stored in blocks of CAL_BLOCK_POINTS, one segment per cal
+ * entry. A segment holds the first point of the block as floats; every
+ * following value is predicted from the previous one (noise-like terms) or
+ * extrapolated from the previous two (smooth terms), and only the residual
+ * is stored, as an int16 multiple of a power of two scale chosen per
+ * segment. The encoder predicts from the decoded values, so the error of
+ * every value is at most half of its segment's scale.
+ *
+ * A segment of n points takes 12 + 4*(n-1) bytes instead of 8*n.
+ */
+
+constexpr int CAL_BLOCK_POINTS = 64;
+
+// bytes taken up by the encoded cal data of a sweep
+static constexpr uint32_t cal_encoded_bytes(int points) {
+	return CAL_ENTRIES * (12*((points + CAL_BLOCK_POINTS - 1) / CAL_BLOCK_POINTS)
+		+ 4*(points - (points + CAL_BLOCK_POINTS - 1) / CAL_BLOCK_POINTS));
+}
+
+// largest encoded segment
+constexpr uint32_t CAL_SEGMENT_BYTES_MAX = 12 + 4*(CAL_BLOCK_POINTS - 1);
+
+// encode n (1..CAL_BLOCK_POINTS) values into out and replace them with the
+// values the decoder will produce. returns the bytes written and raises
+// maxError to the largest absolute error of a real or imaginary part.
+uint32_t cal_encode_segment(complexf* values, int n, uint8_t* out, float& maxError);
+
+// sequential decoder, producing one point of all cal entries at a time
+struct cal_decoder {
+	void begin(const void* data, int points);
+	void next(complexf out[CAL_ENTRIES]);
+
+private:
+	struct component {
+		const int16_t* residual;
+		float scale;
+		float prev, prev2;
+		uint8_t order;
+	};
+	const uint8_t* block;
+	int pointsLeft;
+	int index;		// point within the current block
+	component comp[CAL_ENTRIES][2];
+
+	void beginBlock();
+};
@@ -1,5 +1,19 @@
 #include "command_parser.hpp"
 
+// call handleWrite once for every register group touched by the batch write
+void CommandParser::handleBatchWritten() {
+	uint32_t done[256 / 32] = {};
+	for(int i = 0; i < batchBytes; i++) {
+		int address = uint8_t(cmdStartAddress + i);
+		int group = registerGroup ? uint8_t(registerGroup(address)) : address;
+		uint32_t bit = uint32_t(1) << (group % 32);
+		if(done[group / 32] & bit)
+			continue;
+		done[group / 32] |= bit;
+		handleWrite(group);
+	}
+}
+
 void CommandParser::handleInput(const uint8_t* s, int len) {
 	const uint8_t* end = s + len;
 	if(writeFIFOBytesLeft > 0) {
@@ -80,9 +94,33 @@ void CommandParser::handleInput(const uint8_t* s, int len) {
 					handleWrite(cmdStartAddress);
 				}
 				break;
+			case 0x2a:
+				if(cmdPhase == 2) {
+					batchBytes = batchBytesLeft = c;
+					if(batchBytes == 0)
+						cmdPhase = 0;
+					else
+						cmdPhase++;
+					break;
+				}
+				registers[cmdAddress & registersSizeMask] = c;
+				cmdAddress++;
+				if(--batchBytesLeft == 0) {
+					cmdPhase = 0;
+					handleBatchWritten();
+				}
+				break;
+			case 0x29:
+				if(cmdPhase == 2) {
+					writeFIFOLength = c;
+					cmdPhase++;
+					break;
+				}
+				writeFIFOLength |= int(c) << 8;
+				// fall through
 			case 0x28:
 			{
-				int totalBytes = (int) (uint8_t) c;
+				int totalBytes = (cmdOpcode == 0x29) ? writeFIFOLength : (int) (uint8_t) c;
 				s++; // move past the size byte
 				cmdPhase = 0; // resume command processing once data is consumed
 
@@ -18,6 +18,9 @@
 -- 22 AA XX XX XX XX    : write 4-byte register (address in AA, values in XX)
 -- 23 AA XX XX XX XX    : write 8-byte register (address in AA, values in XX)
 -- 28 AA NN             : write N bytes into FIFO
+-- 29 AA NN NN          : write N bytes into FIFO (N is 16 bits, little endian)
+-- 2a AA NN XX ...      : write N registers starting at AA (values in XX); handleWrite
+--                        is called once all values are written, once per register group
 */
 class CommandParser {
 public:
@@ -35,6 +38,11 @@ public:
 	// called when a register is written
 	small_function<void(int address)> handleWrite;
 
+	// optional; returns the register group an address belongs to. A batch
+	// write (2a) calls handleWrite once with each group it touched.
+	// If not set, every register is its own group.
+	small_function<int(int address)> registerGroup;
+
 	// send data to the stream
 	small_function<void(const uint8_t* s, int len)> send;
 
@@ -52,4 +60,10 @@ public:
 	uint8_t cmdEndAddress = 0xff;
 	uint8_t cmdStartAddress = 0;
 	int writeFIFOBytesLeft = 0;
+	int writeFIFOLength = 0;
+	int batchBytes = 0;
+	int batchBytesLeft = 0;
+
+private:
+	void handleBatchWritten();
 };
@@ -31,6 +31,9 @@ void properties_t::setFieldsToDefault() {
 	_adf4350_txPower = 3;
 	_si5351_txPower = 1;
 	_measurement_mode = MEASURE_MODE_FULL;
+	_gate_shape = TD_WINDOW_NORMAL;
+	_gate_start = 0.0;
+	_gate_stop = 1000.0;
 
 	setCalDataToDefault();
 	memcpy(_trace, def_trace, sizeof(_trace));
@@ -117,6 +117,8 @@ static constexpr uint32_t FREQUENCY_CHANGE_OVER	= 140000000;
 #define TD_WINDOW_MAXIMUM (0b10<<3)
 // L/C match enable option
 #define TD_LC_MATH        (1<<5)
+// time domain gating; applied in both frequency and time domain display
+#define TD_GATE           (1<<6)
 
 #define REDRAW_CELLS      (1<<0)
 #define REDRAW_FREQUENCY  (1<<1)
@@ -192,6 +194,9 @@ struct alignas(4) properties_t {
   int16_t _sweep_points;
   uint16_t _cal_status;
 
+  // working cal data of the current sweep. Calibration collects into it and
+  // the correction reads it per point; a recall decodes the saved cal data
+  // into it (cal_interpolate), so it takes the same RAM as before.
   complexf _cal_data[CAL_ENTRIES][SWEEP_POINTS_MAX];
   float _electrical_delay; // picoseconds
 
@@ -205,6 +210,9 @@ struct alignas(4) properties_t {
   uint8_t _adf4350_txPower; // 0 to 3
   uint8_t _si5351_txPower; // 0 to 3
   uint8_t _measurement_mode; //See enum MeasurementMode.
+  uint8_t _gate_shape; // TD_WINDOW_*, width of the gate edge taper
+  float _gate_start; // picoseconds
+  float _gate_stop; // picoseconds
 
   uint32_t checksum;
 
@@ -215,17 +223,22 @@ struct alignas(4) properties_t {
   void setCalDataToDefault();
 
   properties_t() { setFieldsToDefault(); }
-  freqHz_t startFreqHz() const {
-    if(_frequency1 > 0) return _frequency0;
-    return _frequency0 + _frequency1/2;
+  freqHz_t startFreqHz() const { return startFreqHz(_frequency0, _frequency1); }
+  freqHz_t stopFreqHz() const { return stopFreqHz(_frequency0, _frequency1); }
+  freqHz_t stepFreqHz() const { return stepFreqHz(_frequency0, _frequency1, _sweep_points); }
+
+  // same, for sweep settings stored elsewhere
+  static freqHz_t startFreqHz(freqHz_t f0, freqHz_t f1) {
+    if(f1 > 0) return f0;
+    return f0 + f1/2;
   }
-  freqHz_t stopFreqHz() const {
-    if(_frequency1 > 0) return _frequency1;
-    return _frequency0 - _frequency1/2;
+  static freqHz_t stopFreqHz(freqHz_t f0, freqHz_t f1) {
+    if(f1 > 0) return f1;
+    return f0 - f1/2;
   }
-  freqHz_t stepFreqHz() const {
-    if(_sweep_points > 0)
-      return (stopFreqHz() - startFreqHz()) / (_sweep_points - 1);
+  static freqHz_t stepFreqHz(freqHz_t f0, freqHz_t f1, int points) {
+    if(points > 0)
+      return (stopFreqHz(f0, f1) - startFreqHz(f0, f1)) / (points - 1);
     return 0;
   }
 
@@ -0,0 +1,68 @@
+#include "crc32.hpp"
+#include <string.h>
+
+static constexpr uint32_t CRC32_POLY = 0x04c11db7;
+
+#if defined(STM32F1)
+#include <libopencm3/stm32/crc.h>
+#include <libopencm3/stm32/rcc.h>
+
+static inline uint32_t crc32_byte(uint32_t crc, uint8_t b) {
+	crc ^= uint32_t(b) << 24;
+	for(int i = 0; i < 8; i++)
+		crc = (crc & 0x80000000) ? (crc << 1) ^ CRC32_POLY : crc << 1;
+	return crc;
+}
+
+// the crc unit can only be reset to CRC32_INIT. to continue from crc, feed
+// it the word that takes CRC32_INIT to crc, found by running 32 steps
+// of the crc backwards.
+static uint32_t crc32_preimage(uint32_t crc) {
+	for(int i = 0; i < 32; i++)
+		crc = (crc & 1) ? ((crc ^ CRC32_POLY) >> 1) | 0x80000000 : crc >> 1;
+	return crc ^ CRC32_INIT;
+}
+
+uint32_t crc32(const void* data, size_t len, uint32_t crc) {
+	static bool clockEnabled = false;
+	const uint8_t* p = (const uint8_t*) data;
+	size_t words = len / 4;
+	if(words > 0) {
+		if(!clockEnabled) {
+			rcc_periph_clock_enable(RCC_CRC);
+			clockEnabled = true;
+		}
+		crc_reset();
+		if(crc != CRC32_INIT)
+			CRC_DR = crc32_preimage(crc);
+		for(size_t i = 0; i < words; i++) {
+			uint32_t w;
+			memcpy(&w, p + i*4, 4);
+			CRC_DR = __builtin_bswap32(w);
+		}
+		crc = CRC_DR;
+	}
+	for(size_t i = words*4; i < len; i++)
+		crc = crc32_byte(crc, p[i]);
+	return crc;
+}
+
+#else
+
+uint32_t crc32(const void* data, size_t len, uint32_t crc) {
+	static uint32_t table[256];
+	if(table[1] == 0) {
+		for(uint32_t i = 0; i < 256; i++) {
+			uint32_t c = i << 24;
+			for(int j = 0; j < 8; j++)
+				c = (c & 0x80000000) ? (c << 1) ^ CRC32_POLY : c << 1;
+			table[i] = c;
+		}
+	}
+	const uint8_t* p = (const uint8_t*) data;
+	for(size_t i = 0; i < len; i++)
+		crc = (crc << 8) ^ table[(crc >> 24) ^ p[i]];
+	return crc;
+}
+
+#endif
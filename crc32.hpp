@@ -0,0 +1,18 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * CRC-32/MPEG-2: polynomial 0x04c11db7, initial value 0xffffffff, no
+ * reflection and no final xor. This is what the CRC unit of the GD32F303
+ * computes, so on the device whole words are fed to it (byte swapped, to
+ * keep the bytes in stream order) and only the last bytes of an odd length
+ * are done in software. Elsewhere a table driven implementation is used.
+ *
+ * The CRC unit is shared; call only from the main loop, not from interrupts.
+ */
+
+constexpr uint32_t CRC32_INIT = 0xffffffff;
+
+// crc of len bytes at data, continuing from crc
+uint32_t crc32(const void* data, size_t len, uint32_t crc = CRC32_INIT);
@@ -0,0 +1,18 @@
+#include "fastmath.hpp"
+
+void fast_logmag_array(const std::complex<float>* in, float* out, int n) {
+	for (int i = 0; i < n; i++) {
+		float re = in[i].real(), im = in[i].imag();
+		out[i] = fast_log2(re*re + im*im) * (10 * 0.301029996f);
+	}
+}
+
+void fast_phase_array(const std::complex<float>* in, float* out, int n) {
+	for (int i = 0; i < n; i++)
+		out[i] = fast_atan2(in[i].imag(), in[i].real()) * float(180 / M_PI);
+}
+
+void fast_abs_array(const std::complex<float>* in, float* out, int n) {
+	for (int i = 0; i < n; i++)
+		out[i] = fast_hypot(in[i].real(), in[i].imag());
+}
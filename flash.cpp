@@ -1,17 +1,54 @@
 #include "flash.hpp"
 #include "globals.hpp"
+#include "crc32.hpp"
 #include <libopencm3/stm32/flash.h>
 #include <string.h>
 #include <mculib/printk.hpp>
 
-#define FLASH_PAGE_SIZE 2048
+static int flash_erase(uint32_t page) {
+	flash_unlock();
+	while(FLASH_SR & FLASH_SR_BSY);
+	FLASH_CR |= FLASH_CR_PER;
+	FLASH_AR = page;
+	FLASH_CR |= FLASH_CR_STRT;
+	while(FLASH_SR & FLASH_SR_BSY);
 
-// Use for cache config check
-static uint16_t crc_cache = 0;
+	uint32_t flash_status = FLASH_SR;
+	if(flash_status != FLASH_SR_EOP) {
+		printk("flash_erase: erase error: flash status %d\n", flash_status);
+		printk("flash_erase: while erasing page 0x%x\n", page);
+		return -2;
+	}
+	return 0;
+}
 
-uint32_t flash_program_data(uint32_t dst, uint8_t *src, uint32_t bytes) {
-	uint32_t flash_status = 0;
+// program and verify words. dst must be erased.
+static int flash_program(uint32_t dst, const void *src, uint32_t bytes) {
+	flash_unlock();
+	for(uint32_t iter=0; iter<bytes; iter += 4)
+	{
+		// programming word data
+		uint32_t word;
+		memcpy(&word, (const uint8_t*)src + iter, 4);
+		flash_program_word(dst+iter, word);
+		uint32_t flash_status = flash_get_status_flags();
+		if(flash_status != FLASH_SR_EOP) {
+			printk("flash_program: write error: flash status %d\n", flash_status);
+			return -2;
+		}
+
+		// verify if correct data is programmed
+		uint32_t readback = *(volatile uint32_t*)(dst + iter);
+
+		if(readback != word) {
+			printk("flash_program: verify failed: wrote %x, read %x\n", word, readback);
+			return -3;
+		}
+	}
+	return 0;
+}
 
+uint32_t flash_program_data(uint32_t dst, uint8_t *src, uint32_t bytes) {
 	// check if start_address is in proper range
 	if(dst < FLASH_BASE)
 		return -1;
@@ -24,178 +61,523 @@ uint32_t flash_program_data(uint32_t dst, uint8_t *src, uint32_t bytes) {
 
 	if(FLASH_CR & FLASH_CR_LOCK) {
 		printk("flash_program_data: flash_unlock did not unlock hw\n");
-		printk("&FLASH_KEYR = 0x%x\n", (uint32_t) &FLASH_KEYR);
-		printk("&FLASH_CR = 0x%x\n", (uint32_t) &FLASH_CR);
+		printk("&FLASH_KEYR = 0x%x\n", (uint32_t)(uintptr_t) &FLASH_KEYR);
+		printk("&FLASH_CR = 0x%x\n", (uint32_t)(uintptr_t) &FLASH_CR);
 		printk("FLASH_CR = 0x%x\n", (uint32_t) FLASH_CR);
 		return -2;
 	}
 
 	// Erase pages
-	uint32_t curr = dst;
-	uint32_t end = dst + bytes;
-	while(curr < end) {
-		//flash_erase_page(curr);
-
-		while(FLASH_SR & FLASH_SR_BSY);
-		FLASH_CR |= FLASH_CR_PER;
-		FLASH_AR = curr;
-		FLASH_CR |= FLASH_CR_STRT;
-		while(FLASH_SR & FLASH_SR_BSY);
-
-		flash_status = FLASH_SR;
-		if(flash_status != FLASH_SR_EOP) {
-			printk("flash_program_data: erase error: flash status %d\n", flash_status);
-			printk("flash_program_data: while erasing page 0x%x\n", curr);
+	for(uint32_t curr = dst; curr < dst + bytes; curr += FLASH_PAGE_SIZE) {
+		int ret = flash_erase(curr);
+		if(ret != 0) {
 			printk("flash_program_data: dst = 0x%x\n", dst);
-			return -2;
+			return ret;
 		}
-		curr += FLASH_PAGE_SIZE;
 	}
 
 	// programming flash memory
-	for(uint32_t iter=0; iter<bytes; iter += 4)
-	{
-		// programming word data
-		uint32_t word = *(uint32_t*)(src + iter);
-		flash_program_word(dst+iter, word);
-		flash_status = flash_get_status_flags();
-		if(flash_status != FLASH_SR_EOP) {
-			printk("flash_program_data: write error: flash status %d\n", flash_status);
-			return -2;
+	return flash_program(dst, src, bytes);
+}
+
+/*
+ * record log
+ */
+
+static_assert((sizeof(config_t) % 4) == 0 && (CALDATA_HEAD_BYTES % 4) == 0
+	&& (UISTATE_OFFSET % 4) == 0 && (UISTATE_BYTES % 4) == 0,
+	"records must be an integer multiple of the flash word size");
+
+static_assert((USERFLASH_BYTES % FLASH_PAGE_SIZE) == 0,
+	"USERFLASH_BYTES must be a multiple of the flash page size");
+
+constexpr uint16_t NO_PAGE = 0xffff;
+
+// bytes taken up by a record
+static constexpr uint32_t record_bytes(uint32_t length) {
+	return sizeof(flash_record_t) + length;
+}
+
+constexpr uint32_t CALDATA_PAGES =
+	(record_bytes(caldata_length(SWEEP_POINTS_MAX)) + FLASH_PAGE_SIZE - 1) / FLASH_PAGE_SIZE;
+
+// erased pages kept ahead of the log head so that the oldest record can
+// always be moved out of the way, even when it has to wrap around the end
+constexpr uint32_t RESERVE_PAGES = 2*CALDATA_PAGES + 1;
+
+static_assert(record_bytes(sizeof(config_t)) + SAVEAREA_MAX*record_bytes(UISTATE_BYTES)
+	<= FLASH_PAGE_SIZE, "small records must fit into one page");
+
+static_assert(SAVEAREA_MAX*CALDATA_PAGES + 1 + RESERVE_PAGES <= USERFLASH_PAGES,
+	"USERFLASH_BYTES is too small");
+
+// RAM index of the latest valid record of each kind, rebuilt by log_scan()
+static bool log_scanned = false;
+static const flash_record_t *config_record;
+static const flash_record_t *caldata_record[SAVEAREA_MAX];
+static const flash_record_t *uistate_record[SAVEAREA_MAX];
+static uint32_t next_version, next_stamp;
+// next page to allocate. pages following it are erased up to the oldest record.
+static uint16_t log_head;
+// page small records are appended to
+static uint16_t open_page;
+static uint16_t open_offset;
+
+static inline uint32_t page_address(int page) {
+	return USERFLASH_BEGIN + page*FLASH_PAGE_SIZE;
+}
+
+static inline const flash_record_t *page_record(int page) {
+	return (const flash_record_t*)page_address(page);
+}
+
+static inline const void *record_payload(const flash_record_t *r) {
+	return r + 1;
+}
+
+static bool page_erased(int page) {
+	const uint32_t *p = (const uint32_t*)page_address(page);
+	for(uint32_t i = 0; i < FLASH_PAGE_SIZE/4; i++)
+		if(p[i] != 0xffffffff)
+			return false;
+	return true;
+}
+
+static inline bool record_large(const flash_record_t *r) {
+	return record_bytes(r->length) > FLASH_PAGE_SIZE;
+}
+
+static inline int record_pages(const flash_record_t *r) {
+	return (record_bytes(r->length) + FLASH_PAGE_SIZE - 1) / FLASH_PAGE_SIZE;
+}
+
+static uint32_t record_crc(const flash_record_t *h, const void *payload) {
+	uint32_t value = crc32(h, offsetof(flash_record_t, crc));
+	return crc32(payload, h->length, value);
+}
+
+// header fields that the length of a record can be trusted from
+static inline bool record_sane(const flash_record_t *r) {
+	return r->magic == RECORD_MAGIC && r->length <= USERFLASH_BYTES && (r->length % 4) == 0;
+}
+
+static const flash_record_t **record_slot(int type, int id) {
+	if(type == RECORD_CONFIG)
+		return &config_record;
+	if(id >= SAVEAREA_MAX)
+		return nullptr;
+	if(type == RECORD_CALDATA)
+		return &caldata_record[id];
+	if(type == RECORD_UISTATE)
+		return &uistate_record[id];
+	return nullptr;
+}
+
+static inline bool record_live(const flash_record_t *r) {
+	const flash_record_t **slot = record_slot(r->type, r->id);
+	return slot && *slot == r;
+}
+
+// the crc of a record is computed once. records written completely are
+// marked as checked right away, others when they are first scanned.
+static bool index_record(const flash_record_t *r) {
+	if(r->checked != RECORD_CHECKED) {
+		if(r->crc != record_crc(r, record_payload(r)))
+			return false;
+		if(r->checked == 0xffffffff)
+			flash_program((uintptr_t)&r->checked, &RECORD_CHECKED, 4);
+	}
+	if(r->version >= next_version) next_version = r->version + 1;
+	if(r->stamp >= next_stamp) next_stamp = r->stamp + 1;
+	const flash_record_t **slot = record_slot(r->type, r->id);
+	if(slot == nullptr)
+		return true;
+	const flash_record_t *prev = *slot;
+	// a record that was being moved may be present twice; take the newer copy
+	if(prev == nullptr || prev->version < r->version
+		|| (prev->version == r->version && prev->stamp < r->stamp))
+		*slot = r;
+	return true;
+}
+
+// walk all pages and index every valid record. the log head is placed
+// after the page or large record that was opened last.
+static void log_scan(void) {
+	uint32_t newest = 0, newestSmall = 0;
+	config_record = nullptr;
+	memset(caldata_record, 0, sizeof(caldata_record));
+	memset(uistate_record, 0, sizeof(uistate_record));
+	next_version = next_stamp = 1;
+	log_head = 0;
+	open_page = NO_PAGE;
+
+	for(uint32_t page = 0; page < USERFLASH_PAGES; ) {
+		const flash_record_t *r = page_record(page);
+		uint32_t pages = 1;
+		uint32_t opened = 0;
+		if(record_sane(r) && record_large(r)) {
+			pages = record_pages(r);
+			if(page + pages > USERFLASH_PAGES)
+				pages = USERFLASH_PAGES - page;
+			if(index_record(r))
+				opened = r->stamp;
+		} else if(*(const uint32_t*)r != 0xffffffff) {
+			uint32_t offset = 0;
+			while(offset + sizeof(flash_record_t) <= FLASH_PAGE_SIZE) {
+				r = (const flash_record_t*)(page_address(page) + offset);
+				if(*(const uint32_t*)r == 0xffffffff)
+					break;
+				if(!record_sane(r) || offset + record_bytes(r->length) > FLASH_PAGE_SIZE) {
+					// interrupted write; do not append to this page again
+					offset = FLASH_PAGE_SIZE;
+					break;
+				}
+				if(index_record(r) && opened == 0)
+					opened = r->stamp;
+				offset += record_bytes(r->length);
+			}
+			if(opened > newestSmall) {
+				newestSmall = opened;
+				open_page = page;
+				open_offset = offset;
+			}
 		}
+		if(opened > newest) {
+			newest = opened;
+			log_head = (page + pages) % USERFLASH_PAGES;
+		}
+		page += pages;
+	}
 
-		// verify if correct data is programmed
-		uint32_t readback = *(volatile uint32_t*)(dst + iter);
-		
-		if(readback != word) {
-			printk("flash_program_data: verify failed: wrote %x, read %x\n", word, readback);
-			return -3;
+	// ui state saved before the last full save of a slot no longer applies
+	for(int id = 0; id < SAVEAREA_MAX; id++) {
+		const flash_record_t *r = uistate_record[id];
+		if(r && (caldata_record[id] == nullptr || r->base != caldata_record[id]->version))
+			uistate_record[id] = nullptr;
+	}
+	log_scanned = true;
+}
+
+static inline void log_index(void) {
+	if(!log_scanned)
+		log_scan();
+}
+
+// number of erased pages following the log head
+static uint32_t log_free_pages(void) {
+	uint32_t n = 0;
+	while(n < USERFLASH_PAGES && page_erased((log_head + n) % USERFLASH_PAGES))
+		n++;
+	return n;
+}
+
+static const flash_record_t *log_append(const flash_record_t &h, const void *payload, bool reclaiming);
+
+// move the live records out of the oldest page or large record and erase it
+static int log_reclaim(void) {
+	uint32_t page = log_head;
+	for(uint32_t i = 0; i < USERFLASH_PAGES && page_erased(page); i++)
+		page = (page + 1) % USERFLASH_PAGES;
+	const flash_record_t *r = page_record(page);
+
+	if(record_sane(r) && record_large(r)) {
+		int pages = record_pages(r);
+		if(page + pages > USERFLASH_PAGES)
+			pages = USERFLASH_PAGES - page;
+		if(record_live(r)) {
+			const flash_record_t *moved = log_append(*r, record_payload(r), true);
+			if(moved == nullptr)
+				return -1;
+			*record_slot(r->type, r->id) = moved;
 		}
+		// erase the first page last, it tells how far the record extends
+		for(int i = pages - 1; i >= 0; i--)
+			if(flash_erase(page_address(page + i)) != 0)
+				return -2;
+		return 0;
 	}
 
-	return 0;
+	if(page == open_page)
+		open_page = NO_PAGE;
+	for(uint32_t offset = 0; offset + sizeof(flash_record_t) <= FLASH_PAGE_SIZE; ) {
+		r = (const flash_record_t*)(page_address(page) + offset);
+		if(!record_sane(r) || offset + record_bytes(r->length) > FLASH_PAGE_SIZE)
+			break;
+		if(record_live(r)) {
+			const flash_record_t *moved = log_append(*r, record_payload(r), true);
+			if(moved == nullptr)
+				return -1;
+			*record_slot(r->type, r->id) = moved;
+		}
+		offset += record_bytes(r->length);
+	}
+	return flash_erase(page_address(page));
 }
 
-static inline uint32_t __ROR(uint32_t op1, uint32_t op2) {
-	return (op1 >> op2) | (op1 << (32 - op2));
+// allocate pages at the log head, reclaiming the oldest pages as needed.
+// large records do not wrap around the end of the area.
+static int log_alloc(uint32_t pages, bool reclaiming) {
+	uint32_t reserve = reclaiming ? 0 : RESERVE_PAGES;
+	for(uint32_t tries = 0; tries <= USERFLASH_PAGES; tries++) {
+		uint32_t start = (log_head + pages > USERFLASH_PAGES) ? 0 : log_head;
+		uint32_t skip = (start == log_head) ? 0 : USERFLASH_PAGES - log_head;
+		if(log_free_pages() >= skip + pages + reserve) {
+			log_head = (start + pages) % USERFLASH_PAGES;
+			return start;
+		}
+		if(reclaiming || log_reclaim() != 0)
+			break;
+	}
+	printk("log_alloc: no space for %d pages\n", pages);
+	return -1;
 }
 
-static uint32_t checksum(const void *start, size_t len) {
-	uint32_t *p = (uint32_t*)start;
-	uint32_t value = 0;
-	len>>=2;
-	while (len--)
-		value = __ROR(value, 31) + *p++;
-	return value;
+// a record being programmed
+struct log_writer {
+	flash_record_t hdr;
+	uint32_t dst;
+	uint32_t offset;
+	uint32_t crc;
+	bool ok;
+};
+
+// allocate space for a record with the type, id, version, base and length
+// of h and program its header. the crc is programmed by log_finish(), so
+// a record interrupted by a reset fails the check.
+static bool log_begin(log_writer &w, const flash_record_t &h, bool reclaiming) {
+	w.hdr = h;
+	uint32_t bytes = record_bytes(h.length);
+	if(bytes > FLASH_PAGE_SIZE) {
+		int page = log_alloc((bytes + FLASH_PAGE_SIZE - 1) / FLASH_PAGE_SIZE, reclaiming);
+		if(page < 0)
+			return false;
+		w.dst = page_address(page);
+	} else {
+		if(open_page == NO_PAGE || open_offset + bytes > FLASH_PAGE_SIZE) {
+			int page = log_alloc(1, reclaiming);
+			if(page < 0)
+				return false;
+			open_page = page;
+			open_offset = 0;
+		}
+		w.dst = page_address(open_page) + open_offset;
+		open_offset += bytes;
+	}
+
+	// the stamp orders pages by allocation, so take it only after log_alloc()
+	// has moved older records
+	w.hdr.magic = RECORD_MAGIC;
+	w.hdr.stamp = next_stamp++;
+	w.offset = 0;
+	w.crc = crc32(&w.hdr, offsetof(flash_record_t, crc));
+	w.ok = flash_program(w.dst, &w.hdr, offsetof(flash_record_t, crc)) == 0;
+	return w.ok;
 }
 
-int flash_caldata_save(int id) {
-	// the size of the properties structure must be an integer multiple of
-	// the flash word size, or else we will read past the end of the structure.
-	static_assert((sizeof(current_props) % 4) == 0,
-		"the size of the properties structure must be an integer multiple of 4");
+// program the next bytes of the payload, a multiple of 4
+static void log_payload(log_writer &w, const void *data, uint32_t bytes) {
+	if(!w.ok || w.offset + bytes > w.hdr.length) {
+		w.ok = false;
+		return;
+	}
+	w.crc = crc32(data, bytes, w.crc);
+	w.ok = flash_program(w.dst + sizeof(flash_record_t) + w.offset, data, bytes) == 0;
+	w.offset += bytes;
+}
+
+static const flash_record_t *log_finish(log_writer &w) {
+	// every word has been verified while programming, so the crc is known
+	// to match once it is in place
+	if(!w.ok || w.offset != w.hdr.length
+		|| flash_program(w.dst + offsetof(flash_record_t, crc), &w.crc, 4) != 0
+		|| flash_program(w.dst + offsetof(flash_record_t, checked), &RECORD_CHECKED, 4) != 0)
+		return nullptr;
+	return (const flash_record_t*)w.dst;
+}
+
+// write a record with the type, id, version and base of h
+static const flash_record_t *log_append(const flash_record_t &h, const void *payload, bool reclaiming) {
+	log_writer w;
+	if(!log_begin(w, h, reclaiming))
+		return nullptr;
+	log_payload(w, payload, h.length);
+	return log_finish(w);
+}
+
+static flash_record_t log_header(int type, int id, uint32_t base, uint32_t length) {
+	flash_record_t h = {};
+	h.type = type;
+	h.id = id;
+	h.length = length;
+	h.version = next_version++;
+	h.base = base;
+	return h;
+}
 
-	static_assert(SAVEAREA_BYTES >= sizeof(current_props),
-		"SAVEAREA_BYTES is too small");
+static inline int caldata_points(const uint8_t *head) {
+	int16_t points;
+	memcpy(&points, head + offsetof(properties_t, _sweep_points), sizeof(points));
+	return points;
+}
 
-	uint8_t *src = (uint8_t*)&current_props;
-	uint32_t dst = SAVEAREA(id);
+// the caldata record of a slot, if its layout matches this firmware
+static const uint8_t *caldata_payload(int id) {
+	const flash_record_t *r = caldata_record[id];
+	if (r == nullptr)
+		return nullptr;
+	const uint8_t *p = (const uint8_t*)record_payload(r);
+	uint32_t magic;
+	memcpy(&magic, p, sizeof(magic));
+	int points = caldata_points(p);
+	if (magic != CONFIG_MAGIC || points < 1 || points > SWEEP_POINTS_MAX
+		|| r->length != caldata_length(points))
+		return nullptr;
+	return p;
+}
 
+// whether the sweep and cal data in current_props are the ones saved in the slot
+static bool caldata_unchanged(int id) {
+	const uint8_t *p = caldata_payload(id);
+	if (p == nullptr || memcmp(p, &current_props, CALDATA_HEAD_BYTES) != 0)
+		return false;
+	cal_decoder dec;
+	complexf v[CAL_ENTRIES];
+	dec.begin(p + CALDATA_HEAD_BYTES + UISTATE_BYTES, current_props._sweep_points);
+	for (int i = 0; i < current_props._sweep_points; i++) {
+		dec.next(v);
+		for (int eterm = 0; eterm < CAL_ENTRIES; eterm++)
+			if (v[eterm] != current_props._cal_data[eterm][i])
+				return false;
+	}
+	return true;
+}
+
+float flash_caldata_error = 0;
+
+int flash_caldata_save(int id) {
 	if (id < 0 || id >= SAVEAREA_MAX)
 		return -1;
+	if (current_props._sweep_points < 1 || current_props._sweep_points > SWEEP_POINTS_MAX)
+		return -1;
+	log_index();
 
 	current_props.magic = CONFIG_MAGIC;
-	current_props.checksum = checksum(&current_props, sizeof(current_props) - 8);
 
-	int ret = flash_program_data(dst, src, sizeof(current_props));
+	// when only marker, trace and other ui settings changed since the slot
+	// was last saved, append them alone
+	const flash_record_t *r;
+	if (caldata_unchanged(id)) {
+		r = log_append(log_header(RECORD_UISTATE, id, caldata_record[id]->version, UISTATE_BYTES),
+			(const uint8_t*)&current_props + UISTATE_OFFSET, false);
+		if (r) uistate_record[id] = r;
+		printk("save caldata %d, ui state only\n", id);
+	} else {
+		// the cal data is replaced by the decoded values as it is encoded, so
+		// that it matches what a recall of the slot would produce
+		int points = current_props._sweep_points;
+		float maxError = 0;
+		log_writer w;
+		r = nullptr;
+		if (log_begin(w, log_header(RECORD_CALDATA, id, 0, caldata_length(points)), false)) {
+			uint8_t segment[CAL_SEGMENT_BYTES_MAX];
+			log_payload(w, &current_props, CALDATA_HEAD_BYTES);
+			log_payload(w, (const uint8_t*)&current_props + UISTATE_OFFSET, UISTATE_BYTES);
+			for (int i = 0; i < points; i += CAL_BLOCK_POINTS) {
+				int n = min(points - i, CAL_BLOCK_POINTS);
+				for (int eterm = 0; eterm < CAL_ENTRIES; eterm++)
+					log_payload(w, segment, cal_encode_segment(&current_props._cal_data[eterm][i],
+						n, segment, maxError));
+			}
+			r = log_finish(w);
+		}
+		if (r) {
+			caldata_record[id] = r;
+			uistate_record[id] = nullptr;
+		}
+		flash_caldata_error = maxError;
+		// printk has no %e; the error is shown in units of 1e-9
+		printk("save caldata %d, max cal error %u ppb\n", id, uint32_t(maxError * 1e9f));
+	}
 
-	printk("save caldata %d, ret = %d\n", id, ret);
-	printk("src magic: %x, dst magic = %x\n", *(uint32_t*)src, *(uint32_t*)dst);
+	if (r == nullptr)
+		return -2;
 	lastsaveid = id;
-	crc_cache|=1<<id;
-	return ret;
+	return 0;
 }
 
 int flash_caldata_recall(int id) {
-	const properties_t *src;
-
 	if (id < 0 || id >= SAVEAREA_MAX)
 		return -1;
+	log_index();
 
-	// point to saved area on the flash memory
-	src = (properties_t*)SAVEAREA(id);
-	// Need check it
-	if ((crc_cache&(1<<id)) == 0){
-		if (src->magic != CONFIG_MAGIC) {
-			printk("caldata_recall: incorrect magic %x, should be %x\n", src->magic, CONFIG_MAGIC);
-			return -2;
-		}
-		if (checksum(src, sizeof(current_props) - 8) != src->checksum) {
-			printk("caldata_recall: incorrect checksum %08x\n", src->checksum);
-			return -3;
-		}
+	const uint8_t *src = caldata_payload(id);
+	if (src == nullptr) {
+		printk("caldata_recall: no valid data in slot %d\n", id);
+		return -2;
 	}
 	/* active configuration points to save data on flash memory */
 	lastsaveid = id;
-	crc_cache|=1<<id;
-	/* duplicated saved data onto sram to be able to modify marker/trace */
-	memcpy(&current_props, src, sizeof(properties_t));
+	/* duplicated sweep and ui state onto sram to be able to modify marker/trace.
+	 * the cal data stays in flash until cal_interpolate() loads it. */
+	memcpy(&current_props, src, CALDATA_HEAD_BYTES);
+	const flash_record_t *r = uistate_record[id];
+	if (r && r->length == UISTATE_BYTES)
+		src = (const uint8_t*)record_payload(r);
+	else
+		src += CALDATA_HEAD_BYTES;
+	memcpy((uint8_t*)&current_props + UISTATE_OFFSET, src, UISTATE_BYTES);
 	return 0;
 }
 
-const properties_t *caldata_reference(void) {
-	const properties_t *src = (const properties_t*)SAVEAREA(lastsaveid);
-	// Return cached result
-	if (crc_cache&(1<<lastsaveid)) return src;
-	if (src->magic != CONFIG_MAGIC)
-		return nullptr;
-	if (checksum(src, sizeof(current_props) - 8) != src->checksum)
-		return nullptr;
-	crc_cache|=1<<lastsaveid;
-	return src;
+bool caldata_reference(caldata_ref_t &ref) {
+	if (lastsaveid < 0 || lastsaveid >= SAVEAREA_MAX)
+		return false;
+	log_index();
+	const uint8_t *src = caldata_payload(lastsaveid);
+	if (src == nullptr)
+		return false;
+	freqHz_t f0, f1;
+	memcpy(&f0, src + offsetof(properties_t, _frequency0), sizeof(f0));
+	memcpy(&f1, src + offsetof(properties_t, _frequency1), sizeof(f1));
+	ref._sweep_points = caldata_points(src);
+	ref.start = properties_t::startFreqHz(f0, f1);
+	ref.step = properties_t::stepFreqHz(f0, f1, ref._sweep_points);
+	memcpy(&ref._cal_status, src + offsetof(properties_t, _cal_status), sizeof(ref._cal_status));
+	ref.data = src + CALDATA_HEAD_BYTES + UISTATE_BYTES;
+	return true;
 }
 
 int flash_config_save(void) {
-	uint8_t* src = (uint8_t*)&config;
-	uint32_t dst = CONFIGAREA_BEGIN;
-
-	static_assert(CONFIGAREA_BYTES >= sizeof(config),
-		"CONFIGAREA_BYTES is too small");
-
+	log_index();
 	config.magic = CONFIG_MAGIC;
-	config.checksum = checksum(&config, sizeof(config) - 8);
-	crc_cache|=1<<15;
-	return flash_program_data(dst, src, sizeof(config));
+	const flash_record_t *r = log_append(log_header(RECORD_CONFIG, 0, 0, sizeof(config)), &config, false);
+	if (r == nullptr)
+		return -2;
+	config_record = r;
+	return 0;
 }
 
 int flash_config_recall(void) {
-	const config_t *src = (const config_t*)CONFIGAREA_BEGIN;
-	void *dst = &config;
-	// Check cache
-	if ((crc_cache&(1<<15)) == 0){
-		if (src->magic != CONFIG_MAGIC) {
-			printk("config_recall: incorrect magic %x, should be %x\n", src->magic, CONFIG_MAGIC);
-			return -1;
-		}
-		if (checksum(src, sizeof(config) - 8) != src->checksum) {
-			printk("config_recall: incorrect checksum %08x\n", src->checksum);
-			return -2;
-		}
+	log_index();
+	const flash_record_t *r = config_record;
+	if (r == nullptr || r->length != sizeof(config_t)) {
+		printk("config_recall: no config saved\n");
+		return -1;
+	}
+	const config_t *src = (const config_t*)record_payload(r);
+	if (src->magic != CONFIG_MAGIC) {
+		printk("config_recall: incorrect magic %x, should be %x\n", src->magic, CONFIG_MAGIC);
+		return -1;
 	}
-	crc_cache|=1<<15;
 	/* duplicated saved data onto sram to be able to modify marker/trace */
-	memcpy(dst, src, sizeof(config_t));
+	memcpy(&config, src, sizeof(config_t));
 	return 0;
 }
 
 void flash_clear_user(void) {
 	flash_unlock();
-	crc_cache = 0;
 	// erase flash pages
-	uint8_t *p = (uint8_t*)USERFLASH_BEGIN;
-	uint8_t *tail = (uint8_t*)board::USERFLASH_END;
-	while (p < tail) {
-		flash_erase_page((uint32_t)p);
-		p += FLASH_PAGE_SIZE;
-	}
+	for (uint32_t page = 0; page < USERFLASH_PAGES; page++)
+		flash_erase_page(page_address(page));
+	log_scan();
 }
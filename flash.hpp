@@ -1,43 +1,87 @@
 #pragma once
 #include "common.hpp"
+#include "cal_codec.hpp"
 #include <board.hpp>
+#include <stddef.h>
 
 /*
  * flash.cpp
+ *
+ * The user flash area is a log of records. A save appends a record instead
+ * of erasing and rewriting a fixed area, and the oldest pages are reclaimed
+ * when the log wraps around onto them. Every page is either erased, holds a
+ * run of small records (config, ui state), or belongs to a single large
+ * record (caldata). Large records start on a page boundary so that they can
+ * be referenced in place: recall copies the sweep and ui state to RAM and
+ * leaves the cal data in flash, where cal_interpolate() decodes it into the
+ * working arrays in current_props. This saves a copy on recall, not RAM.
  */
 
 #ifndef SAVEAREA_MAX
 #define SAVEAREA_MAX  7
 #endif
 
-// allocated bytes per save area. must be a multiple of the flash page size (2048)
-constexpr uint32_t SAVEAREA_BYTES = 18432;
+constexpr uint32_t FLASH_PAGE_SIZE = 2048;
 
-// total bytes of save areas
-constexpr uint32_t SAVETOTAL_BYTES = SAVEAREA_BYTES * SAVEAREA_MAX;
-
-// allocated bytes for config data in flash. must be a multiple of the flash page size (2048)
-constexpr uint32_t CONFIGAREA_BYTES = 2048;
+// allocated bytes for the record log. must be a multiple of the flash page size (2048)
+constexpr uint32_t USERFLASH_BYTES = 128*1024;
+constexpr uint32_t USERFLASH_PAGES = USERFLASH_BYTES / FLASH_PAGE_SIZE;
 
 // flash user area is at the very end of the flash, defined by USERFLASH_END in board.hpp
-constexpr uint32_t USERFLASH_BEGIN = board::USERFLASH_END - SAVETOTAL_BYTES - CONFIGAREA_BYTES;
+constexpr uint32_t USERFLASH_BEGIN = board::USERFLASH_END - USERFLASH_BYTES;
+
+enum {
+	RECORD_CONFIG = 1,	// config_t
+	RECORD_CALDATA,		// properties_t with compressed cal data, see caldata_length()
+	RECORD_UISTATE		// the properties_t fields following the cal data
+};
+
+constexpr uint16_t RECORD_MAGIC = 0x5a3c;
+
+struct flash_record_t {
+	uint16_t magic;
+	uint8_t type;
+	uint8_t id;		// save slot
+	uint32_t length;	// payload bytes following the header
+	uint32_t version;	// order of saves; kept when a record is moved
+	uint32_t stamp;		// order of writes; renewed when a record is moved
+	uint32_t base;		// RECORD_UISTATE: version of the caldata record it applies to
+	uint32_t crc;		// crc32() of header and payload, programmed after the payload
+	uint32_t checked;	// RECORD_CHECKED once the crc is known to match
+};
+
+constexpr uint32_t RECORD_CHECKED = 0x0000c0de;
 
-// locations of config and save areas
-constexpr uint32_t CONFIGAREA_BEGIN = USERFLASH_BEGIN;
-constexpr uint32_t SAVEAREA_BEGIN = CONFIGAREA_BEGIN + CONFIGAREA_BYTES;
+// properties_t is split into the sweep and cal data part and the ui state that follows it
+constexpr uint32_t CALDATA_HEAD_BYTES = offsetof(properties_t, _cal_data);
+constexpr uint32_t UISTATE_OFFSET = offsetof(properties_t, _electrical_delay);
+constexpr uint32_t UISTATE_BYTES = offsetof(properties_t, checksum) - UISTATE_OFFSET;
 
-static inline uint32_t SAVEAREA(int id) {
-	//assert(id >= 0 && id < SAVEAREA_MAX);
-	return SAVEAREA_BEGIN + id*SAVEAREA_BYTES;
+// a caldata record holds the fields before _cal_data, the ui state, and
+// the cal data of the sweep points encoded by cal_codec
+static constexpr uint32_t caldata_length(int points) {
+	return CALDATA_HEAD_BYTES + UISTATE_BYTES + cal_encoded_bytes(points);
 }
 
+// saved calibration that the current sweep is interpolated from
+struct caldata_ref_t {
+	freqHz_t start;
+	freqHz_t step;
+	int _sweep_points;
+	uint16_t _cal_status;
+	const void *data;	// read with cal_decoder
+};
 
 
 uint32_t flash_program_data(uint32_t start_address, uint8_t *input_data, uint32_t num_elements);
 
 int flash_caldata_save(int id);
+// largest absolute error of a cal data value stored by the last save that
+// encoded cal data, see cal_encode_segment()
+extern float flash_caldata_error;
 int flash_caldata_recall(int id);
-const properties_t *caldata_reference(void);
+// reference the slot last saved or recalled. returns false if it holds no calibration.
+bool caldata_reference(caldata_ref_t &ref);
 
 int flash_config_save(void);
 int flash_config_recall(void);
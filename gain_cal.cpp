@@ -1,4 +1,4 @@
-#include "vna_measurement.hpp"
+#include "gain_cal.hpp"
 #include "ui.hpp"
 #include "fifo.hpp"
 #include "main.hpp"
@@ -27,11 +27,9 @@ static void discardPoints(FIFO<complexf, fifoSize>& dpFIFO, int n) {
 
 
 // measure the attenuation at each gain setting
-void performGainCal(VNAMeasurement& vnaMeasurement, float* gainTable, int maxGain) {
+void performGainCal(AppVNAMeasurement& vnaMeasurement, float* gainTable, int maxGain) {
 	int j;
 	volatile int currGain = 0;
-	auto old_emitDataPoint = vnaMeasurement.emitDataPoint;
-	auto old_phaseChanged = vnaMeasurement.phaseChanged;
 	auto old_avg = current_props._avg;
 	auto old_pow = current_props._adf4350_txPower;
 	FIFO<complexf, 32> dpFIFO;
@@ -39,7 +37,7 @@ void performGainCal(VNAMeasurement& vnaMeasurement, float* gainTable, int maxGai
 	current_props._adf4350_txPower = 0; // Use 0 power for prevent bbgain0 overflow
 
 	// override phaseChanged, set bbgain to desired value
-	vnaMeasurement.phaseChanged = [&](VNAMeasurementPhases ph) {
+	vnaMeasurement.phaseChangedOverride = [&](VNAMeasurementPhases ph) {
 		rfsw(RFSW_REFL, RFSW_REFL_ON);
 		rfsw(RFSW_RECV, RFSW_RECV_REFL);
 		rfsw(RFSW_ECAL, RFSW_ECAL_OPEN);
@@ -49,7 +47,7 @@ void performGainCal(VNAMeasurement& vnaMeasurement, float* gainTable, int maxGai
 	// disable ecal during gain cal
 	vnaMeasurement.ecalIntervalPoints = 10000;
 	vnaMeasurement.setSweep(DEFAULT_FREQ, 0, 1, 1);
-	vnaMeasurement.emitDataPoint = [&](int freqIndex, freqHz_t freqHz, const VNAObservation& v, const complexf* ecal) {
+	vnaMeasurement.emitDataPointOverride = [&](int freqIndex, freqHz_t freqHz, const VNAObservation& v, const complexf* ecal) {
 		dpFIFO.enqueue(v[1]);
 	};
 
@@ -70,6 +68,6 @@ void performGainCal(VNAMeasurement& vnaMeasurement, float* gainTable, int maxGai
 	current_props._avg = old_avg;
 	current_props._adf4350_txPower = old_pow;
 	// reset callbacks
-	vnaMeasurement.emitDataPoint = old_emitDataPoint;
-	vnaMeasurement.phaseChanged = old_phaseChanged;
+	vnaMeasurement.emitDataPointOverride = {};
+	vnaMeasurement.phaseChangedOverride = {};
 }
@@ -1,5 +1,4 @@
 #pragma once
+#include "measurement_handlers.hpp"
 
-class VNAMeasurement;
-
-void performGainCal(VNAMeasurement& vnaMeasurement, float* gainTable, int maxGain);
+void performGainCal(AppVNAMeasurement& vnaMeasurement, float* gainTable, int maxGain);
@@ -31,6 +31,7 @@ properties_t current_props;
 
 complexf measuredFreqDomain[2][SWEEP_POINTS_MAX] alignas(8);
 complexf measured[2][SWEEP_POINTS_MAX] alignas(8);
+uint32_t measuredGeneration[2];
 
 volatile EcalStates ecalState = ECAL_STATE_MEASURING;
 
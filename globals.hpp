@@ -36,6 +36,10 @@ extern complexf measuredFreqDomain[2][SWEEP_POINTS_MAX];
 // measured data, possibly transformed
 extern complexf measured[2][SWEEP_POINTS_MAX];
 
+// incremented whenever measured[ch] changes; used to skip remapping
+// traces whose data did not change.
+extern uint32_t measuredGeneration[2];
+
 enum EcalStates {
 	ECAL_STATE_MEASURING,
 	ECAL_STATE_2NDSWEEP,
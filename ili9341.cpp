@@ -17,6 +17,7 @@
  * the Free Software Foundation, Inc., 51 Franklin Street,
  * Boston, MA 02110-1301, USA.
  */
+#include <string.h>
 #include "ili9341.hpp"
 #include "Font.h"
 #include "plot.hpp"
@@ -130,8 +131,8 @@
 #define RESET_NEGATE	;
 #define CS_LOW			ili9341_spi_set_cs(true)
 #define CS_HIGH			ili9341_spi_set_cs(false)
-#define DC_CMD			digitalWrite(ili9341_conf_dc, LOW)
-#define DC_DATA			digitalWrite(ili9341_conf_dc, HIGH)
+#define DC_CMD			ili9341_spi_set_dc(false)
+#define DC_DATA			ili9341_spi_set_dc(true)
 
 
 
@@ -147,11 +148,12 @@ uint16_t* ili9341_spi_buffer = ili9341_spi_bufferA;
 uint16_t foreground_color = 0;
 uint16_t background_color = 0;
 
-Pad ili9341_conf_dc;
 small_function<void(bool selected)> ili9341_spi_set_cs;
+small_function<void(bool data)> ili9341_spi_set_dc;
 small_function<uint32_t(uint32_t sdi, int bits)> ili9341_spi_transfer;
-small_function<void(uint32_t words)> ili9341_spi_transfer_bulk;
+small_function<void(uint16_t* buf, uint32_t words)> ili9341_spi_transfer_bulk;
 small_function<void()> ili9341_spi_wait_bulk;
+small_function<uint32_t()> ili9341_spi_window;
 small_function<void(uint8_t *buf, uint32_t bytes)> ili9341_spi_read;
 
 static inline void ssp_senddata(uint8_t x)
@@ -183,6 +185,22 @@ static void send_command(uint8_t cmd, int len, const uint8_t *data)
 	//CS_HIGH;
 }
 
+// bus time of an address window and memory write command, in words
+#define COMMAND_WORDS 8
+// shorter parts of a transfer are not started unless they complete it
+#define BULK_MIN_WORDS 64
+
+// wait until words can be sent before the bus must be kept quiet, see
+// ili9341_spi_window(); returns the current window. Everything but the
+// queued transfers of ili9341_bulk() waits here before using the bus.
+static uint32_t wait_window(uint32_t words)
+{
+	uint32_t n;
+	while ((n = ili9341_spi_window()) < words)
+		;
+	return n;
+}
+
 #ifndef DISPLAY_ST7796
 static const uint8_t ili_init_seq[] = {
   // cmd, len, data...,
@@ -300,6 +318,7 @@ ili9341_init(void)
 
   const uint8_t *p;
   for (p = ili_init_seq; *p; ) {
+	wait_window(COMMAND_WORDS);
 	send_command(p[0], p[1], &p[2]);
 	p += 2 + p[1];
 	delay(5);
@@ -307,7 +326,7 @@ ili9341_init(void)
 }
 
 // Reverses the byte order within each halfword of a word. For example, 0x12345678 becomes 0x34127856.
-#if 0
+#ifndef __arm__
 #define __REV16(v) (((((uint32_t)(v) & 0xFF000000) >> 8) | (((uint32_t)(v) & 0x00FF0000) << 8) | (((uint32_t)(v) & 0x0000FF00) >> 8) | (((uint32_t)(v) & 0x0000FF) << 8)))
 #else
 static inline uint32_t __REV16(uint32_t value)
@@ -337,7 +356,8 @@ void ili9341_fill(int x, int y, int w, int h, uint16_t color)
 	uint32_t len = w * h;
 	uint32_t xx = __REV16(x | ((x + w - 1) << 16));
 	uint32_t yy = __REV16(y | ((y + h - 1) << 16));
-	ili9341_spi_wait_bulk();
+	ili9341_bulk_flush();
+	wait_window(COMMAND_WORDS + (len < BULK_MIN_WORDS ? len : BULK_MIN_WORDS));
 	send_command(ILI9341_COLUMN_ADDRESS_SET, 4, (uint8_t*)&xx);
 	send_command(ILI9341_PAGE_ADDRESS_SET, 4, (uint8_t*)&yy);
 	send_command(ILI9341_MEMORY_WRITE, 0, NULL);
@@ -351,7 +371,12 @@ void ili9341_fill(int x, int y, int w, int h, uint16_t color)
 
 	while(len > 0) {
 		uint32_t bulk = len > fill ? fill : len;
-		ili9341_spi_transfer_bulk(bulk);
+		// the window counts from now, so the previous part must be done
+		ili9341_spi_wait_bulk();
+		uint32_t window = wait_window(bulk < BULK_MIN_WORDS ? bulk : BULK_MIN_WORDS);
+		if (bulk > window)
+			bulk = window;
+		ili9341_spi_transfer_bulk(ili9341_spi_buffer, bulk);
 		len -= bulk;
 	}
 	if(ili9341_spi_buffer == ili9341_spi_bufferA)
@@ -359,31 +384,165 @@ void ili9341_fill(int x, int y, int w, int h, uint16_t color)
 	else ili9341_spi_buffer = ili9341_spi_bufferA;
 }
 
-void ili9341_bulk(int x, int y, int w, int h)
+// bulk transfer queue. One transfer can be in flight and one can be pending,
+// each using one of the two spi buffers. When the transfer in flight
+// completes, ili9341_bulk_done() sends the address window of the pending one
+// and starts its DMA, so the display is kept busy while the next cell
+// is being rendered.
+// A transfer is sent in parts that fit into ili9341_spi_window(); when the
+// window closes, the rest is sent once it opens again. The display keeps
+// accepting pixel data of a memory write as long as no new command is sent.
+struct bulkJob {
+	uint32_t xx, yy;
+	uint32_t words;
+	uint32_t sent;		// words already sent
+	uint16_t* buf;
+};
+bool ili9341_pipelined = true;
+static uint16_t* volatile bulkActive = nullptr; // buffer of the current transfer
+static volatile bool bulkInFlight = false;	// a part of it is being sent
+static volatile bool bulkHasPending = false;
+static bulkJob bulkCurrent;
+static bulkJob bulkPending;
+
+// on the host (test/lcd_host.cpp) transfers complete synchronously and
+// there are no interrupts to mask
+static inline void irq_disable(void)
 {
-	uint32_t len = w * h;
-	uint32_t xx = __REV16(x | ((x + w - 1) << 16));
-	uint32_t yy = __REV16(y | ((y + h - 1) << 16));
+#ifdef __arm__
+  __asm volatile("cpsid i" : : : "memory");
+#endif
+}
+
+static inline void irq_enable(void)
+{
+#ifdef __arm__
+  __asm volatile("cpsie i" : : : "memory");
+#endif
+}
+
+// send the next part of the current transfer if the bus window allows.
+// Must only be called while no part is in flight.
+static void bulk_step(void)
+{
+	bulkJob& job = bulkCurrent;
+	uint32_t left = job.words - job.sent;
+	uint32_t n = ili9341_spi_window();
+	if (job.sent == 0)
+		n = n > COMMAND_WORDS ? n - COMMAND_WORDS : 0;
+	if (n > left)
+		n = left;
+	if (n < left && n < BULK_MIN_WORDS)
+		return;
+	if (job.sent == 0) {
+		send_command(ILI9341_COLUMN_ADDRESS_SET, 4, (const uint8_t*)&job.xx);
+		send_command(ILI9341_PAGE_ADDRESS_SET, 4, (const uint8_t*)&job.yy);
+		send_command(ILI9341_MEMORY_WRITE, 0, NULL);
+	}
+	bulkInFlight = true;
+	uint16_t* buf = job.buf + job.sent;
+	job.sent += n;
+	ili9341_spi_transfer_bulk(buf, n);
+}
+
+// make the pending transfer current; the bus must be idle
+static void bulk_next(void)
+{
+	bulkActive = nullptr;
+	if (!bulkHasPending)
+		return;
+	bulkCurrent = bulkPending;
+	bulkHasPending = false;
+	bulkActive = bulkCurrent.buf;
+}
+
+// continue the queue if the bus is idle. Called from the main loop
+// while waiting, in case ili9341_bulk_done() had to defer it.
+static void bulk_kick(void)
+{
+	bool step = false;
+	irq_disable();
+	if (!bulkInFlight) {
+		if (bulkActive == nullptr)
+			bulk_next();
+		step = (bulkActive != nullptr);
+	}
+	irq_enable();
+	// nothing is in flight, so ili9341_bulk_done() can not run concurrently
+	if (step)
+		bulk_step();
+}
+
+void ili9341_bulk_done(void)
+{
+	// also called after transfers of ili9341_fill()
+	if (!bulkInFlight)
+		return;
+	bulkInFlight = false;
+	if (bulkCurrent.sent == bulkCurrent.words)
+		bulk_next();
+	if (bulkActive != nullptr)
+		bulk_step();
+}
+
+void ili9341_bulk_flush(void)
+{
+	while (bulkActive != nullptr || bulkHasPending)
+		bulk_kick();
 	ili9341_spi_wait_bulk();
-	send_command(ILI9341_COLUMN_ADDRESS_SET, 4, (uint8_t*)&xx);
-	send_command(ILI9341_PAGE_ADDRESS_SET, 4, (uint8_t*)&yy);
-	send_command(ILI9341_MEMORY_WRITE, 0, NULL);
+}
 
-	ili9341_spi_transfer_bulk(len);
+void ili9341_bulk(int x, int y, int w, int h)
+{
+	bulkJob job;
+	job.xx = __REV16(x | ((x + w - 1) << 16));
+	job.yy = __REV16(y | ((y + h - 1) << 16));
+	job.words = w * h;
+	job.sent = 0;
+	job.buf = ili9341_spi_buffer;
+
+	if (!ili9341_pipelined) {
+		// send it through the queue, which fits it into the window,
+		// and wait until it is done
+		ili9341_bulk_flush();
+		bulkCurrent = job;
+		bulkActive = job.buf;
+		ili9341_bulk_flush();
+	} else {
+		// the pending slot is free once the current transfer has completed
+		while (bulkHasPending)
+			bulk_kick();
+		bool start = false;
+		irq_disable();
+		if (bulkActive == nullptr) {
+			bulkCurrent = job;
+			bulkActive = job.buf;
+			start = true;
+		} else {
+			bulkPending = job;
+			bulkHasPending = true;
+		}
+		irq_enable();
+		if (start)
+			bulk_step();
+	}
 
 	// switch buffers so that the user can continue to render while
 	// the bulk transfer is happening.
 	if(ili9341_spi_buffer == ili9341_spi_bufferA)
 		ili9341_spi_buffer = ili9341_spi_bufferB;
 	else ili9341_spi_buffer = ili9341_spi_bufferA;
+
+	// the new render buffer may still be in flight
+	while (bulkActive == ili9341_spi_buffer)
+		bulk_kick();
 }
 
-void
-ili9341_read_memory(int x, int y, int w, int h, uint16_t *out)
+// read one address window of pixels
+static void read_area(int x, int y, int w, int h, uint16_t *out)
 {
 	uint32_t xx = __REV16(x | ((x + w - 1) << 16));
 	uint32_t yy = __REV16(y | ((y + h - 1) << 16));
-	ili9341_spi_wait_bulk();
 	send_command(ILI9341_COLUMN_ADDRESS_SET, 4, (uint8_t *)&xx);
 	send_command(ILI9341_PAGE_ADDRESS_SET, 4, (uint8_t*)&yy);
 
@@ -411,12 +570,48 @@ ili9341_read_memory(int x, int y, int w, int h, uint16_t *out)
 	CS_HIGH;
 }
 
+// The area is read in parts that fit into ili9341_spi_window(): whole rows
+// when the window allows, otherwise parts of a row.
+void
+ili9341_read_memory(int x, int y, int w, int h, uint16_t *out)
+{
+#ifndef DISPLAY_ST7796
+	constexpr uint32_t wordsPerPixel = 2;	// 3 bytes
+#else
+	constexpr uint32_t wordsPerPixel = 1;
+#endif
+	ili9341_bulk_flush();
+	int cx = 0;	// pixels of row y already read
+	while (h > 0) {
+		uint32_t window = wait_window(COMMAND_WORDS + BULK_MIN_WORDS);
+		uint32_t pixels = (window - COMMAND_WORDS) / wordsPerPixel;
+		if (cx == 0 && pixels >= uint32_t(w)) {
+			int rows = pixels / w > uint32_t(h) ? h : pixels / w;
+			read_area(x, y, w, rows, out);
+			out += w * rows;
+			y += rows;
+			h -= rows;
+			continue;
+		}
+		int cols = uint32_t(w - cx) > pixels ? pixels : w - cx;
+		read_area(x + cx, y, cols, 1, out);
+		out += cols;
+		cx += cols;
+		if (cx == w) {
+			cx = 0;
+			y++;
+			h--;
+		}
+	}
+}
+
 void
 ili9341_set_flip(bool flipX, bool flipY) {
-	ili9341_spi_wait_bulk();
+	ili9341_bulk_flush();
 	uint8_t memAcc = ILI9341_MADCTL_BGR | ILI9341_MADCTL_MV;
 	if(flipX) memAcc |= ILI9341_MADCTL_MX;
 	if(flipY) memAcc |= ILI9341_MADCTL_MY;
+	wait_window(COMMAND_WORDS);
 	send_command(ILI9341_MEMORY_ACCESS_CONTROL, 1, &memAcc);
 }
 
@@ -461,30 +656,75 @@ ili9341_drawchar(uint8_t ch, int x, int y)
   ili9341_blitBitmap(x, y, FONT_GET_WIDTH(ch), FONT_GET_HEIGHT, FONT_GET_DATA(ch));
 }
 
+// glyph bits expanded to pixels, one entry per nibble, for the colours they
+// were built with
+static uint16_t glyph_lut[16][4];
+static uint16_t glyph_lut_fg, glyph_lut_bg;
+static bool glyph_lut_valid = false;
+
+static void
+glyph_lut_update(void)
+{
+  if (glyph_lut_valid && glyph_lut_fg == foreground_color && glyph_lut_bg == background_color)
+    return;
+  for (int n = 0; n < 16; n++)
+    for (int i = 0; i < 4; i++)
+      glyph_lut[n][i] = (n & (8 >> i)) ? foreground_color : background_color;
+  glyph_lut_fg = foreground_color;
+  glyph_lut_bg = background_color;
+  glyph_lut_valid = true;
+}
+
+// render as many glyphs as fit into the spi buffer and send them as one
+// transfer
+static void
+drawstring_run(const char *str, int len, int x, int y)
+{
+  static_assert(FONT_MAX_WIDTH <= 8);
+  constexpr int maxWidth = SPI_BUFFER_SIZE / FONT_GET_HEIGHT;
+  glyph_lut_update();
+  while (len > 0) {
+    int n = 0, w = 0;
+    while (n < len && w + FONT_GET_WIDTH((uint8_t)str[n]) <= maxWidth)
+      w += FONT_GET_WIDTH((uint8_t)str[n++]);
+    uint16_t *buf = ili9341_spi_buffer;
+    int xo = 0;
+    for (int i = 0; i < n; i++) {
+      uint8_t ch = str[i];
+      const uint8_t *bits = FONT_GET_DATA(ch);
+      int cw = FONT_GET_WIDTH(ch);
+      for (int c = 0; c < FONT_GET_HEIGHT; c++) {
+        uint16_t *dst = &buf[c * w + xo];
+        memcpy(dst, glyph_lut[bits[c] >> 4], (cw < 4 ? cw : 4) * 2);
+        if (cw > 4)
+          memcpy(dst + 4, glyph_lut[bits[c] & 15], (cw - 4) * 2);
+      }
+      xo += cw;
+    }
+    ili9341_bulk(x, y, w, FONT_GET_HEIGHT);
+    x += w;
+    str += n;
+    len -= n;
+  }
+}
+
 void ili9341_drawstring(const char *str, int x, int y)
 {
-  int x_pos = x;
   while (*str) {
-    uint8_t ch = *str++;
-    if (ch == '\n') {x = x_pos; y+=FONT_STR_HEIGHT; continue;}
-    const uint8_t *char_buf = FONT_GET_DATA(ch);
-    uint16_t w = FONT_GET_WIDTH(ch);
-    ili9341_blitBitmap(x, y, w, FONT_GET_HEIGHT, char_buf);
-    x += w;
+    const char *end = strchr(str, '\n');
+    int len = end ? end - str : strlen(str);
+    drawstring_run(str, len, x, y);
+    if (!end)
+      break;
+    str = end + 1;
+    y += FONT_STR_HEIGHT;
   }
 }
 
 void
 ili9341_drawstring(const char *str, int len, int x, int y)
 {
-	const char* end = str + len;
-	while (str < end) {
-		uint8_t ch = *str++;
-		const uint8_t *char_buf = FONT_GET_DATA(ch);
-		uint16_t w = FONT_GET_WIDTH(ch);
-		ili9341_blitBitmap(x, y, w, FONT_GET_HEIGHT, char_buf);
-		x += w;
-	}
+	drawstring_run(str, len, x, y);
 }
 
 int
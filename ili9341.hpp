@@ -44,18 +44,21 @@ extern uint16_t ili9341_spi_buffers[SPI_BUFFER_SIZE * 2];
 
 // the buffer that ili9341_bulk() transfers from
 extern uint16_t* ili9341_spi_buffer;
-extern Pad ili9341_conf_dc;
 
 // ===== hooks =====
 
 // select or deselect the ili9341 spi slave, called to start/stop a transaction
 extern small_function<void(bool selected)> ili9341_spi_set_cs;
 
+// drive the data/command pin; true selects data, false selects command
+extern small_function<void(bool data)> ili9341_spi_set_dc;
+
 // write sdi onto spi bus while returning read value; does not affect cs pin
 extern small_function<uint32_t(uint32_t sdi, int bits)> ili9341_spi_transfer;
 
-// write spi_buffer to spi bus up to bytes without waiting for completion
-extern small_function<void(uint32_t words)> ili9341_spi_transfer_bulk;
+// write buf to spi bus up to words without waiting for completion.
+// May be called from ili9341_bulk_done(), i.e. from interrupt context.
+extern small_function<void(uint16_t* buf, uint32_t words)> ili9341_spi_transfer_bulk;
 
 // read to buffer from spi bus up to bytes, waiting for completion aftrer
 extern small_function<void(uint8_t *buf, uint32_t bytes)> ili9341_spi_read;
@@ -63,6 +66,18 @@ extern small_function<void(uint8_t *buf, uint32_t bytes)> ili9341_spi_read;
 // wait for bulk transfers to complete
 extern small_function<void()> ili9341_spi_wait_bulk;
 
+// returns how many words may be sent before the spi bus must be kept quiet;
+// 0 while it must be quiet. Queued transfers are sent in parts that fit,
+// and the rest is started from the main loop instead of from
+// ili9341_bulk_done() once the window opens again. Commands and
+// ili9341_fill() wait on the main thread until their part fits.
+extern small_function<uint32_t()> ili9341_spi_window;
+
+// if true, ili9341_bulk() queues the transfer and returns immediately;
+// the address window of the next transfer is sent from ili9341_bulk_done().
+// if false, every transfer is set up synchronously (for benchmarking).
+extern bool ili9341_pipelined;
+
 
 static inline constexpr uint16_t byteReverse16(uint16_t x) {
     return (x << 8) | (x >> 8);
@@ -71,6 +86,10 @@ static inline constexpr uint16_t byteReverse16(uint16_t x) {
 void ili9341_init(void);
 void ili9341_test(int mode);
 void ili9341_bulk(int x, int y, int w, int h);
+// wait for all queued bulk transfers to complete
+void ili9341_bulk_flush(void);
+// must be called from the spi dma transfer complete interrupt
+void ili9341_bulk_done(void);
 void ili9341_set_flip(bool flipX, bool flipY);
 void ili9341_clear_screen(void);
 void ili9341_set_foreground(uint16_t fg);
@@ -83,4 +102,5 @@ void ili9341_drawstring(const char *str, int len, int x, int y);
 //int ili9341_drawchar_size(uint8_t ch, int x, int y, uint8_t size);
 void ili9341_drawstring_size(const char *str, int x, int y, uint8_t size);
 void ili9341_drawfont(uint8_t ch, int x, int y);
+// reads in parts that fit into ili9341_spi_window(), like ili9341_fill()
 void ili9341_read_memory(int x, int y, int w, int h, uint16_t* out);
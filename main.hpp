@@ -35,6 +35,10 @@ namespace UIActions {
 	void set_electrical_delay(float picoseconds);
 	float get_electrical_delay(void);
 
+	// set the time domain gate, in picoseconds. Only ST_START, ST_STOP,
+	// ST_CENTER and ST_SPAN are valid.
+	void set_time_gate(SweepParameter type, float picoseconds);
+
 	void apply_edelay_at(int i);
 
 	void set_averaging(int i);
@@ -41,21 +41,31 @@
 #include "globals.hpp"
 #include "synthesizers.hpp"
 #include "vna_measurement.hpp"
+#include "measurement_handlers.hpp"
 #include "fifo.hpp"
 #include "flash.hpp"
+#include "crc32.hpp"
 #include "calibration.hpp"
 #include "fft.hpp"
 #include "command_parser.hpp"
 #include "stream_fifo.hpp"
+#include "screenshot.hpp"
 #include "sin_rom.hpp"
 #include "gain_cal.hpp"
+#include "measurement_control.hpp"
+#include "usb_protocol.hpp"
 
 #ifdef HAS_SELF_TEST
 #include "self_test.hpp"
 #endif
 
+#ifdef SPI_SLAVE_INTERFACE
+#include "spi_slave.hpp"
+#endif
+
 #include <libopencm3/stm32/timer.h>
 #include <libopencm3/cm3/scb.h>
+#include <libopencm3/cm3/dwt.h>
 #include <libopencm3/cm3/vector.h>
 
 using namespace mculib;
@@ -66,37 +76,17 @@ using namespace board;
 // this can be any value since we are not using shared libraries.
 void* __dso_handle = (void*) &__dso_handle;
 
-static bool outputRawSamples = false;
 int cpu_mhz = 8; /* The CPU boots on internal (HSI) 8Mhz */
 
 
-int lo_freq = 12000; // IF frequency, Hz
-int adf4350_freqStep = 12000; // adf4350 resolution, Hz
-
 static USBSerial serial;
 
 static const int adcBufSize=1024;	// must be power of 2
 static volatile uint16_t adcBuffer[adcBufSize];
 
-static VNAMeasurement vnaMeasurement;
 static CommandParser cmdParser;
 static StreamFIFO cmdInputFIFO;
 static uint8_t cmdInputBuffer[128];
-/* This is written in the 'measurement thread' (ADC ISR)
- * But read by the 'main thread'. So make it volatile */
-static volatile bool lcdInhibit = false;
-
-float gainTable[RFSW_BBGAIN_MAX+1];
-
-struct usbDataPoint {
-	//VNAObservation value;
-	complexf S11, S21;
-	int freqIndex;
-} __attribute__((packed));
-static usbDataPoint usbTxQueue[128];
-static constexpr int usbTxQueueMask = 127;
-static volatile int usbTxQueueWPos = 0;
-static volatile int usbTxQueueRPos = 0;
 
 // periods of a 1MHz clock; how often to call adc_process()
 static constexpr int tim1Period = 25;	// 1MHz / 25 = 40kHz
@@ -110,11 +100,8 @@ volatile uint32_t systemTimeCounter = 0;
 
 static FIFO<small_function<void()>, 8> eventQueue;
 
-static volatile bool usbDataMode = false;
 static volatile bool usbCaptureMode = false;
 
-static freqHz_t currFreqHz = 0;		// current hardware tx frequency
-
 // if nonzero, any ecal data in the next ecalIgnoreValues data points will be ignored.
 // this variable is decremented every time a data point arrives, if nonzero.
 static volatile int ecalIgnoreValues = 0;
@@ -124,7 +111,6 @@ static int collectMeasurementState = 0;
 static small_function<void()> collectMeasurementCB;
 
 static void adc_process();
-static int measurementGetDefaultGain(freqHz_t freqHz);
 void cal_interpolate(void);
 
 #define myassert(x) if(!(x)) do { errorBlink(3); } while(1)
@@ -265,18 +251,85 @@ static void dsp_timer_setup() {
 	// set tim1 to highest priority
 	nvic_set_priority(NVIC_TIM1_UP_IRQ, 0x00);
 	nvic_enable_irq(NVIC_TIM1_UP_IRQ);
+	// used to measure the cost of tim1_up_isr
+	dwt_enable_cycle_counter();
 	startTimer(TIM1, tim1Period);
 }
 
+// display bus schedule. The measurement engine publishes when the next
+// phase that needs a quiet display bus (THRU, ECALTHRU) starts, in IF
+// periods; lcdWindowWords() converts that into the number of display words
+// that can still be sent, using the measured length of an IF period and the
+// measured speed of display transfers.
+static volatile uint32_t lcdCyclesPerPeriod = 0;
+static volatile uint32_t lcdCyclesPerWord = 0;
+static volatile uint32_t lcdLastTickCycles = 0;	// last measurement interrupt
+static uint32_t lcdBulkStartCycles = 0, lcdBulkWords = 0;
+
+// called from the measurement interrupt
+static void lcdScheduleTick(uint32_t cycles) {
+	static bool marked = false;
+	static uint32_t markCycles = 0, markCount = 0;
+	uint32_t count = vnaMeasurement.periodCounter;
+	lcdLastTickCycles = cycles;
+	if(!marked || count - markCount >= 256) {
+		if(marked)
+			lcdCyclesPerPeriod = (cycles - markCycles) / (count - markCount);
+		markCycles = cycles;
+		markCount = count;
+		marked = true;
+	}
+}
+
+static uint32_t lcdWindowWords() {
+	if(lcdInhibit)
+		return 0;
+	uint32_t cyclesPerPeriod = lcdCyclesPerPeriod;
+	uint32_t cyclesPerWord = lcdCyclesPerWord;
+	if(!vnaMeasurement.quietScheduled || cyclesPerPeriod == 0 || cyclesPerWord == 0)
+		return UINT32_MAX;
+	// the measurement is not running; the schedule is stale
+	if(dwt_read_cycle_counter() - lcdLastTickCycles > uint32_t(cpu_mhz) * 1000)
+		return UINT32_MAX;
+	uint32_t start, now;
+	do {
+		start = vnaMeasurement.quietStart;
+		now = vnaMeasurement.periodCounter;
+	} while(start != vnaMeasurement.quietStart);
+	// the current period is already partly over
+	int32_t periods = int32_t(start - now) - 1;
+	if(periods <= 0)
+		return 0;
+	return uint64_t(periods) * cyclesPerPeriod / cyclesPerWord;
+}
+
 extern "C" void tim1_up_isr() {
+	uint32_t startCycles = dwt_read_cycle_counter();
 	TIM1_SR = 0;
 	systemTimeCounter += tim1Period;
 	adc_process();
+	lcdScheduleTick(startCycles);
+
+	uint32_t cycles = dwt_read_cycle_counter() - startCycles;
+	VNAMeasurementStats& stats = vnaMeasurement.stats;
+	stats.isrCycles += cycles;
+	stats.isrCalls++;
+	if(cycles > stats.isrCyclesMax)
+		stats.isrCyclesMax = cycles;
 }
 extern "C" void tim2_isr() {
 	TIM2_SR = 0;
 	UIHW::checkButtons();
 }
+#ifndef SPI_SLAVE_INTERFACE
+extern "C" void dma1_channel3_isr() {
+	dma_clear_interrupt_flags(DMA1, DMA_CHANNEL3, DMA_TCIF);
+	// short transfers are dominated by setup overhead
+	if(lcdBulkWords >= 256)
+		lcdCyclesPerWord = (dwt_read_cycle_counter() - lcdBulkStartCycles + lcdBulkWords - 1) / lcdBulkWords;
+	ili9341_bulk_done();
+}
+#endif
 
 static int si5351_doUpdate(uint32_t freqHz) {
 	// round frequency to values that can be accurately set, so that IF frequency is not wrong
@@ -329,102 +382,34 @@ static void adf4350_powerup(void) {
 	adf4350_rx.sendPowerUp();
 }
 
-// automatically set IF frequency depending on rf frequency and board parameters
-static void updateIFrequency(freqHz_t txFreqHz) {
-#if BOARD_REVISION >= 3
-	nvic_disable_irq(NVIC_TIM1_UP_IRQ);
-	if(txFreqHz < 40000) { //|| (txFreqHz > 149000000 && txFreqHz < 151000000)) {
-		lo_freq = 6000;
-		adf4350_freqStep = 6000;
-		vnaMeasurement.setCorrelationTable(sinROM200x1, 200);
-		vnaMeasurement.adcFullScale = 10000 * 200 * 200;
-		vnaMeasurement.gainMax = 0;
-		vnaMeasurement.currThruGain = 0;
-	} else if(txFreqHz <= 350000) { //|| (txFreqHz > 149000000 && txFreqHz < 151000000)) {
-		lo_freq = 12000;
-		adf4350_freqStep = 12000;
-		vnaMeasurement.setCorrelationTable(sinROM100x1, 100);
-		vnaMeasurement.adcFullScale = 10000 * 100 * 100;
-		vnaMeasurement.gainMax = 0;
-		vnaMeasurement.currThruGain = 0;
-	} else {
-		lo_freq = 150000;
-		adf4350_freqStep = 10000;
-		vnaMeasurement.setCorrelationTable(sinROM10x2, 20);
-		vnaMeasurement.adcFullScale = 10000 * 48 * 20;
-		vnaMeasurement.gainMax = 3;
-	}
-	nvic_enable_irq(NVIC_TIM1_UP_IRQ);
-#else
-	// adf4350 freq step and thus IF frequency must be a divisor of the crystal frequency
-	if(xtalFreqHz == 20000000 || xtalFreqHz == 40000000) {
-		// 6.25/12.5kHz IF
-		if(txFreqHz >= 100000) {
-			lo_freq = 12500;
-			adf4350_freqStep = 12500;
-			vnaMeasurement.setCorrelationTable(sinROM24x2, 48);
-			vnaMeasurement.adcFullScale = 20000 * 48 * 48;
-		} else {
-			lo_freq = 6250;
-			adf4350_freqStep = 6250;
-			vnaMeasurement.setCorrelationTable(sinROM48x1, 48);
-			vnaMeasurement.adcFullScale = 20000 * 48 * 48;
-		}
-	} else {
-		// 6.0/12.0kHz IF
-		if(txFreqHz >= 100000) {
-			lo_freq = 12000;
-			adf4350_freqStep = 12000;
-			vnaMeasurement.setCorrelationTable(sinROM25x2, 50);
-			vnaMeasurement.adcFullScale = 20000 * 48 * 50;
-		} else {
-			lo_freq = 6000;
-			adf4350_freqStep = 6000;
-			vnaMeasurement.setCorrelationTable(sinROM50x1, 50);
-			vnaMeasurement.adcFullScale = 20000 * 48 * 50;
-		}
-	}
-#endif
-}
-
 // needed for correct automatic synthwait setting between board versions
 __attribute__((used, noinline)) int calculateSynthWait(bool isSi, int retval) {
 	if(isSi) return calculateSynthWaitSI(retval);
 	else return calculateSynthWaitAF(retval);
 }
 
-// set the measurement frequency including setting the tx and rx synthesizers
-void setFrequency(freqHz_t freqHz) {
-	updateIFrequency(freqHz);
-	// On measure, call phase change before update frequency call, so update gain for frequency range here
-	rfsw(RFSW_BBGAIN, RFSW_BBGAIN_GAIN(measurementGetDefaultGain(freqHz)));
-
-	/* Only if frequency changes apply the new frequency.
-	 * This is to support proper CW mode:
-	 * changing to an existing frequency temporarily breaks the signal */
-	if(currFreqHz != freqHz) {
-		currFreqHz = freqHz;
-		// use adf4350 for f >= 140MHz
-		if(is_freq_for_adf4350(freqHz)) {
-			adf4350_update(freqHz);
-			rfsw(RFSW_TXSYNTH, RFSW_TXSYNTH_HF);
-			rfsw(RFSW_RXSYNTH, RFSW_RXSYNTH_HF);
-		#ifdef EXPERIMENTAL_SYNTHWAIT
-			vnaMeasurement.nWaitSynth = calculateSynthWaitAF(freqHz);
-		#else
-			vnaMeasurement.nWaitSynth = calculateSynthWait(false, freqHz);
-		#endif
-		} else {
-			int ret = si5351_update(freqHz);
-			rfsw(RFSW_TXSYNTH, RFSW_TXSYNTH_LF);
-			rfsw(RFSW_RXSYNTH, RFSW_RXSYNTH_LF);
-			if(ret < 0 || ret > 2) ret = 2;
-		#ifdef EXPERIMENTAL_SYNTHWAIT
-			vnaMeasurement.nWaitSynth = calculateSynthWaitSI(ret);
-		#else
-			vnaMeasurement.nWaitSynth = calculateSynthWait(true, ret);
-		#endif
-		}
+// program the synthesizers for a changed frequency; see setFrequency()
+void synthSetFrequency(freqHz_t freqHz) {
+	// use adf4350 for f >= 140MHz
+	if(is_freq_for_adf4350(freqHz)) {
+		adf4350_update(freqHz);
+		rfsw(RFSW_TXSYNTH, RFSW_TXSYNTH_HF);
+		rfsw(RFSW_RXSYNTH, RFSW_RXSYNTH_HF);
+	#ifdef EXPERIMENTAL_SYNTHWAIT
+		vnaMeasurement.nWaitSynth = calculateSynthWaitAF(freqHz);
+	#else
+		vnaMeasurement.nWaitSynth = calculateSynthWait(false, freqHz);
+	#endif
+	} else {
+		int ret = si5351_update(freqHz);
+		rfsw(RFSW_TXSYNTH, RFSW_TXSYNTH_LF);
+		rfsw(RFSW_RXSYNTH, RFSW_RXSYNTH_LF);
+		if(ret < 0 || ret > 2) ret = 2;
+	#ifdef EXPERIMENTAL_SYNTHWAIT
+		vnaMeasurement.nWaitSynth = calculateSynthWaitSI(ret);
+	#else
+		vnaMeasurement.nWaitSynth = calculateSynthWait(true, ret);
+	#endif
 	}
 }
 
@@ -464,7 +449,40 @@ void adc_read(volatile uint16_t*& data, int& len, int modulus=1) {
 }
 
 
+#ifdef SPI_SLAVE_INTERFACE
+// headless: SPI1 and DMA1 channel 3 serve the spi slave interface on the
+// display connector. The UI still runs, and draws into hooks that discard it.
+static void headless_setup() {
+	ili9341_spi_set_dc = [](bool data) {};
+	ili9341_spi_set_cs = [](bool selected) {};
+	ili9341_spi_transfer = [](uint32_t sdi, int bits) -> uint32_t {
+		return 0;
+	};
+	ili9341_spi_transfer_bulk = [](uint16_t* buf, uint32_t words) {
+		ili9341_bulk_done();
+	};
+	ili9341_spi_wait_bulk = []() {};
+	ili9341_spi_window = []() -> uint32_t {
+		return UINT32_MAX;
+	};
+	ili9341_spi_read = [](uint8_t *buf, uint32_t bytes) {
+		memset(buf, 0, bytes);
+	};
+	xpt2046.spiSetCS = [](bool selected) {};
+	xpt2046.spiTransfer = [](uint32_t sdi, int bits) -> uint32_t {
+		return 0;
+	};
+	// the touch irq pin is pulled up, so no touch is seen
+	xpt2046.begin(LCD_WIDTH, LCD_HEIGHT);
+
+	spi_slave_init();
+}
+#endif
+
 static void lcd_and_ui_setup() {
+#ifdef SPI_SLAVE_INTERFACE
+	headless_setup();
+#else
 	lcd_spi_init();
 
 	digitalWrite(ili9341_cs, HIGH);
@@ -473,10 +491,13 @@ static void lcd_and_ui_setup() {
 	pinMode(xpt2046_cs, OUTPUT);
 
 	// setup hooks
-	ili9341_conf_dc = ili9341_dc;
+	ili9341_spi_set_dc = [](bool data) {
+		digitalWrite(ili9341_dc, data ? HIGH : LOW);
+	};
+	// ili9341.cpp checks ili9341_spi_window() before it starts using the
+	// bus, so the hooks below do not wait for lcdInhibit themselves
 	ili9341_spi_set_cs = [](bool selected) {
 		lcd_spi_waitDMA();
-		while(lcdInhibit) ;
 		// if the xpt2046 is currently selected, deselect it
 		if(selected && digitalRead(xpt2046_cs) == LOW) {
 			digitalWrite(xpt2046_cs, HIGH);
@@ -486,13 +507,17 @@ static void lcd_and_ui_setup() {
 	ili9341_spi_transfer = [](uint32_t sdi, int bits) {
 		return lcd_spi_transfer(sdi, bits);
 	};
-	ili9341_spi_transfer_bulk = [](uint32_t words) {
-		while(lcdInhibit) ;
-		lcd_spi_transfer_bulk((uint8_t*)ili9341_spi_buffer, words*2);
+	ili9341_spi_transfer_bulk = [](uint16_t* buf, uint32_t words) {
+		lcdBulkStartCycles = dwt_read_cycle_counter();
+		lcdBulkWords = words;
+		lcd_spi_transfer_bulk((uint8_t*)buf, words*2);
 	};
 	ili9341_spi_wait_bulk = []() {
 		lcd_spi_waitDMA();
 	};
+	ili9341_spi_window = []() {
+		return lcdWindowWords();
+	};
 	ili9341_spi_read = [](uint8_t *buf, uint32_t bytes) {
 		lcd_spi_read_bulk(buf, bytes);
 	};
@@ -500,7 +525,7 @@ static void lcd_and_ui_setup() {
 		// a single SPI master is used for both the ILI9346 display and the
 		// touch controller; if an outstanding background DMA is in progress,
 		// we must wait for it to complete.
-		lcd_spi_waitDMA();
+		ili9341_bulk_flush();
 
 		// if the ili9341 is currently selected, deselect it.
 		if(selected && digitalRead(ili9341_cs) == LOW) {
@@ -520,6 +545,12 @@ static void lcd_and_ui_setup() {
 		lcd_spi_write();
 		return ret;
 	};
+	// SPI1_TX is hard-wired to DMA1 channel 3; its transfer complete
+	// interrupt chains the queued display transfers.
+	dma_clear_interrupt_flags(DMA1, DMA_CHANNEL3, DMA_TCIF);
+	dma_enable_transfer_complete_interrupt(DMA1, DMA_CHANNEL3);
+	nvic_set_priority(NVIC_DMA1_CHANNEL3_IRQ, 0xc0);
+	nvic_enable_irq(NVIC_DMA1_CHANNEL3_IRQ);
 	delay(10);
 
 	xpt2046.begin(LCD_WIDTH, LCD_HEIGHT);
@@ -530,6 +561,7 @@ static void lcd_and_ui_setup() {
 	//ili9341_test(5);
 	// clear screen
 	 ili9341_clear_screen();
+#endif
 
 	// tell the plotting code how to calculate frequency in Hz given an index
 	plot_getFrequencyAt = [](int index) {
@@ -559,32 +591,6 @@ static void lcd_and_ui_setup() {
 	};
 }
 
-static void enterUSBDataMode() {
-	usbDataMode = true;
-}
-static void exitUSBDataMode() {
-	usbDataMode = false;
-}
-
-#ifdef BOARD_DISABLE_ECAL
-// Made measure ecal, and apply correction
-#define ecalApplyReflection(refl, freqIndex) refl
-#else
-complexf measuredEcal[ECAL_CHANNELS][USB_POINTS_MAX] alignas(8);
-static complexf ecalApplyReflection(complexf refl, int freqIndex) {
-	#if defined(ECAL_PARTIAL)
-		return refl - measuredEcal[0][freqIndex];
-	#else
-		return SOL_compute_reflection(
-					measuredEcal[1][freqIndex],
-					1.f,
-					measuredEcal[0][freqIndex],
-					refl);
-	#endif
-}
-#endif
-
-
 static complexf applyFixedCorrections(complexf refl, freqHz_t freq) {
 	// These corrections do not affect calibrated measurements
 	// and is only there to fix uglyness when uncalibrated and
@@ -660,12 +666,35 @@ For a description of the command interface see command_parser.hpp
 -- 21: sweepPoints[15..8]
 -- 22: valuesPerFrequency[7..0]
 -- 23: valuesPerFrequency[15..8]
+-- 24: sweepHold: while nonzero, writes to the sweep registers (00 - 23, 50 - 52)
+--     are held; writing 0 applies them as one sweep change.
 -- 26: dataMode: 0 => VNA data, 1 => raw data, 2 => exit usb data mode
 -- 30: valuesFIFO - returns data points; elements are 32-byte. See below for data format.
 --                  command 0x14 reads FIFO data; writing any value clears FIFO.
+-- 38: sequencerJobs - job table FIFO; job entries (24 bytes each, see below) written
+--     with 0x28/0x29 are appended. Writing any value clears the table.
+-- 39: sequencerControl: 1 => run the job table, 0 => stop
+-- 3a: sequencerState (read only): 0 => idle, 2 => running
+-- 3b: number of jobs in the table (read only)
 -- 40: adf4350 power
 -- 41: si5351 power (reserved)
 -- 42: average setting
+-- 50: zeroSpanPeriods[7..0]
+-- 51: zeroSpanPeriods[15..8]
+-- 52: zeroSpanPath: 0 => REFL, 1 => THRU, 2 => alternate REFL/THRU
+-- 58: zeroSpanFIFO - returns zero-span values; elements are 16-byte. See below for data format.
+--                    writing any value clears FIFO.
+-- 60 - 7f: measurement timing of the last completed sweep (read only), see below.
+-- 80: full screen redraw time without display pipelining, us (4 bytes, read only)
+-- 84: full screen redraw time with display pipelining, us (4 bytes, read only)
+-- 88: writing any value redraws the plot area twice and updates 80 and 84.
+-- 8c: render target frame rate, frames per second; 0 => unlimited (default 25)
+-- 90 - 9f: render statistics of the last second (read only), see below.
+-- a0: largest error of the cal data stored by the last calibration save, in
+--     units of 1e-9 (4 bytes, little endian, read only). Cal data is stored
+--     compressed; see cal_codec.hpp.
+-- ee: screenshot; writing 0 sends the screen as raw RGB565 rows, writing 1
+--     sends run-length encoded rows followed by a crc32 (see screenshot.hpp).
 -- f0: device variant (01)
 -- f1: protocol version (01)
 -- f2: hardware revision
@@ -676,6 +705,38 @@ For a description of the command interface see command_parser.hpp
 -- sweepStepHz - Sweep step frequency in Hz.
 -- sweepPoints - Number of points in sweep.
 -- valuesFIFO - Only command 0x13 supported; returns VNA data.
+-- zeroSpanPeriods - If nonzero, the device stops sweeping and holds sweepStartHz;
+--                   one value is pushed into zeroSpanFIFO every zeroSpanPeriods
+--                   IF periods. Set to 0 to return to normal sweeping.
+--                   Only supported on boards where the measurement runs in
+--                   application firmware (hardware revision < 4).
+-- zeroSpanFIFO - Read with command 0x18; N=0 returns all queued values.
+--                Values are sent 4 per usb packet.
+-- Sweep registers written with one batch command (0x2a) are applied as one
+-- sweep change, the same as writing them between sweepHold 1 and 0.
+
+-- measurement timing block (all little endian; periods are IF periods):
+-- 60: synthWaitPeriods (4 bytes)
+-- 64: switchWaitPeriods (4 bytes)
+-- 68: referencePeriods, integration in REFERENCE phase (4 bytes)
+-- 6c: reflPeriods (4 bytes)
+-- 70: thruPeriods (4 bytes)
+-- 74: ecalPeriods, sum of all ecal phases (4 bytes)
+-- 78: agcRetries (2 bytes, saturating)
+-- 7a: dsp interrupt average cpu cycles (2 bytes, saturating)
+-- 7c: dsp interrupt maximum cpu cycles (2 bytes, saturating)
+-- 7e: sweep counter, incremented when the block is updated (2 bytes)
+-- Only populated on boards where the measurement runs in application
+-- firmware (hardware revision < 4).
+
+-- render statistics (all little endian; updated once per second):
+-- 90: achieved frame rate, 0.1 fps (2 bytes)
+-- 92: skipped frames, sweeps coalesced into a later frame (2 bytes)
+-- 94: average frame time, us (4 bytes)
+-- 98: maximum frame time, us (4 bytes)
+-- 9c: counter, incremented when the block is updated (2 bytes)
+-- Frame time is the cpu time spent remapping and drawing the plot; with
+-- display pipelining the last transfers may still be in flight.
 
 -- valuesFIFO element data format:
 -- bytes:
@@ -708,7 +769,41 @@ For a description of the command interface see command_parser.hpp
 
 -- 18: freqIndex[7..0]
 -- 19: freqIndex[15..8]
--- 1a - 1f: reserved
+-- 1a: sequencer job index (0 outside of the sequencer)
+-- 1b: sequencer sweep within the job
+-- 1c: sequencer tag flags
+-- 1d - 1e: reserved
+-- 1f: checksum
+
+-- sequencer job entry (all little endian):
+-- 00: startHz (8 bytes)
+-- 08: stepHz (8 bytes); 0 measures points values at startHz
+-- 10: points (2 bytes)
+-- 12: average (2 bytes); values per frequency averaged into one record
+-- 14: repeat (2 bytes); sweeps of this job
+-- 16: adf4350 power (0 - 3), ff => unchanged
+-- 17: record format: 0 => valuesFIFO element, 1 => reflection record, 2 => thru record
+-- While the sequencer runs, records are sent as they are measured without
+-- being requested; the valuesFIFO must not be read. Jobs run back to back.
+-- valuesFIFO elements carry the tag in bytes 1a - 1c, see above.
+-- reflection and thru record format (16 bytes):
+-- 00 - 03: valueRe * 2^30 (little endian)
+-- 04 - 07: valueIm * 2^30
+-- 08 - 09: freqIndex
+-- 0a - 0c: tag: job index, sweep within the job, flags
+-- 0d - 0e: reserved
+-- 0f: checksum, same algorithm as valuesFIFO
+-- tag flags: bit 0 => last point of a sweep, bit 1 => last record of the run
+
+-- zeroSpanFIFO element data format:
+-- bytes:
+-- 00 - 03: timestamp in us (little endian), resolution is the dsp timer period
+-- 04 - 07: valueRe, value / fwd * 2^30 (little endian)
+-- 08 - 0b: valueIm
+-- 0c: path: 0 => REFL, 1 => THRU
+-- 0d: flags: bit 0 => adc clipped, bit 1 => values were dropped before this one
+-- 0e: sequence number, increments by one for each element sent
+-- 0f: checksum, same algorithm as valuesFIFO
 */
 
 
@@ -717,124 +812,109 @@ static void cmdRegisterWrite(int address);
 //1425tX^^^^^^^^^^^^^^XXXXXXXXXXXXXXXXXXXXXXMMMMMM%Vc222$$$$$$$$$$$$$$$$$$$$$$$$$$$$$$$$$$$$$$$$$$$$$$44443 \uuuuuuuuuuuuiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiyhz<ggggggggggggggggggggggggggggggggggg
 
 
-static void cmdReadFIFO(int address, int nValues) {
-	if(address != 0x30) return;
-	if(!usbDataMode)
-		enterUSBDataMode();
-	// Set count as sweepPoints if 0
-	if (nValues == 0)
-		nValues = *(uint16_t*)(registers + 0x20);
-
-	for(int i=0; i<nValues;) {
-		int rdRPos = usbTxQueueRPos;
-		int rdWPos = usbTxQueueWPos;
-		__sync_synchronize();
-
-		if(rdRPos == rdWPos) { // queue empty
-			continue;
-		}
-
-		usbDataPoint& usbDP = usbTxQueue[rdRPos];
-		if(usbDP.freqIndex < 0 || usbDP.freqIndex >= USB_POINTS_MAX)
-			continue;
-
-		/*VNAObservation& value = usbDP.value;
-		value[0] = ecalApplyReflection(value[0] / value[1], usbDP.freqIndex) * value[1];
-
-		int32_t fwdRe = value[1].real();
-		int32_t fwdIm = value[1].imag();
-		int32_t reflRe = value[0].real();
-		int32_t reflIm = value[0].imag();
-		int32_t thruRe = value[2].real();
-		int32_t thruIm = value[2].imag();*/
-		
-		
-		complexf refl = ecalApplyReflection(usbDP.S11, usbDP.freqIndex);
-		complexf thru = usbDP.S21;
-		int32_t fwdRe = 1073741824;
-		int32_t fwdIm = 0;
-		int32_t reflRe = int32_t(refl.real() * 1073741824.f);
-		int32_t reflIm = int32_t(refl.imag() * 1073741824.f);
-		int32_t thruRe = int32_t(thru.real() * 1073741824.f);
-		int32_t thruIm = int32_t(thru.imag() * 1073741824.f);
-
-
-		uint8_t txbuf[32];
-		txbuf[0] = uint8_t(fwdRe >> 0);
-		txbuf[1] = uint8_t(fwdRe >> 8);
-		txbuf[2] = uint8_t(fwdRe >> 16);
-		txbuf[3] = uint8_t(fwdRe >> 24);
-
-		txbuf[4] = uint8_t(fwdIm >> 0);
-		txbuf[5] = uint8_t(fwdIm >> 8);
-		txbuf[6] = uint8_t(fwdIm >> 16);
-		txbuf[7] = uint8_t(fwdIm >> 24);
-
-		txbuf[8] = uint8_t(reflRe >> 0);
-		txbuf[9] = uint8_t(reflRe >> 8);
-		txbuf[10] = uint8_t(reflRe >> 16);
-		txbuf[11] = uint8_t(reflRe >> 24);
-
-		txbuf[12] = uint8_t(reflIm >> 0);
-		txbuf[13] = uint8_t(reflIm >> 8);
-		txbuf[14] = uint8_t(reflIm >> 16);
-		txbuf[15] = uint8_t(reflIm >> 24);
-
-		txbuf[16] = uint8_t(thruRe >> 0);
-		txbuf[17] = uint8_t(thruRe >> 8);
-		txbuf[18] = uint8_t(thruRe >> 16);
-		txbuf[19] = uint8_t(thruRe >> 24);
-
-		txbuf[20] = uint8_t(thruIm >> 0);
-		txbuf[21] = uint8_t(thruIm >> 8);
-		txbuf[22] = uint8_t(thruIm >> 16);
-		txbuf[23] = uint8_t(thruIm >> 24);
-		
-		
-
-		txbuf[24] = uint8_t(usbDP.freqIndex >> 0);
-		txbuf[25] = uint8_t(usbDP.freqIndex >> 8);
-
-		txbuf[26] = 0;
-		txbuf[27] = 0;
-		txbuf[28] = 0;
-		txbuf[29] = 0;
-		txbuf[30] = 0;
-		txbuf[31] = 0;
-
-		uint8_t checksum=0b01000110;
-		for(int i=0; i<31; i++)
-			checksum = (checksum xor ((checksum<<1) | 1)) xor txbuf[i];
-		txbuf[31] = checksum;
+// redraw the whole plot area with and without the pipelined display queue
+// and store the redraw times in registers 0x80 - 0x87
+static void benchmarkRedraw() {
+	dwt_enable_cycle_counter();
+	for(int pipelined = 0; pipelined < 2; pipelined++) {
+		ili9341_pipelined = pipelined;
+		force_set_markmap();
+		uint32_t startCycles = dwt_read_cycle_counter();
+		draw_all_cells(true);
+		ili9341_bulk_flush();
+		uint32_t us = (dwt_read_cycle_counter() - startCycles) / cpu_mhz;
+		*(uint32_t*)(registers + (pipelined ? 0x84 : 0x80)) = us;
+	}
+	ili9341_pipelined = true;
+}
 
-		if(!serialSendTimeout((char*)txbuf, sizeof(txbuf), 1500)) {
+// render scheduler. The plot is remapped and redrawn at most registers[0x8c]
+// times per second; sweeps that complete in between are coalesced into the
+// next frame. Marker, frequency and cal status redraws requested by the ui
+// are not rate limited. Statistics are published in registers 0x90 - 0x9f
+// once per second.
+#ifndef RENDER_FPS_DEFAULT
+#define RENDER_FPS_DEFAULT 25
+#endif
+struct renderScheduler {
+	uint32_t lastFrameCycles = 0;	// start of the last frame
+	uint32_t windowCycles = 0;		// start of the statistics window
+	uint32_t frames = 0;			// frames in the statistics window
+	uint32_t skipped = 0;			// sweeps coalesced in the statistics window
+	uint32_t frameCyclesSum = 0;
+	uint32_t frameCyclesMax = 0;
+	uint32_t sweeps = 0;			// sweeps completed since the last frame
+	bool mapped = false;			// traces of the next frame are mapped
+	uint32_t frameStartCycles = 0;
+	uint32_t mapCycles = 0;
+
+	bool frameDue(uint32_t now) const {
+		uint32_t fps = registers[0x8c];
+		if(fps == 0)
+			return true;
+		return (now - lastFrameCycles) >= uint32_t(cpu_mhz) * 1000000 / fps;
+	}
+	void publish(uint32_t now) {
+		uint32_t elapsedUs = (now - windowCycles) / cpu_mhz;
+		if(elapsedUs < 1000000)
 			return;
-		}
-
-		__sync_synchronize();
-		usbTxQueueRPos = (rdRPos + 1) & usbTxQueueMask;
-		i++;
+		uint32_t avgUs = (frames == 0) ? 0 : (frameCyclesSum / frames / cpu_mhz);
+		*(uint16_t*)(registers + 0x90) = uint16_t(uint64_t(frames) * 10000000 / elapsedUs);
+		*(uint16_t*)(registers + 0x92) = uint16_t(skipped > 0xffff ? 0xffff : skipped);
+		*(uint32_t*)(registers + 0x94) = avgUs;
+		*(uint32_t*)(registers + 0x98) = frameCyclesMax / cpu_mhz;
+		(*(uint16_t*)(registers + 0x9c))++;
+		windowCycles = now;
+		frames = skipped = frameCyclesSum = frameCyclesMax = 0;
 	}
+};
+static renderScheduler render;
+
+// called from the main loop when there are no pending events
+static void renderIdle() {
+	uint32_t now = dwt_read_cycle_counter();
+	render.publish(now);
+	if(!sweep_enabled || !render.frameDue(now)) {
+		// only ui-requested updates (markers, text)
+		if(!lcdInhibit && redraw_request != 0) draw_all(true);
+		return;
+	}
+	if(!render.mapped) {
+		// cpu only work; done even while the display bus has to be quiet
+		render.frameStartCycles = now;
+		plot_into_index(measured);
+		ui_marker_track();
+		render.mapCycles = dwt_read_cycle_counter() - now;
+		render.mapped = true;
+	}
+	if(lcdInhibit)
+		return;
+	uint32_t drawStart = dwt_read_cycle_counter();
+	render.lastFrameCycles = render.frameStartCycles;
+	render.mapped = false;
+	draw_all(true);
+
+	uint32_t cycles = render.mapCycles + (dwt_read_cycle_counter() - drawStart);
+	render.frames++;
+	render.frameCyclesSum += cycles;
+	if(cycles > render.frameCyclesMax)
+		render.frameCyclesMax = cycles;
+	if(render.sweeps > 1)
+		render.skipped += render.sweeps - 1;
+	render.sweeps = 0;
 }
 
 // apply usb-configured sweep parameters
 static void setVNASweepToUSB() {
+#if BOARD_REVISION < 4
+	usbApplySweep();
+#else
 	int points = *(uint16_t*)(registers + 0x20);
 	int values = *(uint16_t*)(registers + 0x22);
 
 	if(points > USB_POINTS_MAX)
 		points = USB_POINTS_MAX;
 
-#if BOARD_REVISION < 4
-	vnaMeasurement.sweepStartHz = (freqHz_t)*(uint64_t*)(registers + 0x00);
-	vnaMeasurement.sweepStepHz = (freqHz_t)*(uint64_t*)(registers + 0x10);
-	vnaMeasurement.sweepDataPointsPerFreq = values;
-	vnaMeasurement.sweepPoints = points;
-	vnaMeasurement.resetSweep();
-	if(outputRawSamples) {
-		setFrequency((freqHz_t)*(uint64_t*)(registers + 0x00));
-	}
-#else
 	currTimingsArgs.nAverage = 1;
 	sys_syscall(5, &currTimingsArgs);
 	setHWSweep(sys_setSweep_args {
@@ -848,71 +928,54 @@ static void setVNASweepToUSB() {
 	}
 #endif
 }
+
 static void cmdRegisterWrite(int address) {
 	if(address == 0xee) {
 		usbCaptureMode = true;
-#pragma pack(push, 1)
-		constexpr struct {
-			uint16_t width;
-			uint16_t height;
-			uint8_t pixelFormat;
-		} meta = { LCD_WIDTH, LCD_HEIGHT, 16 };
-#pragma pack(pop)
-		serial.print((char*) &meta, sizeof(meta));
-
-		// use uint16_t ili9341_spi_buffers for read buffer
-		static_assert(meta.width * 2 <= sizeof(ili9341_spi_buffers));
-		for (int y=0; y < meta.height; y+=1){
-			ili9341_read_memory(0, y, meta.width, 1, ili9341_spi_buffers);
-			serial.print((char*) ili9341_spi_buffers, meta.width * 2 * 1);
-		}
-
+		screenshot_send(registers[0xee] == 1, [](const uint8_t* data, int len) {
+			serial.print((char*) data, len);
+		});
 		usbCaptureMode = false;
 		return;
 	}
 	if (address == 0x40) {UIActions::set_averaging(registers[0x40]); return;}
 	if (address == 0x42) {UIActions::set_adf4350_txPower(registers[0x42]); return;}
-
-	if(!usbDataMode)
-		enterUSBDataMode();
-	if(address == 0x00 || address == 0x10 || address == 0x20 || address == 0x22) {
-		setVNASweepToUSB();
-	}
-	if(address == 0x26) {
-		auto val = registers[0x26];
-		if(val == 0) {
-			outputRawSamples = false;
-		} else if(val == 1) {
-			outputRawSamples = true;
-		} else if(val == 2) {
-			outputRawSamples = false;
-			exitUSBDataMode();
-		}
-	}
-	if(address == 0x00 || address == 0x10 || address == 0x20) {
-		ecalState = ECAL_STATE_MEASURING;
-		vnaMeasurement.ecalIntervalPoints = 1;
-	}
-	if(address == 0x30) {
-		usbTxQueueRPos = usbTxQueueWPos;
-	}
+	if (address == 0x88) {benchmarkRedraw(); return;}
+	if (address == 0x8c) return;
+	usbRegisterWrite(address);
 }
 
-
 static void cmdInit() {
 	cmdParser.handleReadFIFO = [](int address, int nValues) {
 		return cmdReadFIFO(address, nValues);
 	};
-	cmdParser.handleWriteFIFO = [](int address, int totalBytes, int nBytes, const uint8_t* data) {};
+	cmdParser.handleWriteFIFO = [](int address, int totalBytes, int nBytes, const uint8_t* data) {
+		return cmdWriteFIFO(address, nBytes, data);
+	};
 	cmdParser.handleWrite = [](int address) {
 		return cmdRegisterWrite(address);
 	};
+	cmdParser.registerGroup = [](int address) {
+		return cmdRegisterGroup(address);
+	};
 	cmdParser.send = [](const uint8_t* s, int len) {
 		serialSendTimeout((char*) s, len, 1500);
 	};
 	cmdParser.registers = registers;
 	cmdParser.registersSizeMask = registersSizeMask;
 
+	usb_send = [](const uint8_t* data, int len) {
+		return serialSendTimeout((char*) data, len, 1500);
+	};
+	// the measurement interrupt fills the values queue
+	usb_wait_values = []() {};
+	usb_set_sweep = []() {
+		setVNASweepToUSB();
+	};
+	usb_set_tx_power = [](int power) {
+		UIActions::set_adf4350_txPower(power);
+	};
+
 	cmdInputFIFO.buffer = cmdInputBuffer;
 	cmdInputFIFO.bufferSize = sizeof(cmdInputBuffer);
 	cmdInputFIFO.output = [](const uint8_t* s, int len) {
@@ -920,60 +983,6 @@ static void cmdInit() {
 	};
 }
 
-static int measurementGetDefaultGain(freqHz_t freqHz) {
-	if(freqHz > 2500000000)
-		return 2;
-	else if(freqHz > FREQUENCY_CHANGE_OVER)
-		return 1;
-	else
-		return 0;
-}
-// callback called by VNAMeasurement to change rf switch positions.
-static void measurementPhaseChanged(VNAMeasurementPhases ph) {
-	lcdInhibit = false;
-	switch(ph) {
-		case VNAMeasurementPhases::REFERENCE:
-			rfsw(RFSW_REFL, RFSW_REFL_ON);
-			rfsw(RFSW_RECV, RFSW_RECV_REFL);
-			rfsw(RFSW_ECAL, RFSW_ECAL_OPEN);
-			rfsw(RFSW_BBGAIN, RFSW_BBGAIN_GAIN(measurementGetDefaultGain(currFreqHz)));
-			break;
-		case VNAMeasurementPhases::REFL:
-			// If only measuring REFL and THRU, we skip REFERENCE and thus
-			// the rfsw are not setup correct, so fix it here
-			if (vnaMeasurement.measurement_mode == MEASURE_MODE_REFL_THRU) {
-				rfsw(RFSW_REFL, RFSW_REFL_ON);
-				rfsw(RFSW_RECV, RFSW_RECV_REFL);
-			}
-			rfsw(RFSW_ECAL, RFSW_ECAL_NORMAL);
-			rfsw(RFSW_BBGAIN, RFSW_BBGAIN_GAIN(measurementGetDefaultGain(currFreqHz)));
-			break;
-		case VNAMeasurementPhases::THRU:
-			rfsw(RFSW_ECAL, RFSW_ECAL_NORMAL);
-			rfsw(RFSW_REFL, RFSW_REFL_OFF);
-			rfsw(RFSW_RECV, RFSW_RECV_PORT2);
-			rfsw(RFSW_BBGAIN, RFSW_BBGAIN_GAIN(vnaMeasurement.currThruGain));
-			lcdInhibit = true;
-			break;
-		case VNAMeasurementPhases::ECALTHRU:
-			rfsw(RFSW_ECAL, RFSW_ECAL_LOAD);
-			rfsw(RFSW_RECV, RFSW_RECV_REFL);
-			rfsw(RFSW_BBGAIN, RFSW_BBGAIN_GAIN(measurementGetDefaultGain(currFreqHz)));
-			lcdInhibit = true;
-			break;
-		case VNAMeasurementPhases::ECALLOAD:
-			rfsw(RFSW_REFL, RFSW_REFL_ON);
-			rfsw(RFSW_RECV, RFSW_RECV_REFL);
-			rfsw(RFSW_ECAL, RFSW_ECAL_LOAD);
-			rfsw(RFSW_BBGAIN, RFSW_BBGAIN_GAIN(measurementGetDefaultGain(currFreqHz)));
-			break;
-		case VNAMeasurementPhases::ECALSHORT:
-			rfsw(RFSW_ECAL, RFSW_ECAL_SHORT);
-			rfsw(RFSW_BBGAIN, RFSW_BBGAIN_GAIN(measurementGetDefaultGain(currFreqHz)));
-			break;
-	}
-}
-
 // Allow smooth complex data point array (this remove noise, smooth power depend form count)
 static void measurementDataSmooth(complexf *data, int points, int count){
 	int j;
@@ -1001,7 +1010,7 @@ static void measurementEmitDataPoint(int freqIndex, freqHz_t freqHz, VNAObservat
 	bool collectAllowed = true;
 
 #if BOARD_REVISION < 4
-	v[2]*= gainTable[vnaMeasurement.currThruGain] / gainTable[measurementGetDefaultGain(freqHz)];
+	v[2]*= measurementThruGainScale(vnaMeasurement.currThruGain, freqHz);
 #ifdef USE_FIXED_CORRECTION
 	v[2] = applyFixedCorrectionsThru(v[2], freqHz);
 	v[0] = applyFixedCorrections(v[0]/v[1], freqHz) * v[1];
@@ -1129,20 +1138,7 @@ static void measurementEmitDataPoint(int freqIndex, freqHz_t freqHz, VNAObservat
 			eventQueue.enqueue(collectMeasurementCB);
 		}
 	}
-	// enqueue new data point
-	int wrRPos = usbTxQueueRPos;
-	int wrWPos = usbTxQueueWPos;
-	__sync_synchronize();
-	if(((wrWPos + 1) & usbTxQueueMask) == wrRPos) {
-		// overflow
-	} else {
-		usbTxQueue[wrWPos].freqIndex = freqIndex;
-		//usbTxQueue[wrWPos].value = v;
-		usbTxQueue[wrWPos].S11 = v[0]/v[1];
-		usbTxQueue[wrWPos].S21 = v[2]/v[1];
-		__sync_synchronize();
-		usbTxQueueWPos = (wrWPos + 1) & usbTxQueueMask;
-	}
+	usbEnqueueDataPoint(freqIndex, v[0]/v[1], v[2]/v[1]);
 }
 
 // apply user-entered (on device) sweep parameters
@@ -1185,36 +1181,35 @@ void updateAveraging() {
 	}
 }
 
+void MeasurementHandlers::emitDataPoint(int freqIndex, freqHz_t freqHz, const VNAObservation& v, const complexf* ecal) {
+	measurementEmitDataPoint(freqIndex, freqHz, v, ecal, vnaMeasurement.clipFlag);
+}
+void MeasurementHandlers::sweepSetupChanged(freqHz_t start, freqHz_t stop) {
+	if(!is_freq_for_adf4350(stop)) {
+		/* ADF4350 can be powered down */
+		adf4350_powerdown();
+	}
+	else {
+		adf4350_powerup();
+	}
+	if(is_freq_for_adf4350(start)) {
+		/* Si5351 not needed, power it down? */
+	}
+}
+
 static void measurement_setup() {
-	vnaMeasurement.phaseChanged = [](VNAMeasurementPhases ph) {
-		measurementPhaseChanged(ph);
-	};
-	vnaMeasurement.gainChanged = [](int gain) {
-		rfsw(RFSW_BBGAIN, RFSW_BBGAIN_GAIN(gain));
-	};
-	vnaMeasurement.emitDataPoint = [](int freqIndex, freqHz_t freqHz, const VNAObservation& v, const complexf* ecal) {
-		measurementEmitDataPoint(freqIndex, freqHz, v, ecal, vnaMeasurement.clipFlag);
-	};
-	vnaMeasurement.frequencyChanged = [](freqHz_t freqHz) {
-		setFrequency(freqHz);
-	};
-	vnaMeasurement.sweepSetupChanged = [](freqHz_t start, freqHz_t stop) {
-		if(!is_freq_for_adf4350(stop)) {
-			/* ADF4350 can be powered down */
-			adf4350_powerdown();
-		}
-		else {
-			adf4350_powerup();
-		}
-		if(is_freq_for_adf4350(start)) {
-			/* Si5351 not needed, power it down? */
-		}
-	};
+#ifdef BOARD_DISABLE_ECAL
+	vnaMeasurement.ecalDisabled = true;
+#endif
 	vnaMeasurement.nPeriods = MEASUREMENT_NPERIODS_NORMAL;
 	vnaMeasurement.nPeriodsCalibrating = MEASUREMENT_NPERIODS_CALIBRATING;
 	vnaMeasurement.nWaitSwitch = MEASUREMENT_NWAIT_SWITCH;
+	vnaMeasurement.nWaitFirstPoint = BOARD_MEASUREMENT_FIRST_POINT_WAIT;
 	vnaMeasurement.gainMin = 0;
 	vnaMeasurement.gainMax = RFSW_BBGAIN_MAX;
+	// phases with lcdInhibit set, see measurementPhaseChanged()
+	vnaMeasurement.quietPhaseMask = (1 << int(VNAMeasurementPhases::THRU))
+			| (1 << int(VNAMeasurementPhases::ECALTHRU));
 	vnaMeasurement.init();
 }
 
@@ -1274,10 +1269,127 @@ static float kaiser_window(float k, float n, float beta) {
 	return bessel0(beta * sqrt(1 - r * r)) / bessel0(beta);
 }
 
+// frequency domain window applied before the inverse FFT. bessel0() is slow,
+// so the window is only recomputed when the sweep points or TD settings change.
+// Shared by the TDR display and the time gate.
+static float tdWindow[SWEEP_POINTS_MAX];
+static uint32_t tdWindowKey = 0;
+
+static const float* td_window(int points, bool is_lowpass, uint8_t window) {
+	uint32_t key = 1 | (uint32_t(points) << 1) | (uint32_t(is_lowpass) << 12) | (uint32_t(window) << 16);
+	if (key == tdWindowKey) return tdWindow;
+
+	int window_size = points, offset = 0;
+	if (is_lowpass) {
+		offset = points;
+		window_size = points * 2;
+	}
+
+	float beta = 0.0;
+	switch (window) {
+		case TD_WINDOW_MINIMUM:
+			beta = 0.0; // this is rectangular
+			break;
+		case TD_WINDOW_NORMAL:
+			beta = 6.0;
+			break;
+		case TD_WINDOW_MAXIMUM:
+			beta = 13;
+			break;
+	}
+	for (int i = 0; i < points; i++)
+		tdWindow[i] = kaiser_window(i+offset, window_size, beta);
+	tdWindowKey = key;
+	return tdWindow;
+}
+
+// time gate, evaluated at FFT bin i. The gate is flat between start and stop
+// with raised cosine edges; the gate shape selects the edge width.
+struct timeGate {
+	float start, stop; // in FFT bins
+	float taper; // edge width in FFT bins
+
+	timeGate() {
+		// one FFT bin is 1/(FFT_SIZE * step) seconds
+		float step = (float) current_props.stepFreqHz();
+		float binsPerPs = step * FFT_SIZE * 1e-12f;
+		start = current_props._gate_start * binsPerPs;
+		stop = current_props._gate_stop * binsPerPs;
+		float width = stop - start;
+		switch (current_props._gate_shape) {
+			case TD_WINDOW_MINIMUM: taper = 0; break;
+			case TD_WINDOW_MAXIMUM: taper = width / 4; break;
+			default: taper = width / 8; break;
+		}
+	}
+	float at(int i) const {
+		// upper half of the FFT output holds negative times
+		float t = (i < FFT_SIZE/2) ? i : i - FFT_SIZE;
+		if (t < start || t > stop) return 0.f;
+		if (t < start + taper)
+			return 0.5f - 0.5f * cosf(float(M_PI) * (t - start) / taper);
+		if (t > stop - taper)
+			return 0.5f - 0.5f * cosf(float(M_PI) * (stop - t) / taper);
+		return 1.f;
+	}
+};
+
+// remove everything outside of the time gate from the frequency domain data:
+// window, inverse FFT, gate, forward FFT, then divide out the window again.
+// The bandpass transform is used so that this works for any sweep range.
+// Points close to the band edges are less accurate with the stronger windows,
+// as their window values are small.
+static void gate_domain() {
+	// queued display transfers may still read from the spi buffers
+	ili9341_bulk_flush();
+	float* tmp = (float*)ili9341_spi_buffers;
+	int points = current_props._sweep_points;
+	const float* window = td_window(points, false, domain_mode & TD_WINDOW);
+	timeGate gate;
+
+	for (int ch = 0; ch < 2; ch++) {
+		memcpy(tmp, measuredFreqDomain[ch], sizeof(measuredFreqDomain[0]));
+		for (int i = 0; i < points; i++) {
+			float w = window[i];
+			tmp[i*2+0] *= w;
+			tmp[i*2+1] *= w;
+		}
+		for (int i = points; i < FFT_SIZE; i++) {
+			tmp[i*2+0] = 0.0;
+			tmp[i*2+1] = 0.0;
+		}
+
+		fft_inverse((float(*)[2])tmp);
+		for (int i = 0; i < FFT_SIZE; i++) {
+			float g = gate.at(i);
+			tmp[i*2+0] *= g;
+			tmp[i*2+1] *= g;
+		}
+		fft_forward((float(*)[2])tmp);
+
+		for (int i = 0; i < points; i++) {
+			float w = window[i] * FFT_SIZE;
+			if (w == 0.f) w = FFT_SIZE;
+			measured[ch][i] = complexf{tmp[i*2+0], tmp[i*2+1]} / w;
+		}
+		measuredGeneration[ch]++;
+	}
+}
+
+// the time gate needs a frequency sweep; in CW and zero-step sweeps it is ignored
+static bool gate_enabled() {
+	return (domain_mode & TD_GATE) && current_props.stepFreqHz() != 0;
+}
+
 static void transform_domain() {
-	if ((domain_mode & DOMAIN_MODE) != DOMAIN_TIME) return; // nothing to do for freq domain
+	bool gated = gate_enabled();
+	if ((domain_mode & DOMAIN_MODE) != DOMAIN_TIME) {
+		if (gated) gate_domain();
+		return;
+	}
 	// use spi_buffer as temporary buffer
 	// and calculate ifft for time domain
+	ili9341_bulk_flush();
 	float* tmp = (float*)ili9341_spi_buffers;
 
 	// lowpass uses 2x sweep_points of input buffer space
@@ -1285,39 +1397,22 @@ static void transform_domain() {
 	static_assert(FFT_SIZE*sizeof(float)*2 <= sizeof(ili9341_spi_buffers));
 
 	int points = current_props._sweep_points;
-	int window_size = current_props._sweep_points, offset = 0;
 	bool is_lowpass = false;
 	switch (domain_mode & TD_FUNC) {
 		case TD_FUNC_BANDPASS:
-			offset = 0;
-			window_size = points;
 			break;
 		case TD_FUNC_LOWPASS_IMPULSE:
 		case TD_FUNC_LOWPASS_STEP:
 			is_lowpass = true;
-			offset = points;
-			window_size = points * 2;
-			break;
-	}
-
-	float beta = 0.0;
-	switch (domain_mode & TD_WINDOW) {
-		case TD_WINDOW_MINIMUM:
-			beta = 0.0; // this is rectangular
-			break;
-		case TD_WINDOW_NORMAL:
-			beta = 6.0;
-			break;
-		case TD_WINDOW_MAXIMUM:
-			beta = 13;
 			break;
 	}
-
+	const float* window = td_window(points, is_lowpass, domain_mode & TD_WINDOW);
+	timeGate gate;
 
 	for (int ch = 0; ch < 2; ch++) {
 		memcpy(tmp, measuredFreqDomain[ch], sizeof(measuredFreqDomain[0]));
 		for (int i = 0; i < points; i++) {
-			float w = kaiser_window(i+offset, window_size, beta);
+			float w = window[i];
 			tmp[i*2+0] *= w;
 			tmp[i*2+1] *= w;
 		}
@@ -1336,6 +1431,8 @@ static void transform_domain() {
 		memcpy(measured[ch], tmp, sizeof(measured[0]));
 		for (int i = 0; i < points; i++) {
 			measured[ch][i] /= (float)FFT_SIZE;
+			if (gated)
+				measured[ch][i] *= gate.at(i);
 			if (is_lowpass) {
 				measured[ch][i] = {measured[ch][i].real(), 0.f};
 			}
@@ -1345,6 +1442,7 @@ static void transform_domain() {
 				measured[ch][i] += measured[ch][i-1];
 			}
 		}
+		measuredGeneration[ch]++;
 	}
 }
 
@@ -1359,56 +1457,69 @@ static void apply_edelay(int i, complexf& refl, complexf& thru) {
 void
 cal_interpolate(void)
 {
-  const properties_t *src = caldata_reference();
+  caldata_ref_t src;
   properties_t *dst = &current_props;
+  cal_decoder dec;
+  complexf a[CAL_ENTRIES], b[CAL_ENTRIES]; // src points j and j+1
   int i, j;
   int eterm;
-  if (src == NULL)
+  if (!caldata_reference(src))
     return;
 
-  freqHz_t src_start = src->startFreqHz();
-//freqHz_t src_stop = src->stopFreqHz();
-  freqHz_t src_step = src->stepFreqHz();
   freqHz_t dst_start = dst->startFreqHz();
 //freqHz_t dst_stop = dst->stopFreqHz();
   freqHz_t dst_step = dst->stepFreqHz();
 
+  dec.begin(src.data, src._sweep_points);
   // Upload not interpolated if some
-  if (src_start == dst_start && src_step == dst_step && src->_sweep_points == dst->_sweep_points){
-    memcpy(current_props._cal_data, src->_cal_data, sizeof(src->_cal_data));
-    cal_status |= (src->_cal_status)&~CALSTAT_APPLY;
+  if (src.start == dst_start && src.step == dst_step && src._sweep_points == dst->_sweep_points){
+    for (i = 0; i < src._sweep_points; i++) {
+      dec.next(a);
+      for (eterm = 0; eterm < CAL_ENTRIES; eterm++)
+        cal_data[eterm][i] = a[eterm];
+    }
+    cal_status |= (src._cal_status)&~CALSTAT_APPLY;
     redraw_request |= REDRAW_CAL_STATUS;
     return;
   }
+  dec.next(a);
+  if (src._sweep_points > 1)
+    dec.next(b);
+  else
+    memcpy(b, a, sizeof(b));
+
   // lower than start freq of src range
   for (i = 0; i < sweep_points; i++) {
     freqHz_t dst_f = dst_start + i*dst_step;
-    if (dst_f >= src_start)
+    if (dst_f >= src.start)
       break;
 
     // fill cal_data at head of src range
     for (eterm = 0; eterm < CAL_ENTRIES; eterm++) {
-      cal_data[eterm][i] = src->_cal_data[eterm][0];
+      cal_data[eterm][i] = a[eterm];
     }
   }
 
   j = 0;
   for (; i < sweep_points; i++) {
     freqHz_t dst_f = dst_start + i*dst_step;
-    for (; j < src->_sweep_points; j++) {
-      freqHz_t src_f = src_start + j*src_step;
-      if (src_f <= dst_f && dst_f < src_f + src_step) {
+    for (; j < src._sweep_points; j++) {
+      freqHz_t src_f = src.start + j*src.step;
+      if (src_f <= dst_f && dst_f < src_f + src.step) {
         // found f between freqs at j and j+1
-        float k1 = (src_step == 0) ? 0.0 : (float)(dst_f - src_f) / src_step;
-        int idx = j;
+        float k1 = (src.step == 0) ? 0.0 : (float)(dst_f - src_f) / src.step;
         float k0 = 1.0 - k1;
         for (eterm = 0; eterm < CAL_ENTRIES; eterm++) {
-          cal_data[eterm][i] = src->_cal_data[eterm][idx] * k0 + src->_cal_data[eterm][idx+1] * k1;
+          cal_data[eterm][i] = a[eterm] * k0 + b[eterm] * k1;
         }
         break;
       }
+      // step the decoded window; b stays at the last point
+      memcpy(a, b, sizeof(a));
+      if (j + 2 < src._sweep_points)
+        dec.next(b);
     }
-    if (j == src->_sweep_points-1)
+    if (j == src._sweep_points-1)
       break;
   }
 
@@ -1416,10 +1527,10 @@ cal_interpolate(void)
   for (; i < sweep_points; i++) {
     // fill cal_data at tail of src
     for (eterm = 0; eterm < CAL_ENTRIES; eterm++) {
-      cal_data[eterm][i] = src->_cal_data[eterm][src->_sweep_points-1];
+      cal_data[eterm][i] = b[eterm];
     }
   }
-  cal_status |= (src->_cal_status | CALSTAT_INTERPOLATED)&~CALSTAT_APPLY;
+  cal_status |= (src._cal_status | CALSTAT_INTERPOLATED)&~CALSTAT_APPLY;
   redraw_request |= REDRAW_CAL_STATUS;
 }
 
@@ -1489,17 +1600,30 @@ static bool processDataPoint() {
 			refl = newRefl;
 		}
 		apply_edelay(usbDP.freqIndex, refl, thru);
+#ifdef SPI_SLAVE_INTERFACE
+		spi_slave_buffer_data_point(freqIndex, refl, thru);
+#endif
 		measuredFreqDomain[0][usbDP.freqIndex] = refl;
 		measuredFreqDomain[1][usbDP.freqIndex] = thru;
-		if ((domain_mode & DOMAIN_MODE) == DOMAIN_FREQ) {
-			measured[0][usbDP.freqIndex] = refl;
-			measured[1][usbDP.freqIndex] = thru;
+		// gated data is written to measured[] by transform_domain() at the end of the sweep
+		if ((domain_mode & DOMAIN_MODE) == DOMAIN_FREQ && !gate_enabled()) {
+			if (measured[0][usbDP.freqIndex] != refl) {
+				measured[0][usbDP.freqIndex] = refl;
+				measuredGeneration[0]++;
+			}
+			if (measured[1][usbDP.freqIndex] != thru) {
+				measured[1][usbDP.freqIndex] = thru;
+				measuredGeneration[1]++;
+			}
 		}
 
 		rdRPos = (rdRPos + 1) & usbTxQueueMask;
 		usbTxQueueRPos = rdRPos;
 
 		if(freqIndex == vnaMeasurement.sweepPoints - 1) {
+#ifdef SPI_SLAVE_INTERFACE
+			spi_slave_notify_measurement_complete();
+#endif
 			transform_domain();
 			return true;
 		}
@@ -1507,6 +1631,24 @@ static bool processDataPoint() {
 	return false;
 }
 
+#ifdef SPI_SLAVE_INTERFACE
+// apply the sweep settings of the spi master, the way the ui would, and
+// restart the sweep. The frequencies are clamped to the range of the device.
+static void spiSlaveStartSweep() {
+	SpiSweepConfig_t cfg;
+	spi_slave_get_sweep(cfg);
+	UIActions::set_adf4350_txPower(cfg.power);
+	UIActions::set_averaging(cfg.average);
+	UIActions::set_sweep_points(cfg.points);
+	UIActions::set_sweep_frequency(ST_START, cfg.startHz);
+	UIActions::set_sweep_frequency(ST_STOP, cfg.startHz + cfg.stepHz * (current_props._sweep_points - 1));
+	// points of the previous sweep are not buffered
+	usbTxQueueRPos = usbTxQueueWPos;
+	spi_slave_notify_measurement_start();
+	UIActions::enable_refresh(true);
+}
+#endif
+
 // plot a single line and show which cells are redrawn
 void debug_plot_markmap() {
 	current_props._trace[0].enabled = 0;
@@ -1520,6 +1662,7 @@ void debug_plot_markmap() {
 		measured[0][i] = src;
 	for(int i=5; i<SWEEP_POINTS_MAX; i++)
 		measured[0][i] = pt;
+	measuredGeneration[0]++;
 	plot_into_index(measured);
 	force_set_markmap();
 
@@ -1575,6 +1718,9 @@ int main(void) {
 	registers[0xf2 & registersSizeMask] = (uint8_t) BOARD_REVISION;
 	registers[0xf3 & registersSizeMask] = (uint8_t) FIRMWARE_MAJOR_VERSION;
 	registers[0xf4 & registersSizeMask] = (uint8_t) FIRMWARE_MINOR_VERSION;
+	registers[0x8c & registersSizeMask] = RENDER_FPS_DEFAULT;
+	// used by the render scheduler to time frames
+	dwt_enable_cycle_counter();
 	for(int i=0; i<3; i++) {
 		registers[(0xd0 + i*4 + 0) & registersSizeMask] = deviceID[i] & 0xff;
 		registers[(0xd0 + i*4 + 1) & registersSizeMask] = (deviceID[i] >> 8) & 0xff;
@@ -1643,17 +1789,21 @@ int main(void) {
 	flash_config_recall();
 	// Load 0 slot
 	UIActions::cal_reset();
-	flash_caldata_recall(0);
+	if(flash_caldata_recall(0) == 0)
+		cal_interpolate();
 	if(config.ui_options & UI_OPTIONS_FLIP)
 		ili9341_set_flip(true, true);
 
 	printk("SN: %08x-%08x-%08x\n", deviceID[0], deviceID[1], deviceID[2]);
 
 	// show dmesg and wait for user input if there is an important error
+	// (headless builds have no display to show it on)
+#ifndef SPI_SLAVE_INTERFACE
 	if(shouldShowDmesg) {
 		printk1("Touch anywhere to continue...\n");
 		show_dmesg();
 	}
+#endif
 
 	printk("xtal freq %d.%03d MHz\n", (xtalFreqHz/1000000), ((xtalFreqHz/1000) % 1000));
 
@@ -1693,9 +1843,11 @@ int main(void) {
 
 	if(si5351failed) {
 		printk1("ERROR: si5351 init failed\n");
-		printk1("Touch anywhere to continue...\n");
 		current_props._frequency0 = 200000000;
+#ifndef SPI_SLAVE_INTERFACE
+		printk1("Touch anywhere to continue...\n");
 		show_dmesg();
+#endif
 	}
     UIActions::rebuild_bbgain();
 #ifdef HAS_SELF_TEST
@@ -1722,8 +1874,14 @@ int main(void) {
 
 	bool lastUSBDataMode = false;
 	while(true) {
+		publishMeasurementStats();
+
 		// process any outstanding commands from usb
 		cmdInputFIFO.drain();
+#ifdef SPI_SLAVE_INTERFACE
+		// and from the spi master
+		spi_slave_poll();
+#endif
 		if (usbCaptureMode) {
 			continue;
 		}
@@ -1739,6 +1897,8 @@ int main(void) {
 			}
 			lastUSBDataMode = usbDataMode;
 
+			sequencerProcess();
+
 			// process ui events, but skip processing data points
 			UIActions::application_doSingleEvent();
 			continue;
@@ -1759,27 +1919,23 @@ int main(void) {
 		// when we are in USB mode.
 		myassert(!usbDataMode);
 
+#ifdef SPI_SLAVE_INTERFACE
+		// the spi master started a sweep
+		if(spiSweepChangedFlag)
+			spiSlaveStartSweep();
+#endif
+
 		if(sweep_enabled) {
-			if(processDataPoint()) {
-				// a full sweep has completed
-				if ((domain_mode & DOMAIN_MODE) == DOMAIN_TIME) {
-					plot_into_index(measured);
-					ui_marker_track();
-					if(!lcdInhibit) draw_all(true);
-					continue;
-				}
-			}
+			// a full sweep has completed
+			if(processDataPoint())
+				render.sweeps++;
 		}
 
 		// if we have no pending events, use idle cycles to refresh the graph
 		if(!eventQueue.readable()) {
-			if(sweep_enabled) {
-				if((domain_mode & DOMAIN_MODE) == DOMAIN_FREQ) {
-					plot_into_index(measured);
-					ui_marker_track();
-				}
-			}
-			if(!lcdInhibit) draw_all(true);
+#ifndef SPI_SLAVE_INTERFACE
+			renderIdle();
+#endif
 			continue;
 		}
 		auto callback = eventQueue.read();
@@ -2121,6 +2277,37 @@ namespace UIActions {
 		return electrical_delay;
 	}
 
+	void set_time_gate(SweepParameter type, float picoseconds)
+	{
+		float start = current_props._gate_start;
+		float stop = current_props._gate_stop;
+		float center = (start + stop) / 2;
+		float span = stop - start;
+		switch (type) {
+		case ST_START:
+			start = picoseconds;
+			if (stop < start) stop = start;
+			break;
+		case ST_STOP:
+			stop = picoseconds;
+			if (start > stop) start = stop;
+			break;
+		case ST_CENTER:
+			start = picoseconds - span / 2;
+			stop = picoseconds + span / 2;
+			break;
+		case ST_SPAN:
+			if (picoseconds < 0) picoseconds = 0;
+			start = center - picoseconds / 2;
+			stop = center + picoseconds / 2;
+			break;
+		default:
+			return;
+		}
+		current_props._gate_start = start;
+		current_props._gate_stop = stop;
+	}
+
 	void set_averaging(int i) {
 		if(i < 1) i = 1;
 		if(i > 255) i = 255;
@@ -2140,6 +2327,8 @@ namespace UIActions {
 		ecalIgnoreValues = 1000000;
 		int ret = flash_caldata_save(id);
 		ecalIgnoreValues = 20;
+		float err = flash_caldata_error * 1e9f;
+		*(uint32_t*)(registers + 0xa0) = err < 4e9f ? uint32_t(err) : 0xffffffff;
 		return ret;
 	}
 
@@ -2158,6 +2347,7 @@ namespace UIActions {
 	int caldata_recall(int id) {
 		int ret = flash_caldata_recall(id);
 		if(ret == 0) {
+			cal_interpolate();
 			setVNASweepToUI();
 			force_set_markmap();
 		}
@@ -2183,7 +2373,7 @@ namespace UIActions {
 
 	void enterBootload() {
 		// finish screen updates
-		lcd_spi_waitDMA();
+		ili9341_bulk_flush();
 		// write magic value into ram (note: corrupts top of the stack)
 		bootloaderBootloadIndicator = BOOTLOADER_BOOTLOAD_MAGIC;
 		// soft reset
@@ -2192,7 +2382,7 @@ namespace UIActions {
 	}
 
 	void reconnectUSB() {
-		exitUSBDataMode();
+		usbDataMode = false;
 	}
 
 	void application_doEvents() {
@@ -2206,6 +2396,8 @@ namespace UIActions {
 	}
 
 	void application_doSingleEvent() {
+		publishMeasurementStats();
+
 		// process any outstanding commands from usb
 		cmdInputFIFO.drain();
 		if(eventQueue.readable()) {
@@ -0,0 +1,160 @@
+#include "measurement_control.hpp"
+#include "sin_rom.hpp"
+
+#if BOARD_REVISION >= 3
+#include <libopencm3/cm3/nvic.h>
+#endif
+
+using namespace board;
+
+AppVNAMeasurement vnaMeasurement;
+
+int lo_freq = 12000; // IF frequency, Hz
+int adf4350_freqStep = 12000; // adf4350 resolution, Hz
+freqHz_t currFreqHz = 0;
+
+float gainTable[RFSW_BBGAIN_MAX+1];
+
+volatile bool lcdInhibit = false;
+
+#ifndef BOARD_DISABLE_ECAL
+complexf measuredEcal[ECAL_CHANNELS][USB_POINTS_MAX] alignas(8);
+#endif
+
+void updateIFrequency(freqHz_t txFreqHz) {
+#if BOARD_REVISION >= 3
+	nvic_disable_irq(NVIC_TIM1_UP_IRQ);
+	if(txFreqHz < 40000) { //|| (txFreqHz > 149000000 && txFreqHz < 151000000)) {
+		lo_freq = 6000;
+		adf4350_freqStep = 6000;
+		vnaMeasurement.setCorrelationTable(sinROM200x1, 200);
+		vnaMeasurement.adcFullScale = 10000 * 200 * 200;
+		vnaMeasurement.gainMax = 0;
+		vnaMeasurement.currThruGain = 0;
+	} else if(txFreqHz <= 350000) { //|| (txFreqHz > 149000000 && txFreqHz < 151000000)) {
+		lo_freq = 12000;
+		adf4350_freqStep = 12000;
+		vnaMeasurement.setCorrelationTable(sinROM100x1, 100);
+		vnaMeasurement.adcFullScale = 10000 * 100 * 100;
+		vnaMeasurement.gainMax = 0;
+		vnaMeasurement.currThruGain = 0;
+	} else {
+		lo_freq = 150000;
+		adf4350_freqStep = 10000;
+		vnaMeasurement.setCorrelationTable(sinROM10x2, 20);
+		vnaMeasurement.adcFullScale = 10000 * 48 * 20;
+		vnaMeasurement.gainMax = 3;
+	}
+	nvic_enable_irq(NVIC_TIM1_UP_IRQ);
+#else
+	// adf4350 freq step and thus IF frequency must be a divisor of the crystal frequency
+	if(xtalFreqHz == 20000000 || xtalFreqHz == 40000000) {
+		// 6.25/12.5kHz IF
+		if(txFreqHz >= 100000) {
+			lo_freq = 12500;
+			adf4350_freqStep = 12500;
+			vnaMeasurement.setCorrelationTable(sinROM24x2, 48);
+			vnaMeasurement.adcFullScale = 20000 * 48 * 48;
+		} else {
+			lo_freq = 6250;
+			adf4350_freqStep = 6250;
+			vnaMeasurement.setCorrelationTable(sinROM48x1, 48);
+			vnaMeasurement.adcFullScale = 20000 * 48 * 48;
+		}
+	} else {
+		// 6.0/12.0kHz IF
+		if(txFreqHz >= 100000) {
+			lo_freq = 12000;
+			adf4350_freqStep = 12000;
+			vnaMeasurement.setCorrelationTable(sinROM25x2, 50);
+			vnaMeasurement.adcFullScale = 20000 * 48 * 50;
+		} else {
+			lo_freq = 6000;
+			adf4350_freqStep = 6000;
+			vnaMeasurement.setCorrelationTable(sinROM50x1, 50);
+			vnaMeasurement.adcFullScale = 20000 * 48 * 50;
+		}
+	}
+#endif
+}
+
+void setFrequency(freqHz_t freqHz) {
+	updateIFrequency(freqHz);
+	// On measure, call phase change before update frequency call, so update gain for frequency range here
+	rfsw(RFSW_BBGAIN, RFSW_BBGAIN_GAIN(measurementGetDefaultGain(freqHz)));
+
+	/* Only if frequency changes apply the new frequency.
+	 * This is to support proper CW mode:
+	 * changing to an existing frequency temporarily breaks the signal */
+	if(currFreqHz != freqHz) {
+		currFreqHz = freqHz;
+		synthSetFrequency(freqHz);
+	}
+}
+
+int measurementGetDefaultGain(freqHz_t freqHz) {
+	if(freqHz > 2500000000)
+		return 2;
+	else if(freqHz > FREQUENCY_CHANGE_OVER)
+		return 1;
+	else
+		return 0;
+}
+
+void measurementPhaseChanged(VNAMeasurementPhases ph) {
+	lcdInhibit = false;
+	switch(ph) {
+		case VNAMeasurementPhases::REFERENCE:
+			rfsw(RFSW_REFL, RFSW_REFL_ON);
+			rfsw(RFSW_RECV, RFSW_RECV_REFL);
+			rfsw(RFSW_ECAL, RFSW_ECAL_OPEN);
+			rfsw(RFSW_BBGAIN, RFSW_BBGAIN_GAIN(measurementGetDefaultGain(currFreqHz)));
+			break;
+		case VNAMeasurementPhases::REFL:
+			// If only measuring REFL and THRU, we skip REFERENCE and thus
+			// the rfsw are not setup correct, so fix it here
+			if (vnaMeasurement.measurement_mode == MEASURE_MODE_REFL_THRU
+					|| vnaMeasurement.zeroSpanPeriods != 0) {
+				rfsw(RFSW_REFL, RFSW_REFL_ON);
+				rfsw(RFSW_RECV, RFSW_RECV_REFL);
+			}
+			rfsw(RFSW_ECAL, RFSW_ECAL_NORMAL);
+			rfsw(RFSW_BBGAIN, RFSW_BBGAIN_GAIN(measurementGetDefaultGain(currFreqHz)));
+			break;
+		case VNAMeasurementPhases::THRU:
+			rfsw(RFSW_ECAL, RFSW_ECAL_NORMAL);
+			rfsw(RFSW_REFL, RFSW_REFL_OFF);
+			rfsw(RFSW_RECV, RFSW_RECV_PORT2);
+			rfsw(RFSW_BBGAIN, RFSW_BBGAIN_GAIN(vnaMeasurement.currThruGain));
+			// in zero-span mode we may stay on THRU indefinitely; don't
+			// lock out the display (and the main loop) forever.
+			lcdInhibit = (vnaMeasurement.zeroSpanPeriods == 0);
+			break;
+		case VNAMeasurementPhases::ECALTHRU:
+			rfsw(RFSW_ECAL, RFSW_ECAL_LOAD);
+			rfsw(RFSW_RECV, RFSW_RECV_REFL);
+			rfsw(RFSW_BBGAIN, RFSW_BBGAIN_GAIN(measurementGetDefaultGain(currFreqHz)));
+			lcdInhibit = true;
+			break;
+		case VNAMeasurementPhases::ECALLOAD:
+			rfsw(RFSW_REFL, RFSW_REFL_ON);
+			rfsw(RFSW_RECV, RFSW_RECV_REFL);
+			rfsw(RFSW_ECAL, RFSW_ECAL_LOAD);
+			rfsw(RFSW_BBGAIN, RFSW_BBGAIN_GAIN(measurementGetDefaultGain(currFreqHz)));
+			break;
+		case VNAMeasurementPhases::ECALSHORT:
+			rfsw(RFSW_ECAL, RFSW_ECAL_SHORT);
+			rfsw(RFSW_BBGAIN, RFSW_BBGAIN_GAIN(measurementGetDefaultGain(currFreqHz)));
+			break;
+	}
+}
+
+void MeasurementHandlers::phaseChanged(VNAMeasurementPhases ph) {
+	measurementPhaseChanged(ph);
+}
+void MeasurementHandlers::gainChanged(int gain) {
+	rfsw(RFSW_BBGAIN, RFSW_BBGAIN_GAIN(gain));
+}
+void MeasurementHandlers::frequencyChanged(freqHz_t freqHz) {
+	setFrequency(freqHz);
+}
@@ -0,0 +1,66 @@
+#pragma once
+#include <board.hpp>
+#include "common.hpp"
+#include "measurement_handlers.hpp"
+#ifndef ECAL_PARTIAL
+#include "calibration.hpp"
+#endif
+
+// control of the rf hardware by the measurement: IF frequency and correlation
+// table, synthesizer frequency, baseband gain and the rf switches of each
+// measurement phase. Implements the phaseChanged, gainChanged and
+// frequencyChanged MeasurementHandlers.
+// Shared with the host simulator (sim/), which provides a simulated board.hpp.
+
+extern AppVNAMeasurement vnaMeasurement;
+
+extern int lo_freq;				// IF frequency, Hz
+extern int adf4350_freqStep;	// adf4350 resolution, Hz
+extern freqHz_t currFreqHz;		// current hardware tx frequency
+
+// relative gain of each baseband gain setting; see performGainCal()
+extern float gainTable[board::RFSW_BBGAIN_MAX+1];
+
+/* This is written in the 'measurement thread' (ADC ISR)
+ * But read by the 'main thread'. So make it volatile */
+extern volatile bool lcdInhibit;
+
+#ifdef BOARD_DISABLE_ECAL
+// Made measure ecal, and apply correction
+#define ecalApplyReflection(refl, freqIndex) refl
+#else
+extern complexf measuredEcal[ECAL_CHANNELS][USB_POINTS_MAX];
+static inline complexf ecalApplyReflection(complexf refl, int freqIndex) {
+	#if defined(ECAL_PARTIAL)
+		return refl - measuredEcal[0][freqIndex];
+	#else
+		return SOL_compute_reflection(
+					measuredEcal[1][freqIndex],
+					1.f,
+					measuredEcal[0][freqIndex],
+					refl);
+	#endif
+}
+#endif
+
+// automatically set IF frequency depending on rf frequency and board parameters
+void updateIFrequency(freqHz_t txFreqHz);
+
+int measurementGetDefaultGain(freqHz_t freqHz);
+
+// factor that normalizes a thru value measured at baseband gain gain
+// to the default gain of freqHz
+static inline float measurementThruGainScale(int gain, freqHz_t freqHz) {
+	return gainTable[gain] / gainTable[measurementGetDefaultGain(freqHz)];
+}
+
+// set the measurement frequency including setting the tx and rx synthesizers
+void setFrequency(freqHz_t freqHz);
+
+// program the synthesizers for a changed frequency and set
+// vnaMeasurement.nWaitSynth; defined by the application.
+// Called from the measurement interrupt through setFrequency().
+void synthSetFrequency(freqHz_t freqHz);
+
+// callback called by VNAMeasurement to change rf switch positions.
+void measurementPhaseChanged(VNAMeasurementPhases ph);
@@ -0,0 +1,17 @@
+#pragma once
+#include "vna_measurement.hpp"
+
+// callbacks of the application's VNAMeasurement instance; defined in
+// measurement_control.cpp, usb_protocol.cpp and main2.cpp (sim/vnasim.cpp in
+// the simulator). they are bound at compile time so that the measurement
+// interrupt calls them directly instead of through small_function.
+struct MeasurementHandlers {
+	static void emitDataPoint(int freqIndex, freqHz_t freqHz, const VNAObservationSet& v, const complexf* ecal);
+	static void phaseChanged(VNAMeasurementPhases ph);
+	static void frequencyChanged(freqHz_t freqHz);
+	static void sweepSetupChanged(freqHz_t start, freqHz_t stop);
+	static void gainChanged(int gain);
+	static void emitZeroSpanValue(VNAMeasurementPhases ph, complex<int32_t> value, bool clipped);
+};
+
+typedef VNAMeasurementT<VNAMeasurementStaticCallbacks<MeasurementHandlers>> AppVNAMeasurement;
@@ -5,6 +5,7 @@
 #include "plot.hpp"
 #include "ili9341.hpp"
 #include "Font.h"
+#include "fastmath.hpp"
 #include <board.hpp>
 #include <mculib/printf.hpp>
 #include "ui.hpp"
@@ -16,6 +17,7 @@
 
 
 static void cell_draw_marker_info(int x0, int y0);
+static void marker_info_update(void);
 void frequency_string(char *buf, size_t len, freqHz_t freq);
 void frequency_string_short(char *buf, size_t len, freqHz_t freq, char prefix);
 void markmap_all_markers(void);
@@ -366,6 +368,53 @@ smith_grid3(int x, int y)
 	return 0;
 }
 
+#if PLOT_GRID_CACHE
+// grid mask, one 32 bit word per cell column; see PLOT_GRID_CACHE.
+// Rows are computed on first use, gridCacheValid has one bit per cell column.
+#define GRID_CACHE_ROWS (P_CENTER_Y + 1)
+static_assert(CELLWIDTH == 32, "grid cache assumes one word per cell row");
+static uint32_t gridCache[GRID_CACHE_ROWS][MAX_MARKMAP_X];
+static map_t gridCacheValid[GRID_CACHE_ROWS];
+static uint16_t gridCacheMode = 0;
+
+static void
+grid_cache_invalidate(void)
+{
+	gridCacheMode = 0;
+}
+
+// returns the grid pixels of cell column m in row y; bit n is pixel m*CELLWIDTH+n
+static uint32_t
+grid_cache_row(int m, int y, uint16_t grid_mode)
+{
+	if (grid_mode != gridCacheMode) {
+		memset(gridCacheValid, 0, sizeof(gridCacheValid));
+		gridCacheMode = grid_mode;
+	}
+	if (y > P_CENTER_Y)
+		y = 2 * P_CENTER_Y - y;
+	if (gridCacheValid[y] & (1 << m))
+		return gridCache[y][m];
+
+	int x0 = m * CELLWIDTH;
+	uint32_t bits = 0;
+	for (int x = 0; x < CELLWIDTH; x++) {
+		int g;
+		if (grid_mode == GRID_SMITH)
+			g = smith_grid(x + x0, y);
+		else if (grid_mode == GRID_POLAR)
+			g = polar_grid(x + x0, y);
+		else
+			g = smith_grid3(x + x0, y);
+		if (g)
+			bits |= 1U << x;
+	}
+	gridCache[y][m] = bits;
+	gridCacheValid[y] |= 1 << m;
+	return bits;
+}
+#endif
+
 #if 0
 int
 rectangular_grid(int x, int y)
@@ -415,7 +464,7 @@ rectangular_grid_y(int y)
  */
 float logmag(complexf v) {
 	float re = v.real(), im = v.imag();
-	return log10f(re*re + im*im) * 10;
+	return fast_log10(re*re + im*im) * 10;
 }
 
 /*
@@ -423,32 +472,30 @@ float logmag(complexf v) {
  */
 float phase(complexf v) {
 	float re = v.real(), im = v.imag();
-	return 2 * atan2f(im, re) / M_PI * 90;
+	return 2 * fast_atan2(im, re) / M_PI * 90;
 }
 
 /*
  * calculate groupdelay
  */
 float groupdelay(complexf v, complexf w, float deltaf) {
-	// calculate atan(w)-atan(v)
-	complexf q = w / v;
-	return arg(q) / (2 * M_PI * deltaf);
+	// calculate atan(w)-atan(v); arg(w/v) == arg(w*conj(v))
+	complexf q = w * conj(v);
+	return fast_atan2(q.imag(), q.real()) / (2 * M_PI * deltaf);
 }
 
 /*
  * calculate abs(gamma)
  */
 float linear(complexf v) {
-	float re = v.real(), im = v.imag();
-	return - sqrtf(re*re + im*im);
+	return - fast_hypot(v.real(), v.imag());
 }
 
 /*
  * calculate vswr; (1+gamma)/(1-gamma)
  */
 float swr(complexf v) {
-	float re = v.real(), im = v.imag();
-	float x = sqrtf(re*re + im*im);
+	float x = fast_hypot(v.real(), v.imag());
 	if (x > 1)
 		return INFINITY;
 	return (1 + x)/(1 - x);
@@ -508,57 +555,168 @@ groupdelay_from_array(int i, complexf array[SWEEP_POINTS_MAX])
 	}
 }
 
-uint32_t
-trace_into_index(int x, int t, int i, complexf array[SWEEP_POINTS_MAX])
+static void markmap_segment(uint32_t a, uint32_t b);
+
+// scratch space for the per trace values of trace_into_index()
+static float trace_values[SWEEP_POINTS_MAX];
+
+// store the new screen position of point i of trace t and mark the cells of
+// the line segments next to it if it moved. If mark_all is set all segments
+// are marked, for when the previous index data is not comparable.
+static inline void
+trace_index_update(int t, int i, uint32_t idx, uint32_t& prev_old, bool mark_all)
 {
-	int y = 0;
-	float v = 0;
-	float refpos = 8 - get_trace_refpos(t);
-	float scale = 1 / get_trace_scale(t);
-	complexf coeff = array[i];
+	uint32_t *index = trace_index[t];
+	uint32_t old = index[i];
+	// index[i-1] already holds the new position of the previous point
+	if (mark_all || old != idx || (i > 0 && prev_old != index[i-1])) {
+		if (i > 0) {
+			markmap_segment(prev_old, old);
+			markmap_segment(index[i-1], idx);
+		} else {
+			markmap_segment(old, old);
+			markmap_segment(idx, idx);
+		}
+	}
+	index[i] = idx;
+	prev_old = old;
+}
+
+// values of trace t at full resolution. Values are computed for the whole
+// channel array at once so that the fast math kernels run in a tight loop.
+// Smith and polar charts get the imaginary part, which is what moves their
+// points up and down on the screen.
+static void
+trace_compute_values(int t, complexf array[SWEEP_POINTS_MAX], float *v)
+{
+	int i;
 	switch (trace[t].type) {
+	case TRC_SMITH:
+	//case TRC_ADMIT:
+	case TRC_POLAR:
+	case TRC_IMAG:
+		for (i = 0; i < sweep_points; i++)
+			v[i] = array[i].imag();
+		break;
 	case TRC_LOGMAG:
-		v = refpos - logmag(coeff) * scale;
+		fast_logmag_array(array, v, sweep_points);
 		break;
 	case TRC_PHASE:
-		v = refpos - phase(coeff) * scale;
-		break;
-	case TRC_DELAY:
-		v = refpos - groupdelay_from_array(i, array) * scale;
+		fast_phase_array(array, v, sweep_points);
 		break;
 	case TRC_LINEAR:
-		v = refpos + linear(coeff) * scale;
+		fast_abs_array(array, v, sweep_points);
 		break;
 	case TRC_SWR:
-		v = refpos+ (1 - swr(coeff)) * scale;
+		fast_abs_array(array, v, sweep_points);
+		for (i = 0; i < sweep_points; i++)
+			v[i] = (v[i] > 1) ? INFINITY : (1 + v[i])/(1 - v[i]) - 1;
 		break;
-	case TRC_REAL:
-		v = refpos - coeff.real() * scale;
+	case TRC_DELAY:
+		for (i = 0; i < sweep_points; i++)
+			v[i] = groupdelay_from_array(i, array);
 		break;
-	case TRC_IMAG:
-		v = refpos - coeff.imag() * scale;
+	case TRC_REAL:
+		for (i = 0; i < sweep_points; i++)
+			v[i] = array[i].real();
 		break;
 	case TRC_R:
-		v = refpos - resistance(coeff) * scale;
+		for (i = 0; i < sweep_points; i++)
+			v[i] = resistance(array[i]);
 		break;
 	case TRC_X:
-		v = refpos - reactance(coeff) * scale;
+		for (i = 0; i < sweep_points; i++)
+			v[i] = reactance(array[i]);
 		break;
 	case TRC_Q:
-		v = refpos - qualityfactor(coeff) * scale;
+		for (i = 0; i < sweep_points; i++)
+			v[i] = qualityfactor(array[i]);
 		break;
-
-	case TRC_SMITH:
-	//case TRC_ADMIT:
-	case TRC_POLAR:
-		cartesian_scale(coeff.real(), coeff.imag(), &x, &y, scale);
-		return INDEX(x +CELLOFFSETX, y);
+	default:
+		for (i = 0; i < sweep_points; i++)
+			v[i] = 0;
 		break;
 	}
-	if (v < 0) v = 0;
-	if (v > 8) v = 8;
-	y = float2int(v * GRIDY);
-	return INDEX(x +CELLOFFSETX, y);
+}
+
+// +1 if larger values of trace t are drawn higher on the screen, else -1
+static inline float
+trace_search_sign(int t)
+{
+	if (trace[t].type == TRC_SMITH || trace[t].type == TRC_POLAR)
+		return 1;
+	return get_trace_scale(t) < 0 ? -1 : 1;
+}
+
+// maximum and minimum of each trace, found by trace_into_index() on the
+// full resolution values. They stay valid as long as the trace is not
+// remapped, so tracking a marker costs nothing per frame.
+struct trace_extrema {
+	int16_t index[2];	// indexed by MarkerSearchModes
+	float offset[2];	// vertex of a parabola through the neighbours, in points
+};
+static trace_extrema trace_search[TRACES_MAX];
+
+// offset of the vertex of the parabola through points i-1, i, i+1
+static float
+parabolic_offset(const float *v, int i)
+{
+	if (i <= 0 || i >= sweep_points - 1)
+		return 0;
+	float a = v[i-1], b = v[i], c = v[i+1];
+	float d = a - 2*b + c;
+	if (!isfinite(a) || !isfinite(b) || !isfinite(c) || d == 0)
+		return 0;
+	float x = 0.5f * (a - c) / d;
+	if (x < -0.5f) x = -0.5f;
+	if (x > 0.5f) x = 0.5f;
+	return x;
+}
+
+static void
+trace_search_update(int t, const float *v)
+{
+	float sign = trace_search_sign(t);
+	int imax = 0, imin = 0;
+	float vmax = v[0] * sign, vmin = vmax;
+	for (int i = 1; i < sweep_points; i++) {
+		float x = v[i] * sign;
+		if (x > vmax) { vmax = x; imax = i; }
+		if (x < vmin) { vmin = x; imin = i; }
+	}
+	trace_extrema &e = trace_search[t];
+	e.index[MarkerSearchModes::Max] = imax;
+	e.index[MarkerSearchModes::Min] = imin;
+	e.offset[MarkerSearchModes::Max] = parabolic_offset(v, imax);
+	e.offset[MarkerSearchModes::Min] = parabolic_offset(v, imin);
+}
+
+// map all points of trace t onto the screen
+static void
+trace_into_index(int t, complexf array[SWEEP_POINTS_MAX], bool mark_all)
+{
+	float refpos = 8 - get_trace_refpos(t);
+	float scale = 1 / get_trace_scale(t);
+	float *v = trace_values;
+	uint32_t prev_old = 0;
+	int i;
+	trace_compute_values(t, array, v);
+	trace_search_update(t, v);
+	if (trace[t].type == TRC_SMITH || trace[t].type == TRC_POLAR) {
+		for (i = 0; i < sweep_points; i++) {
+			int x, y;
+			cartesian_scale(array[i].real(), array[i].imag(), &x, &y, scale);
+			trace_index_update(t, i, INDEX(x +CELLOFFSETX, y), prev_old, mark_all);
+		}
+		return;
+	}
+	for (i = 0; i < sweep_points; i++) {
+		int x = i * WIDTH / (sweep_points-1);
+		float y = refpos - v[i] * scale;
+		if (y < 0) y = 0;
+		if (y > 8) y = 8;
+		trace_index_update(t, i, INDEX(x +CELLOFFSETX, float2int(y * GRIDY)), prev_old, mark_all);
+	}
 }
 
 static int
@@ -875,58 +1033,73 @@ invalidate_rect(int x0, int y0, int x1, int y1)
 			mark_map(x, y);
 }
 
-static inline void
-markmap_upperarea(void)
-{
-	// Hardcoded, Text info from upper area
-	invalidate_rect(0, 0, AREA_WIDTH_NORMAL, 3*FONT_STR_HEIGHT);
-}
-
+// mark the cells covered by the bounding box of the line from a to b
 static void
-mark_cells_from_index(void)
+markmap_segment(uint32_t a, uint32_t b)
 {
-	int t, i, j;
-	/* mark cells between each neighber points */
 	map_t *map = &markmap[current_mappage][0];
-	for (t = 0; t < TRACES_MAX; t++) {
-		if (!trace[t].enabled)
-			continue;
-		uint32_t *index = &trace_index[t][0];
-		int m0 = CELL_X(index[0]) / CELLWIDTH;
-		int n0 = CELL_Y(index[0]) / CELLHEIGHT;
-		map[n0] |= 1 << m0;
-		for (i = 1; i < sweep_points; i++) {
-		int m1 = CELL_X(index[i]) / CELLWIDTH;
-		int n1 = CELL_Y(index[i]) / CELLHEIGHT;
-		if (m0 == m1 && n0 == n1)
-			continue;
-		int x0 = m0; int x1 = m1; if (x0>x1) SWAP(x0, x1); m0 = m1;
-		int y0 = n0; int y1 = n1; if (y0>y1) SWAP(y0, y1); n0 = n1;
-		for (; y0 <= y1; y0++)
-			for (j = x0; j <= x1; j++) {
-				if(y0 >= 0 && y0 < MAX_MARKMAP_Y)
-					map[y0] |= 1 << j;
-			}
-		}
+	int x0 = CELL_X(a) / CELLWIDTH, x1 = CELL_X(b) / CELLWIDTH;
+	int y0 = CELL_Y(a) / CELLHEIGHT, y1 = CELL_Y(b) / CELLHEIGHT;
+	if (x0 > x1) SWAP(x0, x1);
+	if (y0 > y1) SWAP(y0, y1);
+	map_t bits = 0;
+	for (int j = x0; j <= x1; j++)
+		bits |= 1 << j;
+	for (; y0 <= y1; y0++)
+		if (y0 >= 0 && y0 < MAX_MARKMAP_Y)
+			map[y0] |= bits;
+}
+
+// everything trace_index[t] depends on, other than the frequencies
+struct trace_map_key {
+	uint32_t generation;
+	float scale, refpos;
+	int16_t points;
+	uint8_t type, channel;
+	bool enabled;
+	bool operator==(const trace_map_key& other) const {
+		return generation == other.generation && scale == other.scale
+			&& refpos == other.refpos && points == other.points
+			&& type == other.type && channel == other.channel
+			&& enabled == other.enabled;
 	}
-}
+};
+static trace_map_key trace_map_keys[TRACES_MAX];
 
 void plot_into_index(complexf measured[2][SWEEP_POINTS_MAX])
 {
-	mark_cells_from_index();
-	int i, t;
-	for (i = 0; i < sweep_points; i++) {
-		int x = i * WIDTH / (sweep_points-1);
-		for (t = 0; t < TRACES_MAX; t++) {
-			if (!trace[t].enabled)
-				continue;
-			int n = trace[t].channel;
-			trace_index[t][i] = trace_into_index(x, t, i, measured[n]);
+	bool changed = false;
+	for (int t = 0; t < TRACES_MAX; t++) {
+		// the data of disabled traces does not matter
+		uint32_t generation = trace[t].enabled ? measuredGeneration[trace[t].channel] : 0;
+		trace_map_key key = {
+			generation, trace[t].scale, trace[t].refpos,
+			(int16_t)sweep_points, trace[t].type, trace[t].channel, (bool)trace[t].enabled
+		};
+		trace_map_key& last = trace_map_keys[t];
+		if (key == last)
+			continue;
+		// if only the data changed, mark the cells of the segments that moved.
+		// Otherwise mark the old and new trace completely.
+		trace_map_key settings = key;
+		settings.generation = last.generation;
+		bool mark_all = !(settings == last);
+		if (mark_all && last.enabled) {
+			uint32_t *index = trace_index[t];
+			for (int i = 1; i < last.points; i++)
+				markmap_segment(index[i-1], index[i]);
+			markmap_segment(index[0], index[0]);
 		}
+		last = key;
+		changed = true;
+		if (!trace[t].enabled)
+			continue;
+		trace_into_index(t, measured[trace[t].channel], mark_all);
 	}
+	if (!changed)
+		return;
 	// Current scan count
 	sweep_count++;
-	mark_cells_from_index();
 	markmap_all_markers();
 	redraw_request |= REDRAW_CELLS;
 }
@@ -1006,22 +1179,23 @@ search_index_range_x(int x1, int x2, uint32_t *index, int *i0, int *i1)
 static void
 cell_blit_bitmap(int x, int y, uint16_t w, uint16_t h, const uint8_t *bmp)
 {
-  if (x <= -w)
+  if (x <= -w || x >= CELLWIDTH || y <= -h || y >= CELLHEIGHT)
     return;
-  uint8_t bits = 0;
-  int c = h+y, r;
-  for (; y < c; y++) {
-    for (r = 0; r < w; r++) {
-      if ((r&7)==0) bits = *bmp++;
-      if (y >= 0 && x+r >= 0 && y < CELLHEIGHT && x+r < CELLWIDTH && (0x80 & bits))
-        ili9341_spi_buffer[y*CELLWIDTH + x + r] = foreground_color;
-      bits <<= 1;
-    }
+  // clip once instead of testing every pixel
+  int stride = (w + 7) / 8;
+  int r0 = x < 0 ? -x : 0, r1 = x + w > CELLWIDTH ? CELLWIDTH - x : w;
+  int c0 = y < 0 ? -y : 0, c1 = y + h > CELLHEIGHT ? CELLHEIGHT - y : h;
+  for (int c = c0; c < c1; c++) {
+    const uint8_t *row = bmp + c * stride;
+    uint16_t *buf = &ili9341_spi_buffer[(y + c) * CELLWIDTH + x];
+    for (int r = r0; r < r1; r++)
+      if (row[r >> 3] & (0x80 >> (r & 7)))
+        buf[r] = foreground_color;
   }
 }
 
 static void
-cell_drawstring(char *str, int x, int y)
+cell_drawstring(const char *str, int x, int y)
 {
   if (y <= -FONT_GET_HEIGHT || y >= CELLHEIGHT)
     return;
@@ -1209,69 +1383,67 @@ draw_marker(int x, int y, int c, int ch)
   cell_blit_bitmap(x, y, MARKER_WIDTH, MARKER_HEIGHT, MARKER_BITMAP(ch+1));
 }
 
-typedef int (*compare_t)(int x, int y);
-static int greater(int x, int y) { return x > y; }
-static int lesser(int x, int y) { return x < y; }
-
-compare_t marker_comparator(MarkerSearchModes mode) {
-	if (mode == MarkerSearchModes::Max)
-		return ::greater;
-	else
-		return ::lesser;
-}
-
-
 int
 marker_search(MarkerSearchModes mode)
 {
-	compare_t compare = marker_comparator(mode);
-	int i;
-	int found = 0;
-
 	if (uistat.current_trace == -1)
 		return -1;
-
-	int value = CELL_Y(trace_index[uistat.current_trace][0]);
-	for (i = 0; i < sweep_points; i++) {
-		uint32_t index = trace_index[uistat.current_trace][i];
-		if ((*compare)(value, CELL_Y(index))) {
-			value = CELL_Y(index);
-			found = i;
-		}
-	}
-
-	return found;
+	return trace_search[uistat.current_trace].index[mode];
 }
 
 int
 marker_search_dir(MarkerSearchModes mode, int from, int dir)
 {
-	compare_t compare = marker_comparator(mode);
 	int i;
 	int found = -1;
+	int t = uistat.current_trace;
 
-	if (uistat.current_trace == -1)
+	if (t == -1)
 		return -1;
 
-	int value = CELL_Y(trace_index[uistat.current_trace][from]);
+	// search the full resolution values; larger is better
+	float *v = trace_values;
+	trace_compute_values(t, measured[trace[t].channel], v);
+	float sign = trace_search_sign(t);
+	if (mode == MarkerSearchModes::Min)
+		sign = -sign;
+
+	// go downhill to the next valley, then uphill to the next peak
+	float value = v[from] * sign;
 	for (i = from + dir; i >= 0 && i < sweep_points; i+=dir) {
-		uint32_t index = trace_index[uistat.current_trace][i];
-		if ((*compare)(value, CELL_Y(index)))
+		if (v[i] * sign > value)
 			break;
-		value = CELL_Y(index);
+		value = v[i] * sign;
 	}
 
 	for (;i >= 0 && i < sweep_points; i+=dir) {
-		uint32_t index = trace_index[uistat.current_trace][i];
-		if ((*compare)(CELL_Y(index), value)) {
+		if (v[i] * sign < value)
 			break;
-		}
 		found = i;
-		value = CELL_Y(index);
+		value = v[i] * sign;
 	}
 	return found;
 }
 
+// frequency of marker mk, refined between sweep points while it tracks the
+// maximum or minimum of the current trace
+static freqHz_t
+marker_frequency(int mk)
+{
+	int idx = markers[mk].index;
+	freqHz_t freq = freqAt(idx);
+	int t = uistat.current_trace;
+	if (!uistat.marker_tracking || mk != active_marker || t == -1)
+		return freq;
+	const trace_extrema &e = trace_search[t];
+	MarkerSearchModes mode = uistat.marker_search_mode;
+	if (e.index[mode] != idx || e.offset[mode] == 0)
+		return freq;
+	float offset = e.offset[mode];
+	freqHz_t step = (offset > 0) ? freqAt(idx + 1) - freq : freq - freqAt(idx - 1);
+	return freq + freqHz_t(offset * step);
+}
+
 int
 distance_to_index(int8_t t, uint16_t idx, int16_t x, int16_t y)
 {
@@ -1322,7 +1494,6 @@ markmap_all_markers(void)
 			continue;
 		markmap_marker(i);
 	}
-	markmap_upperarea();
 }
 
 // Include L/C match functions
@@ -1332,8 +1503,70 @@ markmap_all_markers(void)
 
 bool plot_checkerBoard = false;
 bool plot_shadeCells = false;
+
+// cell render queue: draw_all_cells() turns the dirty cells of the markmap
+// into jobs and sets up what all cells of the frame have in common, then
+// draw_cell() rasterises one job after the other into the free spi buffer
+// while the previous cell is sent by DMA (see ili9341_bulk()).
+typedef struct {
+	uint8_t m, n;
+} cell_job_t;
+
+typedef struct {
+	uint16_t grid_mode;
+	// enabled traces and markers
+	uint8_t trace_count;
+	uint8_t trace_list[TRACES_MAX];
+	uint8_t marker_count;
+	uint8_t marker_list[MARKERS_MAX];
+} cell_frame_t;
+
 static void
-draw_cell(int m, int n)
+cell_frame_setup(cell_frame_t *f)
+{
+	int t, i;
+	f->grid_mode = 0;
+	f->trace_count = 0;
+	for (t = 0; t < TRACES_MAX; t++) {
+		if (!trace[t].enabled)
+			continue;
+		f->trace_list[f->trace_count++] = t;
+
+		if (trace[t].type == TRC_SMITH)
+			f->grid_mode |= GRID_SMITH;
+		//else if (trace[t].type == TRC_ADMIT)
+		//  f->grid_mode |= GRID_ADMIT;
+		else if (trace[t].type == TRC_POLAR)
+			f->grid_mode |= GRID_POLAR;
+		else
+			f->grid_mode |= GRID_RECTANGULAR;
+	}
+	f->marker_count = 0;
+	for (i = 0; i < MARKERS_MAX; i++) {
+		if (markers[i].enabled)
+			f->marker_list[f->marker_count++] = i;
+	}
+}
+
+// collect the cells marked in either markmap page; returns the number of jobs
+static int
+cell_jobs_collect(cell_job_t *jobs)
+{
+	int m, n;
+	int count = 0;
+	for (m = 0; m < (area_width+CELLWIDTH-1) / CELLWIDTH; m++)
+		for (n = 0; n < (area_height+CELLHEIGHT-1) / CELLHEIGHT; n++) {
+			if ((markmap[0][n] | markmap[1][n]) & (1 << m)) {
+				jobs[count].m = m;
+				jobs[count].n = n;
+				count++;
+			}
+		}
+	return count;
+}
+
+static void
+draw_cell(const cell_frame_t *f, int m, int n)
 {
 	int x0 = m * CELLWIDTH;
 	int y0 = n * CELLHEIGHT;
@@ -1342,7 +1575,7 @@ draw_cell(int m, int n)
 	int x, y;
 	int i0, i1;
 	int i;
-	int t;
+	int t, k;
 	bool shade = plot_shadeCells;
 	if(plot_checkerBoard)
 		shade |= (((m + n) % 2) == 0);
@@ -1357,20 +1590,7 @@ draw_cell(int m, int n)
 	if (w <= 0 || h <= 0)
 		return;
 
-	uint16_t grid_mode = 0;
-	for (t = 0; t < TRACES_MAX; t++) {
-		if (!trace[t].enabled)
-			continue;
-
-		if (trace[t].type == TRC_SMITH)
-			grid_mode |= GRID_SMITH;
-		//else if (trace[t].type == TRC_ADMIT)
-		//  grid_mode |= GRID_ADMIT;
-		else if (trace[t].type == TRC_POLAR)
-			grid_mode |= GRID_POLAR;
-		else
-			grid_mode |= GRID_RECTANGULAR;
-	}
+	uint16_t grid_mode = f->grid_mode;
 
 //	PULSE;
 	  // Clear buffer ("0 : height" lines)
@@ -1410,6 +1630,23 @@ draw_cell(int m, int n)
 			}
 		}
 	}
+#if PLOT_GRID_CACHE
+	uint16_t chart_mode = (grid_mode & GRID_SMITH) ? GRID_SMITH
+	                    : (grid_mode & GRID_POLAR) ? GRID_POLAR
+	                    : (grid_mode & GRID_ADMIT);
+	if (chart_mode) {
+		for (y = 0; y < h; y++) {
+			uint32_t bits = grid_cache_row(m, y + y0, chart_mode);
+			if (w < CELLWIDTH)
+				bits &= (1U << w) - 1;
+			uint16_t *row = &ili9341_spi_buffer[y * CELLWIDTH];
+			while (bits) {
+				row[__builtin_ctz(bits)] = c;
+				bits &= bits - 1;
+			}
+		}
+	}
+#else
 	if (grid_mode & GRID_SMITH) {
 		for (y = 0; y < h; y++)
 			for (x = 0; x < w; x++)
@@ -1426,10 +1663,10 @@ draw_cell(int m, int n)
 				if (smith_grid3(x+x0, y+y0))// smith_grid2(x+x0, y+y0, 0.5))
 					ili9341_spi_buffer[y * CELLWIDTH + x] = c;
 	}
+#endif
 //	PULSE;
-	for (t = 0; t < TRACES_MAX; t++) {
-		if (!trace[t].enabled)
-			continue;
+	for (k = 0; k < f->trace_count; k++) {
+		t = f->trace_list[k];
 		c = config.trace_color[t];
 		// draw polar plot (check all points)
 		i0 = 0;
@@ -1452,12 +1689,10 @@ draw_cell(int m, int n)
 //	PULSE;
 	// draw marker symbols on each trace (<10 system ticks for all screen calls)
 #if 1
-	for (i = 0; i < MARKERS_MAX; i++) {
-		if (!markers[i].enabled)
-			continue;
-		for (t = 0; t < TRACES_MAX; t++) {
-			if (!trace[t].enabled)
-				continue;
+	for (int j = 0; j < f->marker_count; j++) {
+		i = f->marker_list[j];
+		for (k = 0; k < f->trace_count; k++) {
+			t = f->trace_list[k];
 			uint32_t index = trace_index[t][markers[i].index];
 			int x = CELL_X(index) - x0 - X_MARKER_OFFSET;
 			int y = CELL_Y(index) - y0 - Y_MARKER_OFFSET;
@@ -1481,9 +1716,8 @@ draw_cell(int m, int n)
 //	PULSE;
 
 	// Draw reference position (<10 system ticks for all screen calls)
-	for (t = 0; t < TRACES_MAX; t++) {
-		if (!trace[t].enabled)
-			continue;
+	for (k = 0; k < f->trace_count; k++) {
+		t = f->trace_list[k];
 		uint32_t trace_type = (1 << trace[t].type);
 		if (trace_type & ((1 << TRC_SMITH) | (1 << TRC_POLAR)))
 			continue;
@@ -1510,19 +1744,20 @@ draw_cell(int m, int n)
 void
 draw_all_cells(bool flush_markmap)
 {
-	int m, n;
-	for (m = 0; m < (area_width+CELLWIDTH-1) / CELLWIDTH; m++)
-		for (n = 0; n < (area_height+CELLHEIGHT-1) / CELLHEIGHT; n++) {
-			if ((markmap[0][n] | markmap[1][n]) & (1 << m)) {
-				draw_cell(m, n);
-				plot_tick();
-				if(plot_canceled)
-					return;
-//				ili9341_fill(m*CELLWIDTH+OFFSETX, n*CELLHEIGHT, 2, 2, RGB565(255,0,0));
-			}
-//			else
-//				ili9341_fill(m*CELLWIDTH+OFFSETX, n*CELLHEIGHT, 2, 2, RGB565(0,255,0));
-		}
+	cell_job_t jobs[MAX_MARKMAP_X * MAX_MARKMAP_Y];
+	cell_frame_t frame;
+	int count, i;
+	marker_info_update();
+	cell_frame_setup(&frame);
+	count = cell_jobs_collect(jobs);
+	for (i = 0; i < count; i++) {
+		draw_cell(&frame, jobs[i].m, jobs[i].n);
+		// cells marked while events are processed here are drawn by the
+		// next redraw; the markmap page they are in is not cleared below
+		plot_tick();
+		if(plot_canceled)
+			return;
+	}
 	if (flush_markmap) {
 		// keep current map for update
 		swap_markmap();
@@ -1536,8 +1771,6 @@ draw_all(bool flush)
 {
 	if(!plot_redraw_enable) return;
 	plot_canceled = false;
-	if (redraw_request & REDRAW_MARKER)
-		markmap_upperarea();
 	if (redraw_request & (REDRAW_CELLS | REDRAW_MARKER))
 		draw_all_cells(flush);
 	if (redraw_request & REDRAW_FREQUENCY)
@@ -1551,11 +1784,9 @@ request_to_redraw_marker(int marker)
 {
 	if (marker == MARKER_INVALID)
 		return;
-	// mark map on new position of marker
+	// mark map on new position of marker; cells of the marker info
+	// are marked by draw_all_cells() where the text changed
 	markmap_marker(marker);
-
-	// mark cells on marker info
-	markmap_upperarea();
 }
 
 void
@@ -1581,8 +1812,41 @@ request_to_draw_cells_behind_numeric_input(void)
   redraw_request |= REDRAW_CELLS;
 }
 
+// trace and marker info at the top of the plot area. The strings are
+// formatted once per redraw by marker_info_update() and only blitted by
+// draw_cell(); cells are marked for redraw only where a string changed.
+#define MARKER_INFO_RUNS 20
+struct marker_info_run {
+	int16_t x, y;		// area coordinates
+	uint16_t width;		// pixels
+	uint16_t color;
+	char str[24];
+};
+// the current and the previous layout
+static marker_info_run marker_info[2][MARKER_INFO_RUNS];
+static uint8_t marker_info_count[2];
+static uint8_t marker_info_page = 0;
+
 static void
-cell_draw_marker_info(int x0, int y0)
+marker_info_add(const char *str, int x, int y)
+{
+	int page = marker_info_page;
+	if (marker_info_count[page] >= MARKER_INFO_RUNS)
+		return;
+	marker_info_run *run = &marker_info[page][marker_info_count[page]++];
+	run->x = x;
+	run->y = y;
+	run->color = foreground_color;
+	strncpy(run->str, str, sizeof(run->str) - 1);
+	run->str[sizeof(run->str) - 1] = 0;
+	int w = 0;
+	for (const char *c = run->str; *c; c++)
+		w += FONT_GET_WIDTH((uint8_t)*c);
+	run->width = w;
+}
+
+static void
+marker_info_layout(void)
 {
 	char buf[24];
 	int t;
@@ -1597,41 +1861,41 @@ cell_draw_marker_info(int x0, int y0)
 			if (!markers[mk].enabled)
 				continue;
 			ili9341_set_foreground(config.trace_color[t]);
-			int xpos = 1 + (j%2)*(WIDTH/2) + CELLOFFSETX - x0;
-			int ypos = 1 + (j/2)*(FONT_STR_HEIGHT) - y0;
+			int xpos = 1 + (j%2)*(WIDTH/2) + CELLOFFSETX;
+			int ypos = 1 + (j/2)*(FONT_STR_HEIGHT);
 			strcpy(buf, " M1"); if (mk == active_marker) buf[0] = S_SARROW[0];
 			buf[2] += mk;
-			cell_drawstring(buf, xpos, ypos);
+			marker_info_add(buf, xpos, ypos);
 			xpos += 3*FONT_WIDTH + 3;
 			//trace_get_info(t, buf, sizeof buf);
-			freqHz_t freq = freqAt(markers[mk].index);
+			freqHz_t freq = marker_frequency(mk);
 			if (uistat.marker_delta && mk != active_marker) {
-				freq -= freqAt(markers[active_marker].index);
+				freq -= marker_frequency(active_marker);
 				frequency_string_short(buf, sizeof buf, freq, S_DELTA[0]);
 			} else {
 				frequency_string_short(buf, sizeof buf, freq, 0);
 			}
-			cell_drawstring(buf, xpos, ypos);
+			marker_info_add(buf, xpos, ypos);
 			xpos += 11*FONT_WIDTH + 11;
 			if (uistat.marker_delta && mk != active_marker)
 				trace_get_value_string_delta(t, buf, sizeof buf, measured[trace[t].channel], markers[mk].index, markers[active_marker].index);
 			else
 				trace_get_value_string(t, buf, sizeof buf, measured[trace[t].channel], markers[mk].index);
 			ili9341_set_foreground(0xFFFF);
-			cell_drawstring(buf, xpos, ypos);
+			marker_info_add(buf, xpos, ypos);
 			j++;
 		}
 
 		// draw marker delta
 		if (!uistat.marker_delta && active_marker != previous_marker) {
 			int idx0 = markers[previous_marker].index;
-			int xpos = (WIDTH/2+30) + CELLOFFSETX - x0;
-			int ypos = 1 + (j/2)*(FONT_STR_HEIGHT) - y0;
+			int xpos = (WIDTH/2+30) + CELLOFFSETX;
+			int ypos = 1 + (j/2)*(FONT_STR_HEIGHT);
 			strcpy(buf, S_DELTA "1-1:"); if (mk == active_marker) buf[0] = S_SARROW[0];
 			buf[1] += active_marker;
 			buf[3] += previous_marker;
 			ili9341_set_foreground(0xFFFF);
-			cell_drawstring(buf, xpos, ypos);
+			marker_info_add(buf, xpos, ypos);
 			xpos += 5*FONT_WIDTH + 5;
 			if ((domain_mode & DOMAIN_MODE) == DOMAIN_FREQ) {
 				frequency_string(buf, sizeof buf, freqAt(idx) - freqAt(idx0));
@@ -1642,62 +1906,105 @@ cell_draw_marker_info(int x0, int y0)
 				buf[n++] = ' ';
 				string_value_with_prefix(&buf[n], sizeof buf - n, distance_of_index(idx) - distance_of_index(idx0), 'm');
 			}
-			cell_drawstring(buf, xpos, ypos);
+			marker_info_add(buf, xpos, ypos);
 		}
 	} else {
 		for (t = 0; t < TRACES_MAX; t++) {
 			if (!trace[t].enabled)
 				continue;
-			int xpos = 1 + (j%2)*(WIDTH/2) + CELLOFFSETX - x0;
-			int ypos = 1 + (j/2)*(FONT_STR_HEIGHT) - y0;
+			int xpos = 1 + (j%2)*(WIDTH/2) + CELLOFFSETX;
+			int ypos = 1 + (j/2)*(FONT_STR_HEIGHT);
 			strcpy(buf, " CH0"); if (t == uistat.current_trace) buf[0] = S_SARROW[0];
 			buf[3] += trace[t].channel;
 			ili9341_set_foreground(config.trace_color[t]);
 			//chsnprintf(buf, sizeof buf, "CH%d", trace[t].channel);
-			cell_drawstring(buf, xpos, ypos); // invert
+			marker_info_add(buf, xpos, ypos); // invert
 			xpos += 4*FONT_WIDTH + 4;
 			trace_get_info(t, buf, sizeof buf);
-			cell_drawstring(buf, xpos, ypos);
+			marker_info_add(buf, xpos, ypos);
 			xpos += 11*FONT_WIDTH + 5;
 			trace_get_value_string(t, buf, sizeof buf, measured[trace[t].channel], idx);
 			ili9341_set_foreground(0xFFFF);
-			cell_drawstring(buf, xpos, ypos);
+			marker_info_add(buf, xpos, ypos);
 			j++;
 		}
 
 		// draw marker frequency
-		int xpos = (WIDTH/2+40) + CELLOFFSETX - x0;
-		int ypos = 1 + (j/2)*(FONT_STR_HEIGHT) - y0;
+		int xpos = (WIDTH/2+40) + CELLOFFSETX;
+		int ypos = 1 + (j/2)*(FONT_STR_HEIGHT);
 		strcpy(buf, " 1:");if (uistat.lever_mode == LM_MARKER) buf[0] = S_SARROW[0];
 		buf[0] += active_marker;
 		xpos += FONT_WIDTH;
 		ili9341_set_foreground(0xFFFF);
-		cell_drawstring(buf, xpos, ypos);
+		marker_info_add(buf, xpos, ypos);
 		xpos += 3*FONT_WIDTH;
 		if ((domain_mode & DOMAIN_MODE) == DOMAIN_FREQ) {
-			frequency_string(buf, sizeof buf, plot_getFrequencyAt(idx));
+			frequency_string(buf, sizeof buf, marker_frequency(active_marker));
 		} else {
 			//chsnprintf(buf, sizeof buf, "%d ns %.1f m", (uint16_t)(time_of_index(idx) * 1e9), distance_of_index(idx));
 			int n = string_value_with_prefix(buf, sizeof buf, time_of_index(idx), 's');
 			buf[n++] = ' ';
 			string_value_with_prefix(&buf[n], sizeof buf-n, distance_of_index(idx), 'm');
 		}
-		cell_drawstring(buf, xpos, ypos);
+		marker_info_add(buf, xpos, ypos);
 	}
 	if (electrical_delay != 0) {
 		// draw electrical delay
-		int xpos = 21 + CELLOFFSETX - x0;
-		int ypos = 1 + ((j+1)/2)*(FONT_STR_HEIGHT) - y0;
+		int xpos = 21 + CELLOFFSETX;
+		int ypos = 1 + ((j+1)/2)*(FONT_STR_HEIGHT);
 		chsnprintf(buf, sizeof buf, "Edelay");
 		ili9341_set_foreground(0xFFFF);
-		cell_drawstring(buf, xpos, ypos);
+		marker_info_add(buf, xpos, ypos);
 		xpos += 7*FONT_WIDTH + 7;
 		int n = string_value_with_prefix(buf, sizeof buf, electrical_delay * 1e-12, 's');
-		cell_drawstring(buf, xpos, ypos);
+		marker_info_add(buf, xpos, ypos);
 		xpos += n*FONT_WIDTH + n;
 		float light_speed_ps = 299792458e-12; //(m/ps)
 		string_value_with_prefix(buf, sizeof buf, electrical_delay * light_speed_ps * velocity_factor, 'm');
-		cell_drawstring(buf, xpos, ypos);
+		marker_info_add(buf, xpos, ypos);
+	}
+}
+
+static inline void
+markmap_marker_info_run(const marker_info_run *run)
+{
+	if (run->width > 0)
+		invalidate_rect(run->x, run->y, run->x + run->width - 1, run->y + FONT_GET_HEIGHT - 1);
+}
+
+// format the info text and mark the cells of strings that changed
+static void
+marker_info_update(void)
+{
+	marker_info_page ^= 1;
+	marker_info_count[marker_info_page] = 0;
+	uint16_t fg = foreground_color;
+	marker_info_layout();
+	ili9341_set_foreground(fg);
+
+	const marker_info_run *cur = marker_info[marker_info_page];
+	const marker_info_run *old = marker_info[marker_info_page ^ 1];
+	int n = marker_info_count[marker_info_page];
+	int m = marker_info_count[marker_info_page ^ 1];
+	for (int i = 0; i < n || i < m; i++) {
+		if (i < n && i < m && cur[i].x == old[i].x && cur[i].y == old[i].y
+				&& cur[i].color == old[i].color && strcmp(cur[i].str, old[i].str) == 0)
+			continue;
+		if (i < m) markmap_marker_info_run(&old[i]);
+		if (i < n) markmap_marker_info_run(&cur[i]);
+	}
+}
+
+static void
+cell_draw_marker_info(int x0, int y0)
+{
+	const marker_info_run *run = marker_info[marker_info_page];
+	for (int i = 0; i < marker_info_count[marker_info_page]; i++, run++) {
+		if (run->x >= x0 + CELLWIDTH || run->x + run->width <= x0
+				|| run->y >= y0 + CELLHEIGHT || run->y + FONT_GET_HEIGHT <= y0)
+			continue;
+		ili9341_set_foreground(run->color);
+		cell_drawstring(run->str, run->x - x0, run->y - y0);
 	}
 }
 
@@ -1933,6 +2240,9 @@ draw_battery_status(void)
 void
 request_to_redraw_grid(void)
 {
+#if PLOT_GRID_CACHE
+	grid_cache_invalidate();
+#endif
 	force_set_markmap();
 	redraw_request |= REDRAW_CELLS;
 }
@@ -50,6 +50,15 @@
 #define P_CENTER_Y (HEIGHT/2)
 #define P_RADIUS   (HEIGHT/2)
 
+// Cache the smith/polar chart grid as a 1 bit per pixel mask of the upper
+// half of the plot area (the grids are symmetric about the horizontal axis).
+// Costs (P_CENTER_Y+1) * (LCD_WIDTH/32) * 4 bytes of RAM: about 4.6 KB for
+// 320x240 and 9.2 KB for 480x320. Boards short on RAM can pass
+// -DPLOT_GRID_CACHE=0 to evaluate the grid per pixel instead.
+#ifndef PLOT_GRID_CACHE
+#define PLOT_GRID_CACHE 1
+#endif
+
 #ifdef __USE_LC_MATCHING__
 // X and Y offset to L/C match text
  #define STR_LC_MATH_X      (OFFSETX +  0)
@@ -0,0 +1,67 @@
+#include "screenshot.hpp"
+#include "ili9341.hpp"
+#include "plot.hpp"
+#include "crc32.hpp"
+#include <string.h>
+#include <algorithm>
+
+int rleEncodeRow(const uint16_t* in, int n, uint8_t* out) {
+	uint8_t* o = out;
+	int i = 0;
+	while(i < n) {
+		int run = 1;
+		while(i + run < n && run < 129 && in[i + run] == in[i])
+			run++;
+		if(run >= 2) {
+			*o++ = uint8_t(0x80 | (run - 2));
+			memcpy(o, &in[i], 2); o += 2;
+			i += run;
+			continue;
+		}
+		// literal: extend until the next run of at least 2 pixels
+		int len = 1;
+		while(i + len < n && len < 128
+				&& !(i + len + 1 < n && in[i + len] == in[i + len + 1]))
+			len++;
+		*o++ = uint8_t(len - 1);
+		memcpy(o, &in[i], len * 2); o += len * 2;
+		i += len;
+	}
+	return o - out;
+}
+
+void screenshot_send(bool rle, const small_function<void(const uint8_t* data, int len)>& write) {
+#pragma pack(push, 1)
+	struct {
+		uint16_t width;
+		uint16_t height;
+		uint8_t pixelFormat;
+		uint8_t encoding;
+	} meta = { LCD_WIDTH, LCD_HEIGHT, 16, 1 };
+#pragma pack(pop)
+	write((uint8_t*) &meta, rle ? sizeof(meta) : sizeof(meta) - 1);
+
+	// rows are read into the first buffer and encoded into the second one
+	constexpr int rows = SPI_BUFFER_SIZE / LCD_WIDTH;
+	static_assert(rows >= 1);
+	static_assert(rleRowBytesMax(LCD_WIDTH) <= SPI_BUFFER_SIZE * 2);
+	uint16_t* in = ili9341_spi_buffers;
+	uint8_t* out = (uint8_t*) &ili9341_spi_buffers[SPI_BUFFER_SIZE];
+	uint32_t crc = CRC32_INIT;
+	for (int y = 0; y < LCD_HEIGHT; y += rows) {
+		int h = std::min(rows, LCD_HEIGHT - y);
+		ili9341_read_memory(0, y, LCD_WIDTH, h, in);
+		if(!rle) {
+			write((uint8_t*) in, LCD_WIDTH * 2 * h);
+			continue;
+		}
+		for (int r = 0; r < h; r++) {
+			uint16_t len = rleEncodeRow(in + r * LCD_WIDTH, LCD_WIDTH, out + 2);
+			memcpy(out, &len, 2);
+			crc = crc32(out, len + 2, crc);
+			write(out, len + 2);
+		}
+	}
+	if(rle)
+		write((uint8_t*) &crc, sizeof(crc));
+}
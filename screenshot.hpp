@@ -0,0 +1,27 @@
+#pragma once
+#include <stdint.h>
+#include <mculib/small_function.hpp>
+
+/*
+ * Screenshot stream of the usb register protocol (register 0xee).
+ * header: uint16 width, uint16 height, uint8 pixelFormat (16 => RGB565),
+ * followed (rle only) by uint8 encoding (1 => rle rows).
+ * raw: width*height pixels. rle: for each row, uint16 encoded length in
+ * bytes followed by the output of rleEncodeRow(); then uint32 crc32() of
+ * all rows.
+ */
+
+// largest encoded row of n pixels, including its uint16 length
+static constexpr int rleRowBytesMax(int n) {
+	return 2 + n * 2 + (n + 127) / 128;
+}
+
+// run-length encode one row of pixels; returns the encoded length in bytes.
+// Each packet starts with a byte n: if bit 7 is set, the following pixel is
+// repeated (n & 0x7f) + 2 times, otherwise n + 1 literal pixels follow.
+// Pixels are sent in display byte order, as in the raw format.
+int rleEncodeRow(const uint16_t* in, int n, uint8_t* out);
+
+// read the display and pass the stream to write in parts. Uses both spi
+// buffers; the display readback keeps to ili9341_spi_window().
+void screenshot_send(bool rle, const small_function<void(const uint8_t* data, int len)>& write);
@@ -0,0 +1,75 @@
+#pragma once
+#include <stdint.h>
+#include "../common.hpp"
+
+// board of the host simulator (see vnasim.cpp): a V2_2 whose rf switches are
+// simulated. The shared measurement sources (measurement_control.cpp,
+// usb_protocol.cpp) are built against this instead of a board_*/board.hpp.
+
+#define BOARD_NAME "NanoVNA V2_2 (simulated)"
+#define BOARD_REVISION (2)
+
+#define USB_POINTS_MAX 1024
+
+#define BOARD_MEASUREMENT_NPERIODS_NORMAL		14
+#define BOARD_MEASUREMENT_NPERIODS_CALIBRATING	30
+#define BOARD_MEASUREMENT_NWAIT_SWITCH			 1
+#define BOARD_MEASUREMENT_FIRST_POINT_WAIT	   196
+
+using namespace std;
+
+enum class RFSWState {
+	RF1 = 0,
+	RF2 = 1,
+	RF3 = 2,
+	RF4 = 3
+};
+
+namespace board {
+	// rf switches of the simulated front end; see rfsw() in vnasim.cpp
+	enum class SimSwitch {
+		ECAL,
+		BBGAIN,
+		TXSYNTH,
+		RXSYNTH,
+		REFL,
+		RECV
+	};
+	static constexpr auto RFSW_ECAL = SimSwitch::ECAL;
+	static constexpr auto RFSW_BBGAIN = SimSwitch::BBGAIN;
+	static constexpr auto RFSW_TXSYNTH = SimSwitch::TXSYNTH;
+	static constexpr auto RFSW_RXSYNTH = SimSwitch::RXSYNTH;
+	static constexpr auto RFSW_REFL = SimSwitch::REFL;
+	static constexpr auto RFSW_RECV = SimSwitch::RECV;
+
+	static constexpr uint32_t xtalFreqHz = 24000000;
+
+	static constexpr auto RFSW_ECAL_SHORT = RFSWState::RF4;
+	static constexpr auto RFSW_ECAL_OPEN = RFSWState::RF3;
+	static constexpr auto RFSW_ECAL_LOAD = RFSWState::RF2;
+	static constexpr auto RFSW_ECAL_NORMAL = RFSWState::RF1;
+
+	static constexpr int RFSW_TXSYNTH_LF = 0;
+	static constexpr int RFSW_TXSYNTH_HF = 1;
+
+	static constexpr int RFSW_RXSYNTH_LF = 1;
+	static constexpr int RFSW_RXSYNTH_HF = 0;
+
+	static constexpr int RFSW_REFL_ON = 1;
+	static constexpr int RFSW_REFL_OFF = 0;
+
+	static constexpr int RFSW_RECV_REFL = 0;
+	static constexpr int RFSW_RECV_PORT2 = 1;
+
+	static constexpr int RFSW_BBGAIN_MAX = 3;
+
+	// gain 0 - 3 => RF1 - RF4
+	static inline RFSWState RFSW_BBGAIN_GAIN(int gain) {
+		if(gain < 0) gain = 0;
+		if(gain > RFSW_BBGAIN_MAX) gain = RFSW_BBGAIN_MAX;
+		return RFSWState(gain);
+	}
+}
+
+void rfsw(board::SimSwitch sw, int state);
+void rfsw(board::SimSwitch sw, RFSWState state);
@@ -0,0 +1,154 @@
+#pragma once
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <math.h>
+#include <complex>
+#include <vector>
+#include <string>
+
+using namespace std;
+
+// device under test of the simulator: S11 and S21 versus frequency.
+// Either loaded from a Touchstone (v1) .s1p/.s2p file or the built-in model.
+// Values between file frequencies are linearly interpolated (real and
+// imaginary parts); outside of the file range the nearest point is used.
+class DUTModel {
+public:
+	typedef complex<double> complexd;
+
+	struct point {
+		double freqHz;
+		complexd s11, s21;
+	};
+	vector<point> points;
+
+	// built-in model: a 25 ohm + 10 pF series load behind 100 ps of 50 ohm
+	// line on port 1, and a 1 ns line with 3 dB loss between port 1 and 2.
+	bool builtin = true;
+
+	// load a Touchstone file; on error returns false and sets err.
+	// .s1p files have no S21; it is taken as 0.
+	bool load(const char* fileName, string& err) {
+		FILE* f = fopen(fileName, "r");
+		if(f == nullptr) {
+			err = string("can not open ") + fileName;
+			return false;
+		}
+		double freqMult = 1e9;
+		enum { FMT_MA, FMT_DB, FMT_RI } fmt = FMT_MA;
+		vector<double> values;
+		char line[1024];
+		int lineNum = 0;
+		while(fgets(line, sizeof(line), f) != nullptr) {
+			lineNum++;
+			char* comment = strchr(line, '!');
+			if(comment != nullptr)
+				*comment = 0;
+			if(line[0] == '#') {
+				// option line: # <unit> S <format> R <z0>
+				for(char* tok = strtok(line + 1, " \t\r\n"); tok != nullptr; tok = strtok(nullptr, " \t\r\n")) {
+					if(strcasecmp(tok, "hz") == 0) freqMult = 1;
+					else if(strcasecmp(tok, "khz") == 0) freqMult = 1e3;
+					else if(strcasecmp(tok, "mhz") == 0) freqMult = 1e6;
+					else if(strcasecmp(tok, "ghz") == 0) freqMult = 1e9;
+					else if(strcasecmp(tok, "ma") == 0) fmt = FMT_MA;
+					else if(strcasecmp(tok, "db") == 0) fmt = FMT_DB;
+					else if(strcasecmp(tok, "ri") == 0) fmt = FMT_RI;
+					else if(strcasecmp(tok, "s") != 0 && strcasecmp(tok, "r") != 0
+							&& strtod(tok, nullptr) == 0.) {
+						err = "unsupported option " + string(tok) + " on line " + to_string(lineNum);
+						fclose(f);
+						return false;
+					}
+				}
+				continue;
+			}
+			for(char* tok = strtok(line, " \t\r\n"); tok != nullptr; tok = strtok(nullptr, " \t\r\n")) {
+				char* end;
+				double v = strtod(tok, &end);
+				if(*end != 0) {
+					err = "bad number " + string(tok) + " on line " + to_string(lineNum);
+					fclose(f);
+					return false;
+				}
+				values.push_back(v);
+			}
+		}
+		fclose(f);
+
+		// a data record is the frequency followed by 1 (s1p) or 4 (s2p) value pairs
+		const char* ext = strrchr(fileName, '.');
+		int nParams = (ext != nullptr && strcasecmp(ext, ".s1p") == 0) ? 1 : 4;
+		int recordLen = 1 + nParams*2;
+		if(values.size() == 0 || (values.size() % recordLen) != 0) {
+			err = string("incomplete data records in ") + fileName;
+			return false;
+		}
+		auto toComplex = [fmt](double a, double b) {
+			switch(fmt) {
+			case FMT_DB:
+				return polar(pow(10., a/20.), b*M_PI/180.);
+			case FMT_RI:
+				return complexd(a, b);
+			default:
+				return polar(a, b*M_PI/180.);
+			}
+		};
+		points.clear();
+		for(size_t i=0; i<values.size(); i+=recordLen) {
+			point p;
+			p.freqHz = values[i] * freqMult;
+			p.s11 = toComplex(values[i+1], values[i+2]);
+			// s2p order is S11 S21 S12 S22
+			p.s21 = (nParams == 1) ? complexd(0., 0.) : toComplex(values[i+3], values[i+4]);
+			if(!points.empty() && p.freqHz <= points.back().freqHz) {
+				err = string("frequencies are not increasing in ") + fileName;
+				return false;
+			}
+			points.push_back(p);
+		}
+		builtin = false;
+		return true;
+	}
+
+	complexd s11(double freqHz) const {
+		if(builtin) {
+			double w = 2*M_PI*freqHz;
+			complexd z = complexd(25., -1./(w*10e-12));
+			complexd gamma = (z - 50.) / (z + 50.);
+			return gamma * polar(1., -w*2*100e-12);
+		}
+		return interpolate(freqHz, &point::s11);
+	}
+
+	complexd s21(double freqHz) const {
+		if(builtin) {
+			double w = 2*M_PI*freqHz;
+			return polar(pow(10., -3./20.), -w*1e-9);
+		}
+		return interpolate(freqHz, &point::s21);
+	}
+
+private:
+	complexd interpolate(double freqHz, complexd point::* param) const {
+		if(freqHz <= points.front().freqHz)
+			return points.front().*param;
+		if(freqHz >= points.back().freqHz)
+			return points.back().*param;
+		// binary search for the last point at or below freqHz
+		size_t lo = 0, hi = points.size() - 1;
+		while(hi - lo > 1) {
+			size_t mid = (lo + hi) / 2;
+			if(points[mid].freqHz <= freqHz)
+				lo = mid;
+			else
+				hi = mid;
+		}
+		const point& a = points[lo];
+		const point& b = points[hi];
+		double t = (freqHz - a.freqHz) / (b.freqHz - a.freqHz);
+		return a.*param + (b.*param - a.*param) * t;
+	}
+};
@@ -0,0 +1,715 @@
+/*
+ * Host simulator of the NanoVNA V2_2 measurement data path.
+ *
+ * The measurement state machine (VNAMeasurement), the correlator
+ * (SampleProcessor), the IF and rf switch control (measurement_control.cpp),
+ * the usb register protocol (usb_protocol.cpp) and the command parser are
+ * the firmware sources, built against the simulated board in sim/board.hpp.
+ * They run against simulated synthesizers, rf switches and an ADC that
+ * synthesises the IF waveform from a DUT model, with noise, clipping and
+ * settle transients. The usb register protocol is served on a pseudo
+ * terminal, so host tools can connect to it as to a real device.
+ *
+ * This file only provides what main2.cpp provides on the device: the
+ * synthesizers (synthSetFrequency), the emitDataPoint handler (usb path
+ * only), the protocol hooks and the dsp timer.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+#include <math.h>
+#include <random>
+#include <vector>
+
+#include <board.hpp>
+#include "../common.hpp"
+#include "../globals.hpp"
+#include "../measurement_control.hpp"
+#include "../usb_protocol.hpp"
+#include "../command_parser.hpp"
+#include "../usb_elements.hpp"
+#include "dut_model.hpp"
+
+using namespace board;
+
+// ##### parameters of the simulated device (V2_2 with a 24MHz tcxo) #####
+
+static constexpr int adcRateHz = 300000;
+
+// ADC samples processed per dsp timer tick
+static constexpr int blockSamples = 100;
+
+
+// ##### simulated rf hardware #####
+
+// synthesizers, rf switches, baseband gain and ADC.
+// The IF waveform at the ADC is the wave selected by the rf switches, scaled
+// by the baseband gain, mixed down to the IF frequency and offset to mid
+// scale. After a frequency change the synthesizers settle with a decaying
+// amplitude and phase error; after a switch change the previous path decays
+// away. Time is counted in ADC samples.
+struct SimHardware {
+	typedef complex<double> complexd;
+
+	const DUTModel* dut = nullptr;
+
+	// receiver gain of each baseband gain setting
+	double gainFactor[RFSW_BBGAIN_MAX+1] = {1., 2., 4., 8.};
+	// ADC counts of the REFERENCE wave at gain 0
+	double refAmplitude = 250.;
+	// rms noise at the ADC, counts
+	double noise = 2.;
+	// multiplier for the settle time constants below
+	double settleScale = 1.;
+	// synthesizer settle time constants, IF periods
+	double settleSi5351 = 3.;
+	double settleAdf4350 = 1.5;
+	// rf switch settle time constant, IF periods
+	double settleSwitch = 0.2;
+
+	uint64_t sample = 0;
+	double freqHz = 0;
+	VNAMeasurementPhases path = VNAMeasurementPhases::REFERENCE;
+	int gain = 0;
+	// samples per IF period and IF phase in cycles
+	double ifPeriod = 25.;
+	double ifPhase = 0.;
+
+	// wave at the receiver input for the current switch and gain setting
+	complexd pathValue = 0.;
+	// value at the last switch change; decays with settleSwitch
+	complexd prevValue = 0.;
+	uint64_t switchTime = 0;
+	// synthesizer phase (random per frequency) and settle error
+	complexd synthPhase = 1.;
+	complexd synthError = 0.;
+	double synthSettle = 1.;
+	uint64_t synthTime = 0;
+
+	mt19937 rng;
+	normal_distribution<double> gauss {0., 1.};
+	uniform_real_distribution<double> uniform {0., 1.};
+
+	// instantaneous complex envelope at the ADC
+	complexd envelope(uint64_t t) {
+		double ts = double(t - switchTime) / (settleSwitch * settleScale * ifPeriod);
+		complexd v = pathValue + (prevValue - pathValue) * exp(-ts);
+		ts = double(t - synthTime) / (synthSettle * settleScale * ifPeriod);
+		return v * synthPhase * (1. + synthError * exp(-ts));
+	}
+
+	void update() {
+		complexd wave = 1.;
+		if(path == VNAMeasurementPhases::REFL)
+			wave = dut->s11(freqHz);
+		else if(path == VNAMeasurementPhases::THRU)
+			wave = dut->s21(freqHz);
+		// the source level drops slightly with frequency
+		double level = refAmplitude * (1. - 0.3*freqHz/4.4e9);
+		pathValue = wave * level * gainFactor[gain];
+	}
+
+	// change rf switches and/or gain
+	void setPath(VNAMeasurementPhases ph, int g) {
+		if(ph == path && g == gain)
+			return;
+		prevValue = envelope(sample) / synthPhase;
+		switchTime = sample;
+		path = ph;
+		gain = g;
+		update();
+	}
+
+	void setFrequency(double f, double samplesPerIFPeriod) {
+		ifPeriod = samplesPerIFPeriod;
+		if(f == freqHz)
+			return;
+		bool adf4350 = (f >= FREQUENCY_CHANGE_OVER);
+		synthSettle = adf4350 ? settleAdf4350 : settleSi5351;
+		synthPhase = polar(1., 2*M_PI*uniform(rng));
+		synthError = polar(0.5, 2*M_PI*uniform(rng)) - 1.;
+		synthTime = sample;
+		freqHz = f;
+		update();
+	}
+
+	void generate(uint16_t* buf, int n) {
+		for(int i=0; i<n; i++) {
+			// the correlator sees the IF with a negative frequency;
+			// see the sin/cos order of the correlation tables
+			complexd v = envelope(sample) * polar(1., -2*M_PI*ifPhase);
+			double x = 2048. + v.real() + noise * gauss(rng);
+			if(x < 0.) x = 0.;
+			if(x > 4095.) x = 4095.;
+			buf[i] = uint16_t(lrint(x));
+			ifPhase += 1. / ifPeriod;
+			if(ifPhase >= 1.) ifPhase -= 1.;
+			sample++;
+		}
+	}
+
+	uint32_t timeMicroseconds() const {
+		return uint32_t(sample * 1000000 / adcRateHz);
+	}
+};
+
+
+// ##### simulated firmware #####
+
+static DUTModel dut;
+static SimHardware hw;
+static CommandParser cmdParser;
+
+// see globals.cpp
+uint8_t registers[registerSize];
+volatile EcalStates ecalState = ECAL_STATE_MEASURING;
+
+volatile uint32_t systemTimeCounter = 0;
+
+// host side of the usb serial port; -1 in self test mode
+static int usbFd = -1;
+static vector<uint8_t> selftestOutput;
+static bool realtime = true;
+static struct timespec startTime;
+
+static bool serialSendTimeout(const uint8_t* s, int len, int timeoutMillis) {
+	if(usbFd < 0) {
+		selftestOutput.insert(selftestOutput.end(), s, s + len);
+		return true;
+	}
+	while(len > 0) {
+		pollfd pfd = {usbFd, POLLOUT, 0};
+		if(poll(&pfd, 1, timeoutMillis) <= 0)
+			return false;
+		int n = write(usbFd, s, len);
+		if(n < 0) {
+			if(errno == EAGAIN || errno == EINTR)
+				continue;
+			return false;
+		}
+		s += n;
+		len -= n;
+	}
+	return true;
+}
+
+// rf switch positions, set by measurementPhaseChanged() and setFrequency()
+static RFSWState swEcal = RFSW_ECAL_NORMAL;
+static int swRecv = RFSW_RECV_REFL;
+static int swGain = 0;
+
+// the receiver sees port 2 (THRU), the reflection bridge (REFL) or, with the
+// ecal switch in any other position, the source (REFERENCE); the ecal
+// standards are not simulated.
+static void applySwitches() {
+	auto path = VNAMeasurementPhases::THRU;
+	if(swRecv == RFSW_RECV_REFL)
+		path = (swEcal == RFSW_ECAL_NORMAL) ? VNAMeasurementPhases::REFL : VNAMeasurementPhases::REFERENCE;
+	hw.setPath(path, swGain);
+}
+
+void rfsw(SimSwitch sw, int state) {
+	if(sw == RFSW_RECV) {
+		swRecv = state;
+		applySwitches();
+	}
+}
+
+void rfsw(SimSwitch sw, RFSWState state) {
+	if(sw == RFSW_ECAL)
+		swEcal = state;
+	else if(sw == RFSW_BBGAIN)
+		swGain = int(state);
+	applySwitches();
+}
+
+// see synthSetFrequency() in main2.cpp; lo_freq was set by updateIFrequency()
+void synthSetFrequency(freqHz_t freqHz) {
+	hw.setFrequency(freqHz, double(adcRateHz) / lo_freq);
+	vnaMeasurement.nWaitSynth = (freqHz >= FREQUENCY_CHANGE_OVER) ? 10 : 18;
+}
+
+// see measurementEmitDataPoint() in main2.cpp; the sim has no ecal hardware
+// and no fixed board corrections, and is always in usb data mode.
+void MeasurementHandlers::emitDataPoint(int freqIndex, freqHz_t freqHz, const VNAObservationSet& v, const complexf* ecal) {
+	complexf thru = v[2] * measurementThruGainScale(vnaMeasurement.currThruGain, freqHz);
+	usbEnqueueDataPoint(freqIndex, v[0]/v[1], thru/v[1]);
+}
+void MeasurementHandlers::sweepSetupChanged(freqHz_t start, freqHz_t stop) {
+}
+
+static void measurement_setup() {
+	// baseband gain calibration, see performGainCal()
+	for(int i=0; i<=RFSW_BBGAIN_MAX; i++)
+		gainTable[i] = float(hw.gainFactor[0] / hw.gainFactor[i]);
+
+	vnaMeasurement.ecalDisabled = true;
+	vnaMeasurement.nPeriods = BOARD_MEASUREMENT_NPERIODS_NORMAL;
+	vnaMeasurement.nPeriodsCalibrating = BOARD_MEASUREMENT_NPERIODS_CALIBRATING;
+	vnaMeasurement.nWaitSwitch = BOARD_MEASUREMENT_NWAIT_SWITCH;
+	vnaMeasurement.nWaitFirstPoint = BOARD_MEASUREMENT_FIRST_POINT_WAIT;
+	vnaMeasurement.gainMin = 0;
+	vnaMeasurement.gainMax = RFSW_BBGAIN_MAX;
+	vnaMeasurement.init();
+	setFrequency(200000000);
+}
+
+// wait until the simulated time catches up with the wall clock
+static void pace() {
+	if(!realtime)
+		return;
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	int64_t elapsedUs = int64_t(now.tv_sec - startTime.tv_sec) * 1000000
+			+ (now.tv_nsec - startTime.tv_nsec) / 1000;
+	int64_t aheadUs = int64_t(hw.sample * 1000000 / adcRateHz) - elapsedUs;
+	if(aheadUs > 1000)
+		usleep(aheadUs);
+}
+
+// one dsp timer tick: acquire a block of ADC samples and process it
+static void simulateBlock() {
+	uint16_t buf[blockSamples];
+	if(outputRawSamples) {
+		// see usb_transmit_rawSamples()
+		hw.setPath(VNAMeasurementPhases::THRU, 0);
+		hw.generate(buf, blockSamples);
+		uint8_t tmpBuf[blockSamples];
+		for(int i=0; i<blockSamples; i++)
+			tmpBuf[i] = uint8_t(int8_t(buf[i] >> 4) - 128);
+		serialSendTimeout(tmpBuf, blockSamples, 1500);
+	} else {
+		hw.generate(buf, blockSamples);
+		systemTimeCounter = hw.timeMicroseconds();
+		vnaMeasurement.processSamples(buf, blockSamples);
+	}
+	pace();
+}
+
+
+// ##### usb register protocol (see usb_protocol.cpp) #####
+
+static void cmdInit() {
+	cmdParser.handleReadFIFO = [](int address, int nValues) {
+		cmdReadFIFO(address, nValues);
+	};
+	cmdParser.handleWriteFIFO = [](int address, int totalBytes, int nBytes, const uint8_t* data) {
+		cmdWriteFIFO(address, nBytes, data);
+	};
+	cmdParser.handleWrite = [](int address) {
+		usbRegisterWrite(address);
+	};
+	cmdParser.registerGroup = [](int address) {
+		return cmdRegisterGroup(address);
+	};
+	cmdParser.send = [](const uint8_t* s, int len) {
+		serialSendTimeout(s, len, 1500);
+	};
+	cmdParser.registers = registers;
+	cmdParser.registersSizeMask = registersSizeMask;
+
+	usb_send = [](const uint8_t* data, int len) {
+		return serialSendTimeout(data, len, 1500);
+	};
+	// the measurement runs in an interrupt on the device
+	usb_wait_values = []() {
+		simulateBlock();
+	};
+	usb_set_sweep = []() {
+		usbApplySweep();
+	};
+	// the source level is not simulated
+	usb_set_tx_power = [](int power) {};
+
+	registers[0xf0] = 2;	// device variant
+	registers[0xf1] = 1;	// protocol version
+	registers[0xf2] = BOARD_REVISION;
+	registers[0xf3] = FIRMWARE_MAJOR_VERSION;
+	registers[0xf4] = FIRMWARE_MINOR_VERSION;
+}
+
+
+// ##### self test #####
+
+static void sendCommand(const vector<uint8_t>& cmd) {
+	cmdParser.handleInput(cmd.data(), cmd.size());
+}
+
+static void put64(vector<uint8_t>& v, uint64_t x) {
+	for(int i=0; i<8; i++)
+		v.push_back(uint8_t(x >> (i*8)));
+}
+
+static void put16(vector<uint8_t>& v, uint16_t x) {
+	v.push_back(uint8_t(x));
+	v.push_back(uint8_t(x >> 8));
+}
+
+static int32_t getInt32(const uint8_t* b) {
+	return int32_t(uint32_t(b[0]) | uint32_t(b[1]) << 8 | uint32_t(b[2]) << 16 | uint32_t(b[3]) << 24);
+}
+
+// sweep the DUT through the usb protocol and compare the result with the
+// model; returns the number of failed checks.
+static int selftestSweep(uint64_t startHz, uint64_t stepHz, int points, double tolerance) {
+	// batch write of the sweep registers 00 - 23
+	vector<uint8_t> cmd = {0x2a, 0x00, 0x24};
+	put64(cmd, startHz);
+	put64(cmd, 0);
+	put64(cmd, stepHz);
+	put64(cmd, 0);
+	cmd.push_back(uint8_t(points));
+	cmd.push_back(uint8_t(points >> 8));
+	cmd.push_back(1);
+	cmd.push_back(0);
+	sendCommand(cmd);
+	sendCommand({0x20, 0x30, 0x00});
+
+	selftestOutput.clear();
+	sendCommand({0x18, 0x30, uint8_t(points)});
+	int fails = 0;
+	double maxErr11 = 0., maxErr21 = 0.;
+	for(int i=0; i<points; i++) {
+		const uint8_t* b = selftestOutput.data() + i*32;
+		if(int(selftestOutput.size()) < (i+1)*32 || b[31] != elementChecksum(b, 31)) {
+			printf("  point %d: missing or bad checksum\n", i);
+			return fails + 1;
+		}
+		int freqIndex = b[24] | (b[25] << 8);
+		if(freqIndex != i) {
+			printf("  point %d: freqIndex %d\n", i, freqIndex);
+			fails++;
+		}
+		complex<double> fwd(getInt32(b + 0), getInt32(b + 4));
+		complex<double> s11 = complex<double>(getInt32(b + 8), getInt32(b + 12)) / fwd;
+		complex<double> s21 = complex<double>(getInt32(b + 16), getInt32(b + 20)) / fwd;
+		double f = double(startHz + stepHz*i);
+		maxErr11 = max(maxErr11, abs(s11 - dut.s11(f)));
+		maxErr21 = max(maxErr21, abs(s21 - dut.s21(f)));
+	}
+	bool ok = (maxErr11 < tolerance && maxErr21 < tolerance);
+	printf("  sweep %.0f - %.0f Hz, %d points: max error S11 %.5f, S21 %.5f %s\n",
+		double(startHz), double(startHz + stepHz*(points-1)), points,
+		maxErr11, maxErr21, ok ? "ok" : "FAIL");
+	return fails + (ok ? 0 : 1);
+}
+
+static int selftestZeroSpan(uint64_t freqHz, double tolerance) {
+	// apply frequency and zero-span settings as one change
+	sendCommand({0x20, 0x24, 1});
+	vector<uint8_t> cmd = {0x23, 0x00};
+	put64(cmd, freqHz);
+	sendCommand(cmd);
+	sendCommand({0x2a, 0x50, 0x03, 20, 0, 1});	// 20 periods, THRU
+	sendCommand({0x20, 0x24, 0});
+	// settle, then read everything queued
+	for(int i=0; i<400; i++)
+		simulateBlock();
+	sendCommand({0x20, 0x58, 0});
+	for(int i=0; i<200; i++)
+		simulateBlock();
+	selftestOutput.clear();
+	sendCommand({0x18, 0x58, 0});
+
+	int n = selftestOutput.size() / 16;
+	int fails = 0;
+	double maxErr = 0.;
+	uint32_t lastTimestamp = 0;
+	for(int i=0; i<n; i++) {
+		const uint8_t* b = selftestOutput.data() + i*16;
+		if(b[15] != elementChecksum(b, 15) || b[12] != 1 || (b[13] & 2) != 0) {
+			fails++;
+			continue;
+		}
+		uint32_t timestamp = uint32_t(getInt32(b));
+		if(i > 0 && timestamp <= lastTimestamp)
+			fails++;
+		lastTimestamp = timestamp;
+		complex<double> s21 = complex<double>(getInt32(b + 4), getInt32(b + 8)) / 1073741824.;
+		maxErr = max(maxErr, abs(s21 - dut.s21(double(freqHz))));
+	}
+	bool ok = (n > 0 && fails == 0 && maxErr < tolerance);
+	printf("  zero span %.0f Hz: %d values, max error S21 %.5f %s\n",
+		double(freqHz), n, maxErr, ok ? "ok" : "FAIL");
+
+	// back to sweeping
+	sendCommand({0x21, 0x50, 0, 0});
+	return ok ? 0 : 1;
+}
+
+struct selftestJob {
+	uint64_t startHz, stepHz;
+	int points, average, repeat, format;
+};
+
+// sequencer job table entry, see the register map in main2.cpp
+static void putJob(vector<uint8_t>& v, const selftestJob& job) {
+	put64(v, job.startHz);
+	put64(v, job.stepHz);
+	put16(v, job.points);
+	put16(v, job.average);
+	put16(v, job.repeat);
+	v.push_back(0xff);
+	v.push_back(job.format);
+}
+
+// run the measurement and the sequencer until the sequencer is idle
+static void runSequencer(int maxBlocks) {
+	for(int i=0; i<maxBlocks && registers[0x3a] != 0; i++) {
+		simulateBlock();
+		sequencerProcess();
+	}
+}
+
+// check the records of a complete run of jobs against the model; returns the
+// number of failed checks.
+static int checkSequencerRecords(const vector<selftestJob>& jobs, double tolerance) {
+	size_t pos = 0;
+	double maxErr = 0.;
+	for(int j=0; j<int(jobs.size()); j++) {
+		const selftestJob& job = jobs[j];
+		int len = (job.format == 0) ? 32 : 16;
+		for(int sweep=0; sweep<job.repeat; sweep++) {
+			for(int i=0; i<job.points; i++) {
+				const uint8_t* b = selftestOutput.data() + pos;
+				if(pos + len > selftestOutput.size() || b[len-1] != elementChecksum(b, len-1)) {
+					printf("  job %d sweep %d point %d: missing or bad checksum\n", j, sweep, i);
+					return 1;
+				}
+				pos += len;
+				const uint8_t* tag = b + ((job.format == 0) ? 24 : 8);
+				bool last = (j == int(jobs.size())-1 && sweep == job.repeat-1 && i == job.points-1);
+				int flags = (i == job.points-1 ? 1 : 0) | (last ? 2 : 0);
+				int freqIndex = tag[0] | (tag[1] << 8);
+				if(freqIndex != i || tag[2] != j || tag[3] != sweep || tag[4] != flags) {
+					printf("  job %d sweep %d point %d: freqIndex %d, tag %d %d %02x\n",
+						j, sweep, i, freqIndex, tag[2], tag[3], tag[4]);
+					return 1;
+				}
+				double f = double(job.startHz + job.stepHz*i);
+				if(job.format == 0) {
+					complex<double> fwd(getInt32(b + 0), getInt32(b + 4));
+					complex<double> s11 = complex<double>(getInt32(b + 8), getInt32(b + 12)) / fwd;
+					complex<double> s21 = complex<double>(getInt32(b + 16), getInt32(b + 20)) / fwd;
+					maxErr = max(maxErr, abs(s11 - dut.s11(f)));
+					maxErr = max(maxErr, abs(s21 - dut.s21(f)));
+				} else {
+					complex<double> value = complex<double>(getInt32(b + 0), getInt32(b + 4)) / 1073741824.;
+					complex<double> model = (job.format == 1) ? dut.s11(f) : dut.s21(f);
+					maxErr = max(maxErr, abs(value - model));
+				}
+			}
+		}
+	}
+	if(pos != selftestOutput.size()) {
+		printf("  %d bytes after the last record\n", int(selftestOutput.size() - pos));
+		return 1;
+	}
+	bool ok = (maxErr < tolerance);
+	printf("  sequencer, %d jobs: %d bytes of records, max error %.5f %s\n",
+		int(jobs.size()), int(pos), maxErr, ok ? "ok" : "FAIL");
+	return ok ? 0 : 1;
+}
+
+// start the sequencer, let it send some records and stop it with cmd; the
+// sequencer must be idle afterwards and send nothing more
+static int selftestSequencerStop(const vector<uint8_t>& cmd, const char* name) {
+	selftestOutput.clear();
+	sendCommand({0x20, 0x39, 1});
+	for(int i=0; i<100000 && selftestOutput.size() < 10*32; i++) {
+		simulateBlock();
+		sequencerProcess();
+	}
+	sendCommand(cmd);
+	size_t sent = selftestOutput.size();
+	for(int i=0; i<2000; i++) {
+		simulateBlock();
+		sequencerProcess();
+	}
+	bool ok = (sent >= 10*32 && registers[0x3a] == 0 && selftestOutput.size() == sent);
+	printf("  sequencer stop by %s: %d bytes before, %d after %s\n", name,
+		int(sent), int(selftestOutput.size() - sent), ok ? "ok" : "FAIL");
+	return ok ? 0 : 1;
+}
+
+static int selftestSequencer(double tolerance) {
+	vector<selftestJob> jobs = {
+		{200000000, 10000000, 11, 2, 2, 0},	// valuesFIFO elements, averaged, repeated
+		{1000000000, 0, 5, 1, 1, 1},		// CW reflection records
+		{100000000, 20000000, 7, 3, 2, 2},	// thru records across the synthesizer change over
+	};
+	// clear the table, then append the first job with 0x28 and the others with 0x29
+	sendCommand({0x20, 0x38, 0});
+	vector<uint8_t> cmd = {0x28, 0x38, 24};
+	putJob(cmd, jobs[0]);
+	sendCommand(cmd);
+	cmd = {0x29, 0x38, 48, 0};
+	putJob(cmd, jobs[1]);
+	putJob(cmd, jobs[2]);
+	sendCommand(cmd);
+	int fails = 0;
+	if(registers[0x3b] != jobs.size()) {
+		printf("  sequencer: %d jobs in the table FAIL\n", registers[0x3b]);
+		return 1;
+	}
+
+	selftestOutput.clear();
+	sendCommand({0x20, 0x39, 1});
+	if(registers[0x3a] != 2) {
+		printf("  sequencer: state %d after start FAIL\n", registers[0x3a]);
+		return 1;
+	}
+	runSequencer(1000000);
+	if(registers[0x3a] != 0) {
+		printf("  sequencer: still running FAIL\n");
+		return 1;
+	}
+	fails += checkSequencerRecords(jobs, tolerance);
+
+	fails += selftestSequencerStop({0x20, 0x39, 0}, "0x39 = 0");
+	fails += selftestSequencerStop({0x20, 0x26, 2}, "0x26 = 2");
+	return fails;
+}
+
+// values of 2 and more saturate instead of wrapping
+static int selftestScaleQ30() {
+	bool ok = scaleQ30(0.5f) == (1 << 29) && scaleQ30(-1.f) == -(1 << 30)
+		&& scaleQ30(2.f) == INT32_MAX && scaleQ30(1e6f) == INT32_MAX
+		&& scaleQ30(-2.f) == INT32_MIN && scaleQ30(-1e6f) == INT32_MIN;
+	printf("  scaleQ30 saturation %s\n", ok ? "ok" : "FAIL");
+	return ok ? 0 : 1;
+}
+
+static int selftest() {
+	realtime = false;
+	int fails = 0;
+	printf("vnasim self test, DUT: %s\n", dut.builtin ? "built-in" : "file");
+	fails += selftestSweep(200000000, 10000000, 101, 0.02);
+	fails += selftestSweep(50000, 5000000, 201, 0.02);
+	fails += selftestSweep(3000000000, 10000000, 51, 0.02);
+	fails += selftestZeroSpan(500000000, 0.02);
+	fails += selftestSequencer(0.02);
+	fails += selftestScaleQ30();
+	uint16_t sweeps = *(uint16_t*)(registers + 0x7e);
+	publishMeasurementStats();
+	if(*(uint16_t*)(registers + 0x7e) == sweeps) {
+		printf("  measurement statistics not updated FAIL\n");
+		fails++;
+	}
+	printf(fails == 0 ? "PASS\n" : "FAIL\n");
+	return fails == 0 ? 0 : 1;
+}
+
+
+// ##### main #####
+
+static int openPty(const char* linkPath) {
+	int fd = posix_openpt(O_RDWR | O_NOCTTY);
+	if(fd < 0 || grantpt(fd) < 0 || unlockpt(fd) < 0) {
+		perror("posix_openpt");
+		return -1;
+	}
+	const char* name = ptsname(fd);
+	// keep the slave side open and raw, so that the port behaves like a
+	// usb serial device across host tool restarts
+	int slave = open(name, O_RDWR | O_NOCTTY);
+	if(slave < 0) {
+		perror(name);
+		return -1;
+	}
+	struct termios tio;
+	tcgetattr(slave, &tio);
+	cfmakeraw(&tio);
+	tcsetattr(slave, TCSANOW, &tio);
+
+	printf("vnasim: usb serial port is %s\n", name);
+	if(linkPath != nullptr) {
+		unlink(linkPath);
+		if(symlink(name, linkPath) < 0)
+			perror(linkPath);
+		else
+			printf("vnasim: linked to %s\n", linkPath);
+	}
+	fflush(stdout);
+	return fd;
+}
+
+static void usage(const char* argv0) {
+	fprintf(stderr,
+		"usage: %s [options]\n"
+		"  -d, --dut FILE       Touchstone .s1p/.s2p DUT (default: built-in model)\n"
+		"  -n, --noise COUNTS   rms ADC noise (default 2)\n"
+		"  -s, --settle SCALE   multiply synthesizer and switch settle times (default 1)\n"
+		"  -l, --link PATH      create a symlink to the pty\n"
+		"  -f, --fast           run as fast as possible instead of in real time\n"
+		"  -S, --seed N         random seed\n"
+		"  -t, --selftest       sweep the DUT through the usb protocol and check the results\n",
+		argv0);
+}
+
+int main(int argc, char** argv) {
+	static const struct option longOptions[] = {
+		{"dut", required_argument, nullptr, 'd'},
+		{"noise", required_argument, nullptr, 'n'},
+		{"settle", required_argument, nullptr, 's'},
+		{"link", required_argument, nullptr, 'l'},
+		{"fast", no_argument, nullptr, 'f'},
+		{"seed", required_argument, nullptr, 'S'},
+		{"selftest", no_argument, nullptr, 't'},
+		{"help", no_argument, nullptr, 'h'},
+		{nullptr, 0, nullptr, 0}
+	};
+	const char* linkPath = nullptr;
+	bool doSelftest = false;
+	int c;
+	while((c = getopt_long(argc, argv, "d:n:s:l:fS:th", longOptions, nullptr)) != -1) {
+		switch(c) {
+		case 'd': {
+			string err;
+			if(!dut.load(optarg, err)) {
+				fprintf(stderr, "%s\n", err.c_str());
+				return 1;
+			}
+			break;
+		}
+		case 'n': hw.noise = atof(optarg); break;
+		case 's': hw.settleScale = atof(optarg); break;
+		case 'l': linkPath = optarg; break;
+		case 'f': realtime = false; break;
+		case 'S': hw.rng.seed(strtoul(optarg, nullptr, 0)); break;
+		case 't': doSelftest = true; break;
+		default:
+			usage(argv[0]);
+			return c == 'h' ? 0 : 1;
+		}
+	}
+
+	hw.dut = &dut;
+	cmdInit();
+	measurement_setup();
+	if(doSelftest)
+		return selftest();
+
+	usbFd = openPty(linkPath);
+	if(usbFd < 0)
+		return 1;
+	fcntl(usbFd, F_SETFL, fcntl(usbFd, F_GETFL) | O_NONBLOCK);
+	clock_gettime(CLOCK_MONOTONIC, &startTime);
+
+	while(true) {
+		uint8_t buf[256];
+		int n = read(usbFd, buf, sizeof(buf));
+		if(n > 0)
+			cmdParser.handleInput(buf, n);
+		simulateBlock();
+		publishMeasurementStats();
+		sequencerProcess();
+	}
+}
@@ -1,56 +1,54 @@
 #ifndef SPI_CONFIG_H
 #define SPI_CONFIG_H
 
-// Define the board revision you are working with, if not already globally defined
-// This might influence some low-level configurations.
-// For board_v2_plus4, BOARD_REVISION is typically 4 or higher.
-// Ensure this aligns with your project's definitions.
-#ifndef BOARD_REVISION
-#define BOARD_REVISION 4
-#endif
-
-// Fixed Measurement Parameters (Adjust these values as needed)
+// Default Measurement Parameters, used until the master writes the sweep registers
 #define SPI_SLAVE_START_FREQ     50000UL    // Example: 50 kHz
 #define SPI_SLAVE_STOP_FREQ      900000000UL // Example: 900 MHz
 #define SPI_SLAVE_NUM_POINTS     201         // Must be <= SWEEP_POINTS_MAX from your build flags
 #define SPI_SLAVE_AVERAGE_N      1           // Example: 1 average
 
-// SPI Commands (Master to Slave)
-#define CMD_TRIGGER_SWEEP   0xA0 // Trigger VNA measurement
-#define CMD_REQUEST_DATA    0xB0 // Request VNA data
-#define CMD_REQUEST_STATUS  0xC0 // Request VNA status (optional)
+// SPI commands (Master to Slave) are the command set of command_parser.hpp;
+// see the register map in spi_slave.cpp.
 
-// VNA Status Codes (Slave to Master, in response to CMD_REQUEST_STATUS)
-#define STATUS_IDLE         0x01 // VNA is idle, ready for trigger
-#define STATUS_MEASURING    0x02 // VNA is currently measuring
-#define STATUS_DATA_READY   0x03 // VNA measurement complete, data is ready
+// VNA Status Codes (Slave to Master, status register 0x45)
+#define STATUS_IDLE         0x01 // No sweep is being buffered
+#define STATUS_MEASURING    0x02 // Buffering the first sweep since the start
+#define STATUS_DATA_READY   0x03 // A completed sweep can be read
 #define STATUS_BUSY         0x04 // VNA is busy with other SPI transaction
 #define STATUS_ERROR        0xFE // VNA error
 
 // SPI Data Buffers
 // Max points defined by your build command (EXTRA_CFLAGS="-DSWEEP_POINTS_MAX=201")
-#define MAX_SWEEP_POINTS SPI_SLAVE_NUM_POINTS
+#define MAX_SWEEP_POINTS SWEEP_POINTS_MAX
 
-// Data structure for one measurement point
-// Frequency (4 bytes) + S11_real (4) + S11_imag (4) + S21_real (4) + S21_imag (4) = 20 bytes
-typedef struct {
-    float frequency;
+// Compact record of one measurement point, 18 bytes. The frequency follows
+// from the index: sweepStartHz + index * sweepStepHz.
+typedef struct __attribute__((packed)) {
+    uint16_t index;
     float s11_real;
     float s11_imag;
     float s21_real;
     float s21_imag;
 } VNADataPoint_t;
 
-// Size of the SPI command receive buffer
-#define SPI_CMD_RX_BUFFER_SIZE 8
-
-// Size of the SPI data transmit buffer (for one chunk of data)
-// This should be a multiple of VNADataPoint_t size and manageable for SPI transaction
-// For example, if SPI FIFO is small, send a few points at a time.
-// Let's define it to hold a certain number of points or a fixed byte size.
-// For now, let's make it large enough for a few data points.
-// Max data for 201 points is 201 * 20 bytes = 4020 bytes.
-// SPI TX buffer for individual transactions. Master will request data multiple times if needed.
-#define SPI_DATA_TX_CHUNK_SIZE (10 * sizeof(VNADataPoint_t)) // Send 10 points per chunk (200 bytes)
+// Header in front of the sweep data read from the sweep FIFO (0x31)
+#define SPI_SWEEP_MAGIC 0x5357 // "WS"
+typedef struct {
+    uint16_t magic;     // SPI_SWEEP_MAGIC
+    uint16_t sequence;  // incremented for every completed sweep
+    uint16_t points;    // data points following the header
+    uint16_t reserved;
+    uint32_t crc;       // crc32() (see crc32.hpp) of the data points
+} SpiSweepHeader_t;
+
+// One complete sweep as it is clocked out by the master
+typedef struct {
+    SpiSweepHeader_t header;
+    VNADataPoint_t points[MAX_SWEEP_POINTS];
+} SpiSweepBuffer_t;
+
+// Size of the SPI command receive ring, filled by the RX DMA
+// Must be a power of 2.
+#define SPI_CMD_RX_BUFFER_SIZE 64
 
 #endif // SPI_CONFIG_H
@@ -1,261 +1,364 @@
 #include "spi_slave.hpp"
-#include "board.hpp" // For board specific pin definitions if needed (SPI pins are usually in board.hpp)
-#include <libopencm3/gd32/f3/rcc.h> // Adjust for your specific GD32 series if f3 is not correct
-#include <libopencm3/gd32/f3/gpio.h>
-#include <libopencm3/gd32/f3/spi.h>
-#include <libopencm3/cm3/nvic.h>
-#include <cstring> // For memcpy
+#include <board.hpp>
+#include "crc32.hpp"
+#include "command_parser.hpp"
+#include <libopencm3/stm32/rcc.h>
+#include <libopencm3/stm32/gpio.h>
+#include <libopencm3/stm32/spi.h>
+#include <libopencm3/stm32/dma.h>
+#include <string.h> // For memcpy
+
+using namespace board;
+
+// SPI peripheral to be used; remapped to the display connector by boardInit()
+#define VNA_SPI_PERIPH SPI1
+
+// SPI1 requests are hard-wired to these DMA1 channels
+#define SPI_RX_DMA_CHANNEL DMA_CHANNEL2
+#define SPI_TX_DMA_CHANNEL DMA_CHANNEL3
 
 // Global buffers and flags defined in hpp
-VNADataPoint_t spiVnaDataBuffer[MAX_SWEEP_POINTS];
+SpiSweepBuffer_t spiSweepBuffers[2];
+volatile uint8_t spiFillBufferIndex = 0;
 volatile uint16_t spiVnaDataBufferCount = 0;
 volatile bool spiDataReadyFlag = false;
 volatile bool spiMeasurementInProgressFlag = false;
 
-// Internal buffers for SPI communication
+/*
+SPI protocol: the master sends the commands of command_parser.hpp, and
+clocks out the response of a read command in a following transaction,
+sending 0x00 (nop) meanwhile. Commands are processed by spi_slave_poll()
+in the main loop, so wait between a command and reading its response; a
+sweep read starts with SPI_SWEEP_MAGIC, which tells whether it was ready.
+Only the response to the last read command is sent. Commands are lost if
+the master clocks more than SPI_CMD_RX_BUFFER_SIZE bytes after them before
+they are processed.
+
+registers map (as the usb register map where they overlap):
+-- 00: sweepStartHz (8 bytes)
+-- 10: sweepStepHz (8 bytes)
+-- 20: sweepPoints (2 bytes)
+-- 30: point FIFO; 18 30 NN reads NN point records (VNADataPoint_t) of the
+--     last completed sweep, starting at the read index, and advances the
+--     read index. NN = 0 reads all remaining points.
+-- 31: sweep FIFO; 18 31 00 reads the sweep header (SpiSweepHeader_t)
+--     followed by all points of the last completed sweep.
+-- 40: average, values averaged per point
+-- 42: adf4350 power (0 - 3)
+-- 44: control: write 1 to start sweeping with the settings of 00 - 42.
+--     Completed sweeps with the previous settings are no longer read; the
+--     status is STATUS_MEASURING until the first new sweep completes.
+--     The settings of spi_config.h are started at boot.
+-- 45: status (read only), see STATUS_* in spi_config.h
+-- 46: sequence number of the last completed sweep (2 bytes, read only)
+-- 48: points of the last completed sweep (2 bytes, read only)
+-- 4a: read index (2 bytes). Writing it starts reading the last completed
+--     sweep through the point FIFO; that sweep is kept until the read index
+--     reaches its end or sweepPoints or more is written.
+*/
+
+// Command ring, written by the circular RX DMA. Every byte the master
+// clocks in ends up here, including the nops sent while reading data.
 static volatile uint8_t spi_rx_cmd_buffer[SPI_CMD_RX_BUFFER_SIZE];
-static volatile uint8_t spi_rx_cmd_buffer_idx = 0;
-
-// Transmit buffer for SPI ISR. Data is copied here before master clocks it out.
-static uint8_t spi_tx_chunk_buffer[SPI_DATA_TX_CHUNK_SIZE];
-static volatile uint16_t spi_tx_chunk_buffer_len = 0;
-static volatile uint16_t spi_tx_chunk_buffer_idx = 0;
+static uint16_t spi_rx_cmd_buffer_idx = 0; // next byte to process
 
-// Current data point index for multi-chunk transmission
-static uint16_t current_tx_data_point_index = 0;
+static CommandParser spiCmdParser;
+static uint8_t spiRegisters[128] __attribute__((aligned(8)));
 
+// Register and status responses, clocked out by the TX DMA
+static uint8_t spi_tx_buffer[16];
 
-void spi_slave_init(void) {
-    // Enable SPI1 clock and GPIOA clock (assuming SPI1 pins are on GPIOA)
-    rcc_periph_clock_enable(RCC_SPI1);
-    rcc_periph_clock_enable(RCC_GPIOA); // Or the specific GPIO port clock for your SPI pins
-
-    // Configure SPI1 pins: SCK, MISO, MOSI, NSS
-    // PA5: SPI1_SCK, PA6: SPI1_MISO, PA7: SPI1_MOSI, PA4: SPI1_NSS (lcd_cs_pin)
-
-    // GPIO setup for SPI1
-    // NSS (PA4) - Input, floating or pull-up/down depending on master
-    gpio_mode_setup(GPIOA, GPIO_MODE_AF, GPIO_PUPD_NONE, GPIO4 | GPIO5 | GPIO6 | GPIO7);
-    gpio_set_af(GPIOA, GPIO_AF0, GPIO4 | GPIO5 | GPIO6 | GPIO7); // For GD32F303, SPI1 AF is usually AF0 or AF5. Check datasheet.
-                                                                // Assuming AF0 for now, common for SPI1 on PA4-7.
-                                                                // For GD32F30x, it's often GPIO_AF_5 for SPI1 on PA4-7. Please double check.
-                                                                // Let's assume board.hpp handles this or we use direct libopencm3 calls.
-
-    // From board_v2_plus4.hpp:
-    // static const int SPI1_CLK_PIN = GPIO5;  // PA5
-    // static const int SPI1_MISO_PIN = GPIO6; // PA6
-    // static const int SPI1_MOSI_PIN = GPIO7; // PA7
-    // static const int lcd_cs_pin = GPIO4;    // PA4 (Used as NSS)
-
-    // Reset SPI1 peripheral
-    spi_reset(VNA_SPI_PERIPH);
+// Sequence number of the next completed sweep
+static uint16_t spi_sweep_sequence = 0;
 
-    // Initialize SPI1 in slave mode
-    spi_set_slave_mode(VNA_SPI_PERIPH);
-    spi_set_direction_2_lines_full_duplex(VNA_SPI_PERIPH); // Full duplex
-    spi_set_data_size(VNA_SPI_PERIPH, SPI_CR2_DS_8BIT);   // 8-bit data
-    
-    // SPI Mode 1: CPOL=0, CPHA=1
-    spi_set_clock_polarity_0(VNA_SPI_PERIPH); // CPOL = 0
-    spi_set_clock_phase_1(VNA_SPI_PERIPH);    // CPHA = 1
+// A sweep completed while the master was reading the other buffer; the
+// buffers are swapped once the read finishes.
+static volatile bool spi_swap_pending = false;
 
-    spi_set_nss_hard(VNA_SPI_PERIPH); // Use hardware NSS pin. Slave select is controlled by master.
-                                      // If NSS is software, use spi_set_nss_soft and spi_enable_ss_output/spi_disable_ss_output.
-                                      // For slave mode with hardware NSS, this is usually correct.
+// The master is reading the last completed sweep through the point FIFO
+static bool spi_point_read_active = false;
 
-    // Baudrate prescaler is not set by slave, it follows master's clock.
-    // spi_set_baudrate_prescaler(VNA_SPI_PERIPH, SPI_CR1_BR_FPCLK_DIV_4); // Not needed for slave
+volatile bool spiSweepChangedFlag = false;
 
-    spi_set_dff_8bit(VNA_SPI_PERIPH); // Data frame format 8-bit
-    
-    spi_enable_rx_buffer_not_empty_interrupt(VNA_SPI_PERIPH);
-    // spi_enable_tx_buffer_empty_interrupt(VNA_SPI_PERIPH); // Enable TXE interrupt when we have data to send
+static uint16_t& reg_readIndex = *(uint16_t*) &spiRegisters[0x4a];
 
-    // Enable SPI1 interrupt in NVIC
-    nvic_enable_irq(NVIC_SPI1_IRQ);
-    nvic_set_priority(NVIC_SPI1_IRQ, 1); // Set appropriate priority
+// Start a TX DMA transfer of len bytes; the master clocks them out.
+static void spi_tx_dma_start(const void* data, uint16_t len) {
+    dma_disable_channel(DMA1, SPI_TX_DMA_CHANNEL);
+    dma_set_memory_address(DMA1, SPI_TX_DMA_CHANNEL, (uintptr_t) data);
+    dma_set_number_of_data(DMA1, SPI_TX_DMA_CHANNEL, len);
+    dma_enable_channel(DMA1, SPI_TX_DMA_CHANNEL);
+}
 
-    // Enable SPI1 peripheral
-    spi_enable(VNA_SPI_PERIPH);
+// True while the master has not yet clocked out sweep data
+static bool spi_tx_dma_reading_sweep(void) {
+    uintptr_t addr = DMA1_CMAR(SPI_TX_DMA_CHANNEL);
+    return (DMA1_CCR(SPI_TX_DMA_CHANNEL) & DMA_CCR_EN)
+        && DMA1_CNDTR(SPI_TX_DMA_CHANNEL) != 0
+        && addr != (uintptr_t) spi_tx_buffer;
+}
 
-    // Initialize flags and buffers
-    spiDataReadyFlag = false;
-    spiMeasurementInProgressFlag = false;
+// Buffers and flags are only used from the main loop; the DMA only sees the
+// addresses handed to spi_tx_dma_start.
+static void spi_swap_buffers(void) {
+    spiFillBufferIndex ^= 1;
     spiVnaDataBufferCount = 0;
-    spi_rx_cmd_buffer_idx = 0;
-    spi_tx_chunk_buffer_len = 0;
-    spi_tx_chunk_buffer_idx = 0;
-    current_tx_data_point_index = 0;
+    spi_swap_pending = false;
+    spiDataReadyFlag = true;
 
-    // Prepare a default byte to send if master clocks when slave has nothing (e.g. status idle)
-    // SPI_DR(VNA_SPI_PERIPH) = STATUS_IDLE; // Or 0xFF
+    const SpiSweepHeader_t& hdr = spiSweepBuffers[spiFillBufferIndex ^ 1].header;
+    *(uint16_t*) &spiRegisters[0x46] = hdr.sequence;
+    *(uint16_t*) &spiRegisters[0x48] = hdr.points;
 }
 
-// SPI1 Interrupt Service Routine
-void spi1_isr(void) {
-    // Check for RXNE (Receive Buffer Not Empty)
-    if (spi_is_rx_nonempty(VNA_SPI_PERIPH)) {
-        uint8_t received_byte = spi_read(VNA_SPI_PERIPH);
+// The last completed sweep can't be replaced while the master reads it
+static bool spi_reading_sweep(void) {
+    return spi_point_read_active || spi_tx_dma_reading_sweep();
+}
 
-        // Store received byte in command buffer (simple 1-byte command for now)
-        if (spi_rx_cmd_buffer_idx < SPI_CMD_RX_BUFFER_SIZE) {
-            spi_rx_cmd_buffer[spi_rx_cmd_buffer_idx++] = received_byte;
+static void spi_read_fifo(int address, int nValues) {
+    const SpiSweepBuffer_t& buf = spiSweepBuffers[spiFillBufferIndex ^ 1];
+    uint16_t points = spiDataReadyFlag ? buf.header.points : 0;
+    if (address == 0x31) {
+        if (!spiDataReadyFlag) {
+            // No sweep since the start; a header without points
+            SpiSweepHeader_t hdr = {SPI_SWEEP_MAGIC, *(uint16_t*) &spiRegisters[0x46], 0, 0, CRC32_INIT};
+            memcpy(spi_tx_buffer, &hdr, sizeof(hdr));
+            spi_tx_dma_start(spi_tx_buffer, sizeof(hdr));
+            return;
         }
-        // For single byte commands, process immediately or signal main loop
-        // For this design, we'll let the main loop poll and process
-        // spi_process_command(received_byte); // Or queue it
+        // Header and all points of the last completed sweep, in one transfer
+        spi_tx_dma_start(&buf, sizeof(SpiSweepHeader_t) + points * sizeof(VNADataPoint_t));
+        return;
     }
-
-    // Check for TXE (Transmit Buffer Empty) - master is clocking out data
-    if (spi_is_tx_empty(VNA_SPI_PERIPH)) {
-        if (spi_tx_chunk_buffer_idx < spi_tx_chunk_buffer_len) {
-            spi_write(VNA_SPI_PERIPH, spi_tx_chunk_buffer[spi_tx_chunk_buffer_idx++]);
-        } else {
-            // All data in the current chunk sent. Master might send dummy byte to get this.
-            spi_write(VNA_SPI_PERIPH, 0xFF); // Send dummy byte if no more data in chunk
-            // Disable TXE interrupt if no more data to send overall, or wait for next CMD_REQUEST_DATA
-            // spi_disable_tx_buffer_empty_interrupt(VNA_SPI_PERIPH);
+    if (address == 0x30) {
+        // The records are contiguous in the sweep buffer; send them in place
+        uint16_t index = reg_readIndex < points ? reg_readIndex : points;
+        uint16_t n = points - index;
+        if (nValues != 0 && nValues < n) {
+            n = nValues;
+        }
+        spi_tx_dma_start(&buf.points[index], n * sizeof(VNADataPoint_t));
+        reg_readIndex = index + n;
+        if (reg_readIndex >= points) {
+            spi_point_read_active = false;
         }
-    }
-
-    // Check for OVR (Overrun Error)
-    if (spi_get_flag(VNA_SPI_PERIPH, SPI_SR_OVR)) {
-        // Clear overrun error: read DR then SR (or specific sequence for GD32)
-        (void)SPI_DR(VNA_SPI_PERIPH);
-        (void)SPI_SR(VNA_SPI_PERIPH);
-        // Handle overrun error (e.g., log, reset state)
     }
 }
 
-void spi_process_command(uint8_t cmd) {
-    // This function is called from the main loop poll
-    switch (cmd) {
-        case CMD_TRIGGER_SWEEP:
-            if (!spiMeasurementInProgressFlag) {
+static void spi_register_write(int address) {
+    switch (address) {
+        case 0x44:
+            if (spiRegisters[0x44] == 1) {
+                // Sweeps with the previous settings, also one waiting for
+                // its swap, are not published; a read in progress is ended
+                spiDataReadyFlag = false;
+                spi_swap_pending = false;
+                spi_point_read_active = false;
                 spi_slave_notify_measurement_start();
-                // The actual sweep start will be handled in main2.cpp's logic
-                // triggered by spiMeasurementInProgressFlag.
-                // For now, just set the flag. The main loop will see this.
-            } else {
-                // Optionally, send a busy status if master tries to trigger while measuring
-            }
-            break;
-
-        case CMD_REQUEST_DATA:
-            spi_prepare_data_for_tx();
-            break;
-
-        case CMD_REQUEST_STATUS:
-            {
-                uint8_t status = spi_get_status();
-                // Prepare status byte for transmission.
-                // This is tricky with slave SPI. Master clocks out data.
-                // One way: ISR loads this into SPI_DR if TXE and no other data.
-                // Another way: master sends a dummy byte, slave responds with status.
-                // For now, assume master sends CMD_REQUEST_STATUS, then clocks out 1 byte for status.
-                spi_tx_chunk_buffer[0] = status;
-                spi_tx_chunk_buffer_len = 1;
-                spi_tx_chunk_buffer_idx = 0;
-                // spi_enable_tx_buffer_empty_interrupt(VNA_SPI_PERIPH); // Enable TXE to send it
+                // The main loop applies the settings, see spi_slave_get_sweep
+                spiSweepChangedFlag = true;
             }
             break;
 
-        default:
-            // Unknown command
+        case 0x4a:
+            spi_point_read_active = spiDataReadyFlag
+                && reg_readIndex < spiSweepBuffers[spiFillBufferIndex ^ 1].header.points;
             break;
     }
 }
 
+static void spi_parser_init(void) {
+    // Defaults from spi_config.h
+    *(uint64_t*) &spiRegisters[0x00] = SPI_SLAVE_START_FREQ;
+    *(uint64_t*) &spiRegisters[0x10] = (SPI_SLAVE_STOP_FREQ - SPI_SLAVE_START_FREQ) / (SPI_SLAVE_NUM_POINTS - 1);
+    *(uint16_t*) &spiRegisters[0x20] = SPI_SLAVE_NUM_POINTS;
+    spiRegisters[0x40] = SPI_SLAVE_AVERAGE_N;
+    spiRegisters[0x42] = 0;
+    spiRegisters[0x45] = STATUS_IDLE;
+
+    spiCmdParser.handleReadFIFO = [](int address, int nValues) {
+        spi_read_fifo(address, nValues);
+    };
+    spiCmdParser.handleWriteFIFO = [](int address, int totalBytes, int nBytes, const uint8_t* data) {};
+    spiCmdParser.handleWrite = [](int address) {
+        spi_register_write(address);
+    };
+    spiCmdParser.send = [](const uint8_t* s, int len) {
+        if (len > (int) sizeof(spi_tx_buffer)) {
+            len = sizeof(spi_tx_buffer);
+        }
+        memcpy(spi_tx_buffer, s, len);
+        spi_tx_dma_start(spi_tx_buffer, len);
+    };
+    spiCmdParser.registers = spiRegisters;
+    spiCmdParser.registersSizeMask = sizeof(spiRegisters) - 1;
+}
 
-void spi_prepare_data_for_tx(void) {
-    if (spiDataReadyFlag && spiVnaDataBufferCount > 0) {
-        if (current_tx_data_point_index < spiVnaDataBufferCount) {
-            uint16_t points_to_send = 0;
-            uint16_t remaining_points = spiVnaDataBufferCount - current_tx_data_point_index;
-            
-            if (remaining_points * sizeof(VNADataPoint_t) > SPI_DATA_TX_CHUNK_SIZE) {
-                points_to_send = SPI_DATA_TX_CHUNK_SIZE / sizeof(VNADataPoint_t);
-            } else {
-                points_to_send = remaining_points;
-            }
+void spi_slave_init(void) {
+    // The display pins of lcd_spi_init(), with the directions of a slave.
+    // xpt2046_cs stays high, so that a touch controller does not drive MISO.
+    rcc_periph_clock_enable(RCC_SPI1);
+    digitalWrite(xpt2046_cs, HIGH);
+    pinMode(xpt2046_cs, OUTPUT);
+    gpio_set_mode(lcd_clk.bank(), GPIO_MODE_INPUT, GPIO_CNF_INPUT_FLOAT, lcd_clk.mask());
+    gpio_set_mode(lcd_mosi.bank(), GPIO_MODE_INPUT, GPIO_CNF_INPUT_FLOAT, lcd_mosi.mask());
+    gpio_set_mode(ili9341_cs.bank(), GPIO_MODE_INPUT, GPIO_CNF_INPUT_PULL_UPDOWN, ili9341_cs.mask());
+    digitalWrite(ili9341_cs, HIGH); // pull up NSS while no master is connected
+    gpio_set_mode(lcd_miso.bank(), GPIO_MODE_OUTPUT_50_MHZ, GPIO_CNF_OUTPUT_ALTFN_PUSHPULL, lcd_miso.mask());
+
+    /* Reset SPI, SPI_CR1 register cleared, SPI is disabled */
+    spi_reset(VNA_SPI_PERIPH);
 
-            if (points_to_send > 0) {
-                memcpy(spi_tx_chunk_buffer, 
-                       &spiVnaDataBuffer[current_tx_data_point_index], 
-                       points_to_send * sizeof(VNADataPoint_t));
-                spi_tx_chunk_buffer_len = points_to_send * sizeof(VNADataPoint_t);
-                spi_tx_chunk_buffer_idx = 0;
-                current_tx_data_point_index += points_to_send;
-                // spi_enable_tx_buffer_empty_interrupt(VNA_SPI_PERIPH); // Enable TXE to start sending
-            } else { // No more data points to send in this sweep
-                spi_tx_chunk_buffer_len = 0;
-                spi_tx_chunk_buffer_idx = 0;
-                // Optionally send a completion marker or rely on master counting bytes
-            }
-        } else { // All data for the sweep has been sent, reset for next potential request
-            spi_tx_chunk_buffer_len = 0;
-            spi_tx_chunk_buffer_idx = 0;
-            // current_tx_data_point_index = 0; // Reset for a new full data request cycle
-            // spiDataReadyFlag = false; // Or keep it true until a new sweep
-        }
-    } else {
-        // Data not ready or no data
-        spi_tx_chunk_buffer_len = 0;
-        spi_tx_chunk_buffer_idx = 0;
-        // Optionally prepare a "no data" or "not ready" response if master expects something
-    }
+    /* Slave mode with:
+     * Clock polarity: Idle Low, clock phase: data sampled on the 2nd edge (SPI mode 1)
+     * Data frame format: 8-bit, MSB first
+     * Slave select: the NSS pin, driven by the master
+     */
+    spi_set_slave_mode(VNA_SPI_PERIPH);
+    spi_set_full_duplex_mode(VNA_SPI_PERIPH);
+    spi_set_unidirectional_mode(VNA_SPI_PERIPH);
+    spi_set_dff_8bit(VNA_SPI_PERIPH);
+    spi_set_clock_polarity_0(VNA_SPI_PERIPH);
+    spi_set_clock_phase_1(VNA_SPI_PERIPH);
+    spi_send_msb_first(VNA_SPI_PERIPH);
+    spi_disable_software_slave_management(VNA_SPI_PERIPH);
+
+    // RX DMA: circular into the command ring.
+    // TX DMA: armed with a response when a command asks for one.
+    // No SPI interrupt is used, so the DSP interrupt is never delayed by SPI traffic.
+    // Both channels are above the ADC (DMA1 channel 1, low priority): a byte
+    // has to be moved before the master clocks the next one, an ADC sample
+    // has a whole sample period.
+    rcc_periph_clock_enable(RCC_DMA1);
+
+    dma_channel_reset(DMA1, SPI_RX_DMA_CHANNEL);
+    dma_set_peripheral_address(DMA1, SPI_RX_DMA_CHANNEL, (uintptr_t) &SPI_DR(VNA_SPI_PERIPH));
+    dma_set_memory_address(DMA1, SPI_RX_DMA_CHANNEL, (uintptr_t) spi_rx_cmd_buffer);
+    dma_set_number_of_data(DMA1, SPI_RX_DMA_CHANNEL, SPI_CMD_RX_BUFFER_SIZE);
+    dma_set_read_from_peripheral(DMA1, SPI_RX_DMA_CHANNEL);
+    dma_enable_memory_increment_mode(DMA1, SPI_RX_DMA_CHANNEL);
+    dma_set_peripheral_size(DMA1, SPI_RX_DMA_CHANNEL, DMA_CCR_PSIZE_8BIT);
+    dma_set_memory_size(DMA1, SPI_RX_DMA_CHANNEL, DMA_CCR_MSIZE_8BIT);
+    dma_enable_circular_mode(DMA1, SPI_RX_DMA_CHANNEL);
+    dma_set_priority(DMA1, SPI_RX_DMA_CHANNEL, DMA_CCR_PL_VERY_HIGH);
+    dma_enable_channel(DMA1, SPI_RX_DMA_CHANNEL);
+
+    dma_channel_reset(DMA1, SPI_TX_DMA_CHANNEL);
+    dma_set_peripheral_address(DMA1, SPI_TX_DMA_CHANNEL, (uintptr_t) &SPI_DR(VNA_SPI_PERIPH));
+    dma_set_read_from_memory(DMA1, SPI_TX_DMA_CHANNEL);
+    dma_enable_memory_increment_mode(DMA1, SPI_TX_DMA_CHANNEL);
+    dma_set_peripheral_size(DMA1, SPI_TX_DMA_CHANNEL, DMA_CCR_PSIZE_8BIT);
+    dma_set_memory_size(DMA1, SPI_TX_DMA_CHANNEL, DMA_CCR_MSIZE_8BIT);
+    dma_set_priority(DMA1, SPI_TX_DMA_CHANNEL, DMA_CCR_PL_VERY_HIGH);
+
+    spi_enable_rx_dma(VNA_SPI_PERIPH);
+    spi_enable_tx_dma(VNA_SPI_PERIPH);
+
+    // Enable SPI1 peripheral
+    spi_enable(VNA_SPI_PERIPH);
+
+    // Initialize flags and buffers
+    spiDataReadyFlag = false;
+    spiMeasurementInProgressFlag = false;
+    spiFillBufferIndex = 0;
+    spiVnaDataBufferCount = 0;
+    spi_rx_cmd_buffer_idx = 0;
+    spi_swap_pending = false;
+    spi_point_read_active = false;
+    spi_parser_init();
+    // Start the default sweep
+    spiSweepChangedFlag = true;
 }
 
+void spi_slave_get_sweep(SpiSweepConfig_t& cfg) {
+    spiSweepChangedFlag = false;
+    cfg.startHz = (freqHz_t) *(uint64_t*) &spiRegisters[0x00];
+    cfg.stepHz = (freqHz_t) *(uint64_t*) &spiRegisters[0x10];
+    cfg.points = *(uint16_t*) &spiRegisters[0x20];
+    if (cfg.points < 1) cfg.points = 1;
+    if (cfg.points > MAX_SWEEP_POINTS) cfg.points = MAX_SWEEP_POINTS;
+    cfg.average = spiRegisters[0x40] ? spiRegisters[0x40] : 1;
+    cfg.power = spiRegisters[0x42] > 3 ? 3 : spiRegisters[0x42];
+}
 
 uint8_t spi_get_status(void) {
-    if (spiMeasurementInProgressFlag) {
-        return STATUS_MEASURING;
-    }
+    // Sweeps run continuously; 46 tells the master whether a sweep is new
     if (spiDataReadyFlag) {
         return STATUS_DATA_READY;
     }
-    // Could add STATUS_BUSY if a SPI transaction is active in ISR
+    if (spiMeasurementInProgressFlag) {
+        return STATUS_MEASURING;
+    }
     return STATUS_IDLE;
 }
 
 void spi_slave_poll(void) {
-    // Check if any command byte has been received by ISR
-    if (spi_rx_cmd_buffer_idx > 0) {
-        // For now, assume single-byte commands.
-        // A more robust system might use a ring buffer for commands.
-        uint8_t cmd = spi_rx_cmd_buffer[0]; // Get the first command byte
-        
-        // Critical section if modifying shared command buffer
-        __disable_irq();
-        // Shift buffer or reset index (simple reset for single byte command)
-        spi_rx_cmd_buffer_idx = 0; 
-        __enable_irq();
-
-        spi_process_command(cmd);
+    // A sweep completed while the master was reading; swap once it is done
+    if (spi_swap_pending && !spi_reading_sweep()) {
+        spi_swap_buffers();
+    }
+
+    spiRegisters[0x45] = spi_get_status();
+
+    // Pass the bytes the RX DMA wrote since the last poll to the parser,
+    // in up to two pieces when the ring wrapped around
+    uint16_t end = (SPI_CMD_RX_BUFFER_SIZE - DMA1_CNDTR(SPI_RX_DMA_CHANNEL)) & (SPI_CMD_RX_BUFFER_SIZE - 1);
+    while (spi_rx_cmd_buffer_idx != end) {
+        uint16_t stop = end > spi_rx_cmd_buffer_idx ? end : SPI_CMD_RX_BUFFER_SIZE;
+        spiCmdParser.handleInput((const uint8_t*) &spi_rx_cmd_buffer[spi_rx_cmd_buffer_idx],
+                                 stop - spi_rx_cmd_buffer_idx);
+        spi_rx_cmd_buffer_idx = stop & (SPI_CMD_RX_BUFFER_SIZE - 1);
     }
 }
 
+// Discards the sweep being buffered; the next sweep is buffered from index 0
 void spi_slave_notify_measurement_start(void) {
     spiMeasurementInProgressFlag = true;
-    spiDataReadyFlag = false;
     spiVnaDataBufferCount = 0;
-    current_tx_data_point_index = 0; // Reset for new data set
 }
 
 void spi_slave_notify_measurement_complete(void) {
+    // Only a sweep buffered from its first point is complete
+    if (spi_swap_pending || !spiMeasurementInProgressFlag || spiVnaDataBufferCount == 0) {
+        spiVnaDataBufferCount = 0;
+        return;
+    }
     spiMeasurementInProgressFlag = false;
-    spiDataReadyFlag = true;
-    // spiVnaDataBufferCount should be set by spi_slave_buffer_data_point
+    // Complete the header of the fill buffer, then make it the read buffer
+    SpiSweepBuffer_t& buf = spiSweepBuffers[spiFillBufferIndex];
+    buf.header.magic = SPI_SWEEP_MAGIC;
+    buf.header.sequence = spi_sweep_sequence++;
+    buf.header.points = spiVnaDataBufferCount;
+    buf.header.reserved = 0;
+    buf.header.crc = crc32(buf.points, spiVnaDataBufferCount * sizeof(VNADataPoint_t));
+
+    if (spi_reading_sweep()) {
+        // The master is reading the other buffer; keep it intact until it is done
+        spi_swap_pending = true;
+        return;
+    }
+    spi_swap_buffers();
 }
 
-void spi_slave_buffer_data_point(uint32_t freq_hz, complexf s11, complexf s21) {
-    if (spiVnaDataBufferCount < MAX_SWEEP_POINTS) {
-        spiVnaDataBuffer[spiVnaDataBufferCount].frequency = (float)freq_hz;
-        spiVnaDataBuffer[spiVnaDataBufferCount].s11_real = s11.real;
-        spiVnaDataBuffer[spiVnaDataBufferCount].s11_imag = s11.imag;
-        spiVnaDataBuffer[spiVnaDataBufferCount].s21_real = s21.real;
-        spiVnaDataBuffer[spiVnaDataBufferCount].s21_imag = s21.imag;
-        spiVnaDataBufferCount++;
+void spi_slave_buffer_data_point(uint16_t index, complexf s11, complexf s21) {
+    // While a swap is pending both buffers are in use and the point is dropped
+    if (spi_swap_pending) {
+        return;
     }
+    if (index == 0) {
+        spi_slave_notify_measurement_start();
+    }
+    // A point was lost or the sweep restarted; wait for the next sweep
+    if (index != spiVnaDataBufferCount || index >= MAX_SWEEP_POINTS) {
+        spiVnaDataBufferCount = 0;
+        return;
+    }
+    VNADataPoint_t& p = spiSweepBuffers[spiFillBufferIndex].points[spiVnaDataBufferCount];
+    p.index = index;
+    p.s11_real = s11.real();
+    p.s11_imag = s11.imag();
+    p.s21_real = s21.real();
+    p.s21_imag = s21.imag();
+    spiVnaDataBufferCount++;
 }
-
@@ -1,31 +1,43 @@
 #ifndef SPI_SLAVE_HPP
 #define SPI_SLAVE_HPP
 
-#include <libopencm3/cm3/nvic.h>
-#include <libopencm3/gd32/f3/spi.h> // Adjust path if different for your libopencm3 setup
 #include "common.hpp" // For complexf
 #include "spi_config.h" // For definitions
 
-// SPI peripheral to be used (SPI1)
-#define VNA_SPI_PERIPH SPI1
-
-// Maximum number of data points to buffer for transmission
-// This buffer holds the entire sweep data
-extern VNADataPoint_t spiVnaDataBuffer[MAX_SWEEP_POINTS];
-extern volatile uint16_t spiVnaDataBufferCount; // Number of valid data points in spiVnaDataBuffer
+// SPI slave interface of headless builds (make SPI_SLAVE=1, which defines
+// SPI_SLAVE_INTERFACE). It uses SPI1 on the display connector: SCK PB3,
+// MISO PB4, MOSI PB5 and NSS PA15 (the display chip select), so the
+// display must not be fitted. SPI1 and its DMA channel 3 are then used by
+// this interface instead of the display.
+
+// Sweep data is double buffered: spi_slave_buffer_data_point fills one
+// buffer while the master reads the other one. The buffers are swapped
+// when a sweep completes.
+extern SpiSweepBuffer_t spiSweepBuffers[2];
+extern volatile uint8_t spiFillBufferIndex;    // buffer being filled; the other one is read
+extern volatile uint16_t spiVnaDataBufferCount; // Number of valid data points in the fill buffer
 extern volatile bool spiDataReadyFlag;          // Flag indicating a full sweep data is ready
 extern volatile bool spiMeasurementInProgressFlag; // Flag indicating measurement is ongoing
 
-// Initialize SPI1 in slave mode
+// Initialize SPI1 in slave mode, with RX and TX DMA (DMA1 channels 2 and 3).
+// No interrupts are used.
 void spi_slave_init(void);
 
-// Process received SPI command
-void spi_process_command(uint8_t cmd);
+// Sweep requested by the master through the sweep registers
+typedef struct {
+    freqHz_t startHz;
+    freqHz_t stepHz;
+    uint16_t points;
+    uint16_t average;   // values averaged per point
+    uint8_t power;      // adf4350 power, 0 - 3
+} SpiSweepConfig_t;
+
+// Set when the master started a sweep (and at init); the main loop then
+// applies spi_slave_get_sweep, which clears it, and restarts the sweep
+extern volatile bool spiSweepChangedFlag;
 
-// Prepare data for SPI transmission (called when CMD_REQUEST_DATA is received)
-// This function will load the next chunk of data into the SPI TX FIFO or a temporary TX buffer
-// that the ISR will use.
-void spi_prepare_data_for_tx(void);
+// Sweep settings of the last start; the defaults in spi_config.h until the master changes them
+void spi_slave_get_sweep(SpiSweepConfig_t& cfg);
 
 // Get current VNA status for SPI transmission
 uint8_t spi_get_status(void);
@@ -33,10 +45,12 @@ uint8_t spi_get_status(void);
 // Call this from main loop to handle SPI related tasks that are not in ISR
 void spi_slave_poll(void);
 
-// Functions to be called from measurement routines
+// Functions to be called from measurement routines, in the main loop
+// (measurement complete computes the sweep crc on the shared CRC unit).
+// Points must be passed in sweep order; a sweep is buffered from index 0.
 void spi_slave_notify_measurement_start(void);
 void spi_slave_notify_measurement_complete(void);
-void spi_slave_buffer_data_point(uint32_t freq_hz, complexf s11, complexf s21);
+void spi_slave_buffer_data_point(uint16_t index, complexf s11, complexf s21);
 
 
 #endif // SPI_SLAVE_HPP
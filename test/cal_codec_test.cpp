@@ -0,0 +1,138 @@
+// round trip of the cal data encoding (cal_codec.cpp); see test/Makefile
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <random>
+#include <vector>
+#include "../cal_codec.hpp"
+
+static std::mt19937 rng(1);
+
+static float uniform(float a, float b) {
+	return std::uniform_real_distribution<float>(a, b)(rng);
+}
+
+static int fails = 0;
+
+// kinds of cal data
+enum {
+	SMOOTH,			// a reflection or transmission term over a wide sweep
+	NOISY,			// a term of a few points with measurement noise
+	STEP,			// a discontinuity, e.g. a band switch
+	CONSTANT,		// an unused term
+	TINY,			// isolation, close to the noise floor
+	LARGE,			// out of the normal range; must not overflow the residuals
+	KINDS
+};
+static const char* kindNames[KINDS] = {"smooth", "noisy", "step", "constant", "tiny", "large"};
+
+static void generate(int kind, complexf* v, int n) {
+	float amplitude = uniform(0.01f, 2.f);
+	float phase = uniform(0.f, 6.f);
+	float rate = uniform(0.f, 0.3f);
+	for(int i = 0; i < n; i++) {
+		complexf x = std::polar(amplitude / (1 + i * 0.01f), phase + i * rate);
+		switch(kind) {
+		case NOISY:
+			x += complexf(uniform(-1e-2f, 1e-2f), uniform(-1e-2f, 1e-2f));
+			break;
+		case STEP:
+			if(i >= n / 2)
+				x += complexf(1.f, -1.f);
+			break;
+		case CONSTANT:
+			x = complexf(0.5f, -0.25f);
+			break;
+		case TINY:
+			x *= 1e-6f;
+			break;
+		case LARGE:
+			x *= 1e30f;
+			break;
+		}
+		v[i] = x;
+	}
+}
+
+// largest difference from the previous value, or from the linear extrapolation
+// of the previous two, whichever is smaller; the encoder picks the better one
+static float residualBound(const complexf* v, int n, int c) {
+	float r[2] = {0, 0};
+	for(int k = 1; k < n; k++) {
+		float x = c ? v[k].imag() : v[k].real();
+		float p1 = c ? v[k-1].imag() : v[k-1].real();
+		float p2 = k >= 2 ? (c ? v[k-2].imag() : v[k-2].real()) : p1;
+		r[0] = fmaxf(r[0], fabsf(x - p1));
+		r[1] = fmaxf(r[1], fabsf(x - (k >= 2 ? 2*p1 - p2 : p1)));
+	}
+	return fminf(r[0], r[1]);
+}
+
+// encode a sweep of all cal entries the way flash_caldata_save() does, then
+// decode it the way cal_interpolate() does
+static void roundTrip(int kind, int points) {
+	static complexf original[CAL_ENTRIES][SWEEP_POINTS_MAX];
+	static complexf values[CAL_ENTRIES][SWEEP_POINTS_MAX];
+	std::vector<uint8_t> encoded(cal_encoded_bytes(points) + CAL_SEGMENT_BYTES_MAX);
+	for(int eterm = 0; eterm < CAL_ENTRIES; eterm++)
+		generate(kind, original[eterm], points);
+	memcpy(values, original, sizeof(values));
+
+	float maxError = 0;
+	float bound = 0;
+	uint32_t bytes = 0;
+	for(int i = 0; i < points; i += CAL_BLOCK_POINTS) {
+		int n = std::min(points - i, CAL_BLOCK_POINTS);
+		for(int eterm = 0; eterm < CAL_ENTRIES; eterm++) {
+			for(int c = 0; c < 2; c++)
+				bound = fmaxf(bound, residualBound(&original[eterm][i], n, c));
+			bytes += cal_encode_segment(&values[eterm][i], n, encoded.data() + bytes, maxError);
+		}
+	}
+
+	const char* error = nullptr;
+	float worst = 0;
+	if(bytes != cal_encoded_bytes(points))
+		error = "encoded size differs from cal_encoded_bytes()";
+
+	cal_decoder dec;
+	dec.begin(encoded.data(), points);
+	for(int i = 0; i < points && !error; i++) {
+		complexf v[CAL_ENTRIES];
+		dec.next(v);
+		for(int eterm = 0; eterm < CAL_ENTRIES; eterm++) {
+			// the encoder replaces the values with exactly what the decoder produces
+			if(memcmp(&v[eterm], &values[eterm][i], sizeof(complexf)) != 0)
+				error = "decoded value differs from the encoder's";
+			complexf d = v[eterm] - original[eterm][i];
+			worst = fmaxf(worst, fmaxf(fabsf(d.real()), fabsf(d.imag())));
+		}
+	}
+	// the error is at most half of the scale, which is chosen from the residuals;
+	// closed loop residuals may need one more power of two
+	if(!error && worst != maxError)
+		error = "reported error differs from the actual error";
+	if(!error && maxError > 2 * bound / 32767.f * 1.0001f)
+		error = "error exceeds the bound given by the residuals";
+	if(error) {
+		printf("  FAIL %s, %d points: %s (error %g, residual bound %g)\n",
+			kindNames[kind], points, error, worst, bound);
+		fails++;
+	}
+}
+
+int main() {
+	printf("cal data encoding:\n");
+	for(int kind = 0; kind < KINDS; kind++) {
+		int before = fails;
+		for(int points = 1; points <= SWEEP_POINTS_MAX; points++)
+			for(int rep = 0; rep < 4; rep++)
+				roundTrip(kind, points);
+		printf("  %-10s 1 - %d points %s\n", kindNames[kind], SWEEP_POINTS_MAX,
+			fails == before ? "ok" : "FAIL");
+	}
+	printf("  %d points take %u bytes instead of %u\n", SWEEP_POINTS_MAX,
+		cal_encoded_bytes(SWEEP_POINTS_MAX), uint32_t(CAL_ENTRIES * SWEEP_POINTS_MAX * sizeof(complexf)));
+	return fails == 0 ? 0 : 1;
+}
@@ -0,0 +1,112 @@
+// crc32() against a bitwise CRC-32/MPEG-2; see test/Makefile
+//
+// Built twice: crc32_test uses the table of the host build, crc32_unit_test
+// (STM32F1 defined) the word path of the device, fed to a simulated crc unit.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <random>
+#include <vector>
+#include "../crc32.hpp"
+
+// the definition: one bit at a time, most significant bit first
+static uint32_t crcReference(const uint8_t* data, size_t len, uint32_t crc = 0xffffffff) {
+	for(size_t i = 0; i < len; i++) {
+		crc ^= uint32_t(data[i]) << 24;
+		for(int j = 0; j < 8; j++)
+			crc = (crc & 0x80000000) ? (crc << 1) ^ 0x04c11db7 : crc << 1;
+	}
+	return crc;
+}
+
+#ifdef STM32F1
+#include <libopencm3/stm32/crc.h>
+#include <libopencm3/stm32/rcc.h>
+
+// the crc unit computes the same crc over whole words, with the most
+// significant byte of the word first
+static uint32_t crcUnitValue;
+static bool crcUnitClock;
+crc_data_register CRC_DR;
+
+crc_data_register& crc_data_register::operator=(uint32_t word) {
+	if(!crcUnitClock) {
+		printf("  FAIL crc unit used before its clock was enabled\n");
+		exit(1);
+	}
+	uint8_t b[4] = {uint8_t(word >> 24), uint8_t(word >> 16), uint8_t(word >> 8), uint8_t(word)};
+	crcUnitValue = crcReference(b, 4, crcUnitValue);
+	return *this;
+}
+
+crc_data_register::operator uint32_t() const {
+	return crcUnitValue;
+}
+
+void crc_reset(void) {
+	crcUnitValue = 0xffffffff;
+}
+
+void rcc_periph_clock_enable(rcc_periph_clken clken) {
+	if(clken == RCC_CRC)
+		crcUnitClock = true;
+}
+#define CRC_PATH "crc unit"
+#else
+#define CRC_PATH "table"
+#endif
+
+static int fails = 0;
+
+static void check(const char* name, uint32_t crc, uint32_t expected) {
+	if(crc != expected) {
+		printf("  FAIL %s: %08x, expected %08x\n", name, crc, expected);
+		fails++;
+	}
+}
+
+int main() {
+	printf("crc32 (%s) against the bitwise reference:\n", CRC_PATH);
+
+	// check value of the CRC-32/MPEG-2 catalogue entry
+	check("check value", crc32("123456789", 9), 0x0376e6e7);
+	check("empty", crc32("", 0), CRC32_INIT);
+	check("reference check value", crcReference((const uint8_t*) "123456789", 9), 0x0376e6e7);
+
+	std::mt19937 rng(1);
+	std::vector<uint8_t> buf(4096 + 8);
+	for(auto& b : buf)
+		b = rng();
+
+	// every length up to a few words at every alignment, and a flash page
+	char name[64];
+	for(size_t len = 0; len <= 64; len++) {
+		for(int offset = 0; offset < 4; offset++) {
+			snprintf(name, sizeof(name), "%zu bytes at offset %d", len, offset);
+			check(name, crc32(&buf[offset], len), crcReference(&buf[offset], len));
+		}
+	}
+	check("2048 bytes", crc32(buf.data(), 2048), crcReference(buf.data(), 2048));
+
+	// continuing from a previous crc, as the flash records and screenshots do
+	for(int i = 0; i < 10000; i++) {
+		size_t len = rng() % 4096;
+		size_t split = len ? rng() % len : 0;
+		int offset = rng() % 8;
+		uint32_t crc = crc32(&buf[offset], split);
+		crc = crc32(&buf[offset + split], len - split, crc);
+		snprintf(name, sizeof(name), "%zu bytes split at %zu", len, split);
+		check(name, crc, crcReference(&buf[offset], len));
+		if(fails > 10)
+			break;
+	}
+	// all ones and all zeros words, where a wrong preimage would cancel out
+	uint32_t ones[8], zeros[4];
+	memset(ones, 0xff, sizeof(ones));
+	memset(zeros, 0, sizeof(zeros));
+	check("ones", crc32(ones, 16, crc32(ones, 3)), crcReference((const uint8_t*) ones, 19));
+	check("zeros", crc32(zeros, 16, 0), crcReference((const uint8_t*) zeros, 16, 0));
+
+	printf(fails == 0 ? "  ok\n" : "  FAIL\n");
+	return fails == 0 ? 0 : 1;
+}
@@ -0,0 +1,106 @@
+// accuracy and speed of fastmath.hpp against libm; see test/Makefile
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+#include <random>
+#include <vector>
+#include "../fastmath.hpp"
+
+// maximum errors documented in fastmath.hpp
+static constexpr double log2MaxErr = 2.2e-5;
+static constexpr double atan2MaxErr = 1.2e-5;
+static constexpr double hypotMaxRelErr = 5e-6;
+
+static int fails = 0;
+
+static void check(const char* name, double err, double limit, const char* unit) {
+	bool ok = err <= limit;
+	printf("  %-10s max error %.3g %s (limit %.3g) %s\n", name, err, unit, limit, ok ? "ok" : "FAIL");
+	if(!ok) fails++;
+}
+
+static double seconds() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+int main() {
+	std::mt19937 rng(1);
+	std::uniform_real_distribution<float> uniform(-1.f, 1.f);
+
+	printf("fastmath accuracy against libm:\n");
+
+	// every mantissa step of the top 16 bits, over normal and denormal exponents
+	double errLog2 = 0.;
+	for(int e = -149; e < 128; e += 7) {
+		for(uint32_t m = 0; m < (1 << 16); m++) {
+			float x = ldexpf(1.f + m / 65536.f, e);
+			if(!(x > 0) || isinf(x))
+				continue;
+			errLog2 = fmax(errLog2, fabs(fast_log2(x) - log2((double) x)));
+		}
+	}
+	if(fast_log2(0.f) != -INFINITY || !isnan(fast_log2(-1.f)))
+		errLog2 = INFINITY;
+	check("fast_log2", errLog2, log2MaxErr, "");
+
+	double errAtan2 = 0., errHypot = 0.;
+	for(int i = 0; i < 2000000; i++) {
+		// magnitudes from 1e-6 to 1e6, as seen for S parameters and raw values
+		float scale = powf(10.f, 6.f * uniform(rng));
+		float x = uniform(rng) * scale, y = uniform(rng) * scale;
+		errAtan2 = fmax(errAtan2, fabs(fast_atan2(y, x) - atan2((double) y, (double) x)));
+		double h = hypot((double) x, (double) y);
+		if(h > 0)
+			errHypot = fmax(errHypot, fabs(fast_hypot(x, y) - h) / h);
+	}
+	// axes and quadrant boundaries
+	float edges[][2] = {{0, 1}, {1, 0}, {0, -1}, {-1, 0}, {1, 1}, {-1, 1}, {1, -1}, {-1, -1}};
+	for(auto& p: edges)
+		errAtan2 = fmax(errAtan2, fabs(fast_atan2(p[1], p[0]) - atan2((double) p[1], (double) p[0])));
+	if(fast_atan2(0.f, 0.f) != 0.f || fast_hypot(0.f, 0.f) != 0.f)
+		errAtan2 = INFINITY;
+	check("fast_atan2", errAtan2, atan2MaxErr, "rad");
+	check("fast_hypot", errHypot, hypotMaxRelErr, "relative");
+
+	// batch functions use the same approximations
+	std::complex<float> in[201];
+	float out[201];
+	double errBatch = 0.;
+	for(auto& v: in)
+		v = {uniform(rng), uniform(rng)};
+	fast_logmag_array(in, out, 201);
+	for(int i = 0; i < 201; i++)
+		errBatch = fmax(errBatch, fabs(out[i] - 10. * log10(std::norm(std::complex<double>(in[i])))));
+	check("logmag", errBatch, log2MaxErr * 10. * log10(2.) * 1.01, "dB");
+
+	// speed on the host; only informative, the target has no FPU
+	printf("host speed (ns per call):\n");
+	const int n = 1 << 22;
+	std::vector<float> a(n), b(n);
+	for(int i = 0; i < n; i++) {
+		a[i] = uniform(rng) * 100.f;
+		b[i] = uniform(rng) * 100.f;
+	}
+	volatile float sink = 0;
+	auto bench = [&](const char* name, auto f) {
+		double t0 = seconds();
+		float acc = 0;
+		for(int i = 0; i < n; i++)
+			acc += f(a[i], b[i]);
+		sink = acc;
+		printf("  %-12s %.2f\n", name, (seconds() - t0) * 1e9 / n);
+	};
+	bench("fast_log2", [](float x, float y) { return fast_log2(fabsf(x) + 1.f); });
+	bench("log2f", [](float x, float y) { return log2f(fabsf(x) + 1.f); });
+	bench("fast_atan2", [](float x, float y) { return fast_atan2(y, x); });
+	bench("atan2f", [](float x, float y) { return atan2f(y, x); });
+	bench("fast_hypot", [](float x, float y) { return fast_hypot(x, y); });
+	bench("hypotf", [](float x, float y) { return hypotf(x, y); });
+	(void) sink;
+
+	printf(fails == 0 ? "PASS\n" : "FAIL\n");
+	return fails == 0 ? 0 : 1;
+}
@@ -0,0 +1,300 @@
+// power-fail simulation of the flash record log (flash.cpp); see test/Makefile
+//
+// The user flash is mapped at its target address and programmed through the
+// flash controller of host/libopencm3/stm32/flash.h. Random config, cal data
+// and ui state saves are made to all slots; some of them lose power after a
+// random number of erase and program operations. After every operation, and
+// after a reboot following a power failure, every slot must recall the last
+// completed save, or the interrupted one if it went through.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <random>
+#include <algorithm>
+
+// flash.cpp is included to reset its static log index on a simulated reboot
+#include "../flash.cpp"
+
+static constexpr int iterations = 20000;
+static constexpr int powerFailFrom = 2000;		// fill the log before failing
+
+static std::mt19937 rng(1);
+
+static int random(int n) {
+	return std::uniform_int_distribution<int>(0, n - 1)(rng);
+}
+
+static int fails = 0;
+
+#define CHECK(cond, ...) do { \
+	if(!(cond)) { \
+		printf("  FAIL line %d: ", __LINE__); \
+		printf(__VA_ARGS__); \
+		printf("\n"); \
+		fails++; \
+		return; \
+	} \
+} while(0)
+
+
+// flash controller
+
+uint32_t FLASH_CR, FLASH_AR, FLASH_KEYR;
+
+struct PowerFail {};
+
+static long powerFailIn = -1;	// erase and program operations left before the power fails
+static int pageErases[USERFLASH_PAGES];
+static long wordsProgrammed;
+
+static void flash_operation() {
+	if(powerFailIn >= 0 && powerFailIn-- == 0)
+		throw PowerFail();
+}
+
+uint32_t flash_sim_status(void) {
+	if(FLASH_CR & FLASH_CR_STRT) {
+		FLASH_CR &= ~(FLASH_CR_STRT | FLASH_CR_PER);
+		uint32_t page = FLASH_AR;
+		if(page < USERFLASH_BEGIN || page >= board::USERFLASH_END || page % FLASH_PAGE_SIZE) {
+			printf("erase of 0x%x outside of the user flash\n", page);
+			abort();
+		}
+		uint8_t *p = (uint8_t*)(uintptr_t) page;
+		try {
+			flash_operation();
+		} catch(PowerFail&) {
+			// an interrupted erase leaves part of the page erased and the rest garbage
+			int erased = random(FLASH_PAGE_SIZE);
+			memset(p, 0xff, erased);
+			for(uint32_t i = erased; i < FLASH_PAGE_SIZE; i++)
+				p[i] = random(256);
+			throw;
+		}
+		memset(p, 0xff, FLASH_PAGE_SIZE);
+		pageErases[(page - USERFLASH_BEGIN) / FLASH_PAGE_SIZE]++;
+	}
+	return FLASH_SR_EOP;
+}
+
+void flash_unlock(void) {}
+
+void flash_erase_page(uint32_t page) {
+	FLASH_CR |= FLASH_CR_PER;
+	FLASH_AR = page;
+	FLASH_CR |= FLASH_CR_STRT;
+	flash_sim_status();
+}
+
+uint32_t flash_get_status_flags(void) {
+	return FLASH_SR_EOP;
+}
+
+void flash_program_word(uint32_t address, uint32_t data) {
+	if(address < USERFLASH_BEGIN || address >= board::USERFLASH_END || address % 4) {
+		printf("program of 0x%x outside of the user flash\n", address);
+		abort();
+	}
+	uint32_t *p = (uint32_t*)(uintptr_t) address;
+	if(*p != 0xffffffff) {
+		printf("program of 0x%x which is not erased\n", address);
+		abort();
+	}
+	try {
+		flash_operation();
+	} catch(PowerFail&) {
+		// words are programmed as two half words
+		if(random(2))
+			*p = data | 0xffff0000;
+		throw;
+	}
+	*p = data;
+	wordsProgrammed++;
+}
+
+
+// expected content of the slots
+
+struct slot_t {
+	bool valid;
+	properties_t props;
+};
+
+static slot_t slots[SAVEAREA_MAX];
+static bool configValid;
+static config_t savedConfig;
+
+// recall a slot to current_props, including the cal data left in flash
+static int recall(int id) {
+	int ret = flash_caldata_recall(id);
+	if(ret != 0)
+		return ret;
+	caldata_ref_t ref;
+	if(!caldata_reference(ref) || ref._sweep_points != current_props._sweep_points)
+		return -100;
+	cal_decoder dec;
+	complexf v[CAL_ENTRIES];
+	dec.begin(ref.data, ref._sweep_points);
+	for(int i = 0; i < ref._sweep_points; i++) {
+		dec.next(v);
+		for(int eterm = 0; eterm < CAL_ENTRIES; eterm++)
+			current_props._cal_data[eterm][i] = v[eterm];
+	}
+	return 0;
+}
+
+static bool sameProps(const properties_t &a, const properties_t &b) {
+	if(memcmp(&a, &b, CALDATA_HEAD_BYTES) != 0)
+		return false;
+	if(memcmp((const uint8_t*)&a + UISTATE_OFFSET, (const uint8_t*)&b + UISTATE_OFFSET, UISTATE_BYTES) != 0)
+		return false;
+	for(int eterm = 0; eterm < CAL_ENTRIES; eterm++)
+		if(memcmp(a._cal_data[eterm], b._cal_data[eterm], a._sweep_points * sizeof(complexf)) != 0)
+			return false;
+	return true;
+}
+
+// change the ui state and, if calibrate is set, the sweep and cal data
+static void modifyProps(bool calibrate) {
+	uint8_t *ui = (uint8_t*)&current_props + UISTATE_OFFSET;
+	for(int i = 0; i < 16; i++)
+		ui[random(UISTATE_BYTES)] = random(256);
+	if(!calibrate)
+		return;
+	if(random(3) == 0)
+		current_props._sweep_points = 2 + random(SWEEP_POINTS_MAX - 1);
+	current_props._frequency0 = 100000 + random(1000000);
+	current_props._frequency1 = 1000000000 + random(1000000000);
+	current_props._cal_status = random(1 << 16);
+	// smooth error terms, with noise on some of the calibrations
+	float amplitude = 0.01f + random(100) / 100.f;
+	float phase = random(100) / 10.f;
+	float noise = random(3) == 0 ? 1e-3f : 0.f;
+	for(int eterm = 0; eterm < CAL_ENTRIES; eterm++)
+		for(int i = 0; i < SWEEP_POINTS_MAX; i++)
+			current_props._cal_data[eterm][i] =
+				std::polar(amplitude * (1 + eterm) / (1 + i * 0.01f), phase + i * 0.05f * eterm)
+				+ complexf(noise * (random(1000) - 500), noise * (random(1000) - 500));
+}
+
+static void checkSlots(int iteration) {
+	for(int id = 0; id < SAVEAREA_MAX; id++) {
+		int ret = recall(id);
+		if(slots[id].valid) {
+			CHECK(ret == 0, "iteration %d: slot %d not recalled (%d)", iteration, id, ret);
+			CHECK(sameProps(current_props, slots[id].props), "iteration %d: slot %d differs", iteration, id);
+		} else
+			CHECK(ret != 0, "iteration %d: empty slot %d recalled", iteration, id);
+	}
+	int ret = flash_config_recall();
+	if(configValid) {
+		CHECK(ret == 0, "iteration %d: config not recalled (%d)", iteration, ret);
+		CHECK(memcmp(&config, &savedConfig, sizeof(config)) == 0, "iteration %d: config differs", iteration);
+	} else
+		CHECK(ret != 0, "iteration %d: config recalled before it was saved", iteration);
+}
+
+// after a power failure the interrupted save may or may not have completed
+static void reboot() {
+	log_scanned = false;
+	for(int id = 0; id < SAVEAREA_MAX; id++) {
+		if(recall(id) != 0)
+			continue;
+		if(!slots[id].valid || !sameProps(current_props, slots[id].props)) {
+			slots[id].valid = true;
+			memcpy(&slots[id].props, &current_props, sizeof(properties_t));
+		}
+	}
+	if(flash_config_recall() == 0) {
+		configValid = true;
+		memcpy(&savedConfig, &config, sizeof(config));
+	}
+}
+
+int main() {
+	uint32_t flashBytes = board::USERFLASH_END - FLASH_BASE;
+	void *flash = mmap((void*)(uintptr_t) FLASH_BASE, flashBytes, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+	if(flash != (void*)(uintptr_t) FLASH_BASE) {
+		printf("can not map the flash at 0x%x\n", FLASH_BASE);
+		return 1;
+	}
+	memset(flash, 0xff, flashBytes);
+
+	printf("flash log: %u pages, caldata record %u pages, reserve %u pages\n",
+		USERFLASH_PAGES, CALDATA_PAGES, RESERVE_PAGES);
+
+	current_props.setFieldsToDefault();
+	checkSlots(-1);
+
+	int uiSaves = 0, calSaves = 0, configSaves = 0, powerFails = 0;
+	for(int iteration = 0; iteration < iterations && fails == 0; iteration++) {
+		int op = random(10);
+		int id = random(SAVEAREA_MAX);
+		if(iteration >= powerFailFrom && random(4) == 0)
+			powerFailIn = random(2) ? random(64) : random(4000);
+		try {
+			if(op == 0) {
+				uint8_t *c = (uint8_t*)&config;
+				for(int i = 0; i < 8; i++)
+					c[4 + random(sizeof(config) - 8)] = random(256);
+				int ret = flash_config_save();
+				if(ret != 0) {
+					printf("  FAIL iteration %d: config save failed (%d)\n", iteration, ret);
+					fails++;
+					break;
+				}
+				configValid = true;
+				memcpy(&savedConfig, &config, sizeof(config));
+				configSaves++;
+			} else {
+				bool calibrate = !slots[id].valid || random(4) == 0;
+				if(slots[id].valid)
+					memcpy(&current_props, &slots[id].props, sizeof(properties_t));
+				modifyProps(calibrate);
+				long words = wordsProgrammed;
+				int ret = flash_caldata_save(id);
+				if(ret != 0) {
+					printf("  FAIL iteration %d: save of slot %d failed (%d)\n", iteration, id, ret);
+					fails++;
+					break;
+				}
+				// a ui state record is a few hundred bytes, a cal data record several pages
+				(wordsProgrammed - words < 256 ? uiSaves : calSaves)++;
+				slots[id].valid = true;
+				memcpy(&slots[id].props, &current_props, sizeof(properties_t));
+			}
+			powerFailIn = -1;
+		} catch(PowerFail&) {
+			powerFailIn = -1;
+			powerFails++;
+			reboot();
+		}
+		// the index is rebuilt from flash at every boot
+		if(random(50) == 0)
+			log_scanned = false;
+		checkSlots(iteration);
+	}
+
+	int minErases = *std::min_element(pageErases, pageErases + USERFLASH_PAGES);
+	int maxErases = *std::max_element(pageErases, pageErases + USERFLASH_PAGES);
+	printf("  %d cal data saves, %d ui state saves, %d config saves, %d power failures\n",
+		calSaves, uiSaves, configSaves, powerFails);
+	printf("  page erases min %d max %d\n", minErases, maxErases);
+	// the log wraps around, so the wear is spread over all pages
+	if(minErases == 0 || maxErases > 2 * minErases + 2) {
+		printf("  FAIL uneven wear\n");
+		fails++;
+	}
+
+	if(fails == 0) {
+		flash_clear_user();
+		for(int id = 0; id < SAVEAREA_MAX; id++)
+			slots[id].valid = false;
+		configValid = false;
+		checkSlots(iterations);
+	}
+	printf(fails == 0 ? "ok\n" : "FAIL\n");
+	return fails == 0 ? 0 : 1;
+}
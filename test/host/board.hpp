@@ -0,0 +1,35 @@
+#pragma once
+// board.hpp of the host tests: a V2_2 or V2Plus4 without peripherals, selected
+// by DISPLAY_ST7796 like the firmware builds.
+#include <stdint.h>
+#include <mculib/fastwiring.hpp>
+#include "../../common.hpp"
+
+#ifdef DISPLAY_ST7796
+#define BOARD_NAME "NanoVNA V2Plus4"
+#define BOARD_REVISION (4)
+#define BOARD_DISABLE_ECAL
+#else
+#define BOARD_NAME "NanoVNA V2_2"
+#define BOARD_REVISION (2)
+#endif
+
+#define BOARD_MEASUREMENT_NPERIODS_NORMAL		14
+#define BOARD_MEASUREMENT_NPERIODS_CALIBRATING	30
+#define BOARD_MEASUREMENT_ECAL_INTERVAL			 5
+#define BOARD_MEASUREMENT_NWAIT_SWITCH			 1
+
+using namespace mculib;
+using namespace std;
+
+namespace board {
+	static constexpr Pad led = 0;
+	// display connector, also used by the spi slave interface
+	static constexpr Pad lcd_clk = 16 + 3;
+	static constexpr Pad lcd_mosi = 16 + 5;
+	static constexpr Pad lcd_miso = 16 + 4;
+	static constexpr Pad ili9341_cs = 15;
+	static constexpr Pad xpt2046_cs = 16 + 7;
+	constexpr uint32_t USERFLASH_END = 0x08000000 + 256*1024;
+	static inline void ledPulse() {}
+}
@@ -0,0 +1,2 @@
+#define GITVERSION "host"
+#define GITURL ""
@@ -0,0 +1,13 @@
+#pragma once
+// crc unit of the host tests, simulated by crc32_test.cpp. Writing CRC_DR
+// feeds a word, most significant bit first; reading it returns the crc.
+#include <stdint.h>
+
+struct crc_data_register {
+	crc_data_register& operator=(uint32_t word);
+	operator uint32_t() const;
+};
+
+extern crc_data_register CRC_DR;
+
+void crc_reset(void);
@@ -0,0 +1,40 @@
+#pragma once
+// dma controller of the host tests, simulated by spi_slave_test.cpp. Only the
+// registers and functions used by spi_slave.cpp exist; addresses are host
+// pointers.
+#include <stdint.h>
+
+#define DMA1			1u
+#define DMA_CHANNEL2	2
+#define DMA_CHANNEL3	3
+
+#define DMA_CCR_EN				(1u << 0)
+#define DMA_CCR_CIRC			(1u << 5)
+#define DMA_CCR_PSIZE_8BIT		0u
+#define DMA_CCR_MSIZE_8BIT		0u
+#define DMA_CCR_PL_HIGH			(2u << 12)
+#define DMA_CCR_PL_VERY_HIGH	(3u << 12)
+
+struct dma_sim_channel {
+	volatile uint32_t ccr, cndtr;
+	volatile uintptr_t cpar, cmar;
+};
+extern dma_sim_channel dma_sim[8];
+
+#define DMA1_CCR(channel)		(dma_sim[channel].ccr)
+#define DMA1_CNDTR(channel)		(dma_sim[channel].cndtr)
+#define DMA1_CMAR(channel)		(dma_sim[channel].cmar)
+
+void dma_channel_reset(uint32_t dma, uint8_t channel);
+void dma_enable_channel(uint32_t dma, uint8_t channel);
+void dma_disable_channel(uint32_t dma, uint8_t channel);
+void dma_set_peripheral_address(uint32_t dma, uint8_t channel, uintptr_t address);
+void dma_set_memory_address(uint32_t dma, uint8_t channel, uintptr_t address);
+void dma_set_number_of_data(uint32_t dma, uint8_t channel, uint16_t number);
+void dma_set_read_from_peripheral(uint32_t dma, uint8_t channel);
+void dma_set_read_from_memory(uint32_t dma, uint8_t channel);
+void dma_enable_memory_increment_mode(uint32_t dma, uint8_t channel);
+void dma_set_peripheral_size(uint32_t dma, uint8_t channel, uint32_t peripheral_size);
+void dma_set_memory_size(uint32_t dma, uint8_t channel, uint32_t memory_size);
+void dma_enable_circular_mode(uint32_t dma, uint8_t channel);
+void dma_set_priority(uint32_t dma, uint8_t channel, uint32_t prio);
@@ -0,0 +1,23 @@
+#pragma once
+// flash controller of the host tests: the user flash is memory mapped at its
+// target address by flash_test.cpp, which also implements these functions.
+// An erase runs when FLASH_SR is polled after FLASH_CR_STRT was set.
+#include <stdint.h>
+
+#define FLASH_BASE		0x08000000u
+
+#define FLASH_SR_BSY	(1u << 0)
+#define FLASH_SR_EOP	(1u << 5)
+#define FLASH_CR_PER	(1u << 1)
+#define FLASH_CR_STRT	(1u << 6)
+#define FLASH_CR_LOCK	(1u << 7)
+
+#define FLASH_SR		(flash_sim_status())
+
+extern uint32_t FLASH_CR, FLASH_AR, FLASH_KEYR;
+
+uint32_t flash_sim_status(void);
+void flash_unlock(void);
+void flash_program_word(uint32_t address, uint32_t data);
+uint32_t flash_get_status_flags(void);
+void flash_erase_page(uint32_t page_address);
@@ -0,0 +1,11 @@
+#pragma once
+// gpio of the host tests; pin modes are not simulated
+#include <stdint.h>
+
+#define GPIO_MODE_INPUT					0x00
+#define GPIO_MODE_OUTPUT_50_MHZ			0x03
+#define GPIO_CNF_INPUT_FLOAT			0x01
+#define GPIO_CNF_INPUT_PULL_UPDOWN		0x02
+#define GPIO_CNF_OUTPUT_ALTFN_PUSHPULL	0x02
+
+static inline void gpio_set_mode(uint32_t gpioport, uint8_t mode, uint8_t cnf, uint16_t gpios) {}
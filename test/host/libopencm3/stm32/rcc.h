@@ -0,0 +1,9 @@
+#pragma once
+// clock control of the host tests; see crc32_test.cpp and spi_slave_test.cpp
+enum rcc_periph_clken {
+	RCC_CRC,
+	RCC_DMA1,
+	RCC_SPI1
+};
+
+void rcc_periph_clock_enable(rcc_periph_clken clken);
@@ -0,0 +1,26 @@
+#pragma once
+// spi of the host tests, for spi_slave_test.cpp. The bytes are moved by the
+// simulated dma of dma.h; the configuration is recorded in spi_sim.
+#include <stdint.h>
+
+#define SPI1			1u
+#define SPI_DR(spi)		(spi_sim.dr)
+
+struct spi_sim_t {
+	volatile uint32_t dr;
+	bool enabled, slave, dff16, cpol, cpha, lsbFirst, softNSS, rxDMA, txDMA;
+};
+extern spi_sim_t spi_sim;
+
+void spi_reset(uint32_t spi);
+void spi_enable(uint32_t spi);
+void spi_set_slave_mode(uint32_t spi);
+void spi_set_full_duplex_mode(uint32_t spi);
+void spi_set_unidirectional_mode(uint32_t spi);
+void spi_set_dff_8bit(uint32_t spi);
+void spi_set_clock_polarity_0(uint32_t spi);
+void spi_set_clock_phase_1(uint32_t spi);
+void spi_send_msb_first(uint32_t spi);
+void spi_disable_software_slave_management(uint32_t spi);
+void spi_enable_rx_dma(uint32_t spi);
+void spi_enable_tx_dma(uint32_t spi);
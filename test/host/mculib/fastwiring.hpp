@@ -0,0 +1,22 @@
+#pragma once
+// host replacement of mculib/fastwiring.hpp for the host tests: pins are
+// plain numbers without hardware behind them and delays return immediately.
+#include <stdint.h>
+#include <mculib/fastwiring_defs.hpp>
+#include <mculib/small_function.hpp>
+
+namespace mculib {
+	struct Pad {
+		int pin;
+		constexpr Pad(): pin(-1) {}
+		constexpr Pad(int pin): pin(pin) {}
+		constexpr uint32_t bank() const { return pin / 16; }
+		constexpr uint16_t mask() const { return 1 << (pin % 16); }
+	};
+	static inline void pinMode(Pad p, int mode) {}
+	static inline void digitalWrite(Pad p, int bit) {}
+	static inline int digitalRead(Pad p) { return 0; }
+	static inline void _delay_8t(uint32_t cycles) {}
+	static inline void delayMicroseconds(uint32_t us) {}
+	static inline void delay(int ms) {}
+}
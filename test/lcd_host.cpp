@@ -0,0 +1,247 @@
+#include <stdio.h>
+#include <string.h>
+#include "lcd_host.hpp"
+#include "../ili9341.hpp"
+#include "../crc32.hpp"
+
+uint16_t lcd_host_framebuffer[LCD_HEIGHT][LCD_WIDTH];
+lcd_host_stats_t lcd_host_stats;
+
+// display controller state
+static bool selected = false;
+static bool dataMode = true;
+static uint8_t command = 0;
+static uint8_t params[4];
+static int paramCount = 0;
+static int xStart = 0, xEnd = LCD_WIDTH - 1, yStart = 0, yEnd = LCD_HEIGHT - 1;
+static int x = 0, y = 0;
+static uint8_t madctl = 0;
+static bool pixelHalf = false;	// first byte of a pixel received
+static uint8_t pixelHigh = 0;
+static int readX = 0, readY = 0;
+static int readByte = 0;	// byte of an RGB888 pixel read, -1 => dummy byte
+static uint16_t readColor = 0;
+
+// simulated bus window, see lcd_host_set_window(). Every poll of the
+// window takes the time of one word.
+static uint32_t windowWords = 0, windowClosedPolls = 0;
+static uint32_t windowLeftBytes = 0, windowClosedLeft = 0;
+
+static uint32_t window() {
+	if(windowWords == 0)
+		return 0xffffffff;
+	if(windowClosedLeft > 0) {
+		if(--windowClosedLeft == 0)
+			windowLeftBytes = windowWords * 2;
+		return 0;
+	}
+	if(windowLeftBytes < 2) {
+		windowClosedLeft = windowClosedPolls;
+		return 0;
+	}
+	// time passes while the window is polled
+	uint32_t words = windowLeftBytes / 2;
+	windowLeftBytes -= 2;
+	return words - 1;
+}
+
+static void writePixel(uint16_t color) {
+	int px = x, py = y;
+	// MX and MY mirror the image relative to the landscape orientation
+	// set by ili9341_init() and ili9341_set_flip()
+	if(madctl & 0x40) px = LCD_WIDTH - 1 - px;
+	if(madctl & 0x80) py = LCD_HEIGHT - 1 - py;
+	if(px >= 0 && px < LCD_WIDTH && py >= 0 && py < LCD_HEIGHT) {
+		lcd_host_framebuffer[py][px] = color;
+		lcd_host_stats.pixels++;
+	} else {
+		lcd_host_stats.clipped++;
+	}
+	if(++x > xEnd) {
+		x = xStart;
+		if(++y > yEnd)
+			y = yStart;
+	}
+}
+
+static void receiveCommand(uint8_t cmd) {
+	lcd_host_stats.commands++;
+	command = cmd;
+	paramCount = 0;
+	pixelHalf = false;
+	if(cmd == 0x2C) {
+		// memory write starts at the top left of the address window
+		x = xStart;
+		y = yStart;
+	} else if(cmd == 0x2E) {
+		readX = xStart;
+		readY = yStart;
+		readByte = -1;
+	}
+}
+
+static void receiveData(uint8_t b) {
+	switch(command) {
+	case 0x2A:	// column address set
+	case 0x2B:	// page address set
+		if(paramCount < 4)
+			params[paramCount++] = b;
+		if(paramCount == 4) {
+			int start = (params[0] << 8) | params[1];
+			int end = (params[2] << 8) | params[3];
+			if(command == 0x2A) {
+				xStart = start;
+				xEnd = end;
+			} else {
+				yStart = start;
+				yEnd = end;
+			}
+		}
+		break;
+	case 0x2C:	// memory write, 16 bit pixels msb first
+	case 0x3C:
+		if(!pixelHalf) {
+			pixelHigh = b;
+			pixelHalf = true;
+		} else {
+			writePixel(uint16_t((pixelHigh << 8) | b));
+			pixelHalf = false;
+		}
+		break;
+	case 0x36:	// memory access control
+		madctl = b;
+		break;
+	default:
+		break;
+	}
+}
+
+// a byte clocked on the bus in either direction
+static void clockByte() {
+	lcd_host_stats.bytes++;
+	if(windowWords != 0) {
+		if(windowLeftBytes == 0)
+			lcd_host_stats.windowOverruns++;
+		else
+			windowLeftBytes--;
+	}
+}
+
+static void receive(uint8_t b) {
+	clockByte();
+	if(!selected)
+		return;
+	if(dataMode)
+		receiveData(b);
+	else
+		receiveCommand(b);
+}
+
+static uint16_t readPixel() {
+	uint16_t color = lcd_host_framebuffer[readY][readX];
+	if(++readX > xEnd) {
+		readX = xStart;
+		if(++readY > yEnd)
+			readY = yStart;
+	}
+	return color;
+}
+
+// ili9341 memory read: a dummy byte, then RGB888 pixels
+static uint8_t readRGB888() {
+	if(readByte < 0) {
+		readByte = 0;
+		return 0;
+	}
+	if(readByte == 0)
+		readColor = readPixel();
+	uint8_t b;
+	switch(readByte) {
+	case 0: b = uint8_t((readColor >> 11) << 3); break;
+	case 1: b = uint8_t(((readColor >> 5) & 0x3f) << 2); break;
+	default: b = uint8_t((readColor & 0x1f) << 3); break;
+	}
+	readByte = (readByte + 1) % 3;
+	return b;
+}
+
+void lcd_host_init() {
+	memset(lcd_host_framebuffer, 0, sizeof(lcd_host_framebuffer));
+	lcd_host_reset_stats();
+
+	ili9341_spi_set_cs = [](bool sel) {
+		selected = sel;
+	};
+	ili9341_spi_set_dc = [](bool data) {
+		dataMode = data;
+	};
+	ili9341_spi_transfer = [](uint32_t sdi, int bits) -> uint32_t {
+		if(bits == 16) {
+			receive(uint8_t(sdi >> 8));
+			receive(uint8_t(sdi));
+		} else {
+			receive(uint8_t(sdi));
+		}
+		// on the ST7796 only the dummy byte of a memory read is read
+		// through here; the pixels come from ili9341_spi_read
+		if(selected && dataMode && command == 0x2E)
+			return readRGB888();
+		return 0;
+	};
+	ili9341_spi_transfer_bulk = [](uint16_t* buf, uint32_t words) {
+		lcd_host_stats.bulkTransfers++;
+		// the dma sends the buffer bytewise in memory order
+		const uint8_t* b = (const uint8_t*) buf;
+		for(uint32_t i = 0; i < words * 2; i++)
+			receive(b[i]);
+		ili9341_bulk_done();
+	};
+	ili9341_spi_wait_bulk = []() {};
+	ili9341_spi_window = []() -> uint32_t {
+		return window();
+	};
+	ili9341_spi_read = [](uint8_t* buf, uint32_t bytes) {
+		// ST7796 memory read: RGB565 msb first
+		for(uint32_t i = 0; i + 1 < bytes; i += 2) {
+			clockByte();
+			clockByte();
+			uint16_t color = readPixel();
+			buf[i] = uint8_t(color >> 8);
+			buf[i + 1] = uint8_t(color);
+		}
+	};
+}
+
+void lcd_host_set_window(uint32_t words, uint32_t closedPolls) {
+	windowWords = words;
+	windowClosedPolls = closedPolls;
+	windowLeftBytes = words * 2;
+	windowClosedLeft = 0;
+}
+
+void lcd_host_reset_stats() {
+	memset(&lcd_host_stats, 0, sizeof(lcd_host_stats));
+}
+
+uint32_t lcd_host_checksum() {
+	return crc32(lcd_host_framebuffer, sizeof(lcd_host_framebuffer));
+}
+
+bool lcd_host_write_ppm(const char* fileName) {
+	FILE* f = fopen(fileName, "wb");
+	if(f == nullptr)
+		return false;
+	fprintf(f, "P6\n%d %d\n255\n", LCD_WIDTH, LCD_HEIGHT);
+	for(int py = 0; py < LCD_HEIGHT; py++) {
+		for(int px = 0; px < LCD_WIDTH; px++) {
+			uint16_t c = lcd_host_framebuffer[py][px];
+			uint8_t rgb[3] = {
+				uint8_t((c >> 11) << 3),
+				uint8_t(((c >> 5) & 0x3f) << 2),
+				uint8_t((c & 0x1f) << 3)
+			};
+			fwrite(rgb, 3, 1, f);
+		}
+	}
+	return fclose(f) == 0;
+}
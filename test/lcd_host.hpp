@@ -0,0 +1,41 @@
+#pragma once
+#include <stdint.h>
+#include "../plot.hpp"
+
+// host display backend: implements the ili9341 spi hooks by decoding the
+// command stream into an in-memory framebuffer, so that ili9341.cpp,
+// plot.cpp and ui.cpp run unmodified on the host.
+// Transfers complete immediately; ili9341_bulk_done() is called from
+// within ili9341_spi_transfer_bulk() like the dma interrupt would.
+
+// RGB565 pixels as they would appear on the panel (not byte swapped)
+extern uint16_t lcd_host_framebuffer[LCD_HEIGHT][LCD_WIDTH];
+
+// spi traffic since the last lcd_host_reset_stats()
+struct lcd_host_stats_t {
+	uint32_t commands;		// command bytes
+	uint32_t bytes;			// all bytes on the bus, including commands
+	uint32_t bulkTransfers;	// ili9341_spi_transfer_bulk() calls
+	uint32_t pixels;		// pixels written to the framebuffer
+	uint32_t clipped;		// pixels written outside of the panel
+	uint32_t windowOverruns;	// bytes sent while the bus had to be quiet
+};
+extern lcd_host_stats_t lcd_host_stats;
+
+// display spi clock of the boards (PCLK2 / 4 at 120 MHz), to estimate bus time
+static constexpr uint32_t lcd_host_spi_hz = 30000000;
+
+// install the ili9341 hooks and clear the framebuffer
+void lcd_host_init();
+void lcd_host_reset_stats();
+
+// simulate quiet bus phases: ili9341_spi_window() allows words, then
+// returns 0 for closedPolls calls before it opens again. words = 0 makes
+// the window unlimited (the default).
+void lcd_host_set_window(uint32_t words, uint32_t closedPolls);
+
+// CRC-32/MPEG-2 of the framebuffer contents
+uint32_t lcd_host_checksum();
+
+// write the framebuffer as a binary PPM; returns false on error
+bool lcd_host_write_ppm(const char* fileName);
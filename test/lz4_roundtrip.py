@@ -0,0 +1,56 @@
+#!/usr/bin/env python3
+"""packs pages with lz4_compress() of bootload_firmware.py and checks with
+lz4_test that the bootloader's decoder restores them; see test/Makefile"""
+import os
+import random
+import subprocess
+import sys
+import types
+from struct import pack
+
+here = os.path.dirname(os.path.abspath(__file__))
+sys.path.insert(0, os.path.join(here, ".."))
+sys.dont_write_bytecode = True
+# the serial port is not used here; do not require pyserial
+sys.modules.setdefault("serial", types.ModuleType("serial"))
+from bootload_firmware import FLASH_PAGESIZE, lz4_compress  # noqa: E402
+
+
+def blocks():
+    "yields (name, data) of the blocks to test"
+    rng = random.Random(1)
+    # the bootloader image, as a sample of firmware code and data
+    with open(os.path.join(here, "..", "bootloader", "binary.bin"), "rb") as f:
+        image = f.read()
+    image += b"\xff" * (-len(image) % FLASH_PAGESIZE)
+    for i in range(0, len(image), FLASH_PAGESIZE):
+        yield "firmware", image[i:i + FLASH_PAGESIZE]
+    yield "erased", b"\xff" * FLASH_PAGESIZE
+    yield "zeros", bytes(FLASH_PAGESIZE)
+    yield "random", bytes(rng.getrandbits(8) for _ in range(FLASH_PAGESIZE))
+    yield "pattern", bytes(i % 7 for i in range(FLASH_PAGESIZE))
+    # matches longer than 15 + 255 bytes, and far apart
+    yield "long runs", b"a" * 300 + bytes(rng.getrandbits(8) for _ in range(1448)) + b"a" * 300
+    # words from a small alphabet, with short matches everywhere
+    yield "text", bytes(rng.choice(b"abcd ") for _ in range(FLASH_PAGESIZE))
+    # short blocks, around the limits of the last match and literals
+    for n in range(40):
+        yield "short", bytes(rng.choice(b"ab") for _ in range(n))
+
+
+def main():
+    stream = bytearray()
+    sizes = {}
+    for name, data in blocks():
+        packed = lz4_compress(data)
+        stream += pack("<II", len(data), len(packed)) + data + packed
+        raw, total = sizes.get(name, (0, 0))
+        sizes[name] = (raw + len(data), total + len(packed))
+    for name, (raw, total) in sizes.items():
+        print(f"  {name:10s} {raw:6d} bytes packed to {total:6d} ({100 * total / max(raw, 1):.0f}%)")
+    result = subprocess.run([os.path.join(here, "lz4_test"), "-"], input=bytes(stream))
+    return result.returncode
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,141 @@
+// lz4Decompress() of the bootloader (bootloader/lz4.cpp); see test/Makefile
+//
+// Without arguments, decodes hand made blocks, valid and malformed. With "-",
+// reads blocks packed by bootload_firmware.py from stdin (see lz4_roundtrip.py)
+// and checks that they decode to the original data, also into a buffer one
+// byte short, truncated and with corrupted bytes. Built with the address
+// sanitizer, so that any access outside of the buffers fails the test.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <random>
+#include <string>
+#include <vector>
+#include "../bootloader/lz4.hpp"
+
+static int fails = 0;
+
+typedef std::vector<uint8_t> bytes;
+
+// decode into heap buffers of exactly the given sizes
+static int decode(const bytes& src, int dstLen, bytes* out = nullptr) {
+	uint8_t* s = new uint8_t[src.size()];
+	uint8_t* d = new uint8_t[dstLen];
+	if(!src.empty())
+		memcpy(s, src.data(), src.size());
+	int ret = lz4Decompress(s, src.size(), d, dstLen);
+	if(out != nullptr && ret >= 0)
+		out->assign(d, d + ret);
+	delete[] s;
+	delete[] d;
+	return ret;
+}
+
+static void expect(const char* name, const bytes& src, int dstLen, int expected, const std::string& data = "") {
+	bytes out;
+	int ret = decode(src, dstLen, &out);
+	bool ok = ret == expected && (expected < 0 || std::string(out.begin(), out.end()) == data);
+	printf("  %-28s %s\n", name, ok ? "ok" : "FAIL");
+	if(!ok) {
+		printf("    returned %d, expected %d\n", ret, expected);
+		fails++;
+	}
+}
+
+static void handMade() {
+	printf("hand made blocks:\n");
+	expect("empty", {}, 16, 0);
+	expect("literals", {0x50, 'h', 'e', 'l', 'l', 'o'}, 16, 5, "hello");
+	expect("literals, exact fit", {0x50, 'h', 'e', 'l', 'l', 'o'}, 5, 5, "hello");
+	expect("literals, 1 byte short", {0x50, 'h', 'e', 'l', 'l', 'o'}, 4, -1);
+	// one literal, then a match of 10 at offset 1 that reads what it writes
+	expect("overlapping match", {0x16, 'a', 1, 0, 0x10, 'b'}, 16, 12, "aaaaaaaaaaab");
+	expect("match at the end", {0x16, 'a', 1, 0}, 16, 11, "aaaaaaaaaaa");
+	expect("match, 1 byte short", {0x16, 'a', 1, 0}, 10, -1);
+	expect("match offset 0", {0x10, 'a', 0, 0}, 16, -1);
+	expect("match before the output", {0x10, 'a', 2, 0}, 16, -1);
+	expect("match offset truncated", {0x10, 'a', 1}, 16, -1);
+	expect("literals past the end", {0x50, 'a', 'b'}, 16, -1);
+	expect("literal length truncated", {0xf0}, 64, -1);
+	expect("match length truncated", {0x1f, 'a', 1, 0}, 64, -1);
+
+	// 15 + 255 + 3 literals
+	bytes longLiterals = {0xf0, 255, 3};
+	std::string text;
+	for(int i = 0; i < 273; i++)
+		text += char('a' + i % 26);
+	longLiterals.insert(longLiterals.end(), text.begin(), text.end());
+	expect("long literal length", longLiterals, 2048, 273, text);
+	// a match of 4 + 15 + 255 + 255 + 0
+	expect("long match length", {0x1f, 'x', 1, 0, 255, 255, 0}, 2048, 530, std::string(530, 'x'));
+	expect("long match, 1 byte short", {0x1f, 'x', 1, 0, 255, 255, 0}, 529, -1);
+}
+
+static uint32_t get32(FILE* f, bool& ok) {
+	uint8_t b[4];
+	ok = fread(b, 1, 4, f) == 4;
+	return b[0] | (b[1] << 8) | (b[2] << 16) | (uint32_t(b[3]) << 24);
+}
+
+// records of: uint32 raw length, uint32 packed length, raw data, packed data
+static void roundTrip(FILE* f) {
+	printf("blocks packed by bootload_firmware.py:\n");
+	std::mt19937 rng(1);
+	int blocks = 0;
+	long rawBytes = 0, packedBytes = 0;
+	while(true) {
+		bool ok1, ok2;
+		uint32_t rawLen = get32(f, ok1);
+		uint32_t packedLen = get32(f, ok2);
+		if(!ok1 || !ok2)
+			break;
+		bytes raw(rawLen), packed(packedLen);
+		if(fread(raw.data(), 1, rawLen, f) != rawLen || fread(packed.data(), 1, packedLen, f) != packedLen) {
+			printf("  FAIL truncated input\n");
+			fails++;
+			return;
+		}
+		blocks++;
+		rawBytes += rawLen;
+		packedBytes += packedLen;
+
+		bytes out;
+		if(decode(packed, rawLen, &out) != int(rawLen) || out != raw) {
+			printf("  FAIL block %d (%u bytes): does not decode to the original\n", blocks, rawLen);
+			fails++;
+			continue;
+		}
+		if(rawLen > 0 && decode(packed, rawLen - 1) != -1) {
+			printf("  FAIL block %d (%u bytes): decoded into a buffer 1 byte short\n", blocks, rawLen);
+			fails++;
+		}
+		// the bootloader rejects a page unless it decodes to exactly the page size
+		for(uint32_t n = 0; n < packedLen; n++) {
+			bytes truncated(packed.begin(), packed.begin() + n);
+			if(decode(truncated, rawLen, &out) == int(rawLen) && out != raw) {
+				printf("  FAIL block %d: truncated to %u bytes decodes to a full block\n", blocks, n);
+				fails++;
+				break;
+			}
+		}
+		// corrupted blocks must not access memory out of bounds
+		for(int i = 0; i < 64 && packedLen > 0; i++) {
+			bytes corrupt = packed;
+			for(int j = 1 + rng() % 4; j > 0; j--)
+				corrupt[rng() % packedLen] = rng();
+			decode(corrupt, rawLen);
+		}
+	}
+	printf("  %d blocks, %ld bytes packed to %ld %s\n", blocks, rawBytes, packedBytes,
+		blocks > 0 && fails == 0 ? "ok" : "FAIL");
+	if(blocks == 0)
+		fails++;
+}
+
+int main(int argc, char** argv) {
+	if(argc > 1 && strcmp(argv[1], "-") == 0)
+		roundTrip(stdin);
+	else
+		handMade();
+	return fails == 0 ? 0 : 1;
+}
@@ -0,0 +1,94 @@
+// the parts of main2.cpp that plot.cpp and ui.cpp call, for the host tests.
+// Sweep settings and trace setup only change current_props; nothing is
+// measured.
+#include "../main.hpp"
+#include "../globals.hpp"
+#include "../uihw.hpp"
+#include "../plot.hpp"
+
+int cpu_mhz = 120;
+
+bool cpu_enable_fpu(void) {
+	return false;
+}
+
+bool UIHW::touchPosition(uint16_t& x, uint16_t& y) {
+	return false;
+}
+
+namespace UIActions {
+	void cal_collect(int type) {}
+	void cal_done(void) {}
+	void cal_reset(void) {}
+	void cal_reset_all(void) {}
+	void rebuild_bbgain(void) {}
+
+	void set_sweep_frequency(SweepParameter type, freqHz_t frequency) {
+		switch(type) {
+		case ST_START: frequency0 = frequency; break;
+		case ST_STOP: frequency1 = frequency; break;
+		default: break;
+		}
+	}
+	void set_sweep_points(int points) {
+		sweep_points = points;
+	}
+	freqHz_t get_sweep_frequency(int type) {
+		switch(type) {
+		case ST_START: return current_props.startFreqHz();
+		case ST_STOP: return current_props.stopFreqHz();
+		case ST_CENTER: return (current_props.startFreqHz() + current_props.stopFreqHz()) / 2;
+		case ST_SPAN: return current_props.stopFreqHz() - current_props.startFreqHz();
+		case ST_CW: return (current_props.startFreqHz() + current_props.stopFreqHz()) / 2;
+		}
+		return 0;
+	}
+	void set_measurement_mode(enum MeasurementMode mode) {}
+	freqHz_t frequencyAt(int index) {
+		return current_props.startFreqHz() + current_props.stepFreqHz() * index;
+	}
+
+	void toggle_sweep(void) {}
+	void enable_refresh(bool enable) {}
+
+	void set_trace_type(int t, int type) {
+		trace[t].type = type;
+	}
+	void set_trace_channel(int t, int channel) {
+		trace[t].channel = channel;
+	}
+	void set_trace_scale(int t, float scale) {
+		trace[t].scale = scale / trace_info[trace[t].type].scale_unit;
+	}
+	void set_trace_refpos(int t, float refpos) {
+		trace[t].refpos = refpos;
+	}
+
+	void set_electrical_delay(float picoseconds) {
+		electrical_delay = picoseconds;
+	}
+	float get_electrical_delay(void) {
+		return electrical_delay;
+	}
+	void set_time_gate(SweepParameter type, float picoseconds) {}
+	void apply_edelay_at(int i) {}
+
+	void set_averaging(int i) {}
+	void set_adf4350_txPower(int i) {}
+
+	int caldata_save(int id) { return -1; }
+	int caldata_recall(int id) { return -1; }
+	int config_save() { return -1; }
+	int config_recall() { return -1; }
+
+	void printTouchCal() {}
+	void enterBootload() {}
+	void reconnectUSB() {}
+
+	// events are run immediately
+	void application_doEvents() {}
+	void application_doSingleEvent() {}
+	void enqueueEvent(const small_function<void()>& cb) {
+		cb();
+	}
+}
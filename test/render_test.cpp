@@ -0,0 +1,382 @@
+// renders canned sweeps through plot.cpp, ui.cpp and ili9341.cpp into the
+// host framebuffer (lcd_host.cpp), compares the frames with golden
+// checksums and measures the render cost.
+//   render_test                 check all scenes against the golden file
+//   render_test --update        rewrite the golden file
+//   render_test --dump DIR      also write each frame as DIR/<scene>.ppm
+//   render_test --bench [N]     time N full and incremental redraws per scene
+// The golden file is test/golden/render_<width>x<height>.txt. Checksums
+// depend on the float results of the host compiler; after a deliberate
+// change of the rendering, check the dumped frames and run --update.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include "../common.hpp"
+#include "../globals.hpp"
+#include "../plot.hpp"
+#include "../ui.hpp"
+#include "../ili9341.hpp"
+#include "lcd_host.hpp"
+
+#define STR(x) #x
+#define XSTR(x) STR(x)
+static const char* goldenFile = "golden/render_" XSTR(LCD_WIDTH) "x" XSTR(LCD_HEIGHT) ".txt";
+
+static constexpr int nPoints = 201;
+static constexpr freqHz_t startHz = 1000000, stopHz = 3000000000;
+
+static uint64_t nanoseconds() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return uint64_t(t.tv_sec) * 1000000000 + t.tv_nsec;
+}
+
+// ##### canned sweeps #####
+
+// S11 of a 25 ohm + 10 pF series load behind 100 ps of line, S21 of a
+// resonator with 20 dB insertion loss at 1 GHz. seed adds a small
+// deterministic ripple, for incremental redraws.
+static void sweepFrequencyDomain(int seed) {
+	for(int i = 0; i < nPoints; i++) {
+		double f = startHz + double(stopHz - startHz) * i / (nPoints - 1);
+		double w = 2 * M_PI * f;
+		complex<double> z(25., -1. / (w * 10e-12));
+		complex<double> s11 = (z - 50.) / (z + 50.) * polar(1., -w * 200e-12);
+		double detune = 8. * (f / 1e9 - 1e9 / f);
+		complex<double> s21 = 0.1 / complex<double>(1., detune) * polar(1., -w * 1e-9);
+		double ripple = 1. + 0.01 * sin(i * 0.7 + seed);
+		measured[0][i] = complexf(s11 * ripple);
+		measured[1][i] = complexf(s21 * ripple);
+	}
+}
+
+// low pass step response of a line with a 75 ohm section and an open end
+static void sweepTimeDomain(int seed) {
+	for(int i = 0; i < nPoints; i++) {
+		auto edge = [i](double at) { return 0.5 + 0.5 * tanh((i - at) / 2.); };
+		double v = 0.2 * edge(40) - 0.2 * edge(90) + 0.9 * edge(150);
+		v += 0.005 * sin(i * 0.3 + seed);
+		measured[0][i] = complexf(float(v), 0.f);
+		measured[1][i] = complexf(float(v * 0.1), 0.f);
+	}
+}
+
+// ##### scenes #####
+
+struct scene {
+	const char* name;
+	void (*setup)();
+	void (*sweep)(int seed);
+};
+
+static void setupCommon(uint8_t domainMode) {
+	current_props.setFieldsToDefault();
+	frequency0 = startHz;
+	frequency1 = stopHz;
+	sweep_points = nPoints;
+	domain_mode = domainMode;
+	cal_status = CALSTAT_APPLY;
+	const int markerIndex[MARKERS_MAX] = {30, 80, 120, 170};
+	for(int i = 0; i < MARKERS_MAX; i++) {
+		markers[i].enabled = 1;
+		markers[i].index = markerIndex[i];
+		markers[i].frequency = current_props.startFreqHz() + current_props.stepFreqHz() * markerIndex[i];
+	}
+	active_marker = 0;
+	update_grid();
+}
+
+// scale is in units of trace_info[type].scale_unit per division
+static void setTrace(int t, int type, int channel, float scale, float refpos) {
+	trace[t].enabled = 1;
+	trace[t].type = type;
+	trace[t].channel = channel;
+	trace[t].scale = scale;
+	trace[t].refpos = refpos;
+}
+
+static void setupLogmag() {
+	setupCommon(DOMAIN_FREQ);
+	setTrace(0, TRC_LOGMAG, 0, 1., 7.);
+	setTrace(1, TRC_LOGMAG, 1, 1., 7.);
+	setTrace(2, TRC_PHASE, 0, 1., 4.);
+	setTrace(3, TRC_SWR, 0, 1., 0.);
+}
+
+static void setupSmith() {
+	setupCommon(DOMAIN_FREQ);
+	setTrace(0, TRC_SMITH, 0, 1., 0.);
+	setTrace(1, TRC_LOGMAG, 1, 1., 7.);
+	setTrace(2, TRC_POLAR, 1, 1., 0.);
+	setTrace(3, TRC_LOGMAG, 0, 1., 7.);
+}
+
+static void setupTDR() {
+	setupCommon(DOMAIN_TIME | TD_FUNC_LOWPASS_STEP);
+	setTrace(0, TRC_REAL, 0, 1., 4.);
+	setTrace(1, TRC_LINEAR, 0, 1., 0.);
+	setTrace(2, TRC_REAL, 1, 0.2, 4.);
+	setTrace(3, TRC_IMAG, 0, 1., 4.);
+}
+
+static const scene scenes[] = {
+	{"logmag", setupLogmag, sweepFrequencyDomain},
+	{"smith", setupSmith, sweepFrequencyDomain},
+	{"tdr", setupTDR, sweepTimeDomain},
+};
+
+// draw the whole screen as after power up: frame, frequencies, cal status
+// and all cells
+static void drawScene(const scene& s, int seed) {
+	s.setup();
+	s.sweep(seed);
+	measuredGeneration[0]++;
+	measuredGeneration[1]++;
+	ili9341_set_background(DEFAULT_BG_COLOR);
+	ili9341_clear_screen();
+	plot_into_index(measured);
+	force_set_markmap();
+	redraw_request |= 0xff;
+	draw_all(true);
+	ili9341_bulk_flush();
+}
+
+// ##### golden checksums #####
+
+struct frameResult {
+	std::string name;
+	uint32_t checksum;
+};
+
+static std::vector<frameResult> renderAll(const char* dumpDir) {
+	std::vector<frameResult> results;
+	auto record = [&](const char* name) {
+		results.push_back({name, lcd_host_checksum()});
+		if(dumpDir != nullptr) {
+			std::string fileName = std::string(dumpDir) + "/" + name + ".ppm";
+			if(!lcd_host_write_ppm(fileName.c_str()))
+				fprintf(stderr, "can not write %s\n", fileName.c_str());
+		}
+	};
+	for(auto& s: scenes) {
+		drawScene(s, 0);
+		record(s.name);
+	}
+
+	// the menu over the logmag plot, opened with the lever
+	drawScene(scenes[0], 0);
+	uiEnableProcessing();
+	ui_process({UIHW::UIEventButtons::LeverCenter, UIHW::UIEventTypes::Click});
+	draw_all(true);
+	ili9341_bulk_flush();
+	record("logmag_menu");
+	// and closed again; the cells behind it are redrawn
+	ui_mode_normal();
+	draw_all(true);
+	ili9341_bulk_flush();
+	record("logmag_menu_closed");
+
+	// the next sweep over an existing frame only redraws cells that changed
+	drawScene(scenes[0], 0);
+	scenes[0].sweep(1);
+	measuredGeneration[0]++;
+	measuredGeneration[1]++;
+	plot_into_index(measured);
+	redraw_request |= REDRAW_CELLS;
+	draw_all(true);
+	ili9341_bulk_flush();
+	record("logmag_next_sweep");
+	// which must be the same as drawing it from scratch
+	drawScene(scenes[0], 1);
+	record("logmag_sweep_1");
+
+	// with quiet bus phases, transfers are split and delayed but the frame
+	// is the same
+	lcd_host_set_window(300, 3);
+	drawScene(scenes[0], 0);
+	ui_process({UIHW::UIEventButtons::LeverCenter, UIHW::UIEventTypes::Click});
+	draw_all(true);
+	ili9341_bulk_flush();
+	record("logmag_menu_windowed");
+	lcd_host_set_window(0, 0);
+	ui_mode_normal();
+	return results;
+}
+
+static bool readGolden(std::vector<frameResult>& golden) {
+	FILE* f = fopen(goldenFile, "r");
+	if(f == nullptr)
+		return false;
+	char name[64];
+	unsigned checksum;
+	while(fscanf(f, "%63s %x", name, &checksum) == 2)
+		golden.push_back({name, checksum});
+	fclose(f);
+	return true;
+}
+
+static bool writeGolden(const std::vector<frameResult>& results) {
+	FILE* f = fopen(goldenFile, "w");
+	if(f == nullptr)
+		return false;
+	for(auto& r: results)
+		fprintf(f, "%s %08x\n", r.name.c_str(), r.checksum);
+	return fclose(f) == 0;
+}
+
+static int checkGolden(const std::vector<frameResult>& results) {
+	std::vector<frameResult> golden;
+	if(!readGolden(golden)) {
+		fprintf(stderr, "can not read %s; run with --update to create it\n", goldenFile);
+		return 1;
+	}
+	int fails = 0;
+	for(auto& r: results) {
+		const frameResult* g = nullptr;
+		for(auto& e: golden)
+			if(e.name == r.name)
+				g = &e;
+		if(g == nullptr) {
+			printf("  %-20s %08x  no golden checksum  FAIL\n", r.name.c_str(), r.checksum);
+			fails++;
+		} else if(g->checksum != r.checksum) {
+			printf("  %-20s %08x  expected %08x  FAIL\n", r.name.c_str(), r.checksum, g->checksum);
+			fails++;
+		} else {
+			printf("  %-20s %08x  ok\n", r.name.c_str(), r.checksum);
+		}
+	}
+	if(golden.size() != results.size()) {
+		printf("  %s has %d frames, rendered %d  FAIL\n", goldenFile, int(golden.size()), int(results.size()));
+		fails++;
+	}
+	return fails;
+}
+
+// partial redraws must leave the same frame as a full redraw
+static int checkRedraws(const std::vector<frameResult>& results) {
+	const char* pairs[][2] = {
+		{"logmag_menu_closed", "logmag"},
+		{"logmag_next_sweep", "logmag_sweep_1"},
+		{"logmag_menu_windowed", "logmag_menu"},
+	};
+	auto find = [&](const char* name) {
+		for(auto& r: results)
+			if(r.name == name)
+				return r.checksum;
+		return 0u;
+	};
+	int fails = 0;
+	for(auto& p: pairs) {
+		bool ok = find(p[0]) == find(p[1]);
+		printf("  %-20s same as %s  %s\n", p[0], p[1], ok ? "ok" : "FAIL");
+		if(!ok)
+			fails++;
+	}
+	bool ok = lcd_host_stats.windowOverruns == 0;
+	printf("  %-20s %u bytes sent while the bus was quiet  %s\n", "window", lcd_host_stats.windowOverruns, ok ? "ok" : "FAIL");
+	if(!ok)
+		fails++;
+	return fails;
+}
+
+// ##### benchmark #####
+
+static uint64_t cellStartNs, cellMaxNs;
+static uint32_t cellCount;
+
+static void benchScene(const scene& s, int iterations) {
+	drawScene(s, 0);
+	plot_tick = []() {
+		uint64_t now = nanoseconds();
+		if(now - cellStartNs > cellMaxNs)
+			cellMaxNs = now - cellStartNs;
+		cellCount++;
+		cellStartNs = now;
+	};
+
+	for(int incremental = 0; incremental < 2; incremental++) {
+		uint64_t mapNs = 0, drawNs = 0;
+		cellMaxNs = 0;
+		cellCount = 0;
+		lcd_host_reset_stats();
+		for(int i = 0; i < iterations; i++) {
+			s.sweep(i + 1);
+			measuredGeneration[0]++;
+			measuredGeneration[1]++;
+			uint64_t t0 = nanoseconds();
+			plot_into_index(measured);
+			if(!incremental)
+				force_set_markmap();
+			redraw_request |= REDRAW_CELLS;
+			uint64_t t1 = nanoseconds();
+			cellStartNs = t1;
+			draw_all(true);
+			ili9341_bulk_flush();
+			mapNs += t1 - t0;
+			drawNs += nanoseconds() - t1;
+		}
+		// the host spends about as long decoding the spi stream into the
+		// framebuffer as the target spends rendering it; this is included
+		double cells = double(cellCount) / iterations;
+		double busMs = double(lcd_host_stats.bytes) * 8 / iterations / lcd_host_spi_hz * 1e3;
+		printf("  %-7s %-11s %6.1f cells  map %7.1f us  draw %7.1f us  cell avg %5.2f max %6.2f us  spi %6.1f kB %5.1f ms\n",
+			s.name, incremental ? "incremental" : "full",
+			cells, mapNs / 1e3 / iterations, drawNs / 1e3 / iterations,
+			cellCount ? drawNs / 1e3 / cellCount : 0., cellMaxNs / 1e3,
+			lcd_host_stats.bytes / 1e3 / iterations, busMs);
+	}
+	plot_tick = []() {};
+}
+
+int main(int argc, char** argv) {
+	bool update = false;
+	const char* dumpDir = nullptr;
+	int benchIterations = 0;
+	for(int i = 1; i < argc; i++) {
+		if(strcmp(argv[i], "--update") == 0)
+			update = true;
+		else if(strcmp(argv[i], "--dump") == 0 && i + 1 < argc)
+			dumpDir = argv[++i];
+		else if(strcmp(argv[i], "--bench") == 0) {
+			benchIterations = 200;
+			if(i + 1 < argc && atoi(argv[i + 1]) > 0)
+				benchIterations = atoi(argv[++i]);
+		} else {
+			fprintf(stderr, "usage: %s [--update] [--dump DIR] [--bench [N]]\n", argv[0]);
+			return 2;
+		}
+	}
+
+	lcd_host_init();
+	plot_getFrequencyAt = [](int index) {
+		return current_props.startFreqHz() + current_props.stepFreqHz() * index;
+	};
+	plot_tick = []() {};
+	ili9341_init();
+	plot_init();
+
+	printf("render %dx%d:\n", LCD_WIDTH, LCD_HEIGHT);
+	if(benchIterations > 0) {
+		for(auto& s: scenes)
+			benchScene(s, benchIterations);
+		return 0;
+	}
+
+	auto results = renderAll(dumpDir);
+	if(update) {
+		if(!writeGolden(results)) {
+			fprintf(stderr, "can not write %s\n", goldenFile);
+			return 1;
+		}
+		printf("  wrote %s\n", goldenFile);
+		return 0;
+	}
+	int fails = checkRedraws(results) + checkGolden(results);
+	printf(fails == 0 ? "PASS\n" : "FAIL\n");
+	return fails == 0 ? 0 : 1;
+}
@@ -0,0 +1,224 @@
+// screenshot stream (screenshot.cpp) round trip; see test/Makefile
+//
+// rleEncodeRow() is checked on random, run-heavy and alternating rows of
+// every length up to two display rows: the decoded row must be the input
+// and the encoded length within rleRowBytesMax(). Then whole screens are
+// read back through ili9341.cpp from the host framebuffer (test/lcd_host.cpp),
+// in raw and rle format and with a narrow bus window, and the stream is
+// decoded and compared with the framebuffer, including its crc.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <random>
+#include <vector>
+#include "lcd_host.hpp"
+#include "../screenshot.hpp"
+#include "../ili9341.hpp"
+
+static int fails = 0;
+static std::mt19937 rng(1);
+
+#define CHECK(cond, ...) do { \
+	if(!(cond)) { \
+		printf("  FAIL line %d: ", __LINE__); \
+		printf(__VA_ARGS__); \
+		printf("\n"); \
+		fails++; \
+		return; \
+	} \
+} while(0)
+
+// CRC-32/MPEG-2, one bit at a time
+static uint32_t crcReference(const uint8_t* data, size_t len, uint32_t crc) {
+	for(size_t i = 0; i < len; i++) {
+		crc ^= uint32_t(data[i]) << 24;
+		for(int j = 0; j < 8; j++)
+			crc = (crc & 0x80000000) ? (crc << 1) ^ 0x04c11db7 : crc << 1;
+	}
+	return crc;
+}
+
+// decode len bytes of one rle row into n pixels; false if the packets do
+// not make up exactly n pixels
+static bool rleDecodeRow(const uint8_t* in, int len, uint16_t* out, int n) {
+	int i = 0, o = 0;
+	while(i < len) {
+		uint8_t p = in[i++];
+		if(p & 0x80) {
+			int count = (p & 0x7f) + 2;
+			if(i + 2 > len || o + count > n)
+				return false;
+			uint16_t pixel;
+			memcpy(&pixel, in + i, 2);
+			i += 2;
+			for(int j = 0; j < count; j++)
+				out[o++] = pixel;
+		} else {
+			int count = p + 1;
+			if(i + count * 2 > len || o + count > n)
+				return false;
+			memcpy(out + o, in + i, count * 2);
+			i += count * 2;
+			o += count;
+		}
+	}
+	return o == n;
+}
+
+enum rowKind { RANDOM, RUNS, ALTERNATING, PAIRS };
+static const char* const rowKindNames[] = { "random", "runs", "alternating", "pairs" };
+
+static void makeRow(rowKind kind, uint16_t* row, int n) {
+	uint16_t a = uint16_t(rng()), b = uint16_t(a ^ 0x5a5a);
+	int i = 0;
+	while(i < n) {
+		switch(kind) {
+		case RANDOM:
+			// mostly distinct pixels with a few short runs
+			row[i] = (i > 0 && rng() % 8 == 0) ? row[i - 1] : uint16_t(rng());
+			i++;
+			break;
+		case RUNS: {
+			// few colors in runs up to beyond the longest packet
+			int len = 1 + rng() % 300;
+			uint16_t c = uint16_t(rng() % 4);
+			for(int j = 0; j < len && i < n; j++)
+				row[i++] = c;
+			break;
+		}
+		case ALTERNATING:
+			// no runs at all: every pixel is a literal
+			row[i] = (i & 1) ? b : a;
+			i++;
+			break;
+		case PAIRS:
+			// a single pixel followed by a run of 2, breaking every literal
+			row[i] = (i % 3 == 0) ? uint16_t(rng()) : uint16_t(a + i / 3);
+			i++;
+			break;
+		}
+	}
+}
+
+static void testRows() {
+	printf("rleEncodeRow:\n");
+	constexpr int maxLen = LCD_WIDTH * 2;
+	uint16_t row[maxLen], decoded[maxLen];
+	uint8_t encoded[rleRowBytesMax(maxLen)];
+	for(int kind = RANDOM; kind <= PAIRS; kind++) {
+		int longest = 0;
+		for(int n = 1; n <= maxLen; n++) {
+			makeRow(rowKind(kind), row, n);
+			int len = rleEncodeRow(row, n, encoded);
+			CHECK(len + 2 <= rleRowBytesMax(n), "%s row of %d pixels: %d bytes, bound %d",
+				rowKindNames[kind], n, len + 2, rleRowBytesMax(n));
+			CHECK(rleDecodeRow(encoded, len, decoded, n), "%s row of %d pixels: bad packets",
+				rowKindNames[kind], n);
+			CHECK(memcmp(row, decoded, n * 2) == 0, "%s row of %d pixels: decoded row differs",
+				rowKindNames[kind], n);
+			if(n == LCD_WIDTH)
+				longest = len + 2;
+		}
+		printf("  %-12s %4d bytes per %d pixel row, bound %d\n", rowKindNames[kind], longest,
+			LCD_WIDTH, rleRowBytesMax(LCD_WIDTH));
+	}
+	// the worst case reaches the bound
+	makeRow(ALTERNATING, row, LCD_WIDTH);
+	CHECK(rleEncodeRow(row, LCD_WIDTH, encoded) + 2 == rleRowBytesMax(LCD_WIDTH),
+		"alternating row is not the worst case");
+	printf("  ok\n");
+}
+
+// fill the framebuffer with rows of every kind
+static void fillScreen() {
+	for(int y = 0; y < LCD_HEIGHT; y++)
+		makeRow(rowKind(y % 4), lcd_host_framebuffer[y], LCD_WIDTH);
+}
+
+static std::vector<uint8_t> capture(bool rle) {
+	std::vector<uint8_t> stream;
+	screenshot_send(rle, [&stream](const uint8_t* data, int len) {
+		stream.insert(stream.end(), data, data + len);
+	});
+	return stream;
+}
+
+// stream pixels are in display byte order, msb first
+static uint16_t streamPixel(uint16_t p) {
+	return uint16_t((p >> 8) | (p << 8));
+}
+
+static void checkRaw(const std::vector<uint8_t>& s) {
+	size_t header = 5;
+	CHECK(s.size() == header + LCD_WIDTH * LCD_HEIGHT * 2, "raw stream of %d bytes", int(s.size()));
+	uint16_t width, height;
+	memcpy(&width, &s[0], 2);
+	memcpy(&height, &s[2], 2);
+	CHECK(width == LCD_WIDTH && height == LCD_HEIGHT && s[4] == 16, "raw header");
+	for(int y = 0; y < LCD_HEIGHT; y++)
+		for(int x = 0; x < LCD_WIDTH; x++) {
+			uint16_t p;
+			memcpy(&p, &s[header + (y * LCD_WIDTH + x) * 2], 2);
+			CHECK(streamPixel(p) == lcd_host_framebuffer[y][x], "raw pixel %d,%d", x, y);
+		}
+}
+
+static void checkRle(const std::vector<uint8_t>& s) {
+	size_t pos = 6;
+	CHECK(s.size() >= pos + 4, "rle stream of %d bytes", int(s.size()));
+	uint16_t width, height;
+	memcpy(&width, &s[0], 2);
+	memcpy(&height, &s[2], 2);
+	CHECK(width == LCD_WIDTH && height == LCD_HEIGHT && s[4] == 16 && s[5] == 1, "rle header");
+	uint32_t crc = 0xffffffff;
+	uint16_t row[LCD_WIDTH];
+	for(int y = 0; y < LCD_HEIGHT; y++) {
+		uint16_t len;
+		CHECK(pos + 2 <= s.size(), "stream ends at row %d", y);
+		memcpy(&len, &s[pos], 2);
+		CHECK(len + 2 <= rleRowBytesMax(LCD_WIDTH), "row %d: %d bytes, bound %d", y, len + 2,
+			rleRowBytesMax(LCD_WIDTH));
+		CHECK(pos + 2 + len <= s.size(), "row %d runs past the stream", y);
+		crc = crcReference(&s[pos], len + 2, crc);
+		CHECK(rleDecodeRow(&s[pos + 2], len, row, LCD_WIDTH), "row %d: bad packets", y);
+		for(int x = 0; x < LCD_WIDTH; x++)
+			CHECK(streamPixel(row[x]) == lcd_host_framebuffer[y][x], "rle pixel %d,%d", x, y);
+		pos += 2 + len;
+	}
+	uint32_t streamCrc;
+	CHECK(pos + 4 == s.size(), "%d bytes after the rows", int(s.size() - pos));
+	memcpy(&streamCrc, &s[pos], 4);
+	CHECK(streamCrc == crc, "crc %08x, rows give %08x", streamCrc, crc);
+}
+
+static void testScreen(uint32_t windowWords) {
+	if(windowWords == 0)
+		printf("screenshot:\n");
+	else
+		printf("screenshot, bus window of %u words:\n", windowWords);
+	fillScreen();
+	lcd_host_set_window(windowWords, 3);
+	lcd_host_reset_stats();
+	auto raw = capture(false);
+	checkRaw(raw);
+	if(fails) return;
+	auto rle = capture(true);
+	checkRle(rle);
+	if(fails) return;
+	CHECK(lcd_host_stats.windowOverruns == 0, "%u bytes read while the bus was quiet",
+		lcd_host_stats.windowOverruns);
+	lcd_host_set_window(0, 0);
+	printf("  raw %d bytes, rle %d bytes\n", int(raw.size()), int(rle.size()));
+	printf("  ok\n");
+}
+
+int main() {
+	lcd_host_init();
+	ili9341_init();
+	testRows();
+	if(fails == 0) testScreen(0);
+	if(fails == 0) testScreen(300);
+	if(fails == 0) testScreen(2000);
+	printf(fails == 0 ? "ok\n" : "FAIL\n");
+	return fails == 0 ? 0 : 1;
+}
@@ -0,0 +1,411 @@
+// spi slave interface (spi_slave.cpp) against a simulated master; see test/Makefile
+//
+// The dma and spi of host/libopencm3 are simulated here: every byte the master
+// clocks is stored into the command ring by the rx dma channel, and the byte
+// clocked back is read by the tx dma channel from the address spi_slave.cpp
+// gave it. spi_slave_poll() runs where the main loop would run it. Built with
+// the address sanitizer, so that a transfer outside of the buffers fails.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <initializer_list>
+#include <random>
+#include "../spi_slave.hpp"
+#include "../crc32.hpp"
+#include <libopencm3/stm32/rcc.h>
+#include <libopencm3/stm32/spi.h>
+#include <libopencm3/stm32/dma.h>
+
+static int fails = 0;
+
+#define CHECK(cond, ...) do { \
+	if(!(cond)) { \
+		printf("  FAIL line %d: ", __LINE__); \
+		printf(__VA_ARGS__); \
+		printf("\n"); \
+		fails++; \
+		return; \
+	} \
+} while(0)
+
+
+// spi and dma
+
+spi_sim_t spi_sim;
+dma_sim_channel dma_sim[8];
+static uint32_t dmaLength[8];	// number of data when the channel was enabled
+
+void rcc_periph_clock_enable(rcc_periph_clken clken) {}
+
+void spi_reset(uint32_t spi) { spi_sim = spi_sim_t(); spi_sim.softNSS = true; }
+void spi_enable(uint32_t spi) { spi_sim.enabled = true; }
+void spi_set_slave_mode(uint32_t spi) { spi_sim.slave = true; }
+void spi_set_full_duplex_mode(uint32_t spi) {}
+void spi_set_unidirectional_mode(uint32_t spi) {}
+void spi_set_dff_8bit(uint32_t spi) { spi_sim.dff16 = false; }
+void spi_set_clock_polarity_0(uint32_t spi) { spi_sim.cpol = false; }
+void spi_set_clock_phase_1(uint32_t spi) { spi_sim.cpha = true; }
+void spi_send_msb_first(uint32_t spi) { spi_sim.lsbFirst = false; }
+void spi_disable_software_slave_management(uint32_t spi) { spi_sim.softNSS = false; }
+void spi_enable_rx_dma(uint32_t spi) { spi_sim.rxDMA = true; }
+void spi_enable_tx_dma(uint32_t spi) { spi_sim.txDMA = true; }
+
+void dma_channel_reset(uint32_t dma, uint8_t channel) { dma_sim[channel] = dma_sim_channel(); }
+void dma_enable_channel(uint32_t dma, uint8_t channel) {
+	dma_sim[channel].ccr |= DMA_CCR_EN;
+	dmaLength[channel] = dma_sim[channel].cndtr;
+}
+void dma_disable_channel(uint32_t dma, uint8_t channel) { dma_sim[channel].ccr &= ~DMA_CCR_EN; }
+void dma_set_peripheral_address(uint32_t dma, uint8_t channel, uintptr_t address) { dma_sim[channel].cpar = address; }
+void dma_set_memory_address(uint32_t dma, uint8_t channel, uintptr_t address) { dma_sim[channel].cmar = address; }
+void dma_set_number_of_data(uint32_t dma, uint8_t channel, uint16_t number) { dma_sim[channel].cndtr = number; }
+void dma_set_read_from_peripheral(uint32_t dma, uint8_t channel) {}
+void dma_set_read_from_memory(uint32_t dma, uint8_t channel) {}
+void dma_enable_memory_increment_mode(uint32_t dma, uint8_t channel) {}
+void dma_set_peripheral_size(uint32_t dma, uint8_t channel, uint32_t peripheral_size) {}
+void dma_set_memory_size(uint32_t dma, uint8_t channel, uint32_t memory_size) {}
+void dma_enable_circular_mode(uint32_t dma, uint8_t channel) { dma_sim[channel].ccr |= DMA_CCR_CIRC; }
+void dma_set_priority(uint32_t dma, uint8_t channel, uint32_t prio) {}
+
+// one byte from the master, one back from the tx dma (0 if it has nothing)
+static uint8_t exchange(uint8_t out) {
+	uint8_t in = 0;
+	dma_sim_channel& tx = dma_sim[3];
+	if((tx.ccr & DMA_CCR_EN) && tx.cndtr > 0) {
+		in = ((const uint8_t*) tx.cmar)[dmaLength[3] - tx.cndtr];
+		tx.cndtr--;
+	}
+	dma_sim_channel& rx = dma_sim[2];
+	if(rx.ccr & DMA_CCR_EN) {
+		((uint8_t*) rx.cmar)[dmaLength[2] - rx.cndtr] = out;
+		if(--rx.cndtr == 0 && (rx.ccr & DMA_CCR_CIRC))
+			rx.cndtr = dmaLength[2];
+	}
+	return in;
+}
+
+
+// master
+
+static void command(std::initializer_list<uint8_t> bytes) {
+	for(uint8_t b : bytes)
+		exchange(b);
+	spi_slave_poll();
+}
+
+// clock out a response, sending nops
+static void clockIn(void* buf, int len) {
+	for(int i = 0; i < len; i++)
+		((uint8_t*) buf)[i] = exchange(0);
+}
+
+static uint16_t readRegister16(uint8_t address) {
+	command({0x11, address});
+	uint16_t value;
+	clockIn(&value, 2);
+	return value;
+}
+
+static uint8_t readRegister8(uint8_t address) {
+	command({0x10, address});
+	uint8_t value;
+	clockIn(&value, 1);
+	return value;
+}
+
+// write a register of 1, 2, 4 or 8 bytes, little endian
+static void writeRegister(uint8_t address, uint64_t value, int bytes) {
+	static const uint8_t opcodes[9] = {0, 0x20, 0x21, 0, 0x22, 0, 0, 0, 0x23};
+	exchange(opcodes[bytes]);
+	exchange(address);
+	for(int i = 0; i < bytes; i++)
+		exchange(uint8_t(value >> (i * 8)));
+	spi_slave_poll();
+}
+
+
+// measurement
+
+// values of point index of the sweep tagged tag
+static complexf s11Of(int tag, int index) { return complexf(tag, index * 1e-3f); }
+static complexf s21Of(int tag, int index) { return complexf(-index, tag * 1e-3f); }
+
+// points from to to - 1, except skip; the last point completes the sweep
+static void measure(int tag, int from, int to, int skip = -1, bool complete = true) {
+	for(int i = from; i < to; i++)
+		if(i != skip)
+			spi_slave_buffer_data_point(i, s11Of(tag, i), s21Of(tag, i));
+	if(complete)
+		spi_slave_notify_measurement_complete();
+}
+
+// the last completed sweep as read through the sweep FIFO
+static SpiSweepBuffer_t sweep;
+
+static void checkSweep(int points, int tag) {
+	CHECK(sweep.header.magic == SPI_SWEEP_MAGIC, "magic %04x", sweep.header.magic);
+	CHECK(sweep.header.points == points, "%d points, expected %d", sweep.header.points, points);
+	CHECK(sweep.header.crc == crc32(sweep.points, points * sizeof(VNADataPoint_t)), "crc differs");
+	for(int i = 0; i < points; i++) {
+		const VNADataPoint_t& p = sweep.points[i];
+		CHECK(p.index == i, "point %d has index %d", i, p.index);
+		CHECK(complexf(p.s11_real, p.s11_imag) == s11Of(tag, i)
+			&& complexf(p.s21_real, p.s21_imag) == s21Of(tag, i), "point %d is not of sweep %d", i, tag);
+	}
+}
+
+// read the header, and the points in two parts with poll in between
+static void readSweep(int split = -1) {
+	command({0x18, 0x31, 0x00});
+	clockIn(&sweep.header, sizeof(sweep.header));
+	int bytes = sweep.header.points * sizeof(VNADataPoint_t);
+	if(split < 0 || split > bytes)
+		split = bytes;
+	clockIn(sweep.points, split);
+	spi_slave_poll();
+	clockIn((uint8_t*) sweep.points + split, bytes - split);
+	spi_slave_poll();
+}
+
+
+static void testInit() {
+	printf("init:\n");
+	spi_slave_init();
+	CHECK(spi_sim.enabled && spi_sim.slave && !spi_sim.dff16, "not an 8 bit slave");
+	CHECK(!spi_sim.cpol && spi_sim.cpha && !spi_sim.lsbFirst, "not spi mode 1, msb first");
+	CHECK(!spi_sim.softNSS, "nss is not the hardware pin");
+	CHECK(spi_sim.rxDMA && spi_sim.txDMA, "dma requests not enabled");
+	CHECK((dma_sim[2].ccr & DMA_CCR_EN) && (dma_sim[2].ccr & DMA_CCR_CIRC), "rx dma is not circular");
+	CHECK(dma_sim[2].cpar == (uintptr_t) &SPI_DR(SPI1) && dma_sim[3].cpar == (uintptr_t) &SPI_DR(SPI1),
+		"dma not on SPI_DR");
+	CHECK(readRegister8(0x45) == STATUS_IDLE, "status %d before the first sweep", readRegister8(0x45));
+
+	// the main loop starts the defaults of spi_config.h
+	CHECK(spiSweepChangedFlag, "default sweep not started");
+	SpiSweepConfig_t cfg;
+	spi_slave_get_sweep(cfg);
+	CHECK(!spiSweepChangedFlag, "start not taken");
+	CHECK(cfg.startHz == freqHz_t(SPI_SLAVE_START_FREQ) && cfg.points == SPI_SLAVE_NUM_POINTS
+		&& cfg.startHz + cfg.stepHz * (cfg.points - 1) <= freqHz_t(SPI_SLAVE_STOP_FREQ)
+		&& cfg.average == SPI_SLAVE_AVERAGE_N && cfg.power == 0, "not the default sweep");
+	// no sweep yet: a header without points
+	readSweep();
+	CHECK(sweep.header.magic == SPI_SWEEP_MAGIC && sweep.header.points == 0
+		&& sweep.header.crc == CRC32_INIT, "header before the first sweep");
+	printf("  ok\n");
+}
+
+static void testSweep() {
+	printf("sweep FIFO:\n");
+	measure(1, 0, 101);
+	CHECK(readRegister8(0x45) == STATUS_DATA_READY, "status %d", readRegister8(0x45));
+	CHECK(readRegister16(0x46) == 0 && readRegister16(0x48) == 101, "sequence %d, points %d",
+		readRegister16(0x46), readRegister16(0x48));
+	readSweep();
+	checkSweep(101, 1);
+	// sent in place, without a copy
+	CHECK(dma_sim[3].cmar == (uintptr_t) &spiSweepBuffers[spiFillBufferIndex ^ 1], "sent from a copy");
+	printf("  ok\n");
+}
+
+static void testPingPong() {
+	printf("sweep completed during a read:\n");
+	command({0x18, 0x31, 0x00});
+	clockIn(&sweep.header, sizeof(sweep.header));
+	clockIn(sweep.points, 50 * sizeof(VNADataPoint_t));
+	spi_slave_poll();
+	// completes while the master reads; its buffer can not be swapped in yet
+	measure(2, 0, 101);
+	spi_slave_poll();
+	// dropped, both buffers are in use
+	measure(3, 0, 101);
+	clockIn(&sweep.points[50], 51 * sizeof(VNADataPoint_t));
+	checkSweep(101, 1);
+	CHECK(sweep.header.sequence == 0, "sequence %d", sweep.header.sequence);
+
+	// the read is done, sweep 2 is swapped in
+	spi_slave_poll();
+	CHECK(readRegister16(0x46) == 1, "sequence %d after the read", readRegister16(0x46));
+	readSweep();
+	checkSweep(101, 2);
+	printf("  ok\n");
+}
+
+static void testIncomplete() {
+	printf("incomplete sweeps:\n");
+	measure(4, 0, 101, 50);
+	CHECK(readRegister16(0x46) == 1, "sweep with a lost point published");
+	measure(5, 30, 101);
+	CHECK(readRegister16(0x46) == 1, "sweep without its first points published");
+	// restarted after points 0 - 19, then a whole sweep
+	measure(6, 0, 20, -1, false);
+	measure(7, 0, 51);
+	CHECK(readRegister16(0x46) == 2, "sequence %d", readRegister16(0x46));
+	readSweep();
+	checkSweep(51, 7);
+	printf("  ok\n");
+}
+
+static void testStart() {
+	printf("sweep registers and start:\n");
+	measure(8, 0, 101);
+	uint16_t sequence = readRegister16(0x46);
+	CHECK(readRegister8(0x45) == STATUS_DATA_READY, "status %d", readRegister8(0x45));
+
+	// the settings take effect on start only
+	writeRegister(0x00, 2500000000ll, 8);
+	writeRegister(0x10, 12345678, 8);
+	writeRegister(0x20, 42, 2);
+	writeRegister(0x40, 7, 1);
+	writeRegister(0x42, 2, 1);
+	CHECK(!spiSweepChangedFlag, "started without a write to 44");
+
+	// a sweep with the previous settings completes while the master reads
+	// through the point FIFO, and waits for the swap
+	writeRegister(0x4a, 0, 2);
+	command({0x18, 0x30, 10});
+	clockIn(sweep.points, 10 * sizeof(VNADataPoint_t));
+	measure(9, 0, 101);
+	spi_slave_poll();
+	writeRegister(0x44, 1, 1);
+	CHECK(spiSweepChangedFlag, "not started");
+	SpiSweepConfig_t cfg;
+	spi_slave_get_sweep(cfg);
+	CHECK(cfg.startHz == 2500000000ll && cfg.stepHz == 12345678 && cfg.points == 42
+		&& cfg.average == 7 && cfg.power == 2, "settings differ");
+	// the start ends the read and drops the sweep waiting for it
+	CHECK(readRegister8(0x45) == STATUS_MEASURING, "status %d after the start", readRegister8(0x45));
+	CHECK(readRegister16(0x46) == sequence, "sweep of the previous settings published");
+	readSweep();
+	CHECK(sweep.header.points == 0, "%d points before the first sweep", sweep.header.points);
+
+	// the first sweep after the start
+	measure(10, 0, 42);
+	CHECK(readRegister8(0x45) == STATUS_DATA_READY, "status %d", readRegister8(0x45));
+	readSweep();
+	checkSweep(42, 10);
+	// the dropped sweep had a sequence number too
+	CHECK(int16_t(sweep.header.sequence - sequence) > 0, "sequence %d", sweep.header.sequence);
+
+	// out of range settings
+	writeRegister(0x20, 60000, 2);
+	writeRegister(0x40, 0, 1);
+	writeRegister(0x42, 9, 1);
+	writeRegister(0x44, 1, 1);
+	spi_slave_get_sweep(cfg);
+	CHECK(cfg.points == SWEEP_POINTS_MAX && cfg.average == 1 && cfg.power == 3,
+		"%d points, average %d, power %d", cfg.points, cfg.average, cfg.power);
+	measure(11, 0, 101);
+	printf("  ok\n");
+}
+
+static void testPointFIFO() {
+	printf("point FIFO:\n");
+	measure(12, 0, 101);
+	uint16_t sequence = readRegister16(0x46);
+	writeRegister(0x4a, 0, 2);
+	command({0x18, 0x30, 16});
+	clockIn(sweep.points, 16 * sizeof(VNADataPoint_t));
+	CHECK(readRegister16(0x4a) == 16, "read index %d", readRegister16(0x4a));
+	// kept while the master reads through the point FIFO
+	measure(13, 0, 101);
+	spi_slave_poll();
+	CHECK(readRegister16(0x46) == sequence, "sweep replaced during a point read");
+	command({0x18, 0x30, 0});
+	clockIn(&sweep.points[16], 85 * sizeof(VNADataPoint_t));
+	spi_slave_poll();
+	sweep.header.magic = SPI_SWEEP_MAGIC;
+	sweep.header.points = 101;
+	sweep.header.crc = crc32(sweep.points, 101 * sizeof(VNADataPoint_t));
+	checkSweep(101, 12);
+	// read to the end: the next sweep is swapped in
+	CHECK(readRegister16(0x4a) == 101, "read index %d", readRegister16(0x4a));
+	CHECK(readRegister16(0x46) == uint16_t(sequence + 1), "sequence %d", readRegister16(0x46));
+
+	// a read index past the end reads nothing and keeps nothing
+	writeRegister(0x4a, 500, 2);
+	command({0x18, 0x30, 0});
+	CHECK(dma_sim[3].cndtr == 0, "%d bytes past the end", dma_sim[3].cndtr);
+	measure(14, 0, 101);
+	spi_slave_poll();
+	CHECK(readRegister16(0x46) == uint16_t(sequence + 2), "sequence %d", readRegister16(0x46));
+	printf("  ok\n");
+}
+
+// commands that wrap around the command ring, or are split between polls
+static void testCommandRing() {
+	printf("command ring:\n");
+	for(int offset = 0; offset < SPI_CMD_RX_BUFFER_SIZE; offset++) {
+		for(int i = 0; i < offset; i++)
+			exchange(0);
+		spi_slave_poll();
+		uint64_t start = 1000000 + offset;
+		uint8_t bytes[10] = {0x23, 0x00};
+		for(int i = 0; i < 8; i++)
+			bytes[2 + i] = uint8_t(start >> (i * 8));
+		int split = offset % 11;
+		for(int i = 0; i < 10; i++) {
+			if(i == split)
+				spi_slave_poll();
+			exchange(bytes[i]);
+		}
+		spi_slave_poll();
+		writeRegister(0x44, 1, 1);
+		SpiSweepConfig_t cfg;
+		spi_slave_get_sweep(cfg);
+		CHECK(cfg.startHz == freqHz_t(start), "offset %d split %d: start %lld", offset, split, (long long) cfg.startHz);
+	}
+	printf("  ok\n");
+}
+
+// sweeps complete at random times while the master reads at random speeds;
+// every sweep read must be a whole one, and the sequence must only increase
+static void testRandom() {
+	printf("random reads and sweeps:\n");
+	std::mt19937 rng(1);
+	int tag = 100, reads = 0;
+	uint16_t lastSequence = readRegister16(0x46);
+	for(int i = 0; i < 2000 && fails == 0; i++) {
+		int points = 2 + rng() % (SWEEP_POINTS_MAX - 1);
+		if(rng() % 2) {
+			measure(++tag, 0, points);
+			continue;
+		}
+		command({0x18, 0x31, 0x00});
+		clockIn(&sweep.header, sizeof(sweep.header));
+		int bytes = sweep.header.points * sizeof(VNADataPoint_t);
+		int done = 0;
+		while(done < bytes) {
+			int n = std::min(bytes - done, int(1 + rng() % 1000));
+			clockIn((uint8_t*) sweep.points + done, n);
+			done += n;
+			// sweeps complete meanwhile
+			if(rng() % 3 == 0)
+				measure(++tag, 0, points);
+			spi_slave_poll();
+		}
+		reads++;
+		CHECK(int16_t(sweep.header.sequence - lastSequence) >= 0, "sequence went back from %d to %d",
+			lastSequence, sweep.header.sequence);
+		lastSequence = sweep.header.sequence;
+		CHECK(sweep.header.magic == SPI_SWEEP_MAGIC
+			&& sweep.header.crc == crc32(sweep.points, bytes), "read %d: torn sweep", reads);
+		// the tag of the sweep, found from its first point
+		int readTag = int(sweep.points[0].s11_real);
+		checkSweep(sweep.header.points, readTag);
+	}
+	printf("  %d sweeps, %d reads, last sequence %d\n", tag - 100, reads, lastSequence);
+}
+
+int main() {
+	testInit();
+	if(fails == 0) testSweep();
+	if(fails == 0) testPingPong();
+	if(fails == 0) testIncomplete();
+	if(fails == 0) testStart();
+	if(fails == 0) testPointFIFO();
+	if(fails == 0) testCommandRing();
+	if(fails == 0) testRandom();
+	printf(fails == 0 ? "ok\n" : "FAIL\n");
+	return fails == 0 ? 0 : 1;
+}
@@ -51,7 +51,8 @@ enum {
 };
 
 enum {
-  KM_START, KM_STOP, KM_CENTER, KM_SPAN, KM_POINTS, KM_CW, KM_SCALE, KM_REFPOS, KM_EDELAY, KM_VELOCITY_FACTOR, KM_SCALEDELAY
+  KM_START, KM_STOP, KM_CENTER, KM_SPAN, KM_POINTS, KM_CW, KM_SCALE, KM_REFPOS, KM_EDELAY, KM_VELOCITY_FACTOR, KM_SCALEDELAY,
+  KM_GATE_START, KM_GATE_STOP, KM_GATE_CENTER, KM_GATE_SPAN
 };
 
 uint8_t ui_mode = UI_NORMAL;
@@ -345,6 +346,89 @@ show_dmesg(void)
 }
 
 
+// show measurement timing of the last sweep (registers 0x60 - 0x7f);
+// refreshes after every sweep until touched.
+void
+show_timing(void)
+{
+  ili9341_set_foreground(DEFAULT_FG_COLOR);
+  ili9341_set_background(DEFAULT_BG_COLOR);
+  uiDisableProcessing();
+  ili9341_clear_screen();
+  ili9341_drawstring_size("MEASUREMENT TIMING", 5, 5, 2);
+
+  int lastCount = -1;
+  uint32_t lastRedraw = 0;
+  int lastRenderCount = -1;
+  while (true) {
+    if (lastUIEvent.type != UIEventTypes::None) {
+      UIEvent evt = uiWaitEvent();
+      if (evt.isTouchPress() || evt.isLeverClick())
+        break;
+    }
+    application_doSingleEvent();
+    // display redraw benchmark, updated by writing usb register 0x88
+    uint32_t redrawSerial = *(uint32_t*)(registers + 0x80);
+    uint32_t redrawPipelined = *(uint32_t*)(registers + 0x84);
+    if (redrawPipelined != lastRedraw) {
+      char buf[64];
+      chsnprintf(buf, sizeof(buf), "REDRAW       %6d us serial %6d us pipelined   ",
+                 (int)redrawSerial, (int)redrawPipelined);
+      ili9341_drawstring(buf, 5, LCD_HEIGHT - FONT_STR_HEIGHT - 5);
+      lastRedraw = redrawPipelined;
+    }
+    // render statistics of the last second before this screen was opened
+    int renderCount = *(uint16_t*)(registers + 0x9c);
+    if (renderCount != lastRenderCount) {
+      char buf[64];
+      int fps10 = *(uint16_t*)(registers + 0x90);
+      chsnprintf(buf, sizeof(buf), "RENDER %3d.%dfps avg%6dus max%6dus skip%5d  ",
+                 fps10 / 10, fps10 % 10, (int)*(uint32_t*)(registers + 0x94),
+                 (int)*(uint32_t*)(registers + 0x98), (int)*(uint16_t*)(registers + 0x92));
+      ili9341_drawstring(buf, 5, LCD_HEIGHT - 2*FONT_STR_HEIGHT - 8);
+      lastRenderCount = renderCount;
+    }
+#if BOARD_REVISION < 4
+    int count = *(uint16_t*)(registers + 0x7e);
+    if (count == lastCount)
+      continue;
+    lastCount = count;
+
+    const char *names[] = { "SYNTH WAIT", "SWITCH WAIT", "REFERENCE", "REFL", "THRU", "ECAL" };
+    uint32_t total = 0;
+    for (int i = 0; i < 6; i++)
+      total += *(uint32_t*)(registers + 0x60 + i*4);
+    if (total == 0) total = 1;
+
+    char buf[64];
+    int x = 5, y = 5 + 2*FONT_GET_HEIGHT + 10;
+    int step = FONT_STR_HEIGHT + 3;
+    for (int i = 0; i < 6; i++) {
+      uint32_t periods = *(uint32_t*)(registers + 0x60 + i*4);
+      chsnprintf(buf, sizeof(buf), "%-12s %8d periods %3d%%   ", names[i], (int)periods, (int)(periods * 100ULL / total));
+      ili9341_drawstring(buf, x, y += step);
+    }
+    chsnprintf(buf, sizeof(buf), "AGC RETRIES  %8d   ", (int)*(uint16_t*)(registers + 0x78));
+    ili9341_drawstring(buf, x, y += step);
+    int isrAvg = *(uint16_t*)(registers + 0x7a), isrMax = *(uint16_t*)(registers + 0x7c);
+    chsnprintf(buf, sizeof(buf), "DSP ISR      avg %5d cyc (%d us) max %5d cyc (%d us)   ",
+               isrAvg, isrAvg / cpu_mhz, isrMax, isrMax / cpu_mhz);
+    ili9341_drawstring(buf, x, y += step);
+    chsnprintf(buf, sizeof(buf), "SWEEP #%d   ", count);
+    ili9341_drawstring(buf, x, y += step * 2);
+#else
+    if (lastCount < 0) {
+      ili9341_drawstring("Measurement runs in the bootloader on this board;", 5, 60);
+      ili9341_drawstring("timing is not available.", 5, 60 + FONT_STR_HEIGHT + 3);
+      lastCount = 0;
+    }
+#endif
+  }
+
+  uiEnableProcessing();
+}
+
+
 void ui_mode_usb(void) {
   int x = 5, y = 5;
   ili9341_set_foreground(DEFAULT_FG_COLOR);
@@ -508,6 +592,12 @@ static UI_FUNCTION_CALLBACK(menu_config_cb)
       request_to_redraw_grid();
       draw_menu();
       break;
+  case 5:
+      show_timing();
+      redraw_frame();
+      request_to_redraw_grid();
+      draw_menu();
+      break;
   }
 }
 
@@ -634,6 +724,29 @@ static UI_FUNCTION_ADV_CALLBACK(menu_transform_acb)
   ui_mode_normal();
 }
 
+static UI_FUNCTION_ADV_CALLBACK(menu_transform_gate_acb)
+{
+  (void)item;
+  (void)data;
+  if(b){
+    if (domain_mode & TD_GATE) b->icon = BUTTON_ICON_CHECK;
+    return;
+  }
+  domain_mode ^= TD_GATE;
+  ui_mode_normal();
+}
+
+static UI_FUNCTION_ADV_CALLBACK(menu_transform_gate_shape_acb)
+{
+  (void)item;
+  if(b){
+    b->icon = current_props._gate_shape == data ? BUTTON_ICON_GROUP_CHECKED : BUTTON_ICON_GROUP;
+    return;
+  }
+  current_props._gate_shape = data;
+  ui_mode_normal();
+}
+
 static UI_FUNCTION_ADV_CALLBACK(menu_transform_filter_acb)
 {
   (void)item;
@@ -1015,6 +1128,25 @@ const menuitem_t menu_transform_window[] = {
   { MT_NONE, 0, NULL, NULL } // sentinel
 };
 
+const menuitem_t menu_transform_gate_shape[] = {
+  { MT_ADV_CALLBACK, TD_WINDOW_MINIMUM, "MINIMUM", (const void *)menu_transform_gate_shape_acb },
+  { MT_ADV_CALLBACK, TD_WINDOW_NORMAL,   "NORMAL", (const void *)menu_transform_gate_shape_acb },
+  { MT_ADV_CALLBACK, TD_WINDOW_MAXIMUM, "MAXIMUM", (const void *)menu_transform_gate_shape_acb },
+  { MT_CANCEL, 0, S_LARROW" BACK", NULL },
+  { MT_NONE, 0, NULL, NULL } // sentinel
+};
+
+const menuitem_t menu_transform_gate[] = {
+  { MT_ADV_CALLBACK, 0, "GATE ON", (const void *)menu_transform_gate_acb },
+  { MT_CALLBACK, KM_GATE_START, "START", (const void *)menu_keyboard_cb },
+  { MT_CALLBACK, KM_GATE_STOP, "STOP", (const void *)menu_keyboard_cb },
+  { MT_CALLBACK, KM_GATE_CENTER, "CENTER", (const void *)menu_keyboard_cb },
+  { MT_CALLBACK, KM_GATE_SPAN, "SPAN", (const void *)menu_keyboard_cb },
+  { MT_SUBMENU, 0, "SHAPE", (const void *)menu_transform_gate_shape },
+  { MT_CANCEL, 0, S_LARROW" BACK", NULL },
+  { MT_NONE, 0, NULL, NULL } // sentinel
+};
+
 const menuitem_t menu_transform[] = {
   { MT_ADV_CALLBACK, 0, "TRANSFORM\nON", (const void *)menu_transform_acb },
   { MT_ADV_CALLBACK, TD_FUNC_LOWPASS_IMPULSE, "LOW PASS\nIMPULSE", (const void *)menu_transform_filter_acb },
@@ -1022,6 +1154,7 @@ const menuitem_t menu_transform[] = {
   { MT_ADV_CALLBACK, TD_FUNC_BANDPASS, "BANDPASS", (const void *)menu_transform_filter_acb },
   { MT_SUBMENU, 0, "WINDOW", (const void *)menu_transform_window },
   { MT_CALLBACK, KM_VELOCITY_FACTOR, "VELOCITY\nFACTOR", (const void *)menu_keyboard_cb },
+  { MT_SUBMENU, 0, "GATE", (const void *)menu_transform_gate },
   { MT_CANCEL, 0, S_LARROW" BACK", NULL },
   { MT_NONE, 0, NULL, NULL } // sentinel
 };
@@ -1168,6 +1301,7 @@ const menuitem_t menu_config[] = {
   { MT_CALLBACK, 0, "SAVE", (const void *)menu_config_save_cb },
   { MT_CALLBACK, 0, "VERSION", (const void *)menu_config_cb },
   { MT_CALLBACK, 0, "DMESG", (const void *)menu_config_cb },
+  { MT_CALLBACK, 0, "TIMING", (const void *)menu_config_cb },
   { MT_SUBMENU, 0, S_RARROW"BOOTLOAD", (const void *)menu_bootload },
   { MT_CANCEL, 0, S_LARROW" BACK", NULL },
   { MT_NONE, 0, NULL, NULL } // sentinel
@@ -1374,11 +1508,16 @@ static const keypads_t * const keypads_mode_tbl[] = {
   keypads_scale, // refpos
   keypads_time, // electrical delay
   keypads_scale, // velocity factor
-  keypads_time // scale of delay
+  keypads_time, // scale of delay
+  keypads_time, // gate start
+  keypads_time, // gate stop
+  keypads_time, // gate center
+  keypads_time // gate span
 };
 
 const char * const keypad_mode_label[] = {
-  "START", "STOP", "CENTER", "SPAN", "POINTS", "CW FREQ", "SCALE", "REFPOS", "EDELAY", "VELOCITY%", "DELAY"
+  "START", "STOP", "CENTER", "SPAN", "POINTS", "CW FREQ", "SCALE", "REFPOS", "EDELAY", "VELOCITY%", "DELAY",
+  "GATE START", "GATE STOP", "GATE CENTER", "GATE SPAN"
 };
 
 static void
@@ -1742,6 +1881,18 @@ void set_numeric_value(void)
   case KM_VELOCITY_FACTOR:
     velocity_factor = uistat.value / 100.f;
     break;
+  case KM_GATE_START:
+    set_time_gate(ST_START, uistat.value);
+    break;
+  case KM_GATE_STOP:
+    set_time_gate(ST_STOP, uistat.value);
+    break;
+  case KM_GATE_CENTER:
+    set_time_gate(ST_CENTER, uistat.value);
+    break;
+  case KM_GATE_SPAN:
+    set_time_gate(ST_SPAN, uistat.value);
+    break;
   }
 }
 
@@ -2008,6 +2159,18 @@ keypad_click(int key)
     case KM_SCALEDELAY:
       set_trace_scale(uistat.current_trace, value * 1e-12); // pico second
       break;
+    case KM_GATE_START:
+      set_time_gate(ST_START, value); // pico seconds
+      break;
+    case KM_GATE_STOP:
+      set_time_gate(ST_STOP, value);
+      break;
+    case KM_GATE_CENTER:
+      set_time_gate(ST_CENTER, value);
+      break;
+    case KM_GATE_SPAN:
+      set_time_gate(ST_SPAN, value);
+      break;
     }
 
     return KP_DONE;
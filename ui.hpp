@@ -83,4 +83,5 @@ void ui_cal_collected();
 void ui_marker_track();
 
 void show_dmesg();
+void show_timing();
 void show_message(const char* title, const char* message, int fg = 0xffff, int bg = 0x0000);
@@ -0,0 +1,64 @@
+#pragma once
+#include <stdint.h>
+#include "common.hpp"
+
+// packing of the FIFO elements of the usb register protocol; the formats
+// are described with the register map in main2.cpp.
+// Shared with the host simulator (sim/), so that both send identical data.
+
+// checksum of the first n bytes of an element
+static inline uint8_t elementChecksum(const uint8_t* b, int n) {
+	uint8_t checksum=0b01000110;
+	for(int i=0; i<n; i++)
+		checksum = (checksum xor ((checksum<<1) | 1)) xor b[i];
+	return checksum;
+}
+
+static inline void putInt32(uint8_t* b, int32_t v) {
+	b[0] = uint8_t(v >> 0);
+	b[1] = uint8_t(v >> 8);
+	b[2] = uint8_t(v >> 16);
+	b[3] = uint8_t(v >> 24);
+}
+
+// value * 2^30, saturated to the int32_t range; the conversion of an out of
+// range float is undefined, and gain and ecal corrections can push a value
+// past 2
+static inline int32_t scaleQ30(float value) {
+	float x = value * 1073741824.f;
+	if(x >= 2147483648.f) return INT32_MAX;
+	if(x <= -2147483648.f) return INT32_MIN;
+	return int32_t(x);
+}
+
+// fill in a valuesFIFO element; job, sweep and flags are the sequencer tag
+static inline void packValuesElement(uint8_t txbuf[32], complexf refl, complexf thru, int freqIndex,
+		uint8_t job, uint8_t sweep, uint8_t flags) {
+	putInt32(txbuf + 0, 1073741824);
+	putInt32(txbuf + 4, 0);
+	putInt32(txbuf + 8, scaleQ30(refl.real()));
+	putInt32(txbuf + 12, scaleQ30(refl.imag()));
+	putInt32(txbuf + 16, scaleQ30(thru.real()));
+	putInt32(txbuf + 20, scaleQ30(thru.imag()));
+	txbuf[24] = uint8_t(freqIndex >> 0);
+	txbuf[25] = uint8_t(freqIndex >> 8);
+	txbuf[26] = job;
+	txbuf[27] = sweep;
+	txbuf[28] = flags;
+	txbuf[29] = 0;
+	txbuf[30] = 0;
+	txbuf[31] = elementChecksum(txbuf, 31);
+}
+
+// fill in a zeroSpanFIFO element; value is already scaled to value / fwd * 2^30,
+// see scaleQ30()
+static inline void packZeroSpanElement(uint8_t b[16], uint32_t timestamp, int32_t valueRe, int32_t valueIm,
+		uint8_t path, uint8_t flags, uint8_t sequence) {
+	putInt32(b + 0, int32_t(timestamp));
+	putInt32(b + 4, valueRe);
+	putInt32(b + 8, valueIm);
+	b[12] = path;
+	b[13] = flags;
+	b[14] = sequence;
+	b[15] = elementChecksum(b, 15);
+}
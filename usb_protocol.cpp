@@ -0,0 +1,463 @@
+#include <string.h>
+#include "usb_protocol.hpp"
+#include "measurement_control.hpp"
+#include "globals.hpp"
+#include "fifo.hpp"
+#include "usb_elements.hpp"
+
+volatile bool usbDataMode = false;
+bool outputRawSamples = false;
+
+small_function<bool(const uint8_t* data, int len)> usb_send;
+small_function<void()> usb_wait_values;
+small_function<void()> usb_set_sweep;
+small_function<void(int power)> usb_set_tx_power;
+
+usbDataPoint usbTxQueue[128];
+volatile int usbTxQueueWPos = 0;
+volatile int usbTxQueueRPos = 0;
+
+// zero-span time series; written by the measurement ISR, drained by cmdReadFIFO.
+// size must be a power of 2.
+#ifndef ZEROSPAN_QUEUE_SIZE
+#define ZEROSPAN_QUEUE_SIZE 256
+#endif
+struct zeroSpanDataPoint {
+	uint32_t timestamp;	// systemTimeCounter at the end of the integration, us
+	AppVNAMeasurement::complexi value;
+	uint8_t path;		// 0 => REFL, 1 => THRU
+	uint8_t gain;		// thru gain index the value was measured at
+	uint8_t flags;		// zeroSpanFIFO element flags
+};
+static FIFO<zeroSpanDataPoint, ZEROSPAN_QUEUE_SIZE> zeroSpanQueue;
+// set when a value was dropped because zeroSpanQueue was full; the next value
+// that is queued carries the "values dropped" flag. Only written by the
+// measurement ISR; the main loop requests a reset through zeroSpanResetGap.
+static bool zeroSpanGapPending = false;
+static volatile bool zeroSpanResetGap = false;
+static uint8_t zeroSpanSequence = 0;
+
+void zeroSpanClear() {
+	zeroSpanResetGap = true;
+	zeroSpanQueue.clear();
+}
+
+void usbEnqueueDataPoint(int freqIndex, complexf S11, complexf S21) {
+	int wrRPos = usbTxQueueRPos;
+	int wrWPos = usbTxQueueWPos;
+	__sync_synchronize();
+	if(((wrWPos + 1) & usbTxQueueMask) == wrRPos) {
+		// overflow
+	} else {
+		usbTxQueue[wrWPos].freqIndex = freqIndex;
+		usbTxQueue[wrWPos].S11 = S11;
+		usbTxQueue[wrWPos].S21 = S21;
+		__sync_synchronize();
+		usbTxQueueWPos = (wrWPos + 1) & usbTxQueueMask;
+	}
+}
+
+void MeasurementHandlers::emitZeroSpanValue(VNAMeasurementPhases ph, complex<int32_t> value, bool clipped) {
+	if(zeroSpanResetGap) {
+		zeroSpanGapPending = false;
+		zeroSpanResetGap = false;
+	}
+	uint32_t i = zeroSpanQueue.beginEnqueue();
+	if(i == (uint32_t) -1) {
+		zeroSpanGapPending = true;
+		return;
+	}
+	zeroSpanDataPoint& dp = zeroSpanQueue.at(i);
+	dp.timestamp = systemTimeCounter;
+	dp.value = value;
+	dp.path = (ph == VNAMeasurementPhases::THRU) ? 1 : 0;
+	dp.gain = vnaMeasurement.currThruGain;
+	dp.flags = (clipped ? 1 : 0) | (zeroSpanGapPending ? 2 : 0);
+	zeroSpanGapPending = false;
+	zeroSpanQueue.endEnqueue(i);
+}
+
+#if BOARD_REVISION < 4
+static void cmdReadZeroSpanFIFO(int nValues) {
+	complexf fwd = vnaMeasurement.currFwd;
+	if(fwd == complexf(0.f, 0.f))
+		fwd = complexf(1.f, 0.f);
+	complexf scale = complexf(1.f, 0.f) / fwd;
+
+	// queued values since the first read
+	if(nValues == 0)
+		nValues = ZEROSPAN_QUEUE_SIZE - 1;
+
+	// one usb packet holds 4 elements
+	uint8_t txbuf[64];
+	int txLen = 0;
+	for(int i=0; i<nValues; i++) {
+		if(!zeroSpanQueue.readable())
+			break;
+		zeroSpanDataPoint dp = zeroSpanQueue.read();
+		zeroSpanQueue.dequeue();
+
+		complexf value = complexf(dp.value.real(), dp.value.imag()) * scale;
+		if(dp.path != 0)
+			value *= measurementThruGainScale(dp.gain, currFreqHz);
+		int32_t valueRe = scaleQ30(value.real());
+		int32_t valueIm = scaleQ30(value.imag());
+
+		packZeroSpanElement(txbuf + txLen, dp.timestamp, valueRe, valueIm,
+				dp.path, dp.flags, zeroSpanSequence++);
+
+		txLen += 16;
+		if(txLen == sizeof(txbuf)) {
+			if(!usb_send(txbuf, txLen))
+				return;
+			txLen = 0;
+		}
+	}
+	if(txLen > 0)
+		usb_send(txbuf, txLen);
+}
+#endif
+
+void cmdReadFIFO(int address, int nValues) {
+#if BOARD_REVISION < 4
+	if(address == 0x58) {
+		cmdReadZeroSpanFIFO(nValues);
+		return;
+	}
+#endif
+	if(address != 0x30) return;
+	usbDataMode = true;
+	// Set count as sweepPoints if 0
+	if (nValues == 0)
+		nValues = *(uint16_t*)(registers + 0x20);
+
+	for(int i=0; i<nValues;) {
+		int rdRPos = usbTxQueueRPos;
+		int rdWPos = usbTxQueueWPos;
+		__sync_synchronize();
+
+		if(rdRPos == rdWPos) { // queue empty
+			usb_wait_values();
+			continue;
+		}
+
+		usbDataPoint& usbDP = usbTxQueue[rdRPos];
+		if(usbDP.freqIndex < 0 || usbDP.freqIndex >= USB_POINTS_MAX) {
+			usbTxQueueRPos = (rdRPos + 1) & usbTxQueueMask;
+			continue;
+		}
+
+		complexf refl = ecalApplyReflection(usbDP.S11, usbDP.freqIndex);
+		uint8_t txbuf[32];
+		packValuesElement(txbuf, refl, usbDP.S21, usbDP.freqIndex, 0, 0, 0);
+
+		if(!usb_send(txbuf, sizeof(txbuf))) {
+			return;
+		}
+
+		__sync_synchronize();
+		usbTxQueueRPos = (rdRPos + 1) & usbTxQueueMask;
+		i++;
+	}
+}
+
+void publishMeasurementStats() {
+#if BOARD_REVISION < 4
+	static uint32_t lastCount = 0;
+	uint32_t count = vnaMeasurement.lastSweepStatsCount;
+	if(count == lastCount)
+		return;
+	__sync_synchronize();
+	VNAMeasurementStats st = vnaMeasurement.lastSweepStats;
+	__sync_synchronize();
+	// the measurement isr replaced the snapshot while we were copying it
+	if(count != vnaMeasurement.lastSweepStatsCount)
+		return;
+	lastCount = count;
+
+	auto sat16 = [](uint32_t x) {
+		return uint16_t(x > 0xffff ? 0xffff : x);
+	};
+	uint32_t ecalPeriods = st.phasePeriods[int(VNAMeasurementPhases::ECALLOAD)]
+			+ st.phasePeriods[int(VNAMeasurementPhases::ECALSHORT)]
+			+ st.phasePeriods[int(VNAMeasurementPhases::ECALTHRU)];
+	uint32_t isrCyclesAvg = (st.isrCalls == 0) ? 0 : (st.isrCycles / st.isrCalls);
+
+	*(uint32_t*)(registers + 0x60) = st.synthWaitPeriods;
+	*(uint32_t*)(registers + 0x64) = st.switchWaitPeriods;
+	*(uint32_t*)(registers + 0x68) = st.phasePeriods[int(VNAMeasurementPhases::REFERENCE)];
+	*(uint32_t*)(registers + 0x6c) = st.phasePeriods[int(VNAMeasurementPhases::REFL)];
+	*(uint32_t*)(registers + 0x70) = st.phasePeriods[int(VNAMeasurementPhases::THRU)];
+	*(uint32_t*)(registers + 0x74) = ecalPeriods;
+	*(uint16_t*)(registers + 0x78) = sat16(st.agcRetries);
+	*(uint16_t*)(registers + 0x7a) = sat16(isrCyclesAvg);
+	*(uint16_t*)(registers + 0x7c) = sat16(st.isrCyclesMax);
+	*(uint16_t*)(registers + 0x7e) = uint16_t(count);
+#endif
+}
+
+void usbApplySweep() {
+	int points = *(uint16_t*)(registers + 0x20);
+	int values = *(uint16_t*)(registers + 0x22);
+
+	if(points > USB_POINTS_MAX)
+		points = USB_POINTS_MAX;
+
+	int zeroSpanPeriods = *(uint16_t*)(registers + 0x50);
+	if(zeroSpanPeriods != 0) {
+		auto path = (registers[0x52] == 1) ? VNAMeasurementPhases::THRU : VNAMeasurementPhases::REFL;
+		zeroSpanClear();
+		vnaMeasurement.setZeroSpan((freqHz_t)*(uint64_t*)(registers + 0x00),
+					zeroSpanPeriods, path, registers[0x52] == 2);
+		return;
+	}
+	vnaMeasurement.zeroSpanPeriods = 0;
+	vnaMeasurement.sweepStartHz = (freqHz_t)*(uint64_t*)(registers + 0x00);
+	vnaMeasurement.sweepStepHz = (freqHz_t)*(uint64_t*)(registers + 0x10);
+	vnaMeasurement.sweepDataPointsPerFreq = values;
+	vnaMeasurement.sweepPoints = points;
+	vnaMeasurement.resetSweep();
+	if(outputRawSamples) {
+		setFrequency((freqHz_t)*(uint64_t*)(registers + 0x00));
+	}
+}
+
+// measurement sequencer: runs a table of sweep jobs back to back and streams
+// the results without waiting for valuesFIFO reads. See the register map.
+struct sequencerJob {
+	uint64_t startHz;
+	uint64_t stepHz;	// 0 for a CW measurement of points values
+	uint16_t points;
+	uint16_t average;	// values per frequency averaged into one record
+	uint16_t repeat;	// sweeps of this job
+	uint8_t power;		// adf4350 power (0 - 3), 0xff => unchanged
+	uint8_t format;		// record format, see the register map
+} __attribute__((packed));
+static_assert(sizeof(sequencerJob) == 24, "sequencer job entries are 24 bytes");
+
+#ifndef SEQUENCER_JOBS_MAX
+#define SEQUENCER_JOBS_MAX 16
+#endif
+static sequencerJob sequencerJobs[SEQUENCER_JOBS_MAX];
+static int sequencerJobBytes = 0;	// bytes of the job table written so far
+
+enum SequencerStates: uint8_t {
+	SEQUENCER_IDLE,
+	SEQUENCER_STARTING,
+	SEQUENCER_RUNNING
+};
+
+static struct {
+	SequencerStates state;
+	int job;
+	int sweep;		// sweep within the job
+	int nextIndex;		// frequency index of the next record
+	int nValues;		// values accumulated for nextIndex
+	complexf refl, thru;	// sums of the accumulated values
+} sequencer;
+
+static inline int sequencerJobCount() {
+	return sequencerJobBytes / sizeof(sequencerJob);
+}
+
+static void sequencerStop() {
+	sequencer.state = SEQUENCER_IDLE;
+	registers[0x3a] = SEQUENCER_IDLE;
+}
+
+static void sequencerStartSweep() {
+	const sequencerJob& job = sequencerJobs[sequencer.job];
+	sequencer.nextIndex = 0;
+	sequencer.nValues = 0;
+	sequencer.refl = sequencer.thru = 0;
+	if(sequencer.sweep != 0)
+		return;	// the sweep keeps running, the next one starts by itself
+
+	int points = job.points;
+	if(points < 1) points = 1;
+	if(points > USB_POINTS_MAX) points = USB_POINTS_MAX;
+	int average = job.average;
+	if(average < 1) average = 1;
+	if(job.power != 0xff)
+		usb_set_tx_power(job.power);
+	*(uint64_t*)(registers + 0x00) = job.startHz;
+	*(uint64_t*)(registers + 0x10) = job.stepHz;
+	*(uint16_t*)(registers + 0x20) = points;
+	*(uint16_t*)(registers + 0x22) = average;
+	*(uint16_t*)(registers + 0x50) = 0;
+	usb_set_sweep();
+	ecalState = ECAL_STATE_MEASURING;
+	vnaMeasurement.ecalIntervalPoints = 1;
+	// drop values of the previous sweep
+	usbTxQueueRPos = usbTxQueueWPos;
+}
+
+// returns false if the host stopped reading
+static bool sequencerSendRecord(const sequencerJob& job, int freqIndex,
+		complexf refl, complexf thru, uint8_t flags) {
+	uint8_t txbuf[32];
+	int len = 32;
+	if(job.format == 0) {
+		packValuesElement(txbuf, refl, thru, freqIndex, sequencer.job, sequencer.sweep, flags);
+	} else {
+		complexf value = (job.format == 1) ? refl : thru;
+		putInt32(txbuf + 0, scaleQ30(value.real()));
+		putInt32(txbuf + 4, scaleQ30(value.imag()));
+		txbuf[8] = uint8_t(freqIndex >> 0);
+		txbuf[9] = uint8_t(freqIndex >> 8);
+		txbuf[10] = sequencer.job;
+		txbuf[11] = sequencer.sweep;
+		txbuf[12] = flags;
+		txbuf[13] = 0;
+		txbuf[14] = 0;
+		txbuf[15] = elementChecksum(txbuf, 15);
+		len = 16;
+	}
+	return usb_send(txbuf, len);
+}
+
+void sequencerProcess() {
+	if(sequencer.state == SEQUENCER_IDLE)
+		return;
+	if(sequencer.state == SEQUENCER_STARTING) {
+		sequencer.job = 0;
+		sequencer.sweep = 0;
+		sequencer.state = SEQUENCER_RUNNING;
+		sequencerStartSweep();
+	}
+
+	int rdRPos = usbTxQueueRPos;
+	int rdWPos = usbTxQueueWPos;
+	__sync_synchronize();
+
+	while(rdRPos != rdWPos && sequencer.state == SEQUENCER_RUNNING) {
+		usbDataPoint usbDP = usbTxQueue[rdRPos];
+		rdRPos = (rdRPos + 1) & usbTxQueueMask;
+		usbTxQueueRPos = rdRPos;
+
+		const sequencerJob& job = sequencerJobs[sequencer.job];
+		int points = *(uint16_t*)(registers + 0x20);
+		int average = *(uint16_t*)(registers + 0x22);
+		// wait for the start of a sweep, and skip values of another frequency
+		if(usbDP.freqIndex != sequencer.nextIndex)
+			continue;
+
+		sequencer.refl += ecalApplyReflection(usbDP.S11, usbDP.freqIndex);
+		sequencer.thru += usbDP.S21;
+		if(++sequencer.nValues < average)
+			continue;
+
+		uint8_t flags = 0;
+		bool sweepDone = (sequencer.nextIndex == points - 1);
+		bool jobDone = sweepDone && (sequencer.sweep + 1 >= job.repeat);
+		bool runDone = jobDone && (sequencer.job + 1 >= sequencerJobCount());
+		if(sweepDone) flags |= 1;
+		if(runDone) flags |= 2;
+		float scale = 1.f / average;
+		if(!sequencerSendRecord(job, sequencer.nextIndex, sequencer.refl * scale,
+					sequencer.thru * scale, flags)) {
+			sequencerStop();
+			return;
+		}
+		sequencer.nextIndex++;
+		sequencer.nValues = 0;
+		sequencer.refl = sequencer.thru = 0;
+		if(!sweepDone)
+			continue;
+
+		if(runDone) {
+			sequencerStop();
+			return;
+		}
+		if(jobDone) {
+			sequencer.job++;
+			sequencer.sweep = 0;
+		} else {
+			sequencer.sweep++;
+		}
+		sequencerStartSweep();
+		return;
+	}
+}
+
+// registers that make up the usb sweep; a change restarts the sweep
+static bool isSweepRegister(int address) {
+	return (address >= 0x00 && address <= 0x07) || (address >= 0x10 && address <= 0x17)
+		|| (address >= 0x20 && address <= 0x23) || (address >= 0x50 && address <= 0x52);
+}
+
+// batch writes report all sweep registers as 0x00, so that the sweep is set up once
+int cmdRegisterGroup(int address) {
+	return isSweepRegister(address) ? 0x00 : address;
+}
+
+// set while a sweep register write is held back by sweepHold
+static bool sweepHeld = false;
+
+void usbRegisterWrite(int address) {
+	if(address == 0x24) {
+		if(registers[0x24] != 0 || !sweepHeld)
+			return;
+		// commit the held sweep registers
+		sweepHeld = false;
+		address = 0x00;
+	} else if(isSweepRegister(address) && registers[0x24] != 0) {
+		sweepHeld = true;
+		return;
+	}
+
+	usbDataMode = true;
+	if(address == 0x00 || address == 0x10 || address == 0x20 || address == 0x22
+			|| address == 0x50 || address == 0x51 || address == 0x52) {
+		usb_set_sweep();
+	}
+	if(address == 0x26) {
+		auto val = registers[0x26];
+		if(val == 0) {
+			outputRawSamples = false;
+		} else if(val == 1) {
+			outputRawSamples = true;
+		} else if(val == 2) {
+			outputRawSamples = false;
+			sequencerStop();
+			usbDataMode = false;
+		}
+	}
+	if(address == 0x00 || address == 0x10 || address == 0x20) {
+		ecalState = ECAL_STATE_MEASURING;
+		vnaMeasurement.ecalIntervalPoints = 1;
+	}
+	if(address == 0x30) {
+		usbTxQueueRPos = usbTxQueueWPos;
+	}
+	if(address == 0x38) {
+		// writing the job FIFO register clears the job table
+		if(sequencer.state == SEQUENCER_IDLE) {
+			sequencerJobBytes = 0;
+			registers[0x3b] = 0;
+		}
+	}
+	if(address == 0x39) {
+		if(registers[0x39] == 1 && sequencerJobCount() > 0) {
+			sequencer.state = SEQUENCER_STARTING;
+			registers[0x3a] = SEQUENCER_RUNNING;
+		} else {
+			sequencerStop();
+		}
+	}
+	if(address == 0x58) {
+		zeroSpanClear();
+	}
+}
+
+void cmdWriteFIFO(int address, int nBytes, const uint8_t* data) {
+	if(address == 0x38 && sequencer.state == SEQUENCER_IDLE) {
+		// append to the job table
+		int space = sizeof(sequencerJobs) - sequencerJobBytes;
+		if(nBytes > space)
+			nBytes = space;
+		memcpy((uint8_t*) sequencerJobs + sequencerJobBytes, data, nBytes);
+		sequencerJobBytes += nBytes;
+		registers[0x3b] = sequencerJobCount();
+	}
+}
@@ -0,0 +1,62 @@
+#pragma once
+#include <stdint.h>
+#include <mculib/small_function.hpp>
+#include "common.hpp"
+
+// usb register protocol of the measurement: the sweep and zero-span
+// registers, the valuesFIFO and zeroSpanFIFO readers, the measurement
+// statistics and the sequencer. See the register map in main2.cpp.
+// Shared with the host simulator (sim/), which serves it on a pseudo terminal.
+
+// set when the host controls the sweep; cleared by writing 2 to 0x26
+extern volatile bool usbDataMode;
+// raw ADC samples are sent instead of measuring (0x26 = 1)
+extern bool outputRawSamples;
+
+// value is in microseconds; defined by the application
+extern volatile uint32_t systemTimeCounter;
+
+// measured values: written by the measurement through usbEnqueueDataPoint(),
+// read by the valuesFIFO and the sequencer in usb data mode and by the
+// application's display path otherwise
+struct usbDataPoint {
+	//VNAObservation value;
+	complexf S11, S21;
+	int freqIndex;
+};
+extern usbDataPoint usbTxQueue[128];
+static constexpr int usbTxQueueMask = 127;
+extern volatile int usbTxQueueWPos;
+extern volatile int usbTxQueueRPos;
+
+// hooks; set by the application before the first command
+// send data to the host; returns false if the host stopped reading
+extern small_function<bool(const uint8_t* data, int len)> usb_send;
+// called while the valuesFIFO reader waits for the measurement
+extern small_function<void()> usb_wait_values;
+// apply the usb sweep registers to the measurement; see usbApplySweep()
+extern small_function<void()> usb_set_sweep;
+// set the adf4350 output power (0 - 3)
+extern small_function<void(int power)> usb_set_tx_power;
+
+// queue a data point; called by the application's emitDataPoint handler
+void usbEnqueueDataPoint(int freqIndex, complexf S11, complexf S21);
+
+// discard queued zero-span values and any pending "values dropped" flag
+void zeroSpanClear();
+
+// apply the usb sweep registers to vnaMeasurement (boards that measure
+// in the application)
+void usbApplySweep();
+
+// copy timing counters of the last completed sweep into registers 0x60 - 0x7f
+void publishMeasurementStats();
+
+// called from the main loop in usb data mode
+void sequencerProcess();
+
+// command parser handlers of the protocol registers
+void usbRegisterWrite(int address);
+int cmdRegisterGroup(int address);
+void cmdReadFIFO(int address, int nValues);
+void cmdWriteFIFO(int address, int nBytes, const uint8_t* data);
@@ -14,12 +14,97 @@ enum class VNAMeasurementPhases {
 	ECALTHRU
 };
 
+// per-sweep timing counters; all period counts are in IF periods.
+struct VNAMeasurementStats {
+	// periods spent waiting for the synthesizers to settle
+	uint32_t synthWaitPeriods;
+	// periods discarded after changing rf switches
+	uint32_t switchWaitPeriods;
+	// periods integrated, indexed by VNAMeasurementPhases
+	uint32_t phasePeriods[6];
+	// measurements restarted by THRU AGC (clip or low signal)
+	uint32_t agcRetries;
+	// dsp interrupt cost, in cpu cycles; filled by the interrupt handler
+	uint32_t isrCycles, isrCyclesMax, isrCalls;
+};
+
+// runtime-rebindable measurement callbacks; this is the default callbacks
+// policy of VNAMeasurementT. A policy class must provide callable members with
+// the names and signatures below; see VNAMeasurementStaticCallbacks for one
+// that binds handlers at compile time.
+struct VNAMeasurementCallbacks {
+	// called when a new data point is available.
+	// ecal is load, short, thru.
+	small_function<void(int freqIndex, freqHz_t freqHz, const VNAObservationSet& v, const complexf* ecal)> emitDataPoint;
+
+	// called to change rf switch direction;
+	// the function may assume the phase progression is always:
+	// REFERENCE, REFL1, REFL2, THRU,
+	// except that REFERENCE may be switched to at any time and from any phase.
+	small_function<void(VNAMeasurementPhases ph)> phaseChanged;
+
+	// called to change synthesizer frequency
+	small_function<void(freqHz_t freqHz)> frequencyChanged;
+
+	// called when sweep setup change is processed in measurement 'thread'
+	small_function<void(freqHz_t start, freqHz_t stop)> sweepSetupChanged;
+
+	// called to change overall system gain; gain is a user defined value
+	// and VNAMeasurement will only increment or decrement it if ADC
+	// clips occur or signal value is too low.
+	// the gain applies to THRU measurements only.
+	small_function<void(int gain)> gainChanged;
+
+	// called in zero-span mode for every zeroSpanPeriods IF periods;
+	// ph is REFL or THRU and value is the averaged raw correlator output.
+	// reference (fwd) value is measured once when zero-span mode is entered
+	// and is available in currFwd.
+	small_function<void(VNAMeasurementPhases ph, complex<int32_t> value, bool clipped)> emitZeroSpanValue;
+};
+
+// callbacks policy that calls static member functions of handlers_t, so that
+// they can be inlined into the measurement interrupt.
+// emitDataPoint and phaseChanged can still be rerouted at run time by setting
+// emitDataPointOverride/phaseChangedOverride (used by performGainCal()).
+template<class handlers_t>
+struct VNAMeasurementStaticCallbacks {
+	small_function<void(int freqIndex, freqHz_t freqHz, const VNAObservationSet& v, const complexf* ecal)> emitDataPointOverride;
+	small_function<void(VNAMeasurementPhases ph)> phaseChangedOverride;
+
+	void emitDataPoint(int freqIndex, freqHz_t freqHz, const VNAObservationSet& v, const complexf* ecal) {
+		if(emitDataPointOverride)
+			emitDataPointOverride(freqIndex, freqHz, v, ecal);
+		else
+			handlers_t::emitDataPoint(freqIndex, freqHz, v, ecal);
+	}
+	void phaseChanged(VNAMeasurementPhases ph) {
+		if(phaseChangedOverride)
+			phaseChangedOverride(ph);
+		else
+			handlers_t::phaseChanged(ph);
+	}
+	void frequencyChanged(freqHz_t freqHz) {
+		handlers_t::frequencyChanged(freqHz);
+	}
+	void sweepSetupChanged(freqHz_t start, freqHz_t stop) {
+		handlers_t::sweepSetupChanged(start, stop);
+	}
+	void gainChanged(int gain) {
+		handlers_t::gainChanged(gain);
+	}
+	void emitZeroSpanValue(VNAMeasurementPhases ph, complex<int32_t> value, bool clipped) {
+		handlers_t::emitZeroSpanValue(ph, value, clipped);
+	}
+};
+
 // implements sweep, rf switch timing, and dsp for single-receiver
 // switched path VNAs (one receiver with switches to select reference,
 // reflected, and thru paths).
 // given switch & synthesizer controls and adc data feed, emit a stream
 // of data points.
-class VNAMeasurement {
+// callbacks_t is the callbacks policy (see VNAMeasurementCallbacks).
+template<class callbacks_t = VNAMeasurementCallbacks>
+class VNAMeasurementT: public callbacks_t {
 public:
 	typedef complex<int32_t> complexi;
 
@@ -29,6 +114,9 @@ public:
 	// how many periods to wait after changing synthesizer frequency
 	uint16_t nWaitSynth = 30;
 
+	// how many periods to wait before the first point of a sweep
+	uint16_t nWaitFirstPoint = 128;
+
 	// how many periods to average over
 	uint16_t nMeasureCount = 0;
 	uint16_t nPeriods = 14;
@@ -38,7 +126,10 @@ public:
 	// every ecalIntervalPoints we will measure one frequency point for ecal
 	uint16_t ecalIntervalPoints = 8;
 
-	// AGC parameters; VNAMeasurement will detect ADC clip events and inform the
+	// never measure ecal (boards without ecal hardware)
+	bool ecalDisabled = false;
+
+	// AGC parameters; VNAMeasurementT will detect ADC clip events and inform the
 	// host when baseband/rf gain needs to be changed.
 	uint8_t gainMin = 0, gainMax = 3;
 
@@ -51,29 +142,7 @@ public:
 	// same as clipFlag, but for S21
 //	bool clipFlag2 = false;
 
-	// called when a new data point is available.
-	// ecal is load, short, thru.
-	small_function<void(int freqIndex, freqHz_t freqHz, const VNAObservationSet& v, const complexf* ecal)> emitDataPoint;
-
-	// called to change rf switch direction;
-	// the function may assume the phase progression is always:
-	// REFERENCE, REFL1, REFL2, THRU,
-	// except that REFERENCE may be switched to at any time and from any phase.
-	small_function<void(VNAMeasurementPhases ph)> phaseChanged;
-
-	// called to change synthesizer frequency
-	small_function<void(freqHz_t freqHz)> frequencyChanged;
-
-	// called when sweep setup change is processed in measurement 'thread'
-	small_function<void(freqHz_t start, freqHz_t stop)> sweepSetupChanged;
-
-	// called to change overall system gain; gain is a user defined value
-	// and VNAMeasurement will only increment or decrement it if ADC
-	// clips occur or signal value is too low.
-	// the gain applies to THRU measurements only.
-	small_function<void(int gain)> gainChanged;
-
-	VNAMeasurement();
+	VNAMeasurementT();
 
 	void init();
 	void setCorrelationTable(const int16_t* table, int length);
@@ -82,10 +151,17 @@ public:
 	// if points is 1, sets frequency to startFreqHz and disables sweep
 	void setSweep(freqHz_t startFreqHz, freqHz_t stepFreqHz, int points, int dataPointsPerFreq=1);
 
+	// hold the synthesizers at freqHz and emit one value through
+	// emitZeroSpanValue() every "periods" IF periods without going through
+	// the sweep/ecal state machine. path is REFL or THRU; if alternate is set
+	// the rf switches toggle between REFL and THRU after every value.
+	// periods == 0 is not allowed; use setSweep() to leave zero-span mode.
+	void setZeroSpan(freqHz_t freqHz, int periods, VNAMeasurementPhases path, bool alternate);
+
 	void resetSweep();
 
 	struct _emitValue_t {
-		VNAMeasurement* m;
+		VNAMeasurementT* m;
 		void operator()(int32_t* valRe, int32_t* valIm);
 	};
 
@@ -111,6 +187,11 @@ public:
 	// What measurements to make
 	enum MeasurementMode measurement_mode = MEASURE_MODE_FULL;
 
+	// zero-span parameters; zeroSpanPeriods is 0 when not in zero-span mode
+	uint16_t zeroSpanPeriods = 0;
+	VNAMeasurementPhases zeroSpanPath = VNAMeasurementPhases::REFL;
+	bool zeroSpanAlternate = false;
+
 	// number of frequency points since start of sweep
 	volatile int sweepCurrPoint = 0;
 
@@ -132,9 +213,432 @@ public:
 
 	complexf ecal[ECAL_CHANNELS];
 
+	// counts every IF period
+	volatile uint32_t periodCounter = 0;
+
+	// bit (1 << phase) is set for phases during which the host keeps the
+	// display bus quiet. On every phase change, the periodCounter values at
+	// which the next run of such phases is expected to start and end are
+	// published in quietStart/quietEnd. AGC retries and synthesizer waits
+	// are not predicted, so a quiet phase never starts earlier than
+	// quietStart but may end later than quietEnd.
+	uint8_t quietPhaseMask = 0;
+	volatile bool quietScheduled = false;
+	volatile uint32_t quietStart = 0, quietEnd = 0;
+
+	// timing counters of the sweep in progress
+	VNAMeasurementStats stats = {};
+
+	// timing counters of the last completed sweep;
+	// lastSweepStatsCount is incremented after each update.
+	VNAMeasurementStats lastSweepStats = {};
+	volatile uint32_t lastSweepStatsCount = 0;
+
 
 	void setMeasurementPhase(VNAMeasurementPhases ph);
+	VNAMeasurementPhases nextPhase(VNAMeasurementPhases ph, uint32_t& ecalCnt) const;
+	uint32_t phaseLength(VNAMeasurementPhases ph) const;
+	void updateQuietSchedule();
 	void sweepAdvance();
 	void sampleProcessor_emitValue(int32_t valRe, int32_t valIm, bool clipped);
+	void zeroSpan_emitValue(int32_t valRe, int32_t valIm, bool clipped);
 	void doEmitValue(bool ecal);
 };
+
+typedef VNAMeasurementT<> VNAMeasurement;
+
+
+template<class callbacks_t>
+VNAMeasurementT<callbacks_t>::VNAMeasurementT(): sampleProcessor(_emitValue_t {this}) {
+
+}
+
+template<class callbacks_t>
+void VNAMeasurementT<callbacks_t>::init() {
+	sampleProcessor.init();
+}
+template<class callbacks_t>
+void VNAMeasurementT<callbacks_t>::setCorrelationTable(const int16_t* table, int length) {
+	sampleProcessor.setCorrelationTable(table, length);
+	sampleProcessor.emitValue = _emitValue_t {this};
+}
+template<class callbacks_t>
+void VNAMeasurementT<callbacks_t>::processSamples(uint16_t* buf, int len) {
+	sampleProcessor.process(buf, len);
+}
+
+template<class callbacks_t>
+void VNAMeasurementT<callbacks_t>::setSweep(freqHz_t startFreqHz, freqHz_t stepFreqHz, int points, int dataPointsPerFreq) {
+	sweepStartHz = startFreqHz;
+	sweepStepHz = stepFreqHz;
+	sweepPoints = points;
+	sweepDataPointsPerFreq = dataPointsPerFreq;
+	zeroSpanPeriods = 0;
+	resetSweep();
+}
+
+template<class callbacks_t>
+void VNAMeasurementT<callbacks_t>::setZeroSpan(freqHz_t freqHz, int periods, VNAMeasurementPhases path, bool alternate) {
+	sweepStartHz = freqHz;
+	sweepStepHz = 0;
+	sweepPoints = 1;
+	sweepDataPointsPerFreq = 1;
+	zeroSpanPath = path;
+	zeroSpanAlternate = alternate;
+	zeroSpanPeriods = periods;
+	resetSweep();
+}
+
+template<class callbacks_t>
+void VNAMeasurementT<callbacks_t>::resetSweep() {
+	__sync_synchronize();
+	sweepCurrPoint = -1;
+}
+
+
+template<class callbacks_t>
+void VNAMeasurementT<callbacks_t>::setMeasurementPhase(VNAMeasurementPhases ph) {
+	this->phaseChanged(ph);
+	measurementPhase = ph;
+	periodCounterSwitch = 0;
+	currDP_re = 0;
+	currDP_im = 0;
+	gainChangeOccurred = false;
+#if 1
+	// For ecal use nPeriodsCalibrating always, for other use nPeriods
+	// (disabled ecal never enters the ecal phases)
+    if (ph > VNAMeasurementPhases::THRU) nMeasureCount = nPeriodsCalibrating * nPeriodsMultiplier;
+	else  	                             nMeasureCount = nPeriods * nPeriodsMultiplier;
+#else
+	// On calibration or first step (ecalIntervalPoints == 1) use nPeriodsCalibrating, for other use nPeriods
+	nMeasureCount = ((ecalIntervalPoints == 1) ? nPeriodsCalibrating : nPeriods) * nPeriodsMultiplier;
+#endif
+	if(quietPhaseMask != 0)
+		updateQuietSchedule();
+}
+
+// the phase that follows ph in the sweep state machine; ecalCnt is the
+// ecalCounter value when ph is entered and is advanced like ecalCounter.
+template<class callbacks_t>
+VNAMeasurementPhases VNAMeasurementT<callbacks_t>::nextPhase(VNAMeasurementPhases ph, uint32_t& ecalCnt) const {
+	switch(ph) {
+		case VNAMeasurementPhases::REFERENCE:
+			return VNAMeasurementPhases::REFL;
+		case VNAMeasurementPhases::REFL:
+			return VNAMeasurementPhases::THRU;
+		case VNAMeasurementPhases::THRU: {
+			if(measurement_mode == MEASURE_MODE_REFL_THRU)
+				return VNAMeasurementPhases::REFL;
+			if(measurement_mode != MEASURE_MODE_FULL || ecalDisabled)
+				return VNAMeasurementPhases::REFERENCE;
+			bool doEcal = (ecalCnt == 0);
+			if(++ecalCnt >= ecalIntervalPoints)
+				ecalCnt = 0;
+			if(!doEcal)
+				return VNAMeasurementPhases::REFERENCE;
+#ifdef ECAL_PARTIAL
+			return VNAMeasurementPhases::ECALLOAD;
+#else
+			return VNAMeasurementPhases::ECALTHRU;
+#endif
+		}
+		case VNAMeasurementPhases::ECALTHRU:
+			return VNAMeasurementPhases::ECALLOAD;
+		case VNAMeasurementPhases::ECALLOAD:
+#ifdef ECAL_PARTIAL
+			return VNAMeasurementPhases::REFERENCE;
+#else
+			return VNAMeasurementPhases::ECALSHORT;
+#endif
+		default:
+			return VNAMeasurementPhases::REFERENCE;
+	}
+}
+
+// IF periods spent in phase ph without AGC retries
+template<class callbacks_t>
+uint32_t VNAMeasurementT<callbacks_t>::phaseLength(VNAMeasurementPhases ph) const {
+	uint32_t n = (ph > VNAMeasurementPhases::THRU) ? nPeriodsCalibrating : nPeriods;
+	return nWaitSwitch + n * nPeriodsMultiplier;
+}
+
+// called when a phase has just been entered
+template<class callbacks_t>
+void VNAMeasurementT<callbacks_t>::updateQuietSchedule() {
+	if(zeroSpanPeriods != 0) {
+		quietScheduled = false;
+		return;
+	}
+	auto isQuiet = [this](VNAMeasurementPhases ph) {
+		return (quietPhaseMask & (1 << int(ph))) != 0;
+	};
+	VNAMeasurementPhases ph = measurementPhase;
+	uint32_t ecalCnt = ecalCounter;
+	uint32_t t = periodCounter;
+	// a sweep point has at most 6 phases
+	int steps = 0;
+	for(; !isQuiet(ph); steps++) {
+		if(steps >= 6) {
+			quietScheduled = false;
+			return;
+		}
+		t += phaseLength(ph);
+		ph = nextPhase(ph, ecalCnt);
+	}
+	uint32_t start = t;
+	for(steps = 0; isQuiet(ph) && steps < 6; steps++) {
+		t += phaseLength(ph);
+		ph = nextPhase(ph, ecalCnt);
+	}
+	quietStart = start;
+	quietEnd = t;
+	quietScheduled = true;
+}
+static inline complexf to_complexf(complex<int32_t> value) {
+	return {(float) value.real(), (float) value.imag()};
+}
+
+template<class callbacks_t>
+void VNAMeasurementT<callbacks_t>::sweepAdvance() {
+	sweepCurrPoint++;
+	if(sweepCurrPoint >= sweepPoints)
+		sweepCurrPoint = 0;
+
+	currFreq = sweepStartHz + sweepStepHz*sweepCurrPoint;
+	this->frequencyChanged(currFreq);
+
+	periodCounterSynth = nWaitSynth;
+	periodCounterSwitch = 0;
+	if(sweepCurrPoint == 0) {
+		lastSweepStats = stats;
+		stats = {};
+		__sync_synchronize();
+		lastSweepStatsCount++;
+
+		periodCounterSynth = nWaitFirstPoint; // for first point need more wait
+		currThruGain = gainMax;
+		ecalCounter = ecalCounterOffset;
+		ecalCounterOffset++;
+		if(ecalCounterOffset >= ecalIntervalPoints)
+			ecalCounterOffset = 0;
+	}
+}
+
+template<class callbacks_t>
+void VNAMeasurementT<callbacks_t>::sampleProcessor_emitValue(int32_t valRe, int32_t valIm, bool clipped) {
+	periodCounter++;
+	auto currPoint = sweepCurrPoint;
+	/* If -1 then we restart */
+	if(currPoint == -1) {
+		freqHz_t start = sweepStartHz;
+		freqHz_t stop = start + sweepStepHz*sweepPoints;
+		this->sweepSetupChanged(start, stop);
+		dpCounterSynth = 0;
+		setMeasurementPhase(VNAMeasurementPhases::REFERENCE);
+		ecalCounterOffset = 0;
+		sweepAdvance();
+		return;
+	}
+	/* If periodCounterSynth not elapsed, decrement and wait for it */
+	if(periodCounterSynth > 0) {
+		// still waiting for synthesizer
+		periodCounterSynth--;
+		stats.synthWaitPeriods++;
+		gainChangeOccurred = false;
+		return;
+	}
+	if(zeroSpanPeriods != 0) {
+		zeroSpan_emitValue(valRe, valIm, clipped);
+		return;
+	}
+	if(periodCounterSwitch >= nWaitSwitch) {
+		currDP_re+= valRe;
+		currDP_im+= valIm;
+		stats.phasePeriods[int(measurementPhase)]++;
+
+		if(measurementPhase == VNAMeasurementPhases::THRU) {
+			if(clipped) {
+				// ADC clip occurred during a measurement period
+				if(currThruGain > gainMin) {
+					// decrease gain and redo measurement
+					stats.agcRetries++;
+					currThruGain--;
+					this->gainChanged(currThruGain);
+					periodCounterSwitch = 0;
+					currDP_re = 0;
+					currDP_im = 0;
+					sampleProcessor.clipFlag = false;
+					gainChangeOccurred = true;
+					return;
+				}
+			}
+		}
+		else // not show clippederror on thru measure
+			clipFlag |= clipped;
+	} else {
+		sampleProcessor.clipFlag = false;
+		stats.switchWaitPeriods++;
+	}
+	periodCounterSwitch++;
+
+	/* If switch time not elapsed, wait some more */
+	if(periodCounterSwitch < (nWaitSwitch + nMeasureCount)) {
+		return;
+	}
+	// Real measure count
+	periodCounterSwitch-=nWaitSwitch;
+	// Get current point measured data (not depend from measure count)
+	complexf currDP = complexf{(float)currDP_re/periodCounterSwitch, (float)currDP_im/periodCounterSwitch};
+
+	// Loop through measurement phase
+	switch(measurementPhase) {
+		case VNAMeasurementPhases::REFERENCE:
+			currFwd = currDP;
+			setMeasurementPhase(VNAMeasurementPhases::REFL);
+			break;
+		case VNAMeasurementPhases::REFL:
+			currRefl = currDP;
+			setMeasurementPhase(VNAMeasurementPhases::THRU);
+			break;
+		case VNAMeasurementPhases::THRU:
+			if(currThruGain < gainMax && !gainChangeOccurred) {
+				float mag = abs(currDP);
+				if(mag < (adcFullScale * 0.15f)) {
+					// signal level too low; increase gain and retry
+					stats.agcRetries++;
+					currThruGain++;
+					this->gainChanged(currThruGain);
+					gainChangeOccurred = true;
+					periodCounterSwitch = 0;
+					currDP_re = 0;
+					currDP_im = 0;
+					return;
+				}
+			}
+			currThru = currDP;
+			switch(measurement_mode) {
+				case MEASURE_MODE_FULL:
+					if(ecalDisabled) {
+						setMeasurementPhase(VNAMeasurementPhases::REFERENCE);
+						doEmitValue(false);
+						break;
+					}
+					if(ecalCounter == 0) {
+#ifdef ECAL_PARTIAL
+						setMeasurementPhase(VNAMeasurementPhases::ECALLOAD);
+#else
+						setMeasurementPhase(VNAMeasurementPhases::ECALTHRU);
+#endif
+					} else {
+						setMeasurementPhase(VNAMeasurementPhases::REFERENCE);
+						doEmitValue(false);
+					}
+					ecalCounter++;
+					if(ecalCounter >= ecalIntervalPoints)
+						ecalCounter = 0;
+					break;
+				case MEASURE_MODE_REFL_THRU_REFRENCE: /* AKA no ECAL */
+					/* Go back to the start: REFERENCE */
+					setMeasurementPhase(VNAMeasurementPhases::REFERENCE);
+					doEmitValue(false);
+					break;
+				case MEASURE_MODE_REFL_THRU:
+					/* aka CW mode
+					 * And keep the signal on the ouput */
+					setMeasurementPhase(VNAMeasurementPhases::REFL);
+					doEmitValue(false);
+					break;
+			}
+			break;
+
+		case VNAMeasurementPhases::ECALTHRU:
+			ecal[2] = currDP;
+			setMeasurementPhase(VNAMeasurementPhases::ECALLOAD);
+			break;
+
+		case VNAMeasurementPhases::ECALLOAD:
+			ecal[0] = currDP;
+#ifdef ECAL_PARTIAL
+			/* Go back to the start: REFERENCE */
+			setMeasurementPhase(VNAMeasurementPhases::REFERENCE);
+			doEmitValue(true);
+#else
+			setMeasurementPhase(VNAMeasurementPhases::ECALSHORT);
+#endif
+			break;
+		case VNAMeasurementPhases::ECALSHORT:
+			ecal[1] = currDP;
+			/* Go back to the start: REFERENCE */
+			setMeasurementPhase(VNAMeasurementPhases::REFERENCE);
+			doEmitValue(true);
+			break;
+	}
+}
+
+// zero-span state machine: REFERENCE is measured once after the synthesizer
+// settles, then values are emitted continuously from zeroSpanPath.
+// there is no low-signal AGC here because a gain change would insert a gap
+// into the time series; only clipping on THRU lowers the gain.
+template<class callbacks_t>
+void VNAMeasurementT<callbacks_t>::zeroSpan_emitValue(int32_t valRe, int32_t valIm, bool clipped) {
+	if(periodCounterSwitch >= nWaitSwitch) {
+		currDP_re+= valRe;
+		currDP_im+= valIm;
+		if(clipped && measurementPhase == VNAMeasurementPhases::THRU
+				&& currThruGain > gainMin) {
+			// discard this value and continue at a lower gain
+			currThruGain--;
+			this->gainChanged(currThruGain);
+			periodCounterSwitch = 0;
+			currDP_re = 0;
+			currDP_im = 0;
+			return;
+		}
+		clipFlag |= clipped;
+	}
+	periodCounterSwitch++;
+
+	uint32_t n = (measurementPhase == VNAMeasurementPhases::REFERENCE) ? nMeasureCount : zeroSpanPeriods;
+	if(periodCounterSwitch < (nWaitSwitch + n))
+		return;
+
+	complexi value = {int32_t(currDP_re / (int32_t) n), int32_t(currDP_im / (int32_t) n)};
+	if(measurementPhase == VNAMeasurementPhases::REFERENCE) {
+		currFwd = to_complexf(value);
+		clipFlag = false;
+		setMeasurementPhase(zeroSpanPath);
+		return;
+	}
+	this->emitZeroSpanValue(measurementPhase, value, clipFlag);
+	clipFlag = false;
+
+	if(zeroSpanAlternate) {
+		setMeasurementPhase(measurementPhase == VNAMeasurementPhases::REFL ?
+				VNAMeasurementPhases::THRU : VNAMeasurementPhases::REFL);
+	} else {
+		// rf switches did not change; no need to wait nWaitSwitch again
+		periodCounterSwitch = nWaitSwitch;
+		currDP_re = 0;
+		currDP_im = 0;
+	}
+}
+
+template<class callbacks_t>
+void VNAMeasurementT<callbacks_t>::doEmitValue(bool ecal) {
+	// emit new data point
+	VNAObservationSet value = {currRefl, currFwd, currThru};
+	this->emitDataPoint(sweepCurrPoint, currFreq, value, ecal ? this->ecal : nullptr);
+
+	clipFlag = false;
+
+	dpCounterSynth++;
+	if(dpCounterSynth >= sweepDataPointsPerFreq && sweepPoints > 1) {
+		dpCounterSynth = 0;
+		sweepAdvance();
+	}
+}
+
+template<class callbacks_t>
+void VNAMeasurementT<callbacks_t>::_emitValue_t::operator()(int32_t* valRe, int32_t* valIm) {
+	m->sampleProcessor_emitValue(*valRe, *valIm, m->sampleProcessor.clipFlag);
+}